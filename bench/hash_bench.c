@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define BENCH_BUFFER_SIZE (64 * 1024 * 1024)  // Bytes hashed per pass
+#define BENCH_PIECE_SIZE (1024 * 1024)        // Piece size, as negotiated by default
+#define BENCH_PASSES 5                        // Passes per algorithm; the fastest one counts
+
+// Helper function to read a monotonic clock in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to time hashing a buffer piece by piece, as the server does for metadata
+static double bench_algorithm(int algorithm, const unsigned char *buffer, size_t size) {
+    unsigned char digest[HASH_DIGEST_SIZE];
+    Hasher hasher;
+    double best = 0;
+
+    if (hasher_begin(&hasher, algorithm) != 0) {
+        return 0;
+    }
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        double start = now_seconds();
+        for (size_t offset = 0; offset < size; offset += BENCH_PIECE_SIZE) {
+            hasher_update(&hasher, buffer + offset, BENCH_PIECE_SIZE);
+            hasher_end(&hasher, digest);
+        }
+        double elapsed = now_seconds() - start;
+        if (best == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    hasher_free(&hasher);
+    return best;
+}
+
+int main(void) {
+    unsigned char *buffer = malloc(BENCH_BUFFER_SIZE);
+    if (!buffer) {
+        perror("Failed to allocate benchmark buffer");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (size_t i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        buffer[i] = (unsigned char)rand();
+    }
+
+    printf("%-8s %10s %12s\n", "algo", "MB/s", "ns/piece");
+    for (int algorithm = 0; algorithm < HASH_ALGO_COUNT; algorithm++) {
+        double seconds = bench_algorithm(algorithm, buffer, BENCH_BUFFER_SIZE);
+        double pieces = BENCH_BUFFER_SIZE / BENCH_PIECE_SIZE;
+        printf("%-8s %10.0f %12.0f\n", hash_algorithm_name(algorithm),
+               BENCH_BUFFER_SIZE / seconds / (1024 * 1024), seconds * 1e9 / pieces);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,729 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "client.h"
+#include "protocol.h"
+#include "frame.h"
+#include "listing.h"
+#include "transfer.h"
+#include "logger.h"
+
+#define LOADGEN_OPS 4                    // Operation kinds in a mix
+#define LOADGEN_MAX_CLIENTS 4096         // Most concurrent clients
+#define LOADGEN_LIST_BYTES (64 * 1024)   // Largest unpaged file list read
+#define LOADGEN_SCRAPE_BYTES (1 << 20)   // Largest metrics scrape read
+#define LOADGEN_PARETO_SHAPE 1.16        // Shape of the Pareto size distribution (the 80/20 rule)
+
+enum { LOAD_LIST, LOAD_METADATA, LOAD_DOWNLOAD, LOAD_UPLOAD };
+static const char *const op_names[LOADGEN_OPS] = { "list", "metadata", "download", "upload" };
+
+enum { SIZES_FIXED, SIZES_UNIFORM, SIZES_PARETO };
+
+// File sizes drawn for the shared files and for uploads
+typedef struct {
+    int kind;
+    long min;
+    long max;
+} SizeDistribution;
+
+// Latencies of one operation kind, in seconds
+typedef struct {
+    double *values;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+// State and results of one client thread
+typedef struct {
+    pthread_t thread;
+    int id;
+    uint64_t random;                     // xorshift64* state
+    Samples latency[LOADGEN_OPS];
+    unsigned long long errors[LOADGEN_OPS];
+    unsigned long long bytes_downloaded;
+    unsigned long long bytes_uploaded;
+    unsigned long long connections;      // Connections opened and negotiated
+    unsigned long long connect_errors;
+} Worker;
+
+// Run configuration
+static const char *server_ip = "127.0.0.1";
+static int server_port = 12345;
+static int clients = 8;
+static double duration = 10;
+static double rate = 0;                   // Operations per second over all clients (0 for a closed loop)
+static double mix[LOADGEN_OPS] = { 1, 2, 6, 1 };
+static const char *mix_spec = "list=1,metadata=2,download=6,upload=1";
+static SizeDistribution sizes = { SIZES_UNIFORM, 4096, 1024 * 1024 };
+static const char *sizes_spec = "uniform:4K-1M";
+static int file_count = 16;
+static int ops_per_connection = 0;       // Operations before reconnecting (0 to keep one connection)
+static const char *metrics_address = NULL;
+static unsigned long long seed = 1;
+
+static int data_fd = -1;                  // Random bytes uploads are sent from
+static int null_fd = -1;                  // Where downloads are written
+static double start_time;                 // When the measured run began
+
+// Helper function to read a monotonic clock in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Helper function to draw a uniform number in [0, 1)
+static double random_uniform(Worker *worker) {
+    worker->random ^= worker->random >> 12;
+    worker->random ^= worker->random << 25;
+    worker->random ^= worker->random >> 27;
+    return ((worker->random * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Function to draw a file size from the configured distribution
+static long random_size(Worker *worker) {
+    double u = random_uniform(worker);
+    switch (sizes.kind) {
+    case SIZES_UNIFORM:
+        return sizes.min + (long)(u * (sizes.max - sizes.min + 1));
+    case SIZES_PARETO: {
+        // Bounded Pareto by inverting its distribution function
+        double low = pow((double)sizes.min / sizes.max, LOADGEN_PARETO_SHAPE);
+        long size = (long)(sizes.min / pow(1 - u * (1 - low), 1 / LOADGEN_PARETO_SHAPE));
+        return size < sizes.max ? size : sizes.max;
+    }
+    default:
+        return sizes.min;
+    }
+}
+
+// Function to pick the next operation from the mix
+static int random_op(Worker *worker) {
+    double total = 0;
+    for (int i = 0; i < LOADGEN_OPS; i++) {
+        total += mix[i];
+    }
+    double pick = random_uniform(worker) * total;
+    for (int i = 0; i < LOADGEN_OPS - 1; i++) {
+        if (pick < mix[i]) {
+            return i;
+        }
+        pick -= mix[i];
+    }
+    return LOADGEN_OPS - 1;
+}
+
+// Helper function to keep a latency sample
+static void samples_add(Samples *samples, double value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (!values) {
+            return;  // The sample is lost, not the run
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+}
+
+// Function to open and negotiate a connection, without exiting on failure like connect_to_server
+static int open_connection(void) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    if (session_reset(sock) != 0) {
+        close(sock);
+        return -1;
+    }
+    negotiate_session(sock, 0, HASH_ALGO_SHA256);  // Legacy servers are measured as they are
+    return sock;
+}
+
+// Helper function to name one of the shared files
+static void shared_name(char *name, size_t size, int index) {
+    snprintf(name, size, "loadgen-%03d.bin", index);
+}
+
+// Function to list the server's files, page by page if it can
+static int op_list(int sock) {
+    if (!session_listing(sock)) {
+        Payload payload = {0};
+        payload.operation = OP_LIST_FILES;
+        static __thread char buffer[LOADGEN_LIST_BYTES];
+        return send_payload(sock, &payload) == 0 && receive_message(sock, OP_FILE_LIST, buffer, sizeof(buffer)) >= 0 ? 0 : -1;
+    }
+
+    uint64_t cursor = 0;
+    int more = 1;
+    while (more) {
+        ByteBuf request = {0};
+        list_put_request(&request, "", cursor, LIST_PAGE_ENTRIES, 0);
+        int result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+        bytebuf_free(&request);
+        if (result != 0) {
+            return -1;
+        }
+
+        Frame frame;
+        ListPage page;
+        ListEntry entry;
+        long frame_len = receive_frame(sock, &frame);
+        if (frame_len < 0 || list_get_page(&frame, &page) != 0 || page.status != STAT_FILE_FOUND) {
+            return -1;
+        }
+        while ((result = list_page_next(&page, &entry)) > 0) {
+            // Entries are decoded as a client would, but not kept
+        }
+        session_consume(sock, frame_len);
+        if (result < 0 || (page.more && page.cursor == cursor)) {
+            return -1;
+        }
+        cursor = page.cursor;
+        more = page.more;
+    }
+    return 0;
+}
+
+// Function to ask for a file's metadata
+static int op_metadata(int sock, const char *filename, Payload *metadata) {
+    Payload payload = {0};
+    payload.operation = OP_REQ_META_DATA;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    if (send_payload(sock, &payload) != 0 || receive_payload(sock, metadata) != 0 || metadata->status == STAT_FILE_NOT_FOUND) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to download a file as cli2219 does, metadata first, into /dev/null
+static long op_download(int sock, const char *filename) {
+    Payload metadata;
+    if (op_metadata(sock, filename, &metadata) != 0) {
+        return -1;
+    }
+
+    Payload payload = {0};
+    payload.operation = OP_DOWNLOAD;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    if (send_payload(sock, &payload) != 0) {
+        return -1;
+    }
+    off_t received = transfer_recv_file(sock, null_fd, 0, metadata.file_size, NULL, NULL);
+    if (received != metadata.file_size) {
+        return -1;
+    }
+
+    // The trailer is read but not checked: what is measured is the server's side of it
+    if (session_trailers(sock) && receive_trailer(sock, NULL) != 0) {
+        return -1;
+    }
+    return received;
+}
+
+// Function to upload a file of the given size from the random data
+static long op_upload(int sock, const char *filename, long size) {
+    Payload payload = {0};
+    payload.operation = OP_UPLOAD;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    Payload request;
+    if (send_payload(sock, &payload) != 0 || receive_payload(sock, &request) != 0 || request.operation != OP_REQ_META_DATA) {
+        return -1;
+    }
+
+    Payload metadata = {0};
+    metadata.operation = OP_META_DATA;
+    strncpy(metadata.filename, filename, sizeof(metadata.filename) - 1);
+    metadata.file_size = size;
+    if (send_payload(sock, &metadata) != 0) {
+        return -1;
+    }
+
+    Hasher hasher;
+    Hasher *digest = trailer_begin(sock, &hasher);
+    off_t sent = transfer_send_file(sock, data_fd, 0, size, session_get(sock)->piece_size, NULL, digest);
+    if (sent != size) {
+        if (digest) {
+            hasher_free(digest);
+        }
+        return -1;
+    }
+    if (session_trailers(sock)) {
+        Payload trailer;
+        trailer_build(digest, filename, 0, size, &trailer);
+        if (send_payload(sock, &trailer) != 0) {
+            return -1;
+        }
+    }
+    return sent;
+}
+
+// Function to run one operation, returning -1 if it failed
+static int run_op(Worker *worker, int sock, int op) {
+    char filename[64];
+    Payload metadata;
+    long bytes;
+
+    switch (op) {
+    case LOAD_LIST:
+        return op_list(sock);
+    case LOAD_METADATA:
+        shared_name(filename, sizeof(filename), (int)(random_uniform(worker) * file_count));
+        return op_metadata(sock, filename, &metadata);
+    case LOAD_DOWNLOAD:
+        shared_name(filename, sizeof(filename), (int)(random_uniform(worker) * file_count));
+        bytes = op_download(sock, filename);
+        if (bytes >= 0) {
+            worker->bytes_downloaded += bytes;
+        }
+        return bytes >= 0 ? 0 : -1;
+    default:
+        // Every client overwrites a file of its own, so downloads never see a half-written one
+        snprintf(filename, sizeof(filename), "loadgen-upload-%d.bin", worker->id);
+        bytes = op_upload(sock, filename, random_size(worker));
+        if (bytes >= 0) {
+            worker->bytes_uploaded += bytes;
+        }
+        return bytes >= 0 ? 0 : -1;
+    }
+}
+
+// Helper function to sleep until a point on the monotonic clock
+static void sleep_until(double when) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)when;
+    ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// Function to run one client until the end of the run
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    double deadline = start_time + duration;
+    double next = start_time;
+    int sock = -1, ops_on_connection = 0;
+
+    while (1) {
+        // Open-loop arrivals are a Poisson process, and latency counts from when an operation was due
+        double scheduled;
+        if (rate > 0) {
+            next += -log(1 - random_uniform(worker)) * clients / rate;
+            if (next >= deadline) {
+                break;
+            }
+            sleep_until(next);
+            scheduled = next;
+        } else {
+            scheduled = now_seconds();
+            if (scheduled >= deadline) {
+                break;
+            }
+        }
+
+        // An operation that opens a connection includes the connect and the handshake
+        if (sock < 0) {
+            sock = open_connection();
+            if (sock < 0) {
+                worker->connect_errors++;
+                if (rate == 0) {
+                    usleep(10000);  // Don't spin against a server that is down
+                }
+                continue;
+            }
+            worker->connections++;
+            ops_on_connection = 0;
+        }
+
+        int op = random_op(worker);
+        if (run_op(worker, sock, op) != 0) {
+            worker->errors[op]++;
+            close(sock);  // The stream may be anywhere; start over on a new connection
+            sock = -1;
+            continue;
+        }
+        samples_add(&worker->latency[op], now_seconds() - scheduled);
+
+        if (ops_per_connection > 0 && ++ops_on_connection >= ops_per_connection) {
+            send_exit_request(sock);
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    if (sock >= 0) {
+        send_exit_request(sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+// Function to fill an in-memory file with the random bytes uploads are sent from
+static int make_upload_data(long size) {
+    data_fd = memfd_create("loadgen-data", MFD_CLOEXEC);
+    if (data_fd < 0 || ftruncate(data_fd, size) != 0) {
+        return -1;
+    }
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, data_fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    srand((unsigned)seed);
+    for (long i = 0; i < size; i++) {
+        data[i] = (unsigned char)rand();  // Incompressible, so every codec moves every byte
+    }
+    munmap(data, size);
+    return 0;
+}
+
+// Function to upload the shared files downloads and metadata requests pick from
+static int upload_shared_files(void) {
+    Worker setup = { .id = -1, .random = seed * 0x9E3779B97F4A7C15ULL | 1 };
+    int sock = open_connection();
+    if (sock < 0) {
+        fprintf(stderr, "Could not connect to %s:%d\n", server_ip, server_port);
+        return -1;
+    }
+    for (int i = 0; i < file_count; i++) {
+        char filename[64];
+        shared_name(filename, sizeof(filename), i);
+        if (op_upload(sock, filename, random_size(&setup)) < 0) {
+            fprintf(stderr, "Could not upload %s\n", filename);
+            close(sock);
+            return -1;
+        }
+    }
+
+    // Requests are answered in order, so a reply means the last upload has been stored
+    Payload metadata;
+    char filename[64];
+    shared_name(filename, sizeof(filename), file_count - 1);
+    int result = op_metadata(sock, filename, &metadata);
+    send_exit_request(sock);
+    close(sock);
+    if (result != 0) {
+        fprintf(stderr, "Shared files did not appear on the server\n");
+    }
+    return result;
+}
+
+// Function to read one unlabelled series from the server's metrics endpoint, or -1 if it can't be scraped
+static double scrape_metric(const char *series) {
+    int sock;
+    if (strspn(metrics_address, "0123456789") == strlen(metrics_address)) {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(metrics_address));
+        inet_pton(AF_INET, server_ip, &addr.sin_addr);
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    } else {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, metrics_address, sizeof(addr.sun_path) - 1);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock < 0) {
+        fprintf(stderr, "Could not scrape metrics from %s\n", metrics_address);
+        return -1;
+    }
+
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    char *reply = malloc(LOADGEN_SCRAPE_BYTES);
+    size_t length = 0;
+    ssize_t n;
+    if (reply && send_bytes(sock, request, strlen(request)) == 0) {
+        while (length < LOADGEN_SCRAPE_BYTES - 1 && (n = recv(sock, reply + length, LOADGEN_SCRAPE_BYTES - 1 - length, 0)) > 0) {
+            length += n;
+        }
+    }
+    close(sock);
+
+    double value = -1;
+    if (reply) {
+        char needle[128];
+        snprintf(needle, sizeof(needle), "\n%s ", series);  // Not the HELP and TYPE lines
+        reply[length] = '\0';
+        char *line = strstr(reply, needle);
+        if (line) {
+            value = strtod(line + strlen(needle), NULL);
+        }
+        free(reply);
+    }
+    return value;
+}
+
+// Function to read the server's CPU seconds once the connections before now are gone
+static double scrape_server_cpu(void) {
+    if (!metrics_address) {
+        return -1;
+    }
+
+    // Forked children add their CPU time as they exit, which trails the client closing
+    for (int tries = 0; tries < 40 && scrape_metric("yats_connections_active") > 0; tries++) {
+        usleep(50000);
+    }
+    usleep(50000);
+    return scrape_metric("yats_cpu_seconds_total");
+}
+
+// Helper function to read a percentile of sorted samples
+static double percentile(const Samples *samples, double fraction) {
+    size_t rank = (size_t)ceil(fraction * samples->count);
+    return samples->values[rank > 0 ? rank - 1 : 0];
+}
+
+// Helper function to order latencies for qsort
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper function to print a JSON number, or null if it is unknown
+static void put_number(FILE *out, const char *name, double value, const char *suffix) {
+    if (value < 0) {
+        fprintf(out, "  \"%s\": null%s\n", name, suffix);
+    } else {
+        fprintf(out, "  \"%s\": %.6g%s\n", name, value, suffix);
+    }
+}
+
+// Function to merge the workers' results and print them as JSON
+static void report(FILE *out, Worker *workers, double elapsed, double cpu_before, double cpu_after, double client_cpu) {
+    Samples all[LOADGEN_OPS] = {{0}};
+    unsigned long long errors[LOADGEN_OPS] = {0};
+    unsigned long long downloaded = 0, uploaded = 0, connections = 0, connect_errors = 0, operations = 0;
+    for (int w = 0; w < clients; w++) {
+        for (int op = 0; op < LOADGEN_OPS; op++) {
+            for (size_t i = 0; i < workers[w].latency[op].count; i++) {
+                samples_add(&all[op], workers[w].latency[op].values[i]);
+            }
+            errors[op] += workers[w].errors[op];
+        }
+        downloaded += workers[w].bytes_downloaded;
+        uploaded += workers[w].bytes_uploaded;
+        connections += workers[w].connections;
+        connect_errors += workers[w].connect_errors;
+    }
+
+    fprintf(out, "{\n  \"config\": {\"server\": \"%s:%d\", \"clients\": %d, \"duration_s\": %g, \"rate\": %g, \"mix\": \"%s\", "
+                 "\"sizes\": \"%s\", \"files\": %d, \"ops_per_connection\": %d, \"seed\": %llu},\n",
+            server_ip, server_port, clients, duration, rate, mix_spec, sizes_spec, file_count, ops_per_connection, seed);
+    fprintf(out, "  \"elapsed_s\": %.6g,\n", elapsed);
+    fprintf(out, "  \"ops\": {\n");
+    for (int op = 0; op < LOADGEN_OPS; op++) {
+        Samples *samples = &all[op];
+        operations += samples->count;
+        fprintf(out, "    \"%s\": {\"count\": %zu, \"errors\": %llu, \"ops_per_s\": %.6g", op_names[op], samples->count, errors[op],
+                samples->count / elapsed);
+        if (samples->count > 0) {
+            qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+            fprintf(out, ", \"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+                    percentile(samples, 0.5) * 1e3, percentile(samples, 0.99) * 1e3, percentile(samples, 0.999) * 1e3,
+                    samples->values[samples->count - 1] * 1e3);
+        }
+        fprintf(out, "}%s\n", op < LOADGEN_OPS - 1 ? "," : "");
+        free(samples->values);
+    }
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"operations\": %llu,\n  \"ops_per_s\": %.6g,\n", operations, operations / elapsed);
+    fprintf(out, "  \"connections\": %llu,\n  \"connect_errors\": %llu,\n  \"connections_per_s\": %.6g,\n",
+            connections, connect_errors, connections / elapsed);
+    fprintf(out, "  \"bytes_downloaded\": %llu,\n  \"bytes_uploaded\": %llu,\n", downloaded, uploaded);
+    fprintf(out, "  \"throughput_bytes_per_s\": %.6g,\n", (downloaded + uploaded) / elapsed);
+
+    // CPU per GB counts both directions, since the server pays for uploads too
+    double gigabytes = (downloaded + uploaded) / 1e9;
+    double server_cpu = cpu_before >= 0 && cpu_after >= 0 ? cpu_after - cpu_before : -1;
+    put_number(out, "server_cpu_s", server_cpu, ",");
+    put_number(out, "server_cpu_s_per_gb", server_cpu >= 0 && gigabytes > 0 ? server_cpu / gigabytes : -1, ",");
+    put_number(out, "client_cpu_s", client_cpu, "");
+    fprintf(out, "}\n");
+}
+
+// Helper function to parse a size with an optional K, M or G suffix
+static long parse_size(const char *text, char **end) {
+    long value = strtol(text, end, 10);
+    switch (**end) {
+    case 'K': case 'k': value <<= 10; (*end)++; break;
+    case 'M': case 'm': value <<= 20; (*end)++; break;
+    case 'G': case 'g': value <<= 30; (*end)++; break;
+    }
+    return value;
+}
+
+// Function to parse fixed:SIZE, uniform:MIN-MAX or pareto:MIN-MAX
+static int parse_sizes(const char *spec) {
+    char *end;
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        sizes.kind = SIZES_FIXED;
+        sizes.min = sizes.max = parse_size(spec + 6, &end);
+        return *end == '\0' && sizes.min >= 0 ? 0 : -1;
+    }
+    if (strncmp(spec, "uniform:", 8) == 0 || strncmp(spec, "pareto:", 7) == 0) {
+        sizes.kind = spec[0] == 'u' ? SIZES_UNIFORM : SIZES_PARETO;
+        sizes.min = parse_size(strchr(spec, ':') + 1, &end);
+        if (*end != '-') {
+            return -1;
+        }
+        sizes.max = parse_size(end + 1, &end);
+        return *end == '\0' && sizes.min >= 0 && sizes.max >= sizes.min && (sizes.kind != SIZES_PARETO || sizes.min > 0) ? 0 : -1;
+    }
+    return -1;
+}
+
+// Function to parse a mix like list=1,metadata=2,download=6,upload=1 (operations left out don't run)
+static int parse_mix(const char *spec) {
+    char copy[256];
+    double total = 0;
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(mix, 0, sizeof(mix));
+    for (char *save, *part = strtok_r(copy, ",", &save); part; part = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(part, '=');
+        int op;
+        if (!equals) {
+            return -1;
+        }
+        *equals = '\0';
+        for (op = 0; op < LOADGEN_OPS && strcmp(part, op_names[op]) != 0; op++) {
+        }
+        if (op == LOADGEN_OPS || (mix[op] = atof(equals + 1)) < 0) {
+            return -1;
+        }
+        total += mix[op];
+    }
+    return total > 0 ? 0 : -1;
+}
+
+// Helper function to read the CPU seconds this process has used
+static double own_cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    const char *output_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value && (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--host") == 0)) {
+            server_ip = argv[++i];
+        } else if (value && (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0)) {
+            server_port = atoi(argv[++i]);
+        } else if (value && strcmp(argv[i], "--clients") == 0) {
+            clients = atoi(argv[++i]);
+        } else if (value && strcmp(argv[i], "--duration") == 0) {
+            duration = atof(argv[++i]);
+        } else if (value && strcmp(argv[i], "--rate") == 0) {
+            rate = atof(argv[++i]);
+        } else if (value && strcmp(argv[i], "--mix") == 0 && parse_mix(value) == 0) {
+            mix_spec = argv[++i];
+        } else if (value && strcmp(argv[i], "--sizes") == 0 && parse_sizes(value) == 0) {
+            sizes_spec = argv[++i];
+        } else if (value && strcmp(argv[i], "--files") == 0) {
+            file_count = atoi(argv[++i]);
+        } else if (value && strcmp(argv[i], "--ops-per-connection") == 0) {
+            ops_per_connection = atoi(argv[++i]);
+        } else if (value && strcmp(argv[i], "--metrics") == 0) {
+            metrics_address = argv[++i];
+        } else if (value && strcmp(argv[i], "--output") == 0) {
+            output_path = argv[++i];
+        } else if (value && strcmp(argv[i], "--seed") == 0) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-h <host>] [-p <port>] [--clients <n>] [--duration <seconds>] [--rate <ops/s>] "
+                            "[--mix list=1,metadata=2,download=6,upload=1] [--sizes fixed:<size>|uniform:<min>-<max>|pareto:<min>-<max>] "
+                            "[--files <n>] [--ops-per-connection <n>] [--metrics <port|path>] [--output <file>] [--seed <n>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (clients < 1 || clients > LOADGEN_MAX_CLIENTS || duration <= 0 || rate < 0 || file_count < 1 || ops_per_connection < 0) {
+        fprintf(stderr, "Invalid load: need 1-%d clients, a positive duration and at least one file\n", LOADGEN_MAX_CLIENTS);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);  // A server closing mid-upload is an error to count, not a reason to stop
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd < 0 || make_upload_data(sizes.max > 0 ? sizes.max : 1) != 0) {
+        perror("Failed to prepare upload data");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Uploading %d shared files (%s)\n", file_count, sizes_spec);
+    if (upload_shared_files() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    Worker *workers = calloc(clients, sizeof(Worker));
+    if (!workers) {
+        perror("Failed to allocate clients");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Running %d clients for %g s (%s)\n", clients, duration, rate > 0 ? "open loop" : "closed loop");
+    double cpu_before = scrape_server_cpu();
+    double client_cpu = own_cpu_seconds();
+    start_time = now_seconds();
+    for (int w = 0; w < clients; w++) {
+        workers[w].id = w;
+        workers[w].random = (seed + w + 1) * 0x9E3779B97F4A7C15ULL;
+        if (pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]) != 0) {
+            perror("Failed to start client");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int w = 0; w < clients; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    double elapsed = now_seconds() - start_time;
+    client_cpu = own_cpu_seconds() - client_cpu;
+    double cpu_after = cpu_before >= 0 ? scrape_server_cpu() : -1;
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        perror("Failed to open output file");
+        return EXIT_FAILURE;
+    }
+    report(out, workers, elapsed, cpu_before, cpu_after, client_cpu);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (int w = 0; w < clients; w++) {
+        for (int op = 0; op < LOADGEN_OPS; op++) {
+            free(workers[w].latency[op].values);
+        }
+    }
+    free(workers);
+    return EXIT_SUCCESS;
+}
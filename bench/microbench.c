@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "logger.h"
+
+#define MICROBENCH_MAX_REPETITIONS 64          // Most repetitions of one benchmark
+#define MICROBENCH_COPY_FILE (16 * 1024 * 1024) // Bytes a chunked copy moves per operation
+
+// Body of a benchmark: runs its operation the given number of times
+typedef void (*BenchFunction)(long iterations, const void *arg);
+
+// Options shared by every benchmark
+static double min_time = 0.1;        // Seconds a measured run lasts at least
+static int repetitions = 5;          // Measured runs; the median is reported
+static const char *filter = NULL;    // Substring a benchmark's name must contain
+
+// Helper function to read a clock in seconds
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Helper function to order run times for qsort
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to time a benchmark and print one line: median wall and CPU time per operation over the repetitions
+static void bench_run(const char *name, BenchFunction function, const void *arg, long bytes_per_op) {
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+
+    // Grow the iteration count until a run lasts min_time, as Google Benchmark does; these runs double as warm-up
+    long iterations = 1;
+    while (1) {
+        double start = clock_seconds(CLOCK_MONOTONIC);
+        function(iterations, arg);
+        double elapsed = clock_seconds(CLOCK_MONOTONIC) - start;
+        if (elapsed >= min_time || iterations >= 1000000000L) {
+            break;
+        }
+        double factor = elapsed > 0 ? min_time * 1.4 / elapsed : 10;
+        iterations = (long)ceil(iterations * (factor < 10 ? (factor > 1.2 ? factor : 1.2) : 10));
+    }
+
+    double wall[MICROBENCH_MAX_REPETITIONS], cpu[MICROBENCH_MAX_REPETITIONS];
+    double sum = 0, squares = 0;
+    for (int r = 0; r < repetitions; r++) {
+        double start = clock_seconds(CLOCK_MONOTONIC);
+        double cpu_start = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+        function(iterations, arg);
+        cpu[r] = (clock_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start) / iterations;
+        wall[r] = (clock_seconds(CLOCK_MONOTONIC) - start) / iterations;
+        sum += wall[r];
+        squares += wall[r] * wall[r];
+    }
+    double mean = sum / repetitions;
+    double deviation = sqrt(fmax(squares / repetitions - mean * mean, 0));
+    qsort(wall, repetitions, sizeof(double), compare_doubles);
+    qsort(cpu, repetitions, sizeof(double), compare_doubles);
+    double median = wall[repetitions / 2];
+
+    char throughput[32] = "";
+    if (bytes_per_op > 0) {
+        snprintf(throughput, sizeof(throughput), "%10.1f MB/s", bytes_per_op / median / (1024 * 1024));
+    }
+    printf("%-44s %12.1f %12.1f %12ld %6.1f%% %s\n", name, median * 1e9, cpu[repetitions / 2] * 1e9, iterations,
+           mean > 0 ? deviation / mean * 100 : 0, throughput);
+    fflush(stdout);
+}
+
+// Connected pair of sockets a payload goes around
+typedef struct {
+    int a;
+    int b;
+} SocketPair;
+
+// Function to send a payload one way and its echo back, as a request and reply do
+static void bench_payload_roundtrip(long iterations, const void *arg) {
+    const SocketPair *pair = arg;
+    Payload request = {0}, received, reply;
+    request.operation = OP_REQ_META_DATA;
+    strcpy(request.filename, "microbench.bin");
+    request.offset = 1024 * 1024;
+
+    for (long i = 0; i < iterations; i++) {
+        // One thread does both ends; a payload fits the socket buffers, so nothing blocks
+        if (send_payload(pair->a, &request) != 0 || receive_payload(pair->b, &received) != 0 ||
+            send_payload(pair->b, &received) != 0 || receive_payload(pair->a, &reply) != 0) {
+            fprintf(stderr, "Payload round trip failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function to connect two TCP sockets over the loopback interface
+static int loopback_pair(SocketPair *pair) {
+    struct sockaddr_in addr = {0};
+    socklen_t length = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &length) != 0) {
+        return -1;
+    }
+    pair->a = socket(AF_INET, SOCK_STREAM, 0);
+    if (pair->a < 0 || connect(pair->a, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(listener);
+        return -1;
+    }
+    pair->b = accept(listener, NULL, NULL);
+    close(listener);
+    return pair->b < 0 ? -1 : 0;
+}
+
+// Function to run the round trip in both wire formats over one kind of socket
+static void bench_payload_pair(const char *transport, SocketPair *pair) {
+    static const struct { const char *name; int wire; } wires[] = { { "legacy", WIRE_LEGACY }, { "framed", WIRE_FRAMED } };
+    for (size_t w = 0; w < sizeof(wires) / sizeof(wires[0]); w++) {
+        char name[64];
+        session_reset(pair->a);
+        session_reset(pair->b);
+        session_get(pair->a)->wire = wires[w].wire;  // The echo answers in the format it received
+        snprintf(name, sizeof(name), "payload_roundtrip/%s/%s", transport, wires[w].name);
+        bench_run(name, bench_payload_roundtrip, pair, 0);
+    }
+    session_reset(pair->a);
+    session_reset(pair->b);
+    close(pair->a);
+    close(pair->b);
+}
+
+// A file to hash and the offset whose chunk is hashed
+typedef struct {
+    const char *path;
+    long offset;
+} HashTarget;
+
+// Function to hash the legacy chunk that ends at an offset
+static void bench_file_hash(long iterations, const void *arg) {
+    const HashTarget *target = arg;
+    char hash[HASH_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        if (calculate_file_hash(target->path, target->offset, hash) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function to hash the 1 MB piece that ends at an offset, as negotiated sessions do
+static void bench_piece_hash(long iterations, const void *arg) {
+    const HashTarget *target = arg;
+    char hash[HASH_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        if (calculate_piece_hash(target->path, target->offset, 1024 * 1024, HASH_ALGO_SHA256, hash) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function to write a file of random bytes; it stays in the page cache, so reads measure the code, not the disk
+static int make_file(const char *path, long size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char block[65536];
+    for (long written = 0; written < size; written += sizeof(block)) {
+        for (size_t i = 0; i < sizeof(block); i++) {
+            block[i] = (unsigned char)rand();
+        }
+        long length = size - written < (long)sizeof(block) ? size - written : (long)sizeof(block);
+        if (write(fd, block, length) != length) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to hash at the start, middle and end of files of a few sizes
+static void bench_hashes(void) {
+    static const struct { const char *label; long size; } files[] = {
+        { "64K", 64L * 1024 }, { "1M", 1024L * 1024 }, { "64M", 64L * 1024 * 1024 },
+    };
+    for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+        char path[64], name[96];
+        snprintf(path, sizeof(path), "hash-%s.bin", files[f].label);
+        if (make_file(path, files[f].size) != 0) {
+            perror("Failed to create hash benchmark file");
+            exit(EXIT_FAILURE);
+        }
+
+        // The chunk hashed is the one that ends at the offset
+        long offsets[] = { CHUNK_SIZE, files[f].size / 2, files[f].size };
+        const char *where[] = { "first", "middle", "last" };
+        for (int o = 0; o < 3; o++) {
+            HashTarget target = { path, offsets[o] };
+            snprintf(name, sizeof(name), "calculate_file_hash/%s/%s", files[f].label, where[o]);
+            bench_run(name, bench_file_hash, &target, CHUNK_SIZE);
+        }
+        if (files[f].size >= 1024 * 1024) {
+            HashTarget target = { path, files[f].size };
+            snprintf(name, sizeof(name), "calculate_piece_hash/%s/last/1M-piece", files[f].label);
+            bench_run(name, bench_piece_hash, &target, 1024 * 1024);
+        }
+        unlink(path);
+    }
+}
+
+// A file copied chunk by chunk and the chunk size
+typedef struct {
+    int fd;
+    int null_fd;
+    size_t chunk;
+    unsigned char *buffer;
+} CopyTarget;
+
+// Function to copy a cached file through a user-space buffer, as the copy fallback does without zero-copy
+static void bench_chunked_copy(long iterations, const void *arg) {
+    const CopyTarget *target = arg;
+    for (long i = 0; i < iterations; i++) {
+        for (off_t offset = 0; offset < MICROBENCH_COPY_FILE; ) {
+            ssize_t n = pread(target->fd, target->buffer, target->chunk, offset);
+            if (n <= 0 || write(target->null_fd, target->buffer, n) != n) {
+                perror("Chunked copy failed");
+                exit(EXIT_FAILURE);
+            }
+            offset += n;
+        }
+    }
+}
+
+// Function to copy with buffers from CHUNK_SIZE up to 1 MB
+static void bench_copies(void) {
+    static const size_t chunks[] = { CHUNK_SIZE, 4096, 16384, 65536, 262144, 1048576 };
+    CopyTarget target;
+    if (make_file("copy.bin", MICROBENCH_COPY_FILE) != 0 || (target.fd = open("copy.bin", O_RDONLY)) < 0 ||
+        (target.null_fd = open("/dev/null", O_WRONLY)) < 0 || !(target.buffer = malloc(chunks[5]))) {
+        perror("Failed to prepare the copy benchmark");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        char name[64];
+        target.chunk = chunks[c];
+        snprintf(name, sizeof(name), "chunked_copy/%zuK%s", chunks[c] / 1024, chunks[c] == CHUNK_SIZE ? " (CHUNK_SIZE)" : "");
+        bench_run(name, bench_chunked_copy, &target, MICROBENCH_COPY_FILE);
+    }
+    free(target.buffer);
+    close(target.null_fd);
+    close(target.fd);
+    unlink("copy.bin");
+}
+
+// Function to queue a typical record, writing the ring out every half ring so none are dropped
+static void bench_log_info(long iterations, const void *arg) {
+    (void)arg;
+    for (long i = 0; i < iterations; i++) {
+        log_message(LOG_INFO, "Sent metadata for file: %s, size: %ld bytes", "microbench.bin", i);
+        if ((i & (LOG_RING_RECORDS / 2 - 1)) == 0) {
+            log_flush();
+        }
+    }
+    log_flush();
+}
+
+// Function to call a rate-limited site that has used up its burst
+static void bench_log_limited(long iterations, const void *arg) {
+    (void)arg;
+    for (long i = 0; i < iterations; i++) {
+        log_message_limited(LOG_ERROR, "Chunk %ld failed", i);
+    }
+    log_flush();
+}
+
+// Function to call a site below LOG_MIN_LEVEL, which compiles out
+static void bench_log_debug(long iterations, const void *arg) {
+    (void)arg;
+    for (long i = 0; i < iterations; i++) {
+        log_message(LOG_DEBUG, "Chunk %ld sent", i);
+        __asm__ volatile("" ::: "memory");  // Keep the empty loop
+    }
+}
+
+// Function to pin the process (and the logger thread it starts later) to one CPU
+static int pin_cpu(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0) {
+        // The highest CPU allowed is the least likely to be handling interrupts
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            return -1;
+        }
+        for (int c = CPU_SETSIZE - 1; c >= 0 && cpu < 0; c--) {
+            if (CPU_ISSET(c, &set)) {
+                cpu = c;
+            }
+        }
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0 ? cpu : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int cpu = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--cpu <n>] [--min-time <seconds>] [--repetitions <n>] [--filter <substring>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (min_time <= 0 || repetitions < 1 || repetitions > MICROBENCH_MAX_REPETITIONS) {
+        fprintf(stderr, "Invalid options: need a positive --min-time and 1-%d repetitions\n", MICROBENCH_MAX_REPETITIONS);
+        return EXIT_FAILURE;
+    }
+
+    cpu = pin_cpu(cpu);
+    if (cpu < 0) {
+        perror("Failed to pin to a CPU");
+        return EXIT_FAILURE;
+    }
+
+    // Files and the log go to a scratch directory
+    char scratch[] = "/tmp/microbench-XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror("Failed to create scratch directory");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+
+    printf("Pinned to CPU %d; median of %d runs of at least %.2f s each\n", cpu, repetitions, min_time);
+    printf("%-44s %12s %12s %12s %7s %15s\n", "Benchmark", "Time (ns)", "CPU (ns)", "Iterations", "CV", "Throughput");
+
+    SocketPair pair;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("Failed to create socket pair");
+        return EXIT_FAILURE;
+    }
+    pair.a = fds[0];
+    pair.b = fds[1];
+    bench_payload_pair("socketpair", &pair);
+    if (loopback_pair(&pair) != 0) {
+        perror("Failed to connect over loopback");
+        return EXIT_FAILURE;
+    }
+    bench_payload_pair("loopback", &pair);
+
+    bench_hashes();
+    bench_copies();
+
+    bench_run("log_message/info", bench_log_info, NULL, 0);
+    bench_run("log_message_limited/suppressed", bench_log_limited, NULL, 0);
+    bench_run("log_message/debug (compiled out)", bench_log_debug, NULL, 0);
+    LogStats stats;
+    log_get_stats(&stats);
+    if (stats.dropped > 0) {
+        printf("Note: the logger dropped %llu records; log_message/info is understated\n", stats.dropped);
+    }
+
+    unlink("log.txt");
+    if (chdir("/") != 0 || rmdir(scratch) != 0) {
+        perror("Failed to remove scratch directory");
+    }
+    return EXIT_SUCCESS;
+}
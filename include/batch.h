@@ -0,0 +1,88 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <sys/types.h>
+
+#include "protocol.h"
+#include "frame.h"
+
+/// Metadata of one file named or matched by a batch request
+typedef struct {
+    char filename[MAX_FILENAME];  ///< Name relative to the shared directory
+    int status;                   ///< STAT_FILE_FOUND or STAT_FILE_NOT_FOUND
+    long file_size;               ///< Size when the batch was resolved
+} BatchFile;
+
+/// Files of a batch request being answered
+typedef struct {
+    int dir_fd;         ///< The shared directory, for openat/fstatat (-1 if closed)
+    BatchFile *files;   ///< Files in reply order
+    int count;          ///< Number of files
+    int next;           ///< Next file to stream (OP_BATCH_DOWNLOAD)
+} Batch;
+
+/**
+ * @brief Append a batch request: payload fields, then the list of names.
+ *
+ * A non-empty pattern is sent in the filename field and matched with
+ * fnmatch(3) on the server instead of the list.
+ *
+ * @param buf The buffer to append to.
+ * @param operation OP_BATCH_META or OP_BATCH_DOWNLOAD.
+ * @param filenames The names of the files (ignored with a pattern).
+ * @param count The number of names.
+ * @param pattern Glob matched against the shared directory, or NULL.
+ */
+void batch_put_request(ByteBuf *buf, int operation, char *const filenames[], int count, const char *pattern);
+
+/**
+ * @brief Resolve the files of a batch request received on a connection.
+ *
+ * Names come from the arguments stored in the session by payload_parse,
+ * or from matching request->filename against the directory. Every file
+ * costs one fstatat on a single directory descriptor.
+ *
+ * @param sock The socket descriptor the request arrived on.
+ * @param request The batch request.
+ * @param dir The shared directory.
+ * @param batch Pointer to the batch to fill in (release with batch_free).
+ * @return 0 on success, -1 on failure.
+ */
+int batch_resolve(int sock, const Payload *request, const char *dir, Batch *batch);
+
+/**
+ * @brief Append the OP_BATCH_META reply listing every file of a batch.
+ *
+ * @param sock The socket descriptor whose session supplies the request id.
+ * @param buf The buffer to append to.
+ * @param batch The resolved batch.
+ */
+void batch_put_metadata(int sock, ByteBuf *buf, const Batch *batch);
+
+/**
+ * @brief Decode an OP_BATCH_META reply.
+ *
+ * @param frame The reply frame.
+ * @param files Pointer to receive a malloc'd array of file metadata.
+ * @return The number of files, -1 if the reply is malformed.
+ */
+int batch_get_metadata(const Frame *frame, BatchFile **files);
+
+/**
+ * @brief Open the next file of the batch that was found.
+ *
+ * @param batch The batch.
+ * @param file Pointer to receive the file (NULL when the batch is done).
+ * @param length Pointer to receive the current size of the file.
+ * @return A file descriptor, or -1 if the file is gone or the batch is done.
+ */
+int batch_open_next(Batch *batch, const BatchFile **file, off_t *length);
+
+/**
+ * @brief Release a batch.
+ *
+ * @param batch The batch.
+ */
+void batch_free(Batch *batch);
+
+#endif /* BATCH_H */
@@ -0,0 +1,54 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Streaming XXH64 state
+typedef struct {
+    uint64_t total_len;  ///< Bytes hashed so far
+    uint64_t v[4];       ///< Accumulators of the four lanes
+    unsigned char mem[32]; ///< Bytes of an incomplete stripe
+    size_t mem_size;     ///< Bytes in mem
+    uint64_t seed;       ///< Seed the state started from
+} Xxh64State;
+
+/**
+ * @brief Extend a CRC32C (Castagnoli) checksum with more bytes.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it and a table
+ * otherwise. Start from 0; the result of one call is the input of the next.
+ *
+ * @param crc The checksum of the bytes so far.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return The checksum including the new bytes.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @brief Start an XXH64 hash.
+ *
+ * @param state The state to initialize.
+ * @param seed The seed.
+ */
+void xxh64_begin(Xxh64State *state, uint64_t seed);
+
+/**
+ * @brief Add bytes to an XXH64 hash.
+ *
+ * @param state The state.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ */
+void xxh64_update(Xxh64State *state, const void *data, size_t len);
+
+/**
+ * @brief Finish an XXH64 hash.
+ *
+ * @param state The state (unchanged, so more bytes may follow).
+ * @return The hash.
+ */
+uint64_t xxh64_end(const Xxh64State *state);
+
+#endif /* CHECKSUM_H */
@@ -13,12 +13,24 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include "protocol.h"
+#include "batch.h"
+#include "ranges.h"
+#include "delta.h"
 
 // Define maximum filename length
 #define MAX_FILENAME 256
 
+// Requests kept in flight by pipelined downloads
+#define PIPELINE_DEPTH 32
+
+// Segmented downloads
+#define SEGMENT_STEP (4 * 1024 * 1024)  // Bytes fetched per range request
+#define MAX_CONNECTIONS 64              // Most connections per segmented download
+
 // Shared directory for files
 extern char DEST_DIR[MAX_FILENAME];
 
@@ -33,6 +45,27 @@ extern char DEST_DIR[MAX_FILENAME];
  */
 int connect_to_server(const char *server_ip, int port);
 
+/**
+ * @brief Negotiate session parameters (piece size, checksum algorithm, trailers) with the server.
+ *
+ * Without negotiation, or if the server does not answer, the connection
+ * keeps the legacy CHUNK_SIZE piece size, SHA-256 checksums and no
+ * trailers. Servers that don't know the proposed algorithm answer with
+ * SHA-256. Every supported feature (SESSION_FEATURES) is proposed, and
+ * the stream codec chosen with set_compression if there is one.
+ *
+ * The proposal is sent as a legacy Payload so that servers predating
+ * framing can read it. A connection whose wire is WIRE_FRAMED switches
+ * to framed messages only if the reply echoes SESSION_FEATURE_FRAMED,
+ * and stays on WIRE_LEGACY otherwise.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param piece_size The proposed piece size.
+ * @param hash_algorithm The proposed checksum algorithm (HASH_ALGO_*).
+ * @return 0 if the server agreed, -1 otherwise.
+ */
+int negotiate_session(int sock, long piece_size, int hash_algorithm);
+
 /**
  * @brief Request metadata for a specific file from the server.
  *
@@ -51,6 +84,19 @@ int request_file_metadata(int sock, const char *filename, long offset, Payload *
  */
 void request_file_list(int sock);
 
+/**
+ * @brief List the server's files page by page with OP_LIST_PAGE.
+ *
+ * Needs a session that agreed to SESSION_FEATURE_LISTING. A pattern
+ * without glob characters matches names it is a prefix of.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param pattern The name filter (empty for every file).
+ * @param details Non-zero to print the size, mtime and Merkle root of every file.
+ * @return The number of files listed, -1 on failure.
+ */
+int list_files(int sock, const char *pattern, int details);
+
 /**
  * @brief Download a file from the server.
  *
@@ -59,6 +105,160 @@ void request_file_list(int sock);
  */
 void download_file(int sock, const char *filename);
 
+/**
+ * @brief Read exact byte ranges of a file into a local file.
+ *
+ * Sends one OP_READ_RANGES request. The server merges ranges that touch
+ * and streams each resulting range after its own header; every range is
+ * written at its offset in fd. Ranges past the end of the file are
+ * clipped. Needs a framed connection.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filename The name of the file to read.
+ * @param ranges The ranges to read, in any order.
+ * @param count The number of ranges (at most MAX_RANGES).
+ * @param fd The local file to write the ranges into.
+ * @return The number of bytes written, -1 on failure.
+ */
+long read_ranges(int sock, const char *filename, const ByteRange *ranges, int count, int fd);
+
+/**
+ * @brief Bring a local copy of a file up to date, re-fetching only what differs.
+ *
+ * Hashes the local pieces and compares them with the server's Merkle
+ * manifest, whose leaves are checked against the root with range proofs.
+ * Differing pieces and the missing tail are fetched with read_ranges,
+ * then the whole file is verified against the root. Needs a framed
+ * connection with a negotiated piece size of at least MIN_PIECE_SIZE;
+ * with smaller pieces the copy is only resumed after the single-piece
+ * check of download_file, and is not reported as verified.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filename The name of the file.
+ * @return The number of bytes re-fetched, -1 on failure or if the copy couldn't be verified.
+ */
+long repair_file(int sock, const char *filename);
+
+/**
+ * @brief Choose whether files the other side already has move as deltas.
+ *
+ * When enabled and the server agreed to SESSION_FEATURE_DELTA, downloads
+ * of files with a local copy and uploads of files the server has send
+ * only the changed blocks, falling back to whole files otherwise.
+ *
+ * @param enabled Non-zero to use deltas.
+ */
+void set_delta_transfers(int enabled);
+
+/**
+ * @brief Choose the codec proposed for compressing file streams.
+ *
+ * Applies to connections negotiated afterwards. Downloads and uploads of
+ * single files then move compressed if the server agrees; files whose
+ * first pieces don't shrink switch back to raw bytes by themselves.
+ *
+ * @param codec One of COMPRESS_* (COMPRESS_NONE to propose none).
+ */
+void set_compression(int codec);
+
+/**
+ * @brief Bring a local copy of a file up to date from a delta against it.
+ *
+ * Sends the block signature of the local copy in an OP_DELTA request;
+ * the server answers with a script of copies from that copy and the
+ * literal bytes it lacks. The new copy is built next to the old one and
+ * replaces it once its SHA-256 matches the server's.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filename The name of the file.
+ * @return 0 if the local copy was replaced, -1 otherwise (it is then unchanged).
+ */
+int download_delta(int sock, const char *filename);
+
+/**
+ * @brief Upload a file as a delta against the server's copy.
+ *
+ * Fetches the server's block signature with OP_DELTA_SIGNATURE, then
+ * sends the script and its literal bytes with OP_DELTA_UPLOAD.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filename The name of the file.
+ * @param fd The local file.
+ * @param file_size The size of the local file.
+ * @return 0 if the server rebuilt its copy, -1 otherwise (upload the whole file instead).
+ */
+int upload_delta(int sock, const char *filename, int fd, long file_size);
+
+/**
+ * @brief Download one file over several connections at once.
+ *
+ * The file is split into one byte range per connection, each fetched
+ * over its own connect_to_server connection in SEGMENT_STEP requests and
+ * written at its offset into a preallocated output file. A connection
+ * that runs out of work takes over half of the largest range still
+ * left, so a slow connection doesn't hold up the rest, and the ranges of
+ * failed connections are picked up by the others, or by @p sock once
+ * they are all done. Small files, a single connection and servers that
+ * didn't answer OP_HELLO use download_file instead. Always fetches the
+ * whole file.
+ *
+ * @param sock The socket descriptor used for the metadata request.
+ * @param server_ip The IP address of the server.
+ * @param port The port number of the server.
+ * @param filename The name of the file to download.
+ * @param connections The number of connections (1 to MAX_CONNECTIONS).
+ * @return 0 on success, -1 on failure.
+ */
+int download_file_segmented(int sock, const char *server_ip, int port, const char *filename, int connections);
+
+/**
+ * @brief Download several files with pipelined requests.
+ *
+ * Keeps up to PIPELINE_DEPTH download requests in flight on the one
+ * connection; the server answers them in order, each with an OP_DATA
+ * header carrying the request id and stream length, so a batch costs
+ * about one round trip instead of two per file. Files are fetched
+ * whole. Legacy connections, which cannot carry request ids, fall back
+ * to download_file for each file, which only logs failures.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filenames The names of the files to download.
+ * @param count The number of files.
+ * @return 0 if every file was downloaded, -1 otherwise.
+ */
+int download_files(int sock, char *const filenames[], int count);
+
+/**
+ * @brief Request the metadata of many files in one round trip.
+ *
+ * Names the files, or matches a glob against the server's shared
+ * directory. Legacy connections fall back to request_file_metadata for
+ * each name and don't support patterns.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filenames The names of the files (ignored with a pattern).
+ * @param count The number of names.
+ * @param pattern Glob to match on the server, or NULL.
+ * @param files Pointer to receive a malloc'd array of file metadata.
+ * @return The number of files, -1 on failure.
+ */
+int request_batch_metadata(int sock, char *const filenames[], int count, const char *pattern, BatchFile **files);
+
+/**
+ * @brief Download many files with a single batch request.
+ *
+ * The server replies with the metadata of every file, then streams the
+ * found files back to back. Legacy connections fall back to
+ * download_files and don't support patterns.
+ *
+ * @param sock The socket descriptor for communication with the server.
+ * @param filenames The names of the files (ignored with a pattern).
+ * @param count The number of names.
+ * @param pattern Glob to match on the server, or NULL.
+ * @return 0 if every file was downloaded, -1 otherwise.
+ */
+int download_batch(int sock, char *const filenames[], int count, const char *pattern);
+
 /**
  * @brief Upload a file to the server.
  *
@@ -0,0 +1,134 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "hash.h"
+
+/// Stream codecs a session can agree on
+#define COMPRESS_NONE 0   ///< File streams are raw bytes, the default and the only choice of old peers
+#define COMPRESS_ZLIB 1   ///< Raw deflate at the fastest level
+#define COMPRESS_COUNT 2  ///< Number of codecs
+
+#define COMPRESS_PIECE_SIZE (256 * 1024)  ///< File bytes per compressed chunk
+#define COMPRESS_HEADER_SIZE 8            ///< Bytes of the header in front of every chunk
+#define COMPRESS_STORED 0x80000000u       ///< Packed-length flag of a chunk whose file bytes follow as they are
+#define COMPRESS_MAX_RUN (1L << 30)       ///< Most file bytes behind one stored header
+#define COMPRESS_SAMPLE_PIECES 4          ///< Pieces compressed before deciding whether the file is worth it
+#define COMPRESS_MIN_SAVING 10            ///< Percent the sample must shrink by for compression to continue
+
+/**
+ * One direction of a compressed file stream.
+ *
+ * The stream is a run of chunks, each a header of two big-endian 32-bit
+ * words, the file bytes it carries and the packed length, followed by the
+ * packed bytes; a packed length with COMPRESS_STORED set means the file
+ * bytes follow unchanged instead. Once the sampled pieces show the data
+ * doesn't compress, the sender puts the rest of the file behind stored
+ * headers so it can still go out with sendfile.
+ */
+typedef struct {
+    int codec;                       ///< COMPRESS_* codec (COMPRESS_NONE while no stream is open)
+    int sending;                     ///< Non-zero for the compressing side
+    z_stream zlib;                   ///< Deflate or inflate state, reset for every chunk
+    unsigned char *raw;              ///< One piece of file data
+    size_t raw_len;                  ///< Bytes decoded into raw (receiving side)
+    size_t raw_done;                 ///< Of those, bytes already written to the file
+    unsigned char *chunk;            ///< Encoded chunk, header first
+    size_t chunk_len;                ///< Bytes in chunk: prepared to send, or received so far
+    size_t chunk_need;               ///< Bytes the chunk being received needs (receiving side)
+    size_t chunk_sent;               ///< Bytes of chunk already sent (sending side)
+    size_t chunk_raw;                ///< File bytes the chunk being sent carries, reported once it is out
+    off_t stored;                    ///< File bytes of the current stored chunk still to move as they are
+    int sampled;                     ///< Pieces sampled so far
+    unsigned long long sample_raw;   ///< File bytes of the sampled pieces
+    unsigned long long sample_wire;  ///< Bytes they took once compressed
+    int skipping;                    ///< Non-zero once the sample showed the data doesn't compress
+    unsigned long long raw_bytes;    ///< File bytes moved by the stream
+    unsigned long long wire_bytes;   ///< Bytes the stream took on the wire
+} CompressStream;
+
+/**
+ * @brief Check whether this build can use a codec.
+ *
+ * @param codec One of COMPRESS_*.
+ * @return Non-zero if the codec is supported (COMPRESS_NONE always is).
+ */
+int compress_codec_supported(int codec);
+
+/**
+ * @brief Get the name of a codec.
+ *
+ * @param codec One of COMPRESS_*.
+ * @return The name, or "unknown".
+ */
+const char *compress_codec_name(int codec);
+
+/**
+ * @brief Look up a codec by name.
+ *
+ * @param name "none" or "zlib".
+ * @return One of COMPRESS_*, or -1 if the name is unknown.
+ */
+int compress_codec_parse(const char *name);
+
+/**
+ * @brief Open one direction of a compressed file stream.
+ *
+ * @param stream The stream; call compress_end when done with it.
+ * @param codec The agreed codec (not COMPRESS_NONE).
+ * @param sending Non-zero to compress, zero to decompress.
+ * @return 0 on success, -1 on failure (nothing is left open).
+ */
+int compress_begin(CompressStream *stream, int codec, int sending);
+
+/**
+ * @brief Close a compressed file stream; a no-op if none is open.
+ *
+ * @param stream The stream.
+ */
+void compress_end(CompressStream *stream);
+
+/**
+ * @brief Prepare the next chunk to send.
+ *
+ * Reads up to a piece of the file at offset, hashes it and compresses it
+ * into stream->chunk, or stores it if it didn't shrink. After sampling
+ * has given up on the file, prepares a stored header for up to
+ * COMPRESS_MAX_RUN bytes instead and leaves them in stream->stored for
+ * the caller to send from the file.
+ *
+ * @param stream The sending stream, with no chunk in flight.
+ * @param fd The file, read with pread.
+ * @param offset The file offset of the next byte of the stream.
+ * @param count The most file bytes the chunk may cover.
+ * @param hasher Optional running digest the file bytes are folded into (may be NULL).
+ * @return 0 on success (an empty chunk at end of file), -1 on failure (errno set).
+ */
+int compress_next(CompressStream *stream, int fd, off_t offset, size_t count, Hasher *hasher);
+
+/**
+ * @brief Decode a chunk header.
+ *
+ * @param header COMPRESS_HEADER_SIZE bytes.
+ * @param raw_len Pointer to receive the file bytes the chunk carries.
+ * @param packed_len Pointer to receive the packed bytes that follow (0 for a stored chunk).
+ * @return 1 for a stored chunk, 0 for a compressed one, -1 if the header is malformed.
+ */
+int compress_parse_header(const unsigned char *header, uint32_t *raw_len, uint32_t *packed_len);
+
+/**
+ * @brief Decompress the packed bytes of a received chunk into stream->raw.
+ *
+ * @param stream The receiving stream.
+ * @param packed The packed bytes.
+ * @param packed_len The number of packed bytes.
+ * @param raw_len The file bytes the header promised.
+ * @return 0 on success, -1 if the bytes don't decode to exactly raw_len bytes.
+ */
+int compress_decode(CompressStream *stream, const unsigned char *packed, size_t packed_len, size_t raw_len);
+
+#endif /* COMPRESS_H */
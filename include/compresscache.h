@@ -0,0 +1,55 @@
+#ifndef COMPRESSCACHE_H
+#define COMPRESSCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+
+#define COMPRESS_CACHE_SUFFIX ".zcache"                   ///< Appended to the shared directory to name the cache directory
+#define COMPRESS_CACHE_DEFAULT_LIMIT (1024L * 1024 * 1024) ///< Default total size of the cached copies
+#define COMPRESS_CACHE_MIN_FILE (1024 * 1024)             ///< Smaller files are compressed as they are sent
+#define COMPRESS_CACHE_HOT_HITS 2                         ///< Compressed downloads of a file before a copy is built
+#define COMPRESS_CACHE_HEADER_SIZE 4096                   ///< Bytes in front of the compressed stream of an entry
+
+/// A compressed copy of a file, ready to be sent as the whole stream
+typedef struct {
+    int fd;                 ///< The cache entry (-1 if the file is cached as incompressible)
+    off_t offset;           ///< Where the compressed stream starts in the entry
+    off_t length;           ///< Bytes of compressed stream
+    int incompressible;     ///< Non-zero if the file doesn't compress and should go out raw behind stored headers
+    char hash[HASH_SIZE];   ///< Trailer digest of the file with the requested checksum algorithm
+} CachedCopy;
+
+/**
+ * @brief Open (or create) the cache of compressed copies next to a shared directory.
+ *
+ * Starts the background thread that builds copies of files once they
+ * have been downloaded compressed COMPRESS_CACHE_HOT_HITS times, and
+ * evicts the least recently served copies beyond the size limit. Call
+ * before forking or starting workers: lookups from any process of the
+ * server queue their misses to this thread.
+ *
+ * @param dir The shared directory.
+ * @param limit The most bytes the cached copies may take.
+ * @return 0 on success, -1 on failure (lookups then always miss).
+ */
+int compress_cache_open(const char *dir, long limit);
+
+/**
+ * @brief Find a current compressed copy of a file.
+ *
+ * An entry matches when the file's device, inode, size and mtime are the
+ * ones it was built from; anything else counts as a miss and asks the
+ * builder for a (new) copy. Hits mark the entry as recently used.
+ *
+ * @param filename The name of the file in the shared directory.
+ * @param file_stat The result of fstat on the file.
+ * @param codec The codec the stream must use (COMPRESS_*).
+ * @param hash_algorithm The checksum algorithm of the trailer digest (HASH_ALGO_*).
+ * @param copy The copy to fill in on a hit; the caller closes copy->fd.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int compress_cache_lookup(const char *filename, const struct stat *file_stat, int codec, int hash_algorithm, CachedCopy *copy);
+
+#endif /* COMPRESSCACHE_H */
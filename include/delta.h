@@ -0,0 +1,235 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "frame.h"
+#include "hash.h"
+#include "ranges.h"
+
+#define DELTA_MIN_BLOCK (2 * 1024)      ///< Smallest signature block
+#define DELTA_MAX_BLOCK (128 * 1024)    ///< Largest signature block, unless the file needs more than DELTA_MAX_BLOCKS
+#define DELTA_MAX_BLOCKS (512 * 1024)   ///< Most blocks in one signature (keeps it well inside one frame)
+#define DELTA_MAX_OPS (2 * DELTA_MAX_BLOCKS)  ///< Most steps in one script (larger deltas fall back to whole files)
+#define DELTA_STRONG_SIZE 16            ///< Bytes of SHA-256 kept as the strong hash of a block
+#define DELTA_TEMP_SUFFIX ".delta"      ///< Suffix of the file a delta is applied to before it replaces the old one
+
+/// Checksums of one block of the old copy of a file
+typedef struct {
+    uint32_t weak;                            ///< Rolling checksum
+    unsigned char strong[DELTA_STRONG_SIZE];  ///< Truncated SHA-256
+} DeltaBlock;
+
+/// Block checksums of the old copy of a file, sent by the side that has it
+typedef struct {
+    long file_size;      ///< Size of the old copy
+    long block_size;     ///< Bytes per block (the last block may be shorter)
+    long count;          ///< Number of blocks
+    DeltaBlock *blocks;  ///< The blocks, in file order
+} DeltaSignature;
+
+/// One step of a delta script, producing the next length bytes of the new file
+typedef struct {
+    long source;  ///< Offset of the bytes in the old copy, or -1 for literal bytes from the stream
+    long length;  ///< Number of bytes
+} DeltaOp;
+
+/**
+ * Instructions rebuilding the new copy of a file from the old one.
+ *
+ * The literal bytes are not part of the script: they follow it on the
+ * connection, in script order, as one raw stream.
+ */
+typedef struct {
+    long file_size;                         ///< Size of the new copy
+    unsigned char digest[HASH_DIGEST_SIZE]; ///< SHA-256 of the new copy
+    int count;                              ///< Number of steps
+    int cap;                                ///< Steps allocated
+    DeltaOp *ops;                           ///< The steps, in file order
+} DeltaScript;
+
+/// A new copy of a file being rebuilt next to the old one
+typedef struct {
+    int fd;                                  ///< The new copy, for the literal bytes (-1 once handed over or closed)
+    long file_size;                          ///< Size of the new copy
+    unsigned char digest[HASH_DIGEST_SIZE];  ///< Expected SHA-256 of the new copy
+    char path[MAX_FILENAME];                 ///< The file being replaced
+    char temp_path[MAX_FILENAME + 8];        ///< The new copy until it is verified (empty if no patch is open)
+} DeltaPatch;
+
+/**
+ * @brief Pick the signature block size for a file.
+ *
+ * Roughly the square root of the size, as a power of two, so the
+ * signature and the expected literal data stay small together.
+ *
+ * @param file_size The size of the old copy.
+ * @return The block size.
+ */
+long delta_block_size(long file_size);
+
+/**
+ * @brief Compute the rolling checksum of a block.
+ *
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return The checksum.
+ */
+uint32_t delta_weak(const unsigned char *data, size_t len);
+
+/**
+ * @brief Compute the block checksums of the old copy of a file.
+ *
+ * @param fd The file, read with pread.
+ * @param file_size The size of the file.
+ * @param signature The signature to fill in (release with delta_signature_free).
+ * @return 0 on success, -1 on failure.
+ */
+int delta_signature_build(int fd, long file_size, DeltaSignature *signature);
+
+/**
+ * @brief Release a signature.
+ *
+ * @param signature The signature.
+ */
+void delta_signature_free(DeltaSignature *signature);
+
+/**
+ * @brief Find the parts of a new file that the old copy already has.
+ *
+ * Slides a rolling checksum over the new file one byte at a time and
+ * confirms candidate blocks with their strong hash. The short last block
+ * of the old copy is never matched.
+ *
+ * @param fd The new copy of the file.
+ * @param file_size The size of the new copy.
+ * @param signature The signature of the old copy.
+ * @param script The script to fill in (release with delta_script_free).
+ * @return 0 on success, -1 on failure.
+ */
+int delta_script_build(int fd, long file_size, const DeltaSignature *signature, DeltaScript *script);
+
+/**
+ * @brief Get the literal ranges of a script, in stream order.
+ *
+ * @param script The script.
+ * @param literals Pointer to receive a malloc'd array of ranges of the new file.
+ * @return The number of ranges, -1 on failure.
+ */
+int delta_script_literals(const DeltaScript *script, ByteRange **literals);
+
+/**
+ * @brief Release a script.
+ *
+ * @param script The script.
+ */
+void delta_script_free(DeltaScript *script);
+
+/**
+ * @brief Start rebuilding a file: copy every matched block into a new copy.
+ *
+ * The new copy is written next to the file under DELTA_TEMP_SUFFIX; the
+ * caller then writes the literal ranges to patch->fd.
+ *
+ * @param patch The patch to open (finish it with delta_patch_finish).
+ * @param path The file being replaced, the old copy the script refers to.
+ * @param script The script.
+ * @return 0 on success, -1 on failure (nothing is left open).
+ */
+int delta_patch_open(DeltaPatch *patch, const char *path, const DeltaScript *script);
+
+/**
+ * @brief Finish rebuilding a file: verify the new copy and move it into place.
+ *
+ * @param patch The open patch.
+ * @param complete Non-zero if every literal byte was written.
+ * @return 0 if the new copy matched the digest and replaced the file, -1 otherwise.
+ */
+int delta_patch_finish(DeltaPatch *patch, int complete);
+
+/**
+ * @brief Append an OP_DELTA request: the signature of the client's copy.
+ *
+ * @param buf The buffer to append to.
+ * @param filename The name of the file.
+ * @param signature The signature of the client's copy.
+ */
+void delta_put_request(ByteBuf *buf, const char *filename, const DeltaSignature *signature);
+
+/**
+ * @brief Decode the signature of an OP_DELTA request received on a connection.
+ *
+ * @param sock The socket descriptor the request arrived on.
+ * @param signature The signature to fill in (release with delta_signature_free).
+ * @return 0 on success, -1 if the request is malformed.
+ */
+int delta_parse_request(int sock, DeltaSignature *signature);
+
+/**
+ * @brief Append the OP_DELTA reply that precedes the literal bytes.
+ *
+ * @param sock The socket descriptor whose session supplies the request id.
+ * @param buf The buffer to append to.
+ * @param status STAT_FILE_FOUND, or the reason no script follows.
+ * @param script The script (ignored unless status is STAT_FILE_FOUND).
+ */
+void delta_put_reply(int sock, ByteBuf *buf, int status, const DeltaScript *script);
+
+/**
+ * @brief Decode an OP_DELTA reply.
+ *
+ * @param frame The reply frame.
+ * @param status Pointer to receive the status.
+ * @param script The script to fill in when the status is STAT_FILE_FOUND.
+ * @return 0 on success, -1 if the reply is malformed.
+ */
+int delta_get_reply(const Frame *frame, int *status, DeltaScript *script);
+
+/**
+ * @brief Append an OP_DELTA_SIGNATURE request for the server's copy of a file.
+ *
+ * @param buf The buffer to append to.
+ * @param filename The name of the file.
+ */
+void delta_put_signature_request(ByteBuf *buf, const char *filename);
+
+/**
+ * @brief Append the OP_DELTA_SIGNATURE reply.
+ *
+ * @param sock The socket descriptor whose session supplies the request id.
+ * @param buf The buffer to append to.
+ * @param status STAT_FILE_FOUND, or the reason there is no signature.
+ * @param signature The signature (ignored unless status is STAT_FILE_FOUND).
+ */
+void delta_put_signature_reply(int sock, ByteBuf *buf, int status, const DeltaSignature *signature);
+
+/**
+ * @brief Decode an OP_DELTA_SIGNATURE reply.
+ *
+ * @param frame The reply frame.
+ * @param status Pointer to receive the status.
+ * @param signature The signature to fill in when the status is STAT_FILE_FOUND.
+ * @return 0 on success, -1 if the reply is malformed.
+ */
+int delta_get_signature_reply(const Frame *frame, int *status, DeltaSignature *signature);
+
+/**
+ * @brief Append an OP_DELTA_UPLOAD request: the script its literal bytes follow.
+ *
+ * @param buf The buffer to append to.
+ * @param filename The name of the file.
+ * @param script The script against the server's copy.
+ */
+void delta_put_upload(ByteBuf *buf, const char *filename, const DeltaScript *script);
+
+/**
+ * @brief Decode the script of an OP_DELTA_UPLOAD request received on a connection.
+ *
+ * @param sock The socket descriptor the request arrived on.
+ * @param script The script to fill in (release with delta_script_free).
+ * @return 0 on success, -1 if the request is malformed.
+ */
+int delta_parse_upload(int sock, DeltaScript *script);
+
+#endif /* DELTA_H */
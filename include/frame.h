@@ -0,0 +1,224 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+/// Frame header constants
+#define FRAME_MAGIC       0xF7  ///< First byte of every frame (never a legacy opcode byte)
+#define FRAME_VERSION     1     ///< Wire format version
+#define FRAME_HEADER_MAX  14    ///< Fixed header plus the longest body-length varint
+#define FRAME_MAX_BODY    (16 * 1024 * 1024) ///< Largest accepted frame body
+
+/// Frame flags
+#define FRAME_FLAG_REQUEST_ID  0x01  ///< Body starts with a varint request id
+
+/// Growable output buffer used to build frames
+typedef struct {
+    unsigned char *data;  ///< Buffer contents
+    size_t len;           ///< Bytes used
+    size_t cap;           ///< Bytes allocated
+    int failed;           ///< Set if an allocation failed
+} ByteBuf;
+
+/// Cursor over a received frame body
+typedef struct {
+    const unsigned char *p;    ///< Next unread byte
+    const unsigned char *end;  ///< End of the body
+    int failed;                ///< Set if a read ran past the end or was malformed
+} ByteReader;
+
+/// A parsed frame; the body points into the receive buffer
+typedef struct {
+    int version;                ///< Wire format version of the sender
+    int opcode;                 ///< Operation code (OP_*)
+    int flags;                  ///< Frame flags
+    uint64_t request_id;        ///< Request id (0 if the frame carries none)
+    const unsigned char *body;  ///< Frame body, after the request id
+    size_t body_len;            ///< Length of the body
+} Frame;
+
+/**
+ * @brief Append bytes to a buffer, growing it as needed.
+ *
+ * @param buf The buffer.
+ * @param data The bytes to append.
+ * @param len The number of bytes.
+ */
+void bytebuf_put(ByteBuf *buf, const void *data, size_t len);
+
+/**
+ * @brief Append an unsigned LEB128 varint.
+ *
+ * @param buf The buffer.
+ * @param value The value to encode.
+ */
+void bytebuf_put_varint(ByteBuf *buf, uint64_t value);
+
+/**
+ * @brief Append a signed (zigzag) varint.
+ *
+ * @param buf The buffer.
+ * @param value The value to encode.
+ */
+void bytebuf_put_svarint(ByteBuf *buf, int64_t value);
+
+/**
+ * @brief Append a varint length followed by the bytes.
+ *
+ * @param buf The buffer.
+ * @param data The bytes to append.
+ * @param len The number of bytes.
+ */
+void bytebuf_put_string(ByteBuf *buf, const void *data, size_t len);
+
+/**
+ * @brief Release the memory held by a buffer.
+ *
+ * @param buf The buffer.
+ */
+void bytebuf_free(ByteBuf *buf);
+
+/**
+ * @brief Start a frame: append its header with a placeholder body length.
+ *
+ * A nonzero request id is carried in the frame so pipelined replies can
+ * be matched to their requests.
+ *
+ * @param buf The buffer to append to.
+ * @param opcode The operation code.
+ * @param request_id The request id, or 0 for none.
+ * @return Position to pass to frame_end.
+ */
+size_t frame_begin(ByteBuf *buf, int opcode, uint64_t request_id);
+
+/**
+ * @brief Finish a frame started with frame_begin by fixing up its body length.
+ *
+ * @param buf The buffer.
+ * @param start The position returned by frame_begin.
+ */
+void frame_end(ByteBuf *buf, size_t start);
+
+/**
+ * @brief Parse one frame from received bytes.
+ *
+ * @param data The received bytes.
+ * @param len The number of bytes available.
+ * @param frame Pointer to the frame to fill in.
+ * @return Total frame length, 0 if more bytes are needed, -1 if malformed.
+ */
+long frame_parse(const unsigned char *data, size_t len, Frame *frame);
+
+/**
+ * @brief Read an unsigned varint.
+ *
+ * @param reader The reader.
+ * @return The value (0 and reader->failed set on error).
+ */
+uint64_t reader_varint(ByteReader *reader);
+
+/**
+ * @brief Read a signed (zigzag) varint.
+ *
+ * @param reader The reader.
+ * @return The value (0 and reader->failed set on error).
+ */
+int64_t reader_svarint(ByteReader *reader);
+
+/**
+ * @brief Read a varint length followed by that many bytes.
+ *
+ * @param reader The reader.
+ * @param len Pointer to receive the length.
+ * @return Pointer to the bytes inside the frame (NULL on error).
+ */
+const unsigned char *reader_string(ByteReader *reader, size_t *len);
+
+/**
+ * @brief Append a Payload as a compact frame.
+ *
+ * Integers become varints, the filename is length-prefixed and the hex
+ * hash travels as raw bytes.
+ *
+ * @param buf The buffer to append to.
+ * @param payload The payload to encode.
+ * @param request_id The request id, or 0 for none.
+ */
+void frame_put_payload(ByteBuf *buf, const Payload *payload, uint64_t request_id);
+
+/**
+ * @brief Append the fields of a Payload to a frame body.
+ *
+ * Requests with extra arguments (batch name lists) start their body
+ * with these fields and append the arguments after them.
+ *
+ * @param buf The buffer to append to.
+ * @param payload The payload to encode.
+ */
+void frame_put_payload_fields(ByteBuf *buf, const Payload *payload);
+
+/**
+ * @brief Decode a Payload from a frame.
+ *
+ * @param frame The frame.
+ * @param payload Pointer to the payload to fill in.
+ * @return Bytes of the body used by the payload fields, -1 if the body is malformed.
+ */
+int frame_get_payload(const Frame *frame, Payload *payload);
+
+/**
+ * @brief Append a payload in the wire format of a connection.
+ *
+ * Framed payloads carry the session's current request id.
+ *
+ * @param sock The socket descriptor whose session selects the format.
+ * @param buf The buffer to append to.
+ * @param payload The payload to encode.
+ */
+void payload_put(int sock, ByteBuf *buf, const Payload *payload);
+
+/**
+ * @brief Append an opaque message body in the wire format of a connection.
+ *
+ * Framed connections get a frame with the given opcode and the
+ * session's current request id; legacy connections get the raw bytes,
+ * as before framing.
+ *
+ * @param sock The socket descriptor whose session selects the format.
+ * @param buf The buffer to append to.
+ * @param opcode The operation code of the frame.
+ * @param body The message body.
+ * @param len The length of the body.
+ */
+void message_put(int sock, ByteBuf *buf, int opcode, const void *body, size_t len);
+
+/**
+ * @brief Receive the next frame on a framed connection.
+ *
+ * The frame points into the session's read-ahead buffer; pass the
+ * returned length to session_consume once done with it.
+ *
+ * @param sock The socket descriptor.
+ * @param frame Pointer to the frame to fill in.
+ * @return The frame length, -1 on failure or if the peer closed the connection.
+ */
+long receive_frame(int sock, Frame *frame);
+
+/**
+ * @brief Receive an opaque message body sent with message_put.
+ *
+ * Legacy connections return whatever arrives in one read.
+ *
+ * @param sock The socket descriptor.
+ * @param opcode The expected operation code (framed connections).
+ * @param data Buffer to receive the body.
+ * @param size Size of the buffer; longer bodies are truncated.
+ * @return Bytes stored, -1 on failure or if the peer closed the connection.
+ */
+ssize_t receive_message(int sock, int opcode, void *data, size_t size);
+
+#endif /* FRAME_H */
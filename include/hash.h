@@ -0,0 +1,173 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#include "checksum.h"
+
+#define HASH_DIGEST_SIZE 32                    ///< Bytes in a SHA-256 digest (the largest of the algorithms)
+#define HASH_POOL_MAX_THREADS 16               ///< Most hashing threads, the caller included
+#define HASH_PARALLEL_MIN_BYTES (8 * 1024 * 1024) ///< Smaller runs are hashed on the calling thread
+#define HASH_CLAIM_BYTES (4 * 1024 * 1024)     ///< Bytes of pieces a thread takes at a time
+
+/// Piece checksum algorithms a session can agree on
+#define HASH_ALGO_SHA256 0  ///< SHA-256, the default and the only one old peers know
+#define HASH_ALGO_CRC32C 1  ///< CRC32C, hardware accelerated with SSE4.2
+#define HASH_ALGO_XXH64 2   ///< XXH64
+#define HASH_ALGO_COUNT 3   ///< Number of algorithms
+
+/// Incremental SHA-256 through the OpenSSL EVP interface
+typedef struct {
+    EVP_MD_CTX *ctx;  ///< Reused across digests
+} Sha256;
+
+/// Incremental digest with any of the HASH_ALGO_* algorithms
+typedef struct {
+    int algorithm;     ///< One of HASH_ALGO_*
+    Sha256 sha;        ///< State for HASH_ALGO_SHA256
+    uint32_t crc;      ///< State for HASH_ALGO_CRC32C
+    Xxh64State xxh;    ///< State for HASH_ALGO_XXH64
+} Hasher;
+
+/**
+ * @brief Start a SHA-256 digest.
+ *
+ * EVP picks the fastest implementation for the CPU (SHA-NI, AVX2, ...).
+ *
+ * @param sha The digest state; call sha256_free when done with it.
+ * @return 0 on success, -1 on failure.
+ */
+int sha256_begin(Sha256 *sha);
+
+/**
+ * @brief Add bytes to a SHA-256 digest.
+ *
+ * @param sha The digest state.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ */
+void sha256_update(Sha256 *sha, const void *data, size_t len);
+
+/**
+ * @brief Finish a SHA-256 digest; the state can then start another.
+ *
+ * @param sha The digest state.
+ * @param digest Buffer for HASH_DIGEST_SIZE bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int sha256_end(Sha256 *sha, unsigned char *digest);
+
+/**
+ * @brief Release a SHA-256 digest state.
+ *
+ * @param sha The digest state.
+ */
+void sha256_free(Sha256 *sha);
+
+/**
+ * @brief Hash a small buffer with SHA-256 in one call.
+ *
+ * Reuses a per-thread EVP context, so it is cheap enough for Merkle nodes.
+ *
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @param digest Buffer for HASH_DIGEST_SIZE bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int sha256_digest(const void *data, size_t len, unsigned char *digest);
+
+/**
+ * @brief Start a digest with the given algorithm.
+ *
+ * @param hasher The digest state; call hasher_free when done with it.
+ * @param algorithm One of HASH_ALGO_*.
+ * @return 0 on success, -1 on failure or an unknown algorithm.
+ */
+int hasher_begin(Hasher *hasher, int algorithm);
+
+/**
+ * @brief Add bytes to a digest.
+ *
+ * @param hasher The digest state.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ */
+void hasher_update(Hasher *hasher, const void *data, size_t len);
+
+/**
+ * @brief Finish a digest; the state can then start another.
+ *
+ * @param hasher The digest state.
+ * @param digest Buffer for hash_digest_size(algorithm) bytes, big-endian.
+ * @return 0 on success, -1 on failure.
+ */
+int hasher_end(Hasher *hasher, unsigned char *digest);
+
+/**
+ * @brief Release a digest state.
+ *
+ * @param hasher The digest state.
+ */
+void hasher_free(Hasher *hasher);
+
+/**
+ * @brief Get the digest size of an algorithm.
+ *
+ * @param algorithm One of HASH_ALGO_*.
+ * @return The number of bytes, or 0 for an unknown algorithm.
+ */
+size_t hash_digest_size(int algorithm);
+
+/**
+ * @brief Get the name of an algorithm.
+ *
+ * @param algorithm One of HASH_ALGO_*.
+ * @return The name, or "unknown".
+ */
+const char *hash_algorithm_name(int algorithm);
+
+/**
+ * @brief Look up an algorithm by name.
+ *
+ * @param name "sha256", "crc32c" or "xxh64".
+ * @return One of HASH_ALGO_*, or -1 if the name is unknown.
+ */
+int hash_algorithm_parse(const char *name);
+
+/**
+ * @brief Hash a run of pieces of a file with plain SHA-256.
+ *
+ * Large runs are spread over a pool of threads that each hash whole
+ * pieces with their own buffer and context; the caller hashes too.
+ *
+ * @param fd The file, read with pread.
+ * @param file_size The size of the file.
+ * @param piece_size The bytes per piece.
+ * @param first The first piece to hash.
+ * @param count The number of pieces.
+ * @param digests Buffer for count digests of HASH_DIGEST_SIZE bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int hash_pieces(int fd, long file_size, long piece_size, long first, long count, unsigned char *digests);
+
+/**
+ * @brief Encode bytes as lowercase hex.
+ *
+ * @param bytes The bytes.
+ * @param len The number of bytes.
+ * @param hex Buffer of at least 2 * len + 1 bytes.
+ */
+void hex_encode(const unsigned char *bytes, size_t len, char *hex);
+
+/**
+ * @brief Decode hex digits, stopping at the first character that isn't one.
+ *
+ * @param hex The hex string.
+ * @param bytes Buffer for the decoded bytes.
+ * @param max The most bytes to decode.
+ * @return The number of bytes decoded.
+ */
+size_t hex_decode(const char *hex, unsigned char *bytes, size_t max);
+
+#endif /* HASH_H */
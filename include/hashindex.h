@@ -0,0 +1,65 @@
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+
+#define HASH_INDEX_SUFFIX ".hashindex"              ///< Appended to the shared directory to name the index file
+#define HASH_INDEX_SLOTS 65536                      ///< Files the index can describe (power of two)
+#define HASH_INDEX_MAX_SIZE (1024L * 1024 * 1024)   ///< Size at which the index starts over
+
+/**
+ * @brief Open (or create) the hash index stored next to a shared directory.
+ *
+ * The index is a memory-mapped file shared by every process and thread
+ * of the server; open it before forking or starting workers. Entries are
+ * keyed by device, inode, size, mtime and piece size.
+ *
+ * @param dir The shared directory.
+ * @return 1 if the index was created or found unusable (cold), 0 if it was loaded, -1 on failure.
+ */
+int hash_index_open(const char *dir);
+
+/**
+ * @brief Get the SHA-256 digest of every piece of a file.
+ *
+ * Answers from the index when an entry matches the file's inode, size
+ * and mtime; otherwise hashes the file and stores the digests for next
+ * time. Pieces smaller than MIN_PIECE_SIZE are hashed but not stored.
+ * Works without an open index too.
+ *
+ * @param fd The open file.
+ * @param file_stat The result of fstat on fd.
+ * @param piece_size The bytes per piece.
+ * @param digests Pointer to receive a malloc'd array of digests.
+ * @param count Pointer to receive the number of pieces (1 for an empty file).
+ * @return 0 on success, -1 on failure.
+ */
+int hash_index_digests(int fd, const struct stat *file_stat, long piece_size, unsigned char **digests, long *count);
+
+/**
+ * @brief Get the SHA-256 digest of one piece of a file if the index has it.
+ *
+ * Never reads the file: a miss is left for the caller to hash the one
+ * piece it needs, and for the background build to index.
+ *
+ * @param file_stat The result of stat on the file.
+ * @param piece_size The bytes per piece.
+ * @param piece The zero-based piece number.
+ * @param digest Buffer of MERKLE_HASH_SIZE bytes to receive the digest.
+ * @return 0 on a hit, -1 on a miss or if the index is closed.
+ */
+int hash_index_lookup(const struct stat *file_stat, long piece_size, long piece, unsigned char *digest);
+
+/**
+ * @brief Hash every file of a directory into the index from a background thread.
+ *
+ * @param dir The shared directory.
+ * @param piece_size The piece size to index.
+ * @return 0 if the thread started, -1 otherwise.
+ */
+int hash_index_build_async(const char *dir, long piece_size);
+
+#endif /* HASHINDEX_H */
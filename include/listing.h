@@ -0,0 +1,101 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "frame.h"
+#include "merkle.h"
+
+#define LIST_PAGE_ENTRIES 1024          ///< Most entries in one page (and the default)
+#define LIST_PAGE_BYTES (64 * 1024)     ///< Reply bytes after which a page is closed
+#define LIST_SCAN_MAX 65536             ///< Directory entries examined for one page, matching or not
+#define LIST_DIGESTS 0x1                ///< Request flag: include the Merkle root of every file
+
+/// One file of a listing page
+typedef struct {
+    char filename[MAX_FILENAME];               ///< Name relative to the shared directory
+    long file_size;                            ///< Size in bytes
+    long mtime_sec;                            ///< Modification time, seconds since the epoch
+    long mtime_nsec;                           ///< Nanoseconds of the modification time
+    int has_digest;                            ///< Non-zero if digest holds the file's Merkle root
+    unsigned char digest[MERKLE_HASH_SIZE];    ///< Merkle root at the session piece size, as OP_MANIFEST reports it
+} ListEntry;
+
+/**
+ * A received listing page, decoded one entry at a time.
+ *
+ * Entries are read straight out of the reply frame, so a client holds
+ * at most one page no matter how large the directory is.
+ */
+typedef struct {
+    int status;          ///< STAT_FILE_FOUND, or STAT_SERVER_ERROR if the directory couldn't be read
+    uint64_t cursor;     ///< Cursor to request the next page with
+    int more;            ///< Non-zero if the directory has entries past the cursor
+    ByteReader reader;   ///< The entries still to decode
+} ListPage;
+
+/**
+ * @brief Append an OP_LIST_PAGE request.
+ *
+ * A pattern without glob characters matches names it is a prefix of;
+ * anything else is matched with fnmatch(3). An empty pattern lists
+ * every file.
+ *
+ * @param buf The buffer to append to.
+ * @param pattern The name filter (may be empty).
+ * @param cursor 0 for the first page, or the cursor of the previous page.
+ * @param limit The most entries wanted (0 for LIST_PAGE_ENTRIES).
+ * @param flags LIST_* request flags.
+ */
+void list_put_request(ByteBuf *buf, const char *pattern, uint64_t cursor, int limit, int flags);
+
+/**
+ * @brief Decode the cursor, limit and flags of an OP_LIST_PAGE request received on a connection.
+ *
+ * @param sock The socket descriptor the request arrived on.
+ * @param cursor Pointer to receive the cursor.
+ * @param limit Pointer to receive the entry limit, clipped to LIST_PAGE_ENTRIES.
+ * @param flags Pointer to receive the LIST_* flags.
+ * @return 0 on success, -1 if the request is malformed.
+ */
+int list_parse_request(int sock, uint64_t *cursor, int *limit, int *flags);
+
+/**
+ * @brief Append one page of a directory listing.
+ *
+ * Reads the directory with getdents64 from the cursor, a d_off value the
+ * kernel handed out earlier, so every page costs the same however deep
+ * into the directory it starts. A page ends after limit matching files,
+ * LIST_PAGE_BYTES of reply or LIST_SCAN_MAX entries examined.
+ *
+ * @param sock The socket descriptor whose session supplies the request id and piece size.
+ * @param buf The buffer to append to.
+ * @param dir The shared directory.
+ * @param pattern The name filter (may be empty).
+ * @param cursor Where to resume reading the directory.
+ * @param limit The most entries to include.
+ * @param flags LIST_* request flags.
+ * @return The number of entries in the page, -1 if the directory couldn't be read (an error reply is appended).
+ */
+int list_put_page(int sock, ByteBuf *buf, const char *dir, const char *pattern, uint64_t cursor, int limit, int flags);
+
+/**
+ * @brief Decode the header of an OP_LIST_PAGE reply.
+ *
+ * @param frame The reply frame; it must stay valid while entries are read.
+ * @param page The page to fill in.
+ * @return 0 on success, -1 if the reply is malformed.
+ */
+int list_get_page(const Frame *frame, ListPage *page);
+
+/**
+ * @brief Decode the next entry of a listing page.
+ *
+ * @param page The page.
+ * @param entry The entry to fill in.
+ * @return 1 if an entry was decoded, 0 at the end of the page, -1 if it is malformed.
+ */
+int list_page_next(ListPage *page, ListEntry *entry);
+
+#endif /* LISTING_H */
@@ -7,10 +7,33 @@
 
 // Log levels
 typedef enum {
+    LOG_DEBUG, ///< Per-request and per-chunk detail (compiled out unless LOG_MIN_LEVEL is LOG_DEBUG)
     LOG_INFO,  ///< Informational messages
     LOG_ERROR  ///< Error messages
 } LogLevel;
 
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO   ///< Calls below this level are compiled out (build with -DLOG_MIN_LEVEL=LOG_DEBUG to keep them)
+#endif
+
+#define LOG_RING_RECORDS 1024    ///< Records queued for the writer thread before new ones are dropped (power of two)
+#define LOG_RECORD_SIZE 1024     ///< Longest message kept; longer ones are cut short
+#define LOG_RATE_BURST 10        ///< Messages a rate-limited call site logs per second
+
+/// Counters of the calling process's logger
+typedef struct {
+    unsigned long long written;     ///< Records written to the log file
+    unsigned long long dropped;     ///< Records lost because the ring was full
+    unsigned long long suppressed;  ///< Messages held back by rate limiting
+} LogStats;
+
+/// Rate limiting state of one call site (see log_message_limited)
+typedef struct {
+    long window;            ///< Second the count applies to
+    unsigned int count;     ///< Messages in that second
+    unsigned int suppressed; ///< Messages held back since the last report
+} LogRateLimit;
+
 /**
  * @brief Get the current timestamp as a formatted string.
  *
@@ -19,13 +42,64 @@ typedef enum {
 const char* get_current_time();
 
 /**
- * @brief Log a message with a specified log level and format.
+ * @brief Queue a message with a specified log level and format.
+ *
+ * The message is formatted by the caller and pushed into a lock-free
+ * ring; a background thread writes queued records to the log file in
+ * batches, so callers never wait for the disk. When the ring is full the
+ * record is dropped and counted. Safe to call from any thread, and in
+ * forked children (each process writes its own records). Use the
+ * log_message macro, which compiles out levels below LOG_MIN_LEVEL.
  *
  * @param level The log level (e.g., LOG_INFO, LOG_ERROR).
  * @param format The format string for the message.
  * @param ... Additional arguments for the format string.
  */
-void log_message(LogLevel level, const char *format, ...);
+void log_write(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/// Log a message; calls below LOG_MIN_LEVEL, arguments included, are compiled out
+#define log_message(level, ...) \
+    do { \
+        if ((level) >= LOG_MIN_LEVEL) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * @brief Check whether a rate-limited call site may log now.
+ *
+ * Allows LOG_RATE_BURST messages per second. The first message allowed
+ * in a new second is preceded by a count of those held back before it.
+ *
+ * @param limit The call site's state.
+ * @param file The source file of the call site, for the report.
+ * @param line The line of the call site.
+ * @return Non-zero if the message should be logged.
+ */
+int log_rate_allow(LogRateLimit *limit, const char *file, int line);
+
+/// Log a message at most LOG_RATE_BURST times a second from this call site (for per-chunk messages)
+#define log_message_limited(level, ...) \
+    do { \
+        static LogRateLimit log_limit_; \
+        if ((level) >= LOG_MIN_LEVEL && log_rate_allow(&log_limit_, __FILE__, __LINE__)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * @brief Write every queued record now.
+ *
+ * Runs at exit, so nothing queued by a finished process is lost.
+ */
+void log_flush(void);
+
+/**
+ * @brief Get the logger counters of the calling process.
+ *
+ * @param stats Pointer to receive the counters.
+ */
+void log_get_stats(LogStats *stats);
 
 /**
  * @brief Enable or disable verbose logging mode.
@@ -0,0 +1,209 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "protocol.h"
+#include "frame.h"
+#include "hash.h"
+
+#define MERKLE_HASH_SIZE HASH_DIGEST_SIZE      ///< Bytes in every leaf and node hash
+#define MERKLE_MAX_LEVELS 64                   ///< Levels of the tallest possible tree
+#define MERKLE_MAX_PROOF (2 * MERKLE_MAX_LEVELS) ///< Most hashes in a range proof
+#define MERKLE_MAX_REPLY_LEAVES 65536          ///< Most leaf hashes in one OP_MANIFEST reply
+
+/**
+ * Merkle tree over the pieces of a file.
+ *
+ * Leaves are SHA-256(0x00 || SHA-256(piece)) and nodes SHA-256(0x01 || left || right);
+ * the last node of a level with an odd width is promoted unchanged. An
+ * empty file has a single empty piece.
+ */
+typedef struct {
+    long piece_size;                      ///< Bytes per leaf (the last piece may be shorter)
+    long file_size;                       ///< Size of the hashed file
+    long leaf_count;                      ///< Number of pieces
+    int levels;                           ///< Number of levels, leaves included
+    long level_start[MERKLE_MAX_LEVELS];  ///< Index of each level's first node in nodes
+    long level_width[MERKLE_MAX_LEVELS];  ///< Number of nodes in each level
+    unsigned char *nodes;                 ///< Every level, leaves first
+} MerkleTree;
+
+/// A decoded OP_MANIFEST reply: the root and a verifiable run of leaves
+typedef struct {
+    int status;                            ///< STAT_FILE_FOUND, or why there is no tree
+    long file_size;                        ///< Size of the file on the server
+    long piece_size;                       ///< Bytes per leaf
+    long leaf_count;                       ///< Number of pieces
+    unsigned char root[MERKLE_HASH_SIZE];  ///< Root hash of the whole file
+    long first;                            ///< Index of the first leaf included
+    long count;                            ///< Number of leaves included
+    unsigned char *leaves;                 ///< The leaf hashes (count of them)
+    int proof_count;                       ///< Number of proof hashes
+    unsigned char *proof;                  ///< Hashes linking the leaves to the root
+} Manifest;
+
+/**
+ * @brief Allocate a tree for a file; leaves are filled in separately.
+ *
+ * @param tree The tree to initialize (release with merkle_free).
+ * @param file_size The size of the file.
+ * @param piece_size The bytes per leaf.
+ * @return 0 on success, -1 on failure.
+ */
+int merkle_init(MerkleTree *tree, long file_size, long piece_size);
+
+/**
+ * @brief Get a leaf hash of a tree.
+ *
+ * @param tree The tree.
+ * @param index The piece index.
+ * @return Pointer to the MERKLE_HASH_SIZE bytes of the leaf.
+ */
+unsigned char *merkle_leaf(MerkleTree *tree, long index);
+
+/**
+ * @brief Set a leaf of a tree from the digest of its piece.
+ *
+ * @param tree The tree.
+ * @param index The piece index.
+ * @param digest The SHA-256 digest of the piece, as from hash_pieces.
+ */
+void merkle_set_piece(MerkleTree *tree, long index, const unsigned char *digest);
+
+/**
+ * @brief Hash a run of pieces of a file into the leaves of a tree.
+ *
+ * @param tree The tree.
+ * @param fd The file, read with pread.
+ * @param first The first piece to hash.
+ * @param count The number of pieces.
+ * @return 0 on success, -1 on failure.
+ */
+int merkle_hash_pieces(MerkleTree *tree, int fd, long first, long count);
+
+/**
+ * @brief Compute the levels above the leaves, up to the root.
+ *
+ * @param tree The tree with every leaf filled in.
+ */
+void merkle_finish(MerkleTree *tree);
+
+/**
+ * @brief Hash a whole file into a tree.
+ *
+ * @param tree The tree to build (release with merkle_free).
+ * @param fd The file.
+ * @param file_size The size of the file.
+ * @param piece_size The bytes per leaf.
+ * @return 0 on success, -1 on failure.
+ */
+int merkle_build(MerkleTree *tree, int fd, long file_size, long piece_size);
+
+/**
+ * @brief Build a tree from the digests of every piece of a file.
+ *
+ * @param tree The tree to build (release with merkle_free).
+ * @param digests The digest of every piece, in order.
+ * @param file_size The size of the file.
+ * @param piece_size The bytes per leaf.
+ * @return 0 on success, -1 on failure.
+ */
+int merkle_build_from_digests(MerkleTree *tree, const unsigned char *digests, long file_size, long piece_size);
+
+/**
+ * @brief Get the root hash of a finished tree.
+ *
+ * @param tree The tree.
+ * @return Pointer to the MERKLE_HASH_SIZE bytes of the root.
+ */
+const unsigned char *merkle_root(const MerkleTree *tree);
+
+/**
+ * @brief Collect the hashes proving a run of leaves belongs to the root.
+ *
+ * At most two hashes per level are needed, whatever the length of the run.
+ *
+ * @param tree The finished tree.
+ * @param first The first leaf of the run.
+ * @param count The number of leaves in the run.
+ * @param proof Buffer for up to MERKLE_MAX_PROOF hashes.
+ * @return The number of hashes written.
+ */
+int merkle_range_proof(const MerkleTree *tree, long first, long count, unsigned char *proof);
+
+/**
+ * @brief Check a run of leaves against a root with a range proof.
+ *
+ * @param root The expected root hash.
+ * @param leaf_count The number of leaves in the tree.
+ * @param first The first leaf of the run.
+ * @param count The number of leaves in the run.
+ * @param leaves The leaf hashes of the run.
+ * @param proof The proof hashes from merkle_range_proof.
+ * @param proof_count The number of proof hashes.
+ * @return 0 if the leaves belong to the root, -1 otherwise.
+ */
+int merkle_verify_range(const unsigned char *root, long leaf_count, long first, long count,
+                        const unsigned char *leaves, const unsigned char *proof, int proof_count);
+
+/**
+ * @brief Release a tree.
+ *
+ * @param tree The tree.
+ */
+void merkle_free(MerkleTree *tree);
+
+/**
+ * @brief Append an OP_MANIFEST request for the root and a run of leaves.
+ *
+ * The tree uses the piece size of the session.
+ *
+ * @param buf The buffer to append to.
+ * @param filename The name of the file.
+ * @param first The first leaf wanted.
+ * @param count The number of leaves wanted (0 for the root alone).
+ */
+void manifest_put_request(ByteBuf *buf, const char *filename, long first, long count);
+
+/**
+ * @brief Decode the leaf run of an OP_MANIFEST request received on a connection.
+ *
+ * @param sock The socket descriptor the request arrived on.
+ * @param first Pointer to receive the first leaf wanted.
+ * @param count Pointer to receive the number of leaves wanted.
+ * @return 0 on success, -1 if the request is malformed.
+ */
+int manifest_parse_request(int sock, long *first, long *count);
+
+/**
+ * @brief Append the OP_MANIFEST reply for a run of leaves.
+ *
+ * The run is clipped to the tree and to MERKLE_MAX_REPLY_LEAVES.
+ *
+ * @param sock The socket descriptor whose session supplies the request id.
+ * @param buf The buffer to append to.
+ * @param status STAT_FILE_FOUND, or the reason there is no tree.
+ * @param tree The finished tree (ignored unless status is STAT_FILE_FOUND).
+ * @param first The first leaf wanted.
+ * @param count The number of leaves wanted.
+ */
+void manifest_put_reply(int sock, ByteBuf *buf, int status, const MerkleTree *tree, long first, long count);
+
+/**
+ * @brief Decode and verify an OP_MANIFEST reply.
+ *
+ * Leaves that don't prove against the root are rejected.
+ *
+ * @param frame The reply frame.
+ * @param manifest The manifest to fill in (release with manifest_free).
+ * @return 0 on success, -1 if the reply is malformed or fails verification.
+ */
+int manifest_get_reply(const Frame *frame, Manifest *manifest);
+
+/**
+ * @brief Release a manifest.
+ *
+ * @param manifest The manifest.
+ */
+void manifest_free(Manifest *manifest);
+
+#endif /* MERKLE_H */
@@ -0,0 +1,92 @@
+#ifndef METAINDEX_H
+#define METAINDEX_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "frame.h"
+
+#define META_INDEX_MIN_SLOTS 4096        ///< Smallest table (the table is sized from the directory at startup)
+#define META_INDEX_NAME_BYTES 64         ///< Name arena bytes reserved per slot
+#define META_INDEX_FD_CACHE 64           ///< Open files each process keeps for repeated requests
+
+/**
+ * @brief Index the shared directory in memory and keep the index current with inotify.
+ *
+ * The index maps every regular file's name to its stat information and
+ * lives in a shared anonymous mapping, so the forked children of the
+ * server and the reactor's worker threads all read the same table. A
+ * background thread fills it and applies inotify events to it; until the
+ * first scan is done, or whenever the directory outgrows the table or
+ * inotify drops events, lookups go to the filesystem instead. Call
+ * before forking or starting workers.
+ *
+ * @param dir The shared directory.
+ * @return 0 on success, -1 on failure (lookups then always go to the filesystem).
+ */
+int meta_index_open(const char *dir);
+
+/**
+ * @brief Get the stat information of a file in the shared directory.
+ *
+ * Answers from the index without a system call when it is current.
+ *
+ * @param file_path The path of the file (indexed if it names a file directly inside the shared directory).
+ * @param file_stat The result, as stat(2) would give it (device, inode, mode, size and mtime).
+ * @return 0 on success, -1 on failure (errno set).
+ */
+int meta_index_stat(const char *file_path, struct stat *file_stat);
+
+/**
+ * @brief Build the newline-separated list of files from the index.
+ *
+ * @param file_list The buffer to append the list to.
+ * @param limit The most bytes of names to append; the list is truncated past it.
+ * @return The length of the list, -1 if the index can't answer (list the directory instead).
+ */
+ssize_t meta_index_list(ByteBuf *file_list, size_t limit);
+
+/**
+ * @brief Record a change this process made to a file, without waiting for inotify.
+ *
+ * @param file_path The path of the file.
+ */
+void meta_index_refresh(const char *file_path);
+
+/**
+ * @brief Open a file of the shared directory for reading through the per-process fd cache.
+ *
+ * A file that is still open from an earlier request and hasn't changed
+ * since is handed out again, so hot files cost neither a path lookup nor
+ * an fstat. Release the descriptor with meta_index_close_file, never close(2).
+ *
+ * @param file_path The path of the file.
+ * @param file_stat Pointer to receive the stat information of the file.
+ * @return The file descriptor, -1 on failure (errno set).
+ */
+int meta_index_open_file(const char *file_path, struct stat *file_stat);
+
+/**
+ * @brief Open a file only if the fd cache holds a current descriptor for it.
+ *
+ * Never touches the disk, so event loops can call it. Release the
+ * descriptor with meta_index_close_file.
+ *
+ * @param file_path The path of the file.
+ * @param file_stat Pointer to receive the stat information of the file.
+ * @return The file descriptor, -1 if the file isn't cached.
+ */
+int meta_index_open_cached(const char *file_path, struct stat *file_stat);
+
+/**
+ * @brief Release a descriptor from meta_index_open_file.
+ *
+ * Descriptors the cache doesn't know are simply closed, so any file
+ * descriptor may be released this way.
+ *
+ * @param fd The file descriptor.
+ */
+void meta_index_close_file(int fd);
+
+#endif /* METAINDEX_H */
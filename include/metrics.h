@@ -0,0 +1,89 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+#define METRICS_OPS 20               ///< Opcodes with their own series (others count as opcode 0, "unknown")
+#define METRICS_SHARDS 16            ///< Copies of every counter, so processes and threads rarely share a cache line
+#define METRICS_SUB_BUCKETS 8        ///< Histogram buckets per power of two (about 12% precision)
+#define METRICS_MAGNITUDES 40        ///< Powers of two a histogram covers; larger values land in the last bucket
+#define METRICS_BUCKETS (METRICS_MAGNITUDES * METRICS_SUB_BUCKETS)
+
+/**
+ * @brief Map the shared counters and histograms.
+ *
+ * The block is a shared anonymous mapping, so forked children of the
+ * server and the reactor's workers all record into it and the scrape
+ * endpoint sees their sum; call before forking or starting workers.
+ * Until it is called every recording function does nothing.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_open(void);
+
+/**
+ * @brief Read the monotonic clock for a later recording call.
+ *
+ * @return Nanoseconds since an arbitrary point, or 0 if metrics are off.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Count a handled request and its latency.
+ *
+ * @param opcode The request's opcode.
+ * @param start_ns metrics_now() when the request arrived.
+ */
+void metrics_request(int opcode, uint64_t start_ns);
+
+/**
+ * @brief Count a request that failed or could not be answered as asked.
+ *
+ * @param opcode The request's opcode.
+ */
+void metrics_error(int opcode);
+
+/**
+ * @brief Record a file stream: bytes moved, time to its first byte and throughput.
+ *
+ * @param opcode The request the stream answers.
+ * @param start_ns metrics_now() when the request arrived.
+ * @param first_byte_ns metrics_now() when the stream started (0 if it never did).
+ * @param bytes Bytes of file data moved.
+ * @param sending Non-zero for a download, zero for an upload.
+ */
+void metrics_transfer(int opcode, uint64_t start_ns, uint64_t first_byte_ns, uint64_t bytes, int sending);
+
+/**
+ * @brief Count a connection opening (+1) or closing (-1).
+ *
+ * @param delta +1 or -1.
+ */
+void metrics_connection(int delta);
+
+/**
+ * @brief Count the CPU time of a forked child that is about to exit.
+ *
+ * The scrape endpoint adds it to the server's own CPU time, so the
+ * exported total covers connections served by children that are gone.
+ */
+void metrics_process_exit(void);
+
+/**
+ * @brief Append every metric in the Prometheus text exposition format.
+ *
+ * @param out The buffer to append to.
+ */
+void metrics_render(ByteBuf *out);
+
+/**
+ * @brief Serve the metrics over HTTP on a local endpoint from a background thread.
+ *
+ * @param address A TCP port to listen on at 127.0.0.1, or the path of a Unix socket.
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_serve(const char *address);
+
+#endif /* METRICS_H */
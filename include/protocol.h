@@ -3,10 +3,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <openssl/sha.h>
 #include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "hash.h"
+#include "compress.h"
 
 /// Operation codes for communication
 #define OP_DOWNLOAD       1  ///< Download operation
@@ -15,6 +21,18 @@
 #define OP_REQ_META_DATA  4  ///< Request file metadata
 #define OP_META_DATA      5  ///< Metadata operation
 #define OP_EXIT           6  ///< Exit operation
+#define OP_HELLO          7  ///< Session negotiation (piece size, checksum algorithm)
+#define OP_FILE_LIST      8  ///< File list reply (framed connections)
+#define OP_DATA           9  ///< Header of a file stream answering a pipelined request
+#define OP_BATCH_META     10 ///< Metadata of many files (names or a glob) in one reply
+#define OP_BATCH_DOWNLOAD 11 ///< Batch metadata, then the files back to back
+#define OP_READ_RANGES    12 ///< Exact byte ranges of a file, each with its own header
+#define OP_MANIFEST       13 ///< Merkle root of a file and a verifiable run of piece hashes
+#define OP_TRAILER        14 ///< Digest of the file stream just sent (when both peers agreed to trailers)
+#define OP_DELTA          15 ///< Signature of the client's copy, answered with a delta script and its literal bytes
+#define OP_DELTA_SIGNATURE 16 ///< Signature of the server's copy of a file, ahead of a delta upload
+#define OP_DELTA_UPLOAD   17 ///< Delta script against the server's copy, followed by its literal bytes
+#define OP_LIST_PAGE      18 ///< One page of the file listing with attributes, resumed from a directory cursor
 
 /// Status codes for file operations
 #define STAT_FILE_FOUND           100 ///< File found
@@ -23,10 +41,32 @@
 #define STAT_FILE_CHANGED         103 ///< File has changed
 #define STAT_FILE_VERIFY          104 ///< File verification status
 #define STAT_SERVER_ERROR         105 ///< Server error
+#define STAT_ACCEPTED             106 ///< Session parameters accepted
 
 /// Constants for file handling
 #define MAX_FILENAME 256      ///< Maximum length of filename
-#define CHUNK_SIZE 1024       ///< Size of data chunks for transfer
+#define CHUNK_SIZE 1024       ///< Legacy piece size, used by peers that don't negotiate
+#define MIN_PIECE_SIZE (64 * 1024)           ///< Smallest negotiable piece size
+#define MAX_PIECE_SIZE (4 * 1024 * 1024)     ///< Largest negotiable piece size
+#define DEFAULT_PIECE_SIZE (1024 * 1024)     ///< Piece size proposed by default
+#define HELLO_TIMEOUT_SEC 2   ///< Seconds to wait for a reply to OP_HELLO
+#define BATCH_MAX_FILES 65536 ///< Most files named or matched by one batch request
+#define SESSION_READ_SIZE 4096 ///< Bytes requested per read-ahead from the socket
+
+/// Session features, proposed and echoed above the checksum algorithm in the OP_HELLO offset
+#define HELLO_ALGORITHM_MASK    0xFF   ///< Bits of the OP_HELLO offset that hold the checksum algorithm
+#define SESSION_FEATURE_TRAILER 0x100  ///< Framed file streams are followed by an OP_TRAILER with their digest
+#define SESSION_FEATURE_DELTA   0x200  ///< The server answers OP_DELTA, OP_DELTA_SIGNATURE and OP_DELTA_UPLOAD
+#define SESSION_FEATURE_LISTING 0x400  ///< The server answers OP_LIST_PAGE
+#define SESSION_FEATURE_TRACE   0x800  ///< The server records a trace of the connection (proposed only by tracing clients)
+#define SESSION_FEATURE_FRAMED  0x1000 ///< The server reads framed messages (the client may switch to WIRE_FRAMED)
+#define SESSION_FEATURES        (SESSION_FEATURE_TRAILER | SESSION_FEATURE_DELTA | SESSION_FEATURE_LISTING | SESSION_FEATURE_TRACE | SESSION_FEATURE_FRAMED) ///< Every feature this build supports
+#define HELLO_COMPRESS_SHIFT    16        ///< Bit position of the stream codec in the OP_HELLO offset
+#define HELLO_COMPRESS_MASK     0xFF0000  ///< Bits of the OP_HELLO offset that hold the stream codec
+
+/// Wire formats of a connection
+#define WIRE_LEGACY 0  ///< Raw Payload structs (same-architecture peers only)
+#define WIRE_FRAMED 1  ///< Versioned, length-prefixed frames
 #define HASH_SIZE (SHA256_DIGEST_LENGTH * 2 + 1) ///< Size of hash string
 
 /// Structure for communication payload
@@ -40,8 +80,131 @@ typedef struct {
     char hash[HASH_SIZE]; ///< File hash for integrity checks (optional)
 } Payload;
 
+/// Per-connection parameters agreed with the peer
+typedef struct {
+    long piece_size;      ///< Resume alignment and hash window (CHUNK_SIZE unless negotiated)
+    int hash_algorithm;   ///< Piece checksum algorithm (HASH_ALGO_SHA256 unless negotiated)
+    int features;         ///< SESSION_FEATURE_* bits agreed with the peer (none unless negotiated)
+    int compression;      ///< COMPRESS_* codec of single-file streams (COMPRESS_NONE unless negotiated)
+    int wire;             ///< Wire format used to send (WIRE_LEGACY or WIRE_FRAMED)
+    uint64_t request_id;  ///< Id of the request being answered or sent (0 if none)
+    unsigned char *args;  ///< Body bytes of the last request after the payload fields (batch name lists)
+    size_t args_len;      ///< Length of args
+    size_t args_cap;      ///< Bytes allocated for args
+    unsigned char *rbuf;  ///< Bytes read ahead from the socket
+    size_t rbuf_start;    ///< Offset of the first unconsumed byte
+    size_t rbuf_len;      ///< End of the buffered bytes
+    size_t rbuf_cap;      ///< Bytes allocated for rbuf
+    unsigned char *wbuf;  ///< Bytes queued while corked
+    size_t wbuf_len;      ///< Bytes queued
+    size_t wbuf_cap;      ///< Bytes allocated for wbuf
+    int corked;           ///< Non-zero while sends are being batched
+} Session;
+
+/**
+ * @brief Get the session state of a connection.
+ *
+ * Sessions are kept in a table indexed by socket descriptor, so any code
+ * holding the socket can reach them. A fresh entry has legacy defaults.
+ * The table grows on demand; session_reset makes room for a descriptor
+ * when it is opened, and a descriptor without room aborts.
+ *
+ * @param sock The socket descriptor.
+ * @return Pointer to the session, never NULL.
+ */
+Session *session_get(int sock);
+
+/**
+ * @brief Reset the session of a connection to legacy defaults.
+ *
+ * Call when a socket descriptor is accepted, connected or closed. Frees
+ * any buffered bytes. Fails only if there is no memory for a session,
+ * in which case the connection should be refused.
+ *
+ * @param sock The socket descriptor.
+ * @return 0 on success, -1 if the session couldn't be allocated.
+ */
+int session_reset(int sock);
+
+/**
+ * @brief Clamp a proposed piece size to the negotiable range.
+ *
+ * @param piece_size The proposed piece size.
+ * @return The piece size both peers will use.
+ */
+long piece_size_agree(long piece_size);
+
+/**
+ * @brief Send bytes over the socket, handling partial writes.
+ *
+ * While the session is corked the bytes are queued instead, so several
+ * frames leave in one syscall when it is uncorked.
+ *
+ * @param sock The socket descriptor.
+ * @param data The bytes to send.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int send_bytes(int sock, const void *data, size_t len);
+
+/**
+ * @brief Start batching sends on a connection.
+ *
+ * @param sock The socket descriptor.
+ */
+void session_cork(int sock);
+
+/**
+ * @brief Stop batching and send everything queued in one go.
+ *
+ * @param sock The socket descriptor.
+ * @return 0 on success, -1 on failure.
+ */
+int session_uncork(int sock);
+
+/**
+ * @brief Read more bytes from the socket into the session's read-ahead buffer.
+ *
+ * Performs a single recv, so it also works on non-blocking sockets.
+ *
+ * @param sock The socket descriptor.
+ * @return Bytes read, 0 if the peer closed the connection, -1 on error (errno set).
+ */
+ssize_t session_fill(int sock);
+
+/**
+ * @brief Get the bytes read ahead but not consumed yet.
+ *
+ * @param sock The socket descriptor.
+ * @param data Pointer to receive the start of the buffered bytes.
+ * @return The number of buffered bytes.
+ */
+size_t session_buffered(int sock, const unsigned char **data);
+
+/**
+ * @brief Mark buffered bytes as consumed.
+ *
+ * @param sock The socket descriptor.
+ * @param len The number of bytes consumed.
+ */
+void session_consume(int sock, size_t len);
+
 /**
- * @brief Send a payload over the socket.
+ * @brief Write bytes read ahead from the socket into a file.
+ *
+ * Raw data streams that follow a message may already sit in the
+ * read-ahead buffer; receivers call this before reading the socket.
+ *
+ * @param sock The socket descriptor.
+ * @param fd The destination file descriptor.
+ * @param offset The file offset to write at.
+ * @param max The most bytes that belong to the stream.
+ * @return Bytes written, -1 on failure.
+ */
+long session_drain_to_file(int sock, int fd, off_t offset, long max);
+
+/**
+ * @brief Send a payload over the socket in the session's wire format.
  *
  * @param sock The socket descriptor.
  * @param payload Pointer to the payload to send.
@@ -50,7 +213,36 @@ typedef struct {
 int send_payload(int sock, const Payload *payload);
 
 /**
- * @brief Receive a payload from the socket.
+ * @brief Send bytes that file data follows immediately.
+ *
+ * The bytes are sent with MSG_MORE so a small range shares its first
+ * segment with them instead of waiting behind them.
+ *
+ * @param sock The socket descriptor.
+ * @param data The bytes to send.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int send_bytes_more(int sock, const void *data, size_t len);
+
+/**
+ * @brief Send a payload that file data follows immediately.
+ *
+ * The payload is sent with MSG_MORE so a small file shares its first
+ * segment with the header instead of waiting behind it.
+ *
+ * @param sock The socket descriptor.
+ * @param payload Pointer to the payload to send.
+ * @return 0 on success, -1 on failure.
+ */
+int send_payload_more(int sock, const Payload *payload);
+
+/**
+ * @brief Receive a payload from the socket in either wire format.
+ *
+ * Handles partial reads. The format is detected from the first byte,
+ * and replies to this peer then use the same format and carry the
+ * request id of the received frame.
  *
  * @param sock The socket descriptor.
  * @param payload Pointer to the payload to receive.
@@ -58,6 +250,122 @@ int send_payload(int sock, const Payload *payload);
  */
 int receive_payload(int sock, Payload *payload);
 
+/**
+ * @brief Decode a payload from the bytes already read ahead.
+ *
+ * @param sock The socket descriptor.
+ * @param payload Pointer to the payload to receive.
+ * @return 1 if a payload was decoded, 0 if more bytes are needed, -1 if malformed.
+ */
+int payload_parse(int sock, Payload *payload);
+
+/**
+ * @brief Check whether file streams on a connection are followed by an OP_TRAILER.
+ *
+ * Trailers are used on framed connections whose peer agreed to
+ * SESSION_FEATURE_TRAILER.
+ *
+ * @param sock The socket descriptor.
+ * @return Non-zero if streams carry trailers.
+ */
+int session_trailers(int sock);
+
+/**
+ * @brief Check whether a connection can send files as deltas against the peer's copy.
+ *
+ * Deltas are used on framed connections whose peer agreed to
+ * SESSION_FEATURE_DELTA.
+ *
+ * @param sock The socket descriptor.
+ * @return Non-zero if delta requests are understood.
+ */
+int session_delta(int sock);
+
+/**
+ * @brief Check whether a connection can list files page by page.
+ *
+ * Paged listings are used on framed connections whose peer agreed to
+ * SESSION_FEATURE_LISTING.
+ *
+ * @param sock The socket descriptor.
+ * @return Non-zero if OP_LIST_PAGE is understood.
+ */
+int session_listing(int sock);
+
+/**
+ * @brief Check whether the server records a trace of a connection.
+ *
+ * Traces are recorded for framed connections whose peer asked for
+ * SESSION_FEATURE_TRACE.
+ *
+ * @param sock The socket descriptor.
+ * @return Non-zero if the connection is traced.
+ */
+int session_traced(int sock);
+
+/**
+ * @brief Get the short name of an opcode, for metrics and traces.
+ *
+ * @param opcode The opcode.
+ * @return The name (e.g. "download"), or "unknown".
+ */
+const char *opcode_name(int opcode);
+
+/**
+ * @brief Open the compressed stream of a single-file transfer if the connection agreed to a codec.
+ *
+ * Answers to OP_DOWNLOAD and uploads after OP_META_DATA are compressed;
+ * batch, range and delta streams never are.
+ *
+ * @param sock The socket descriptor.
+ * @param stream The stream to open.
+ * @param sending Non-zero on the side that sends the file.
+ * @return 1 if the file moves compressed, 0 if it moves as raw bytes, -1 if the stream couldn't be opened.
+ */
+int session_compress_begin(int sock, CompressStream *stream, int sending);
+
+/**
+ * @brief Start the running digest of a file stream if the connection uses trailers.
+ *
+ * The digest uses the session's checksum algorithm.
+ *
+ * @param sock The socket descriptor.
+ * @param hasher The digest state to start.
+ * @return hasher if the stream gets a trailer and the digest started, NULL otherwise.
+ */
+Hasher *trailer_begin(int sock, Hasher *hasher);
+
+/**
+ * @brief Finish the running digest of a stream as an OP_TRAILER payload.
+ *
+ * Releases the digest state.
+ *
+ * @param hasher The digest state from trailer_begin (NULL leaves the digest empty, which never verifies).
+ * @param filename The name of the file streamed.
+ * @param offset The file offset the stream started at.
+ * @param length The number of bytes streamed.
+ * @param trailer Pointer to the payload to fill in.
+ */
+void trailer_build(Hasher *hasher, const char *filename, long offset, long length, Payload *trailer);
+
+/**
+ * @brief Compare a received trailer with the one built over the received bytes.
+ *
+ * @param expected The trailer built locally.
+ * @param received The trailer sent by the peer.
+ * @return 0 if they describe the same bytes with the same digest, -1 otherwise.
+ */
+int trailer_verify(const Payload *expected, const Payload *received);
+
+/**
+ * @brief Receive the trailer that follows a stream and compare it with the local one.
+ *
+ * @param sock The socket descriptor.
+ * @param expected The trailer built over the received bytes, or NULL to only consume it.
+ * @return 0 if the digests match, -1 on mismatch or receive failure.
+ */
+int receive_trailer(int sock, const Payload *expected);
+
 /**
  * @brief Calculate the SHA-256 hash of a specific chunk of a file.
  *
@@ -68,4 +376,16 @@ int receive_payload(int sock, Payload *payload);
  */
 int calculate_file_hash(const char *file_path, long offset, char *hash_output);
 
+/**
+ * @brief Calculate the checksum of the piece that ends at an offset.
+ *
+ * @param file_path Path to the file.
+ * @param offset The end of the piece (at least piece_size).
+ * @param piece_size The size of the hashed window.
+ * @param algorithm The checksum algorithm (HASH_ALGO_*), as agreed for the session.
+ * @param hash_output Buffer to store the resulting hex string.
+ * @return 0 on success, -1 on failure.
+ */
+int calculate_piece_hash(const char *file_path, long offset, long piece_size, int algorithm, char *hash_output);
+
 #endif // PROTOCOL_H
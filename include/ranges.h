@@ -0,0 +1,69 @@
+#ifndef RANGES_H
+#define RANGES_H
+
+#include "protocol.h"
+#include "frame.h"
+
+#define MAX_RANGES 4096  ///< Most byte ranges in one OP_READ_RANGES request
+
+/// A byte range [offset, offset + length) of a file
+typedef struct {
+    long offset;  ///< First byte of the range
+    long length;  ///< Number of bytes
+} ByteRange;
+
+/**
+ * @brief Append an OP_READ_RANGES request for several ranges of one file.
+ *
+ * @param buf The buffer to append to.
+ * @param filename The name of the file.
+ * @param ranges The ranges to read, in any order.
+ * @param count The number of ranges.
+ */
+void ranges_put_request(ByteBuf *buf, const char *filename, const ByteRange *ranges, int count);
+
+/**
+ * @brief Decode the ranges of an OP_READ_RANGES request received on a connection.
+ *
+ * The ranges come from the arguments stored in the session by payload_parse.
+ *
+ * @param sock The socket descriptor the request arrived on.
+ * @param ranges Pointer to receive a malloc'd array of ranges.
+ * @return The number of ranges, -1 if the request is malformed.
+ */
+int ranges_parse(int sock, ByteRange **ranges);
+
+/**
+ * @brief Sort ranges, clip them to the file and merge overlapping or adjacent ones.
+ *
+ * @param ranges The ranges, rewritten in place.
+ * @param count The number of ranges.
+ * @param file_size The size of the file.
+ * @return The number of ranges left.
+ */
+int ranges_coalesce(ByteRange *ranges, int count, long file_size);
+
+/**
+ * @brief Append the OP_READ_RANGES reply that precedes the range streams.
+ *
+ * Each of the count ranges then follows as an OP_DATA header and its bytes.
+ *
+ * @param sock The socket descriptor whose session supplies the request id.
+ * @param buf The buffer to append to.
+ * @param status STAT_FILE_FOUND, or the reason no ranges follow.
+ * @param file_size The size of the file.
+ * @param count The number of ranges that follow.
+ */
+void ranges_put_reply(int sock, ByteBuf *buf, int status, long file_size, int count);
+
+/**
+ * @brief Decode an OP_READ_RANGES reply.
+ *
+ * @param frame The reply frame.
+ * @param status Pointer to receive the status.
+ * @param file_size Pointer to receive the size of the file.
+ * @return The number of ranges that follow, -1 if the reply is malformed.
+ */
+int ranges_get_reply(const Frame *frame, int *status, long *file_size);
+
+#endif /* RANGES_H */
@@ -0,0 +1,94 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "frame.h"
+#include "batch.h"
+#include "ranges.h"
+#include "delta.h"
+#include "trace.h"
+
+#define REACTOR_MAX_EVENTS 256   ///< Maximum epoll events handled per wakeup
+#define REACTOR_BACKLOG    4096  ///< Listen backlog of each worker socket
+#define REACTOR_IO_BUDGET  16    ///< Chunks moved per connection before yielding
+#define REACTOR_OFFLOAD_THREADS 4  ///< Threads running the blocking steps of requests (opening, hashing, deltas)
+
+/// States of the per-connection protocol state machine
+typedef enum {
+    CONN_READ_REQUEST,  ///< Waiting for (the rest of) a request message
+    CONN_SEND_BUFFER,   ///< Flushing a buffered response
+    CONN_SEND_FILE,     ///< Streaming a file to the client
+    CONN_RECV_FILE,     ///< Receiving an uploaded file from the client
+    CONN_OFFLOADED,     ///< Waiting for a blocking step running on an offload thread
+    CONN_CLOSING        ///< Connection is done and will be closed
+} ConnState;
+
+/// Literal streams of a delta, whose ranges follow each other without headers
+typedef enum {
+    DELTA_NONE,       ///< No delta in progress
+    DELTA_SENDING,    ///< Streaming the literals of a delta download
+    DELTA_RECEIVING   ///< Receiving the literals of a delta upload
+} DeltaStream;
+
+/// Per-connection state, resumed whenever the socket becomes ready
+typedef struct {
+    int sock;                     ///< Non-blocking client socket
+    ConnState state;              ///< Current state
+    struct sockaddr_in addr;      ///< Address of the client
+    Payload request;              ///< Request being dispatched
+    Payload reply;                ///< Reply built by an offloaded step
+    int offload_result;           ///< Result of the last offloaded step
+    ByteBuf out;                  ///< Pending response bytes
+    size_t out_sent;              ///< Bytes of the pending response already sent
+    int file_fd;                  ///< File being sent or received (-1 if none)
+    off_t file_offset;            ///< Current offset in the file
+    off_t file_remaining;         ///< Bytes left to transfer
+    char filename[MAX_FILENAME];  ///< Name of the file being transferred
+    Batch batch;                  ///< Batch download being streamed (dir_fd -1 if none)
+    ByteRange *ranges;            ///< Ranges of file_fd being streamed (NULL if none)
+    int range_count;              ///< Number of ranges
+    int range_next;               ///< Next range to stream
+    int trailed;                  ///< Non-zero if the file stream gets an OP_TRAILER
+    Hasher hasher;                ///< Running digest of the file stream
+    Hasher *digest;               ///< &hasher while the digest is running (NULL otherwise)
+    off_t stream_offset;          ///< File offset the stream started at
+    off_t stream_length;          ///< Length of the stream
+    Payload expected_trailer;     ///< Trailer built over an upload, until the client's arrives
+    int trailer_pending;          ///< Non-zero while expected_trailer waits for the client's
+    DeltaStream delta;            ///< Delta whose literals are the ranges being streamed (DELTA_NONE if none)
+    DeltaPatch patch;             ///< File being rebuilt by a delta upload (temp_path empty if none)
+    CompressStream compress;      ///< Codec state of the file stream (codec COMPRESS_NONE if it moves raw)
+    int cached;                   ///< Non-zero if file_fd is a precompressed copy sent as it is
+    char cached_hash[HASH_SIZE];  ///< Trailer digest of the file the cached copy holds
+    int op;                       ///< Opcode of the request being served
+    uint64_t request_start;       ///< metrics_now() when that request arrived (0 once it is counted)
+    uint64_t first_byte;          ///< metrics_now() when the current file stream started (0 before)
+    uint64_t transferred;         ///< File bytes the current stream has moved
+    TraceContext trace;           ///< Tracing state, attached while the connection is served if the client asked for a trace
+    uint64_t trace_start;         ///< trace_now() when the request being served arrived
+} Conn;
+
+/**
+ * @brief Run the epoll reactor server.
+ *
+ * Starts one worker thread per requested core. Every worker owns a
+ * listening socket bound to the same port (SO_REUSEPORT) and a
+ * non-blocking epoll loop serving its connections. Steps that block on
+ * the disk (opening files, building metadata, manifests and deltas) run
+ * on REACTOR_OFFLOAD_THREADS shared threads, and the connection resumes
+ * on its event loop when they are done. Does not return
+ * unless a worker cannot be started or its loop fails; the workers
+ * already running are then stopped and joined and every listener is
+ * closed first.
+ *
+ * @param port The port to listen on.
+ * @param workers The number of event loops to run (0 for one per core).
+ * @return -1 on failure.
+ */
+int reactor_run(int port, int workers);
+
+#endif /* REACTOR_H */
@@ -17,8 +17,11 @@
 #include <sys/stat.h>
 
 #include "protocol.h"
+#include "frame.h"
+#include "delta.h"
 
 #define MAX_CLIENTS 10 ///< Maximum number of simultaneous clients
+#define FILE_LIST_SIZE 1024 ///< Size of the file list buffer
 
 /// Shared directory for files
 extern char SRC_DIR[MAX_FILENAME]; 
@@ -45,6 +48,84 @@ void handle_client(int client_sock, struct sockaddr_in client_addr);
  */
 void send_file_list(int client_sock);
 
+/**
+ * @brief Build the newline-separated list of files in the shared directory.
+ *
+ * @param file_list The buffer to append the list to.
+ * @param limit The most bytes of names to append; the list is truncated past it.
+ * @return The length of the list on success, -1 on failure.
+ */
+ssize_t build_file_list(ByteBuf *file_list, size_t limit);
+
+/**
+ * @brief Build the OP_FILE_LIST reply to an OP_LIST_FILES request.
+ *
+ * Framed replies carry their own length and hold every file. Legacy
+ * clients read the list with a single FILE_LIST_SIZE read, so legacy
+ * replies are truncated to fit it.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param reply The buffer to append the reply to.
+ * @return The length of the list (0 if there are no files), -1 on failure.
+ */
+ssize_t build_file_list_reply(int client_sock, ByteBuf *reply);
+
+/**
+ * @brief Build the OP_LIST_PAGE reply to a paged listing request.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The listing request (its filename is the name filter).
+ * @param reply The buffer to append the reply to.
+ */
+void build_list_page(int client_sock, const Payload *request, ByteBuf *reply);
+
+/**
+ * @brief Answer an OP_LIST_PAGE request.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The listing request.
+ */
+void send_list_page(int client_sock, const Payload *request);
+
+/**
+ * @brief Build the metadata payload for a specific file.
+ *
+ * @param filename The name of the file whose metadata is requested.
+ * @param offset The offset used for the resume hash (0 for none).
+ * @param piece_size The size of the window hashed before the offset.
+ * @param hash_algorithm The checksum algorithm agreed for the session (HASH_ALGO_*).
+ * @param metadata_payload Pointer to the payload to fill in.
+ * @return 0 if the payload is ready to be sent, -1 on failure.
+ */
+int build_file_metadata(const char *filename, long offset, long piece_size, int hash_algorithm, Payload *metadata_payload);
+
+/**
+ * @brief Build the OP_DATA header announcing a file stream.
+ *
+ * Pipelined download requests (those carrying a request id) are answered
+ * with this header, then the raw file bytes, so the client knows the
+ * length without asking for metadata first.
+ *
+ * @param filename The name of the file being sent.
+ * @param offset The offset the stream starts at.
+ * @param length The number of bytes that follow (0 on error).
+ * @param status STAT_FILE_FOUND, or the reason nothing follows.
+ * @param header Pointer to the payload to fill in.
+ */
+void build_data_header(const char *filename, long offset, long length, int status, Payload *header);
+
+/**
+ * @brief Agree on session parameters proposed by the client.
+ *
+ * Records the agreed piece size, checksum algorithm and features in the
+ * connection's session and fills in the OP_HELLO reply.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param hello The OP_HELLO payload received from the client.
+ * @param reply Pointer to the reply payload to fill in.
+ */
+void build_session_reply(int client_sock, const Payload *hello, Payload *reply);
+
 /**
  * @brief Send metadata for a specific file to the client.
  *
@@ -68,8 +149,126 @@ void send_request_metadata(int client_sock, const char *filename);
  * @param client_sock The socket descriptor for the connected client.
  * @param filename The name of the file to send.
  * @param offset The offset from which to start sending the file.
+ * @param max_length The most bytes to send (0 to send to the end of the file).
+ */
+void send_file(int client_sock, const char *filename, long offset, long max_length);
+
+/**
+ * @brief Answer an OP_BATCH_META or OP_BATCH_DOWNLOAD request.
+ *
+ * Sends the metadata of every named or matched file in one reply; for
+ * downloads the found files follow back to back, each preceded by an
+ * OP_DATA header.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The batch request.
+ */
+void send_batch(int client_sock, const Payload *request);
+
+/**
+ * @brief Answer an OP_READ_RANGES request.
+ *
+ * The requested ranges are sorted, clipped to the file and merged where
+ * they touch, then announced in one reply and streamed one after the
+ * other, each preceded by an OP_DATA header with its exact offset and
+ * length.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The range request.
+ */
+void send_ranges(int client_sock, const Payload *request);
+
+/**
+ * @brief Build the OP_MANIFEST reply to a manifest request.
+ *
+ * Builds a Merkle tree at the session's piece size from the hash index and
+ * appends its root, the requested run of leaf hashes and the proof that
+ * links them to the root.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The manifest request.
+ * @param reply The buffer to append the reply to.
+ */
+void build_manifest(int client_sock, const Payload *request, ByteBuf *reply);
+
+/**
+ * @brief Answer an OP_MANIFEST request.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The manifest request.
+ */
+void send_manifest(int client_sock, const Payload *request);
+
+/**
+ * @brief Build the OP_DELTA reply to a delta download request.
+ *
+ * Compares the file with the signature of the client's copy and appends
+ * the script that rebuilds it; the literal ranges then follow the reply
+ * as one raw stream.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The delta request.
+ * @param reply The buffer to append the reply to.
+ * @param fd Pointer to receive the open file the literals come from (-1 if none follow).
+ * @param literals Pointer to receive a malloc'd array of the literal ranges (NULL if none follow).
+ * @return The number of literal ranges that follow the reply.
+ */
+int build_delta(int client_sock, const Payload *request, ByteBuf *reply, int *fd, ByteRange **literals);
+
+/**
+ * @brief Answer an OP_DELTA request.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The delta request.
+ */
+void send_delta(int client_sock, const Payload *request);
+
+/**
+ * @brief Build the OP_DELTA_SIGNATURE reply: the block checksums of the server's copy.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The signature request.
+ * @param reply The buffer to append the reply to.
+ */
+void build_delta_signature(int client_sock, const Payload *request, ByteBuf *reply);
+
+/**
+ * @brief Answer an OP_DELTA_SIGNATURE request.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The signature request.
+ */
+void send_delta_signature(int client_sock, const Payload *request);
+
+/**
+ * @brief Start applying an OP_DELTA_UPLOAD: copy the unchanged blocks into a new copy.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The delta upload request.
+ * @param patch The patch to open; patch->fd is -1 if the file can't be rebuilt,
+ *              and the literals must then be received and discarded.
+ * @param literals Pointer to receive a malloc'd array of the literal ranges.
+ * @return The number of literal ranges the client sends next, -1 if the script is malformed.
+ */
+int begin_delta_upload(int client_sock, const Payload *request, DeltaPatch *patch, ByteRange **literals);
+
+/**
+ * @brief Finish applying an OP_DELTA_UPLOAD and build the reply to it.
+ *
+ * @param patch The patch from begin_delta_upload.
+ * @param filename The name of the file.
+ * @param complete Non-zero if every literal byte arrived.
+ * @param reply Pointer to the payload to fill in (status STAT_FILE_FOUND if the file was replaced).
+ */
+void finish_delta_upload(DeltaPatch *patch, const char *filename, int complete, Payload *reply);
+
+/**
+ * @brief Receive an OP_DELTA_UPLOAD and rebuild the file from the server's copy.
+ *
+ * @param client_sock The socket descriptor for the connected client.
+ * @param request The delta upload request.
  */
-void send_file(int client_sock, const char *filename, long offset);
+void receive_delta(int client_sock, const Payload *request);
 
 /**
  * @brief Receive a file from the client and save it to the shared directory.
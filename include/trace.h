@@ -0,0 +1,93 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_BUFFER_EVENTS 256                  ///< Events a thread holds before writing them out
+#define TRACE_FILE_CHARS 64                      ///< Longest file name kept with an event
+#define TRACE_PROGRESS_BYTES (4 * 1024 * 1024)   ///< Stream bytes between progress events
+
+/// Tracing state of one traced connection, attached to the thread serving it
+typedef struct {
+    int track;              ///< Track (thread id in the viewer) the events go to, e.g. the socket
+    uint64_t stream_start;  ///< trace_now() when the current file stream began (0 if none)
+    long long stream_bytes; ///< Bytes the current stream has moved
+} TraceContext;
+
+/**
+ * @brief Name the file traced events are written to.
+ *
+ * The file is a Chrome trace-event JSON array, which chrome://tracing and
+ * Perfetto open as it is. A path ending in '/' is a directory in which
+ * every process writes <name>-<pid>.json, so forked children get files
+ * of their own. Nothing is written, and no file or directory created,
+ * until a thread attaches a context and records events.
+ *
+ * @param path The trace file, or a directory ending in '/'.
+ * @param name The process name shown in the viewer.
+ * @return 0 on success, -1 on failure.
+ */
+int trace_open(const char *path, const char *name);
+
+/**
+ * @brief Check whether trace_open has been called.
+ *
+ * @return Non-zero if traced connections can be recorded.
+ */
+int trace_enabled(void);
+
+/**
+ * @brief Record the calling thread's events for a connection, or stop recording.
+ *
+ * @param context The connection's tracing state, or NULL to stop.
+ */
+void trace_attach(TraceContext *context);
+
+/**
+ * @brief Read the clock events are stamped with.
+ *
+ * @return Monotonic microseconds, or 0 if the calling thread isn't recording.
+ */
+uint64_t trace_now(void);
+
+/**
+ * @brief Record a span that started at start_us and ends now.
+ *
+ * @param name The span name (a string literal; it is kept by reference).
+ * @param start_us trace_now() when the span began (nothing is recorded if 0).
+ * @param file The file the span worked on, or NULL.
+ * @param bytes Bytes the span moved or hashed, or -1.
+ */
+void trace_span(const char *name, uint64_t start_us, const char *file, long long bytes);
+
+/**
+ * @brief Start timing a file stream of the attached connection.
+ *
+ * The stream's first byte and every TRACE_PROGRESS_BYTES after it are
+ * recorded as instant events as the bytes are counted.
+ */
+void trace_stream_begin(void);
+
+/**
+ * @brief Count bytes of the attached connection's current stream.
+ *
+ * @param bytes Bytes just moved.
+ */
+void trace_stream_bytes(long long bytes);
+
+/**
+ * @brief Record the current stream as a span and stop timing it.
+ *
+ * @param name The span name (a string literal).
+ * @param file The file the stream moved, or NULL.
+ */
+void trace_stream_end(const char *name, const char *file);
+
+/**
+ * @brief Write the calling thread's buffered events to the trace file.
+ *
+ * Runs by itself when the buffer fills and at exit.
+ */
+void trace_flush(void);
+
+#endif /* TRACE_H */
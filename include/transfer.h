@@ -0,0 +1,190 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <sys/types.h>
+
+#include "hash.h"
+#include "compress.h"
+
+#define TRANSFER_BUFFER_SIZE   (256 * 1024)  ///< Default read buffer of the copy fallback
+#define TRANSFER_MIN_CHUNK     (64 * 1024)   ///< Smallest adaptive sender I/O size
+#define TRANSFER_MAX_CHUNK     (4 * 1024 * 1024) ///< Largest adaptive sender I/O size
+#define TRANSFER_SENDFILE_MAX  (1L << 30)    ///< Largest count passed to one sendfile call
+#define TRANSFER_PIPE_SIZE     (1024 * 1024) ///< Requested capacity of the splice pipe
+#define TRANSFER_PROGRESS_STEP (4 * 1024 * 1024) ///< Bytes moved between progress updates
+
+/// Byte counters of the transfer engine
+typedef struct {
+    unsigned long long zero_copy_bytes;  ///< Bytes moved kernel-to-kernel (sendfile or splice)
+    unsigned long long copied_bytes;     ///< Bytes moved through a user-space buffer
+    unsigned long long fallbacks;        ///< Chunks copied because the file could not be spliced
+    unsigned long long uring_bytes;      ///< Of the copied bytes, those moved by io_uring
+} TransferStats;
+
+/**
+ * @brief Enable or disable the zero-copy (sendfile/splice) paths.
+ *
+ * @param enabled If non-zero, use sendfile and splice where possible; otherwise always copy.
+ */
+void transfer_set_zero_copy(int enabled);
+
+/**
+ * @brief Check whether the zero-copy path is enabled.
+ *
+ * @return Non-zero if zero-copy transfers are enabled.
+ */
+int transfer_zero_copy_enabled(void);
+
+/**
+ * @brief Select the io_uring backend for blocking whole-range transfers.
+ *
+ * When enabled and io_uring is available, transfer_send_file and
+ * transfer_recv_file use batched io_uring submissions; otherwise they
+ * use the sendfile/splice or copy paths.
+ *
+ * @param enabled If non-zero, prefer io_uring.
+ */
+void transfer_set_uring(int enabled);
+
+/**
+ * @brief Send up to count bytes of a file to a socket in one step.
+ *
+ * Uses sendfile when enabled and supported by the file, otherwise reads
+ * into a large buffer and sends it. Works on blocking and non-blocking
+ * sockets: on a non-blocking socket only the bytes accepted are consumed.
+ * Bytes that went out with sendfile are hashed from the page cache they
+ * were just sent from; copied bytes are hashed from the buffer.
+ *
+ * @param sock The destination socket.
+ * @param fd The source file descriptor.
+ * @param offset In/out file offset; advanced by the bytes sent.
+ * @param count Maximum number of bytes to send.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the transferred bytes are folded into, in stream order (may be NULL).
+ * @return Bytes sent, 0 at end of file, -1 on error (errno set).
+ */
+ssize_t transfer_send_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Send a range of a file to a blocking socket.
+ *
+ * The size of each I/O starts at chunk_size and adapts to the observed
+ * throughput: it doubles while throughput keeps improving and halves
+ * when it drops, within [TRANSFER_MIN_CHUNK, TRANSFER_MAX_CHUNK].
+ *
+ * @param sock The destination socket.
+ * @param fd The source file descriptor.
+ * @param offset The offset to start sending from.
+ * @param length The number of bytes to send.
+ * @param chunk_size The initial I/O size (usually the session piece size).
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the transferred bytes are folded into, in stream order (may be NULL).
+ * @return Bytes sent (less than length if the file ended), -1 on error.
+ */
+off_t transfer_send_file(int sock, int fd, off_t offset, off_t length, size_t chunk_size, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Receive up to count bytes from a socket into a file in one step.
+ *
+ * Moves the bytes socket->pipe->file with splice when enabled, so they
+ * never enter user space, and otherwise receives into a large buffer and
+ * writes it. Never reads more than count bytes from the socket. Works on
+ * blocking and non-blocking sockets.
+ * With a hasher the file must be open for reading too: spliced bytes are
+ * hashed back from the page cache they were just written to.
+ *
+ * @param sock The source socket.
+ * @param fd The destination file descriptor.
+ * @param offset In/out file offset; advanced by the bytes written.
+ * @param count Maximum number of bytes to receive.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the transferred bytes are folded into, in stream order (may be NULL).
+ * @return Bytes received, 0 if the peer closed the connection, -1 on error (errno set).
+ */
+ssize_t transfer_recv_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Receive exactly length bytes from a blocking socket into a file.
+ *
+ * @param sock The source socket.
+ * @param fd The destination file descriptor.
+ * @param offset The file offset to write at.
+ * @param length The number of bytes to receive.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the transferred bytes are folded into, in stream order (may be NULL).
+ * @return Bytes received (less than length if the peer closed early), -1 on error.
+ */
+off_t transfer_recv_file(int sock, int fd, off_t offset, off_t length, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Send the next part of a file as a compressed stream, in one step.
+ *
+ * Finishes the chunk in flight before preparing the next one, so it works
+ * on non-blocking sockets: -1 with EAGAIN means the socket is full and the
+ * call should be repeated once it is writable. Stored chunks go out with
+ * transfer_send_some.
+ *
+ * @param sock The destination socket.
+ * @param fd The source file descriptor.
+ * @param offset In/out file offset; advanced as chunks are prepared.
+ * @param count Most file bytes left in the stream.
+ * @param stream The open sending stream.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the file bytes are folded into, in stream order (may be NULL).
+ * @return File bytes whose chunks are now sent, 0 at end of file, -1 on error (errno set).
+ */
+ssize_t transfer_send_compressed_some(int sock, int fd, off_t *offset, size_t count, CompressStream *stream, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Send a range of a file to a blocking socket as a compressed stream.
+ *
+ * @param sock The destination socket.
+ * @param fd The source file descriptor.
+ * @param offset The offset to start sending from.
+ * @param length The number of file bytes to send.
+ * @param stream The open sending stream.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the file bytes are folded into, in stream order (may be NULL).
+ * @return File bytes sent (less than length if the file ended), -1 on error.
+ */
+off_t transfer_send_compressed(int sock, int fd, off_t offset, off_t length, CompressStream *stream, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Receive the next part of a compressed stream into a file, in one step.
+ *
+ * Reads only the bytes of the chunk it is assembling, so nothing behind
+ * the stream is read ahead. Works on blocking and non-blocking sockets.
+ *
+ * @param sock The source socket.
+ * @param fd The destination file descriptor.
+ * @param offset In/out file offset; advanced by the bytes written.
+ * @param count Most file bytes to write.
+ * @param stream The open receiving stream.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the file bytes are folded into, in stream order (may be NULL).
+ * @return File bytes written, 0 if the peer closed the connection, -1 on error (errno set; EPROTO for a corrupt chunk).
+ */
+ssize_t transfer_recv_compressed_some(int sock, int fd, off_t *offset, size_t count, CompressStream *stream, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Receive exactly length file bytes of a compressed stream from a blocking socket.
+ *
+ * @param sock The source socket.
+ * @param fd The destination file descriptor.
+ * @param offset The file offset to write at.
+ * @param length The number of file bytes to receive.
+ * @param stream The open receiving stream.
+ * @param stats Optional per-transfer counters to update (may be NULL).
+ * @param hasher Optional running digest the file bytes are folded into, in stream order (may be NULL).
+ * @return File bytes received (less than length if the peer closed early), -1 on error.
+ */
+off_t transfer_recv_compressed(int sock, int fd, off_t offset, off_t length, CompressStream *stream, TransferStats *stats, Hasher *hasher);
+
+/**
+ * @brief Get a snapshot of the process-wide transfer counters.
+ *
+ * @param stats Pointer to the structure to fill in.
+ */
+void transfer_get_stats(TransferStats *stats);
+
+#endif /* TRANSFER_H */
@@ -0,0 +1,51 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+
+#include "hash.h"
+
+#define URING_DEPTH        8             ///< Buffers (and SQEs) in flight per batch
+#define URING_BUFFER_SIZE  (256 * 1024)  ///< Size of each registered buffer
+
+/**
+ * @brief Check whether io_uring can be used by the calling thread.
+ *
+ * Sets up the thread's ring, registered buffers and registered file
+ * table on first use.
+ *
+ * @return Non-zero if the io_uring backend is usable.
+ */
+int uring_available(void);
+
+/**
+ * @brief Send a range of a file to a blocking socket with batched io_uring submissions.
+ *
+ * Each batch issues up to URING_DEPTH fixed-buffer file reads in one
+ * submission, then the matching socket sends as one linked submission.
+ *
+ * @param sock The destination socket.
+ * @param fd The source file descriptor.
+ * @param offset The offset to start sending from.
+ * @param length The number of bytes to send.
+ * @param hasher Optional running digest the registered buffers are folded into, in stream order (may be NULL).
+ * @return Bytes sent (less than length if the file ended), -1 on error.
+ */
+off_t uring_send_file(int sock, int fd, off_t offset, off_t length, Hasher *hasher);
+
+/**
+ * @brief Receive exactly length bytes from a blocking socket into a file with batched io_uring submissions.
+ *
+ * Each batch issues up to URING_DEPTH linked socket receives in one
+ * submission, then the matching fixed-buffer file writes in another.
+ *
+ * @param sock The source socket.
+ * @param fd The destination file descriptor.
+ * @param offset The file offset to write at.
+ * @param length The number of bytes to receive.
+ * @param hasher Optional running digest the registered buffers are folded into, in stream order (may be NULL).
+ * @return Bytes received (less than length if the peer closed early), -1 on error.
+ */
+off_t uring_recv_file(int sock, int fd, off_t offset, off_t length, Hasher *hasher);
+
+#endif /* URING_H */
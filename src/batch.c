@@ -0,0 +1,195 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+// Function to append a batch request: payload fields, then the list of names
+void batch_put_request(ByteBuf *buf, int operation, char *const filenames[], int count, const char *pattern) {
+    Payload payload = {0};
+    payload.operation = operation;
+    if (pattern) {
+        strncpy(payload.filename, pattern, sizeof(payload.filename) - 1);
+        count = 0;
+    }
+
+    size_t start = frame_begin(buf, operation, 0);
+    frame_put_payload_fields(buf, &payload);
+    bytebuf_put_varint(buf, count);
+    for (int i = 0; i < count; i++) {
+        bytebuf_put_string(buf, filenames[i], strnlen(filenames[i], MAX_FILENAME - 1));
+    }
+    frame_end(buf, start);
+}
+
+// Function to add a file to a batch
+static int batch_add(Batch *batch, const char *filename, size_t len) {
+    if (batch->count >= BATCH_MAX_FILES || len >= MAX_FILENAME) {
+        return -1;
+    }
+    if ((batch->count & (batch->count - 1)) == 0) {
+        // Grow at powers of two
+        BatchFile *files = realloc(batch->files, sizeof(BatchFile) * (batch->count ? batch->count * 2 : 16));
+        if (!files) {
+            return -1;
+        }
+        batch->files = files;
+    }
+
+    BatchFile *file = &batch->files[batch->count++];
+    memcpy(file->filename, filename, len);
+    file->filename[len] = '\0';
+    return 0;
+}
+
+// Function to order batch files by name
+static int compare_batch_files(const void *a, const void *b) {
+    return strcmp(((const BatchFile *)a)->filename, ((const BatchFile *)b)->filename);
+}
+
+// Function to add every directory entry matching a glob
+static int batch_match(Batch *batch, const char *pattern) {
+    DIR *dir = fdopendir(dup(batch->dir_fd));
+    if (!dir) {
+        return -1;
+    }
+
+    struct dirent *entry;
+    int result = 0;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        if (fnmatch(pattern, entry->d_name, FNM_PERIOD) == 0) {
+            result = batch_add(batch, entry->d_name, strlen(entry->d_name));
+        }
+    }
+    closedir(dir);
+
+    // Directory order is arbitrary; reply in a stable order
+    qsort(batch->files, batch->count, sizeof(BatchFile), compare_batch_files);
+    return result;
+}
+
+// Function to resolve the files of a batch request received on a connection
+int batch_resolve(int sock, const Payload *request, const char *dir, Batch *batch) {
+    memset(batch, 0, sizeof(*batch));
+    batch->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (batch->dir_fd < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    if (request->filename[0] != '\0') {
+        result = batch_match(batch, request->filename);
+    } else {
+        Session *session = session_get(sock);
+        ByteReader reader = { session->args, session->args + session->args_len, 0 };
+        uint64_t count = reader_varint(&reader);
+        for (uint64_t i = 0; result == 0 && i < count && !reader.failed; i++) {
+            size_t len;
+            const unsigned char *name = reader_string(&reader, &len);
+            result = name ? batch_add(batch, (const char *)name, len) : -1;
+        }
+        if (reader.failed) {
+            result = -1;
+        }
+    }
+    if (result != 0) {
+        batch_free(batch);
+        return -1;
+    }
+
+    // One stat per file against the directory descriptor; nothing is opened yet
+    for (int i = 0; i < batch->count; i++) {
+        struct stat file_stat;
+        BatchFile *file = &batch->files[i];
+        if (fstatat(batch->dir_fd, file->filename, &file_stat, 0) == 0 && S_ISREG(file_stat.st_mode)) {
+            file->status = STAT_FILE_FOUND;
+            file->file_size = file_stat.st_size;
+        } else {
+            file->status = STAT_FILE_NOT_FOUND;
+            file->file_size = 0;
+        }
+    }
+    return 0;
+}
+
+// Function to append the reply listing every file of a batch
+void batch_put_metadata(int sock, ByteBuf *buf, const Batch *batch) {
+    size_t start = frame_begin(buf, OP_BATCH_META, session_get(sock)->request_id);
+    bytebuf_put_varint(buf, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        const BatchFile *file = &batch->files[i];
+        bytebuf_put_string(buf, file->filename, strlen(file->filename));
+        bytebuf_put_svarint(buf, file->status);
+        bytebuf_put_svarint(buf, file->file_size);
+    }
+    frame_end(buf, start);
+}
+
+// Function to decode a batch metadata reply
+int batch_get_metadata(const Frame *frame, BatchFile **files) {
+    ByteReader reader = { frame->body, frame->body + frame->body_len, 0 };
+    uint64_t count = reader_varint(&reader);
+    if (reader.failed || frame->opcode != OP_BATCH_META || count > BATCH_MAX_FILES) {
+        return -1;
+    }
+
+    *files = calloc(count ? count : 1, sizeof(BatchFile));
+    if (!*files) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        BatchFile *file = &(*files)[i];
+        size_t len;
+        const unsigned char *name = reader_string(&reader, &len);
+        if (!name || len >= sizeof(file->filename)) {
+            reader.failed = 1;
+            break;
+        }
+        memcpy(file->filename, name, len);
+        file->status = (int)reader_svarint(&reader);
+        file->file_size = (long)reader_svarint(&reader);
+    }
+
+    if (reader.failed) {
+        free(*files);
+        *files = NULL;
+        return -1;
+    }
+    return (int)count;
+}
+
+// Function to open the next file of the batch that was found
+int batch_open_next(Batch *batch, const BatchFile **file, off_t *length) {
+    *file = NULL;
+    while (batch->next < batch->count) {
+        const BatchFile *candidate = &batch->files[batch->next++];
+        if (candidate->status != STAT_FILE_FOUND) {
+            continue;  // The client already knows it won't get this one
+        }
+
+        *file = candidate;
+        int fd = openat(batch->dir_fd, candidate->filename, O_RDONLY);
+        struct stat file_stat;
+        if (fd >= 0 && fstat(fd, &file_stat) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        *length = fd >= 0 ? file_stat.st_size : 0;
+        return fd;
+    }
+    return -1;
+}
+
+// Function to release a batch
+void batch_free(Batch *batch) {
+    if (batch->dir_fd >= 0) {
+        close(batch->dir_fd);
+    }
+    free(batch->files);
+    memset(batch, 0, sizeof(*batch));
+    batch->dir_fd = -1;
+}
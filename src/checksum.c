@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "checksum.h"
+
+#define CRC32C_POLY 0x82F63B78u  // Castagnoli polynomial, reflected
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];  // Slicing-by-8 tables for CPUs without SSE4.2
+static int crc32c_hardware = 0;        // Non-zero if the crc32 instruction is available
+
+// Function to build the software tables and check for the crc32 instruction
+static void crc32c_setup(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t prev = crc32c_table[slice - 1][i];
+            crc32c_table[slice][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Function to extend a raw (uninverted) CRC32C eight bytes at a time with tables
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Function to extend a raw (uninverted) CRC32C with the SSE4.2 crc32 instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware_update(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Function to extend a CRC32C checksum with more bytes
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_setup);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hardware) {
+        return ~crc32c_hardware_update(crc, data, len);
+    }
+#endif
+    return ~crc32c_software(crc, data, len);
+}
+
+// Function to rotate a 64-bit value left
+static inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Function to read a little-endian 64-bit value
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;  // x86 and arm64 Linux are little-endian
+}
+
+// Function to read a little-endian 32-bit value
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Function to mix one 8-byte lane into an accumulator
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+// Function to fold an accumulator into the hash of a long input
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Function to start an XXH64 hash
+void xxh64_begin(Xxh64State *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+}
+
+// Function to add bytes to an XXH64 hash, 32-byte stripes at a time
+void xxh64_update(Xxh64State *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    state->total_len += len;
+
+    // Top up a partial stripe first
+    if (state->mem_size + len < 32) {
+        memcpy(state->mem + state->mem_size, p, len);
+        state->mem_size += len;
+        return;
+    }
+    if (state->mem_size > 0) {
+        size_t fill = 32 - state->mem_size;
+        memcpy(state->mem + state->mem_size, p, fill);
+        for (int lane = 0; lane < 4; lane++) {
+            state->v[lane] = xxh64_round(state->v[lane], read64(state->mem + lane * 8));
+        }
+        p += fill;
+        state->mem_size = 0;
+    }
+
+    while (end - p >= 32) {
+        state->v[0] = xxh64_round(state->v[0], read64(p));
+        state->v[1] = xxh64_round(state->v[1], read64(p + 8));
+        state->v[2] = xxh64_round(state->v[2], read64(p + 16));
+        state->v[3] = xxh64_round(state->v[3], read64(p + 24));
+        p += 32;
+    }
+
+    state->mem_size = end - p;
+    memcpy(state->mem, p, state->mem_size);
+}
+
+// Function to finish an XXH64 hash
+uint64_t xxh64_end(const Xxh64State *state) {
+    uint64_t hash;
+    if (state->total_len >= 32) {
+        hash = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            hash = xxh64_merge_round(hash, state->v[lane]);
+        }
+    } else {
+        hash = state->seed + XXH_PRIME64_5;
+    }
+    hash += state->total_len;
+
+    // The tail of fewer than 32 bytes
+    const unsigned char *p = state->mem;
+    size_t len = state->mem_size;
+    while (len >= 8) {
+        hash ^= xxh64_round(0, read64(p));
+        hash = rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        hash ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+        hash = rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        hash ^= (*p++) * XXH_PRIME64_5;
+        hash = rotl64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    // Avalanche
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -1,6 +1,9 @@
 #include "protocol.h"
+#include "transfer.h"
 #include "logger.h"
 #include "client.h"
+#include "hash.h"
+#include "trace.h"
 
 int main(int argc, char *argv[]) {
     // Check for the minimum number of arguments
@@ -12,6 +15,12 @@ int main(int argc, char *argv[]) {
     char *server_ip = NULL;
     int port = 0;
     int verbose_mode = 0;
+    long piece_size = DEFAULT_PIECE_SIZE;
+    int wire = WIRE_FRAMED;
+    int connections = 1;
+    int hash_algorithm = HASH_ALGO_SHA256;
+    int delta = 0;
+    int compression = COMPRESS_NONE;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
@@ -25,6 +34,34 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "--destination-directory") == 0) {
             strncpy(DEST_DIR, argv[++i], sizeof(DEST_DIR) - 1);
             DEST_DIR[sizeof(DEST_DIR) - 1] = '\0'; // Null-terminate
+        } else if (strcmp(argv[i], "--no-zero-copy") == 0) {
+            transfer_set_zero_copy(0);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            transfer_set_uring(1);
+        } else if (strcmp(argv[i], "--piece-size") == 0 && i + 1 < argc) {
+            piece_size = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--wire") == 0 && i + 1 < argc) {
+            wire = strcmp(argv[++i], "legacy") == 0 ? WIRE_LEGACY : WIRE_FRAMED;
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            delta = 1;
+            set_delta_transfers(1);
+        } else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            compression = compress_codec_parse(argv[++i]);
+            if (compression < 0) {
+                fprintf(stderr, "Unknown compression codec: %s (expected none or zlib)\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            set_compression(compression);
+        } else if (strcmp(argv[i], "--checksum") == 0 && i + 1 < argc) {
+            hash_algorithm = hash_algorithm_parse(argv[++i]);
+            if (hash_algorithm < 0) {
+                fprintf(stderr, "Unknown checksum algorithm: %s (expected sha256, crc32c or xxh64)\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_open(argv[++i], "client");
         }
     }
 
@@ -41,6 +78,15 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Framed messages need a server that understands them; the negotiation switches to them only if it says so
+    session_get(sock)->wire = wire;
+
+    // Agree on a bulk piece size, checksum and features; --wire legacy --piece-size 1024 with SHA-256 keeps the legacy protocol
+    if (wire == WIRE_FRAMED || connections > 1 || piece_size != CHUNK_SIZE || hash_algorithm != HASH_ALGO_SHA256 || delta || compression != COMPRESS_NONE ||
+        trace_enabled()) {
+        negotiate_session(sock, piece_size, hash_algorithm);
+    }
+
     char filename[MAX_FILENAME];
     char input[256];  // Buffer for user input
     int option;
@@ -52,6 +98,10 @@ int main(int argc, char *argv[]) {
         printf("2. Upload a file\n");
         printf("3. View file list\n");
         printf("4. Exit\n");
+        printf("5. Download several files\n");
+        printf("6. Download files matching a pattern\n");
+        printf("7. Verify and repair a downloaded file\n");
+        printf("8. View file details (size, time, digest)\n");
         printf("Enter your choice: ");
 
         // Use fgets for input to avoid buffer overflow
@@ -69,7 +119,11 @@ int main(int argc, char *argv[]) {
                 printf("Enter the file name to download: ");
                 fgets(filename, sizeof(filename), stdin);
                 filename[strcspn(filename, "\n")] = '\0';  // Remove newline character
-                download_file(sock, filename);
+                if (connections > 1) {
+                    download_file_segmented(sock, server_ip, port, filename, connections);
+                } else {
+                    download_file(sock, filename);
+                }
                 break;
 
             case 2:  // Upload file
@@ -89,6 +143,61 @@ int main(int argc, char *argv[]) {
                 close(sock);
                 return 0;
 
+            case 5: {  // Download several files with pipelined requests
+                char *names[PIPELINE_DEPTH * 8];
+                char line[4096];
+                int count = 0;
+                request_file_list(sock);
+                printf("Enter the file names to download, separated by spaces: ");
+                if (!fgets(line, sizeof(line), stdin)) {
+                    break;
+                }
+                for (char *name = strtok(line, " \t\n"); name && count < PIPELINE_DEPTH * 8; name = strtok(NULL, " \t\n")) {
+                    names[count++] = name;
+                }
+                if (download_files(sock, names, count) == 0) {
+                    printf("Downloaded %d files.\n", count);
+                }
+                break;
+            }
+
+            case 6: {  // Download every file matching a glob in one batch
+                char pattern[MAX_FILENAME];
+                printf("Enter the pattern to download (e.g. *.txt): ");
+                if (!fgets(pattern, sizeof(pattern), stdin)) {
+                    break;
+                }
+                pattern[strcspn(pattern, "\n")] = '\0';  // Remove newline character
+                if (download_batch(sock, NULL, 0, pattern) == 0) {
+                    printf("Downloaded the files matching '%s'.\n", pattern);
+                }
+                break;
+            }
+
+            case 7:  // Check a local copy piece by piece and re-fetch what differs
+                printf("Enter the file name to verify: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = '\0';  // Remove newline character
+                if (repair_file(sock, filename) >= 0) {
+                    printf("File '%s' is verified.\n", filename);
+                }
+                break;
+
+            case 8: {  // Page through the listing with attributes, filtered on the server
+                char pattern[MAX_FILENAME];
+                if (!session_listing(sock)) {
+                    printf("The server doesn't support detailed listings.\n");
+                    break;
+                }
+                printf("Enter a name prefix or pattern (empty for all files): ");
+                if (!fgets(pattern, sizeof(pattern), stdin)) {
+                    break;
+                }
+                pattern[strcspn(pattern, "\n")] = '\0';  // Remove newline character
+                list_files(sock, pattern, 1);
+                break;
+            }
+
             default:
                 log_message(LOG_ERROR, "Invalid option selected: %d", option);
                 printf("Invalid option. Please try again.\n");
@@ -1,8 +1,19 @@
+#include <time.h>
+
 #include "protocol.h"
+#include "frame.h"
+#include "batch.h"
+#include "merkle.h"
+#include "listing.h"
 #include "logger.h"
 #include "client.h"
+#include "transfer.h"
+#include "trace.h"
 
 char DEST_DIR[MAX_FILENAME] = "client_dir";
+static int delta_transfers = 0;  // Non-zero to send and fetch deltas of files the other side has
+static int compression_codec = COMPRESS_NONE;  // Stream codec proposed when negotiating
+static __thread TraceContext client_trace;     // Tracing state of the connection this thread uses
 
 // Function to connect to the server
 int connect_to_server(const char *server_ip, int port) {
@@ -12,7 +23,7 @@ int connect_to_server(const char *server_ip, int port) {
     // Create the socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         log_message(LOG_ERROR, "Socket creation error");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Set up the server address
@@ -22,21 +33,142 @@ int connect_to_server(const char *server_ip, int port) {
     // Convert IP address from text to binary form
     if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
         log_message(LOG_ERROR, "Invalid address/Address not supported: %s", server_ip);
-        exit(EXIT_FAILURE);
+        close(sock);
+        return -1;
     }
 
     // Connect to the server
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         log_message(LOG_ERROR, "Connection failed to %s:%d", server_ip, port);
-        exit(EXIT_FAILURE);
+        close(sock);
+        return -1;
     }
 
+    if (session_reset(sock) != 0) {
+        log_message(LOG_ERROR, "Out of memory for the session of the connection to %s:%d", server_ip, port);
+        close(sock);
+        return -1;
+    }
+    client_trace.track = sock;
+    trace_attach(&client_trace);  // Records nothing unless a trace file was named
     log_message(LOG_INFO, "Successfully connected to server %s:%d", server_ip, port);
     return sock;
 }
 
+// Function to negotiate session parameters with the server
+int negotiate_session(int sock, long piece_size, int hash_algorithm) {
+    Payload payload;
+    memset(&payload, 0, sizeof(payload));
+    payload.operation = OP_HELLO;
+    payload.file_size = piece_size;
+    payload.offset = hash_algorithm | SESSION_FEATURES | ((long)compression_codec << HELLO_COMPRESS_SHIFT);  // Servers that predate any of them leave them out of the reply
+    if (!trace_enabled()) {
+        payload.offset &= ~SESSION_FEATURE_TRACE;  // Only clients that trace ask the server to
+    }
+
+    // Servers that predate framing can't parse a frame, so the proposal always goes out as a legacy Payload
+    Session *session = session_get(sock);
+    int wire = session->wire;
+    session->wire = WIRE_LEGACY;
+    if (send_payload(sock, &payload) != 0) {
+        log_message(LOG_ERROR, "Failed to send session negotiation");
+        return -1;
+    }
+
+    // Servers that predate OP_HELLO ignore it; don't wait for them forever
+    struct timeval timeout = { HELLO_TIMEOUT_SEC, 0 };
+    struct timeval no_timeout = { 0, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Payload reply;
+    int result = receive_payload(sock, &reply);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+
+    if (result != 0 || reply.operation != OP_HELLO || reply.status != STAT_ACCEPTED) {
+        log_message(LOG_INFO, "Server did not negotiate; using legacy piece size %d and messages", CHUNK_SIZE);
+        session->wire = WIRE_LEGACY;
+        return -1;
+    }
+
+    session->piece_size = reply.file_size;
+    int algorithm = (int)(reply.offset & HELLO_ALGORITHM_MASK);
+    session->hash_algorithm = hash_digest_size(algorithm) > 0 ? algorithm : HASH_ALGO_SHA256;
+    session->features = (int)(reply.offset & SESSION_FEATURES);
+    int codec = (int)((reply.offset & HELLO_COMPRESS_MASK) >> HELLO_COMPRESS_SHIFT);
+    session->compression = codec == compression_codec ? codec : COMPRESS_NONE;
+    session->wire = wire == WIRE_FRAMED && (session->features & SESSION_FEATURE_FRAMED) ? WIRE_FRAMED : WIRE_LEGACY;
+    log_message(LOG_INFO, "Negotiated piece size %ld, %s checksums, features 0x%x, %s compression and %s messages", reply.file_size,
+                hash_algorithm_name(session->hash_algorithm), session->features, compress_codec_name(session->compression),
+                session->wire == WIRE_FRAMED ? "framed" : "legacy");
+    return 0;
+}
+
+// Function to list the server's files page by page, with their attributes if asked
+int list_files(int sock, const char *pattern, int details) {
+    uint64_t cursor = 0;
+    int total = 0, more = 1;
+
+    // One page is held at a time, however many files the server has
+    while (more) {
+        ByteBuf request = {0};
+        list_put_request(&request, pattern, cursor, LIST_PAGE_ENTRIES, details ? LIST_DIGESTS : 0);
+        int result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+        bytebuf_free(&request);
+        if (result != 0) {
+            log_message(LOG_ERROR, "Error requesting file list from server");
+            return -1;
+        }
+
+        Frame frame;
+        ListPage page;
+        ListEntry entry;
+        long frame_len = receive_frame(sock, &frame);
+        if (frame_len < 0 || list_get_page(&frame, &page) != 0 || page.status != STAT_FILE_FOUND) {
+            if (frame_len >= 0) {
+                session_consume(sock, frame_len);
+            }
+            log_message(LOG_ERROR, "Error receiving file list from server");
+            return -1;
+        }
+        while ((result = list_page_next(&page, &entry)) > 0) {
+            if (total++ == 0) {
+                printf("Available files:\n");
+            }
+            if (!details) {
+                printf("%s\n", entry.filename);
+                continue;
+            }
+            char modified[32], digest[MERKLE_HASH_SIZE * 2 + 1] = "-";
+            time_t mtime = entry.mtime_sec;
+            strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+            if (entry.has_digest) {
+                hex_encode(entry.digest, MERKLE_HASH_SIZE, digest);
+            }
+            printf("%-32s %12ld  %s  %s\n", entry.filename, entry.file_size, modified, digest);
+        }
+        session_consume(sock, frame_len);
+        if (result < 0 || (page.more && page.cursor == cursor)) {
+            log_message(LOG_ERROR, "Malformed file list page received from server");
+            return -1;
+        }
+        cursor = page.cursor;
+        more = page.more;
+    }
+
+    if (total == 0) {
+        printf("No files available in the shared directory.\n");
+    }
+    log_message(LOG_INFO, "Received file list of %d files (filter '%s')", total, pattern);
+    return total;
+}
+
 // Function to request and display the file list from the server
 void request_file_list(int sock) {
+    // Servers that page their listings have no limit on its length
+    if (session_listing(sock)) {
+        list_files(sock, "", 0);
+        return;
+    }
+
     Payload payload;
     memset(&payload, 0, sizeof(payload));
 
@@ -48,9 +180,23 @@ void request_file_list(int sock) {
         return;
     }
 
+    // Framed lists hold every file; legacy ones fit one 1 KB read
+    Frame frame;
+    if (session_get(sock)->wire == WIRE_FRAMED) {
+        long frame_len = receive_frame(sock, &frame);
+        if (frame_len < 0 || frame.opcode != OP_FILE_LIST) {
+            log_message(LOG_ERROR, "Error receiving file list from server");
+            return;
+        }
+        printf("Available files:\n%.*s", (int)frame.body_len, (const char *)frame.body);
+        log_message(LOG_INFO, "Received file list of %zu bytes", frame.body_len);
+        session_consume(sock, frame_len);
+        return;
+    }
+
     // Receive the list of files from the server
     char buffer[1024] = {0};
-    ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    ssize_t bytes_received = receive_message(sock, OP_FILE_LIST, buffer, sizeof(buffer) - 1);
     if (bytes_received <= 0) {
         log_message(LOG_ERROR, "Error receiving file list from server");
         return;
@@ -69,8 +215,8 @@ void request_file_list(int sock) {
 
 // Function to download a file from the server with hash validation
 void download_file(int sock, const char *filename) {
-    char buffer[CHUNK_SIZE];
     char file_path[MAX_FILENAME];
+    uint64_t started = trace_now();
 
     // Construct the file path
     int result = snprintf(file_path, sizeof(file_path), "%s/%s", DEST_DIR, filename);
@@ -89,11 +235,21 @@ void download_file(int sock, const char *filename) {
         resume_offset = ftell(file);
         fclose(file);
         
+        // Framed connections check every local piece against the manifest and keep the ones that match;
+        // legacy-sized pieces aren't indexed, so every manifest page would rehash the file on the server
+        if (resume_offset > 0 && session_get(sock)->wire == WIRE_FRAMED && session_get(sock)->piece_size >= MIN_PIECE_SIZE) {
+            if (delta_transfers && session_delta(sock) && download_delta(sock, filename) == 0) {
+                return;  // Shifted or rewritten copies fare better as a delta
+            }
+            repair_file(sock, filename);
+            return;
+        }
+
         // Log the resume offset
         log_message(LOG_INFO, "Resuming download for '%s' at offset %ld", filename, resume_offset);
 
-        // Ensure the resume offset is aligned to a chunk boundary
-        long remainder = resume_offset % CHUNK_SIZE;
+        // Ensure the resume offset is aligned to a piece boundary
+        long remainder = resume_offset % session_get(sock)->piece_size;
         if (remainder != 0) {
             resume_offset -= remainder; // Align to chunk size
             log_message(LOG_INFO, "Adjusted resume offset to %ld for chunk alignment", resume_offset);
@@ -102,7 +258,10 @@ void download_file(int sock, const char *filename) {
 
     // Request file metadata from the server (including size and hash validation)
     Payload metadata;
-    if (request_file_metadata(sock, filename, resume_offset, &metadata) != 0) {
+    uint64_t traced = trace_now();
+    result = request_file_metadata(sock, filename, resume_offset, &metadata);
+    trace_span("request_file_metadata", traced, filename, -1);
+    if (result != 0) {
         log_message(LOG_ERROR, "Failed to get file metadata from server for '%s'", filename);
         return;
     }
@@ -118,63 +277,778 @@ void download_file(int sock, const char *filename) {
         log_message(LOG_INFO, "Resuming download from offset %ld", resume_offset);
     }
 
-    // Open the file for writing (resuming or starting fresh)
-    file = fopen(file_path, resume_offset > 0 ? "r+b" : "wb");
-    if (!file) {
+    // Open the file for writing (resuming or starting fresh); readable too, for the running digest
+    int fd = open(file_path, resume_offset > 0 ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         log_message(LOG_ERROR, "Error opening file for download: %s", filename);
         return;
     }
 
-    // Move the file pointer to the resume offset if continuing
-    if (resume_offset > 0) {
-        if (fseek(file, resume_offset, SEEK_SET) != 0) {
-            log_message(LOG_ERROR, "Error seeking to resume offset %ld for '%s'", resume_offset, filename);
-            fclose(file);
-            return;
-        }
-    }
-
     // Get the total file size from server metadata
     long total_size = metadata.file_size;
 
     // Prepare the download request payload
     Payload payload = {0};
     payload.operation = OP_DOWNLOAD;
-    strncpy(payload.filename, filename, sizeof(payload.filename));
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
     payload.offset = resume_offset;
 
     // Send the download request
+    traced = trace_now();
     if (send_payload(sock, &payload) != 0) {
         log_message(LOG_ERROR, "Failed to send download request for '%s'", filename);
-        fclose(file);
+        close(fd);
         return;
     }
+    trace_span("send_download_request", traced, filename, -1);
+    trace_stream_begin();
 
-    // Download the file in chunks
-    int bytes_received;
+    // Download the file in progress steps through the selected backend, never past the announced size
+    off_t bytes_received = 0;
     long total_downloaded = resume_offset;
-    while (total_downloaded < total_size && (bytes_received = recv(sock, buffer, CHUNK_SIZE, 0)) > 0) {
-        size_t bytes_written = fwrite(buffer, 1, bytes_received, file);
-        if (bytes_written != bytes_received) {
-            log_message(LOG_ERROR, "Error writing to file '%s'", filename);
-            break;
-        }
-        total_downloaded += bytes_received;
+    TransferStats stats = {0};
+    Hasher hasher;
+    Hasher *digest = trailer_begin(sock, &hasher);
+    CompressStream stream;
+    int compressed = session_compress_begin(sock, &stream, 0);
+    while (compressed >= 0 && total_downloaded < total_size) {
+        long step = total_size - total_downloaded < TRANSFER_PROGRESS_STEP ? total_size - total_downloaded : TRANSFER_PROGRESS_STEP;
+        bytes_received = compressed ? transfer_recv_compressed(sock, fd, total_downloaded, step, &stream, &stats, digest)
+                                    : transfer_recv_file(sock, fd, total_downloaded, step, &stats, digest);
+        if (bytes_received > 0) {
+            total_downloaded += bytes_received;
 
-        // Update the progress display
-        display_progress(total_size, total_downloaded);
+            // Update the progress display
+            display_progress(total_size, total_downloaded);
+        }
+        if (bytes_received < step) {
+            break;  // Error or connection closed
+        }
     }
 
+    trace_stream_end("receive_file", filename);
+
     // Check for errors or incomplete download
-    if (bytes_received < 0) {
+    if (bytes_received < 0 || compressed < 0) {
         log_message(LOG_ERROR, "Error during download of '%s'", filename);
     } else if (total_downloaded == total_size) {
-        log_message(LOG_INFO, "Download complete for '%s'", filename);
+        log_message(LOG_INFO, "Download complete for '%s' (%llu bytes zero-copy, %llu bytes copied, %llu bytes on the wire)",
+                    filename, stats.zero_copy_bytes, stats.copied_bytes,
+                    compressed ? stream.wire_bytes : (unsigned long long)(total_size - resume_offset));
+
+        // The server's digest of what it sent follows the file
+        if (session_trailers(sock)) {
+            Payload trailer;
+            trailer_build(digest, filename, resume_offset, total_size - resume_offset, &trailer);
+            digest = NULL;
+            if (receive_trailer(sock, &trailer) != 0) {
+                log_message(LOG_ERROR, "Integrity check failed for '%s'; verify and repair it to fetch the bad pieces again", filename);
+            } else {
+                log_message(LOG_INFO, "Verified %s hash of '%s'", hash_algorithm_name(hasher.algorithm), filename);
+            }
+        }
     } else {
         log_message(LOG_INFO, "Download interrupted for '%s'. Downloaded %ld of %ld bytes", filename, total_downloaded, total_size);
     }
+    if (digest) {
+        hasher_free(digest);
+    }
+    compress_end(&stream);
+
+    close(fd);
+    trace_span("download_file", started, filename, total_downloaded - resume_offset);
+    trace_flush();
+}
+
+// Function to receive the file stream announced by an OP_DATA header; answers to single-file requests may be compressed and trailed
+static int receive_data(int sock, const char *filename, const Payload *header, int single) {
+    if (header->status != STAT_FILE_FOUND) {
+        log_message(LOG_INFO, "File '%s' not available on server (status %d)", filename, header->status);
+        return -1;
+    }
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", DEST_DIR, filename);
+    int fd = result < 0 || result >= sizeof(file_path) ? -1 : open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        // The bytes are on their way regardless; discard them to stay in step with the server
+        log_message(LOG_ERROR, "Error opening file for download: %s", filename);
+        fd = open("/dev/null", O_WRONLY);
+        if (fd < 0) {
+            return -2;
+        }
+        result = -1;
+    }
+
+    // Discarded streams aren't hashed, but their trailer is still read to stay in step
+    CompressStream stream;
+    int compressed = single ? session_compress_begin(sock, &stream, 0) : 0;
+    int trailed = single && session_trailers(sock);
+    TransferStats stats = {0};
+    Hasher hasher;
+    Hasher *digest = trailed && result >= 0 ? trailer_begin(sock, &hasher) : NULL;
+    off_t received = compressed > 0 ? transfer_recv_compressed(sock, fd, header->offset, header->file_size, &stream, &stats, digest)
+                   : compressed == 0 ? transfer_recv_file(sock, fd, header->offset, header->file_size, &stats, digest)
+                   : -1;
+    if (compressed > 0) {
+        compress_end(&stream);
+    }
+    close(fd);
+
+    if (received != header->file_size) {
+        log_message(LOG_ERROR, "Download interrupted for '%s'. Downloaded %ld of %ld bytes", filename, (long)(received > 0 ? received : 0), header->file_size);
+        if (digest) {
+            hasher_free(digest);
+        }
+        return -2;
+    }
+    if (trailed) {
+        Payload trailer;
+        trailer_build(digest, filename, header->offset, header->file_size, &trailer);
+        if (receive_trailer(sock, result >= 0 ? &trailer : NULL) != 0) {
+            log_message(LOG_ERROR, "Integrity check failed for '%s'", filename);
+            return -1;
+        }
+    }
+    if (result < 0) {
+        return -1;
+    }
+    log_message(LOG_INFO, "Download complete for '%s' (%ld bytes)", filename, header->file_size);
+    return 0;
+}
+
+// Function to fetch and verify one run of leaves of a file's manifest
+static int request_manifest(int sock, const char *filename, long first, long count, Manifest *manifest) {
+    ByteBuf request = {0};
+    manifest_put_request(&request, filename, first, count);
+    int result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+    bytebuf_free(&request);
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send manifest request for '%s'", filename);
+        return -1;
+    }
+
+    Frame frame;
+    long frame_len = receive_frame(sock, &frame);
+    result = frame_len < 0 ? -1 : manifest_get_reply(&frame, manifest);
+    if (frame_len >= 0) {
+        session_consume(sock, frame_len);
+    }
+    if (result != 0) {
+        log_message(LOG_ERROR, "Invalid manifest received for '%s'", filename);
+    }
+    return result;
+}
+
+// Function to add a piece-aligned range to a list, extending the last one if they touch
+static int add_range(ByteRange **ranges, int *count, long offset, long length) {
+    if (*count > 0 && (*ranges)[*count - 1].offset + (*ranges)[*count - 1].length == offset) {
+        (*ranges)[*count - 1].length += length;
+        return 0;
+    }
+    if ((*count & (*count - 1)) == 0) {
+        // Grow at powers of two
+        ByteRange *grown = realloc(*ranges, sizeof(ByteRange) * (*count ? *count * 2 : 16));
+        if (!grown) {
+            return -1;
+        }
+        *ranges = grown;
+    }
+    (*ranges)[*count].offset = offset;
+    (*ranges)[*count].length = length;
+    (*count)++;
+    return 0;
+}
+
+// Function to bring a local copy up to date, re-fetching only the pieces that differ
+long repair_file(int sock, const char *filename) {
+    if (session_get(sock)->wire != WIRE_FRAMED) {
+        log_message(LOG_ERROR, "Verifying '%s' needs a framed connection", filename);
+        return -1;
+    }
+
+    // The server indexes no pieces below MIN_PIECE_SIZE, so each manifest page and batch would rehash the file
+    if (session_get(sock)->piece_size < MIN_PIECE_SIZE) {
+        printf("Pieces of %ld bytes are too small to verify '%s' piece by piece; resuming it from its last piece instead.\n",
+               session_get(sock)->piece_size, filename);
+        log_message(LOG_INFO, "Piece size %ld is below %d; checking only the last piece of '%s'", session_get(sock)->piece_size,
+                    MIN_PIECE_SIZE, filename);
+        download_file(sock, filename);
+        return -1;
+    }
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", DEST_DIR, filename);
+    int fd = result < 0 || result >= sizeof(file_path) ? -1 : open(file_path, O_RDWR | O_CREAT, 0644);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        log_message(LOG_ERROR, "Error opening local copy of '%s'", filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // Hash the pieces we already have
+    long piece_size = session_get(sock)->piece_size;
+    MerkleTree local = {0};
+    MerkleTree remote = {0};
+    long local_pieces = file_stat.st_size > 0 ? (file_stat.st_size + piece_size - 1) / piece_size : 0;
+    if (merkle_init(&local, file_stat.st_size, piece_size) != 0 || merkle_hash_pieces(&local, fd, 0, local_pieces) != 0) {
+        log_message(LOG_ERROR, "Error hashing local copy of '%s'", filename);
+        merkle_free(&local);
+        close(fd);
+        return -1;
+    }
+
+    // Compare them with the server's leaves, one verified run at a time
+    Manifest manifest;
+    unsigned char root[MERKLE_HASH_SIZE];
+    ByteRange *ranges = NULL;
+    int range_count = 0;
+    long compared = 0;
+    result = 0;
+    do {
+        long want = local_pieces - compared < MERKLE_MAX_REPLY_LEAVES ? local_pieces - compared : MERKLE_MAX_REPLY_LEAVES;
+        if (request_manifest(sock, filename, compared, want, &manifest) != 0) {
+            result = -1;
+            break;
+        }
+        if (manifest.status != STAT_FILE_FOUND) {
+            log_message(LOG_INFO, "File '%s' not available on server (status %d)", filename, manifest.status);
+            result = -1;
+        } else if (compared == 0) {
+            memcpy(root, manifest.root, sizeof(root));
+            if (merkle_init(&remote, manifest.file_size, manifest.piece_size) != 0 || manifest.piece_size != piece_size) {
+                result = -1;
+            }
+        } else if (memcmp(root, manifest.root, sizeof(root)) != 0 || manifest.first != compared) {
+            log_message(LOG_ERROR, "File '%s' changed on the server while it was being verified", filename);
+            result = -1;
+        }
+
+        for (long i = 0; result == 0 && i < manifest.count; i++) {
+            long index = compared + i;
+            memcpy(merkle_leaf(&remote, index), manifest.leaves + i * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+            if (memcmp(merkle_leaf(&local, index), merkle_leaf(&remote, index), MERKLE_HASH_SIZE) != 0) {
+                long offset = index * piece_size;
+                long length = remote.file_size - offset < piece_size ? remote.file_size - offset : piece_size;
+                result = add_range(&ranges, &range_count, offset, length);
+            }
+        }
+        compared += manifest.count;
+        manifest_free(&manifest);
+    } while (result == 0 && manifest.count > 0 && compared < local_pieces && compared < remote.leaf_count);
+    merkle_free(&local);
+
+    // Everything past the compared pieces is missing locally
+    long tail = compared * piece_size;
+    if (result == 0 && tail < remote.file_size) {
+        result = add_range(&ranges, &range_count, tail, remote.file_size - tail);
+    }
+    if (result == 0 && ftruncate(fd, remote.file_size) != 0) {
+        log_message(LOG_ERROR, "Error resizing local copy of '%s'", filename);
+        result = -1;
+    }
+
+    // Fetch what differs, then hash it so the whole file can be checked against the root
+    long fetched = 0;
+    for (int i = 0; result == 0 && i < range_count; i += MAX_RANGES) {
+        int count = range_count - i < MAX_RANGES ? range_count - i : MAX_RANGES;
+        long received = read_ranges(sock, filename, ranges + i, count, fd);
+        result = received < 0 ? -1 : 0;
+        fetched += received;
+    }
+    for (int i = 0; result == 0 && i < range_count; i++) {
+        long first = ranges[i].offset / piece_size;
+        result = merkle_hash_pieces(&remote, fd, first, (ranges[i].length + piece_size - 1) / piece_size);
+    }
+    if (result == 0 && remote.file_size == 0) {
+        result = merkle_hash_pieces(&remote, fd, 0, 1);  // The single empty piece is never fetched
+    }
+    if (result == 0) {
+        merkle_finish(&remote);
+        if (memcmp(merkle_root(&remote), root, sizeof(root)) != 0) {
+            log_message(LOG_ERROR, "Verification of '%s' failed after re-fetching %ld bytes", filename, fetched);
+            result = -1;
+        } else {
+            char root_hex[HASH_SIZE];
+            hex_encode(root, MERKLE_HASH_SIZE, root_hex);
+            log_message(LOG_INFO, "File '%s' verified (root %s); re-fetched %ld bytes in %d ranges",
+                        filename, root_hex, fetched, range_count);
+        }
+    }
+
+    free(ranges);
+    merkle_free(&remote);
+    close(fd);
+    return result == 0 ? fetched : -1;
+}
+
+// A byte range of a segmented download owned by one connection
+typedef struct {
+    long start;     // Next byte to fetch
+    long end;       // End of the range (exclusive)
+    long inflight;  // End of the request being fetched (start if idle)
+    int alive;      // Cleared when the connection fails
+} Segment;
+
+// State shared by the connections of a segmented download
+typedef struct {
+    const char *server_ip;  // Server to connect to
+    int port;               // Port of the server
+    const char *filename;   // File being downloaded
+    int fd;                 // Preallocated output file
+    long piece_size;        // Piece size to negotiate on every connection
+    int hash_algorithm;     // Checksum algorithm to negotiate on every connection
+    int wire;               // Wire format of every connection
+    long total_size;        // Size of the file
+    long received;          // Bytes written so far
+    pthread_mutex_t lock;   // Protects the segments and the counters
+    Segment *segments;      // One range per connection
+    int count;              // Number of connections
+} SegmentedDownload;
+
+// Arguments of one connection's thread
+typedef struct {
+    SegmentedDownload *download;
+    int index;
+} SegmentWorker;
+
+// Function to fetch exactly [offset, offset + length) of a file into the output
+static int fetch_range(int sock, const char *filename, int fd, long offset, long length) {
+    if (session_get(sock)->wire == WIRE_FRAMED) {
+        ByteRange range = { offset, length };
+        return read_ranges(sock, filename, &range, 1, fd) == length ? 0 : -1;
+    }
+
+    // Legacy connections: a download whose size limits the stream to the range
+    Payload payload = {0};
+    payload.operation = OP_DOWNLOAD;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    payload.offset = offset;
+    payload.file_size = length;
+    if (send_payload(sock, &payload) != 0) {
+        return -1;
+    }
+
+    // A codec agreed for the session applies to the range stream too
+    CompressStream stream;
+    int compressed = session_compress_begin(sock, &stream, 0);
+    off_t received = compressed > 0 ? transfer_recv_compressed(sock, fd, offset, length, &stream, NULL, NULL)
+                   : compressed == 0 ? transfer_recv_file(sock, fd, offset, length, NULL, NULL)
+                   : -1;
+    if (compressed > 0) {
+        compress_end(&stream);
+    }
+    return received == length ? 0 : -1;
+}
+
+// Function to read exact byte ranges of a file into a local file
+long read_ranges(int sock, const char *filename, const ByteRange *ranges, int count, int fd) {
+    if (session_get(sock)->wire != WIRE_FRAMED || count > MAX_RANGES) {
+        log_message(LOG_ERROR, "Range reads need a framed connection and at most %d ranges", MAX_RANGES);
+        return -1;
+    }
+
+    ByteBuf request = {0};
+    ranges_put_request(&request, filename, ranges, count);
+    int result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+    bytebuf_free(&request);
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send range request for '%s'", filename);
+        return -1;
+    }
+
+    Frame frame;
+    int status;
+    long file_size;
+    long frame_len = receive_frame(sock, &frame);
+    int parts = frame_len < 0 ? -1 : ranges_get_reply(&frame, &status, &file_size);
+    if (frame_len >= 0) {
+        session_consume(sock, frame_len);
+    }
+    if (parts < 0) {
+        log_message(LOG_ERROR, "Error receiving range reply for '%s'", filename);
+        return -1;
+    }
+    if (status != STAT_FILE_FOUND) {
+        log_message(LOG_INFO, "File '%s' not available on server (status %d)", filename, status);
+        return -1;
+    }
+
+    // Each merged range arrives after its own header
+    long total = 0;
+    for (int i = 0; i < parts; i++) {
+        Payload header;
+        if (receive_payload(sock, &header) != 0 || header.operation != OP_DATA) {
+            log_message(LOG_ERROR, "Unexpected reply while reading ranges of '%s'", filename);
+            return -1;
+        }
+        if (transfer_recv_file(sock, fd, header.offset, header.file_size, NULL, NULL) != header.file_size) {
+            log_message(LOG_ERROR, "Range %ld+%ld of '%s' interrupted", header.offset, header.file_size, filename);
+            return -1;
+        }
+        total += header.file_size;
+    }
+    return total;
+}
+
+// Function to take over half of the largest range left (lock held)
+static int steal_range(SegmentedDownload *download, int thief) {
+    int victim = -1;
+    long best = 0;
+
+    // Live connections keep the request they are fetching; failed ones give up everything
+    for (int i = 0; i < download->count; i++) {
+        Segment *segment = &download->segments[i];
+        long from = segment->alive ? segment->inflight : segment->start;
+        long left = segment->end - from;
+        if (i != thief && left > best && (!segment->alive || left > SEGMENT_STEP)) {
+            victim = i;
+            best = left;
+        }
+    }
+    if (victim < 0) {
+        return 0;
+    }
+
+    Segment *segment = &download->segments[victim];
+    long split = segment->alive ? segment->inflight : segment->start;
+    if (segment->alive) {
+        split += (segment->end - split) / 2;
+        split += (download->piece_size - split % download->piece_size) % download->piece_size;
+        if (split >= segment->end) {
+            return 0;
+        }
+    }
+
+    Segment *own = &download->segments[thief];
+    own->start = own->inflight = split;
+    own->end = segment->end;
+    segment->end = split;
+    return 1;
+}
+
+// Function run by each connection of a segmented download
+static void *segment_worker(void *arg) {
+    SegmentWorker *worker = arg;
+    SegmentedDownload *download = worker->download;
+    Segment *segment = &download->segments[worker->index];
+    int sock = connect_to_server(download->server_ip, download->port);
+
+    // The first connection already agreed on the session; one that can't connect or agree leaves its range to the others
+    if (sock >= 0) {
+        session_get(sock)->wire = download->wire;
+        if (negotiate_session(sock, download->piece_size, download->hash_algorithm) != 0) {
+            log_message(LOG_ERROR, "Connection %d could not negotiate for '%s'", worker->index, download->filename);
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock < 0) {
+        pthread_mutex_lock(&download->lock);
+        segment->inflight = segment->start;
+        segment->alive = 0;
+        pthread_mutex_unlock(&download->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&download->lock);
+    while (segment->start < segment->end || steal_range(download, worker->index)) {
+        long offset = segment->start;
+        long length = segment->end - offset < SEGMENT_STEP ? segment->end - offset : SEGMENT_STEP;
+        segment->inflight = offset + length;
+        pthread_mutex_unlock(&download->lock);
+
+        int result = fetch_range(sock, download->filename, download->fd, offset, length);
+
+        pthread_mutex_lock(&download->lock);
+        if (result != 0) {
+            // Leave the rest of the range to the other connections
+            log_message(LOG_ERROR, "Connection %d failed at offset %ld of '%s'", worker->index, offset, download->filename);
+            segment->inflight = segment->start;
+            break;
+        }
+        segment->start = segment->inflight;
+        download->received += length;
+        display_progress(download->total_size, download->received);
+    }
+    segment->alive = 0;
+    pthread_mutex_unlock(&download->lock);
+
+    send_exit_request(sock);
+    close(sock);
+    return NULL;
+}
+
+// Function to download one file over several connections at once
+int download_file_segmented(int sock, const char *server_ip, int port, const char *filename, int connections) {
+    Payload metadata;
+    if (request_file_metadata(sock, filename, 0, &metadata) != 0 || metadata.status == STAT_FILE_NOT_FOUND) {
+        log_message(LOG_ERROR, "Failed to get file metadata from server for '%s'", filename);
+        return -1;
+    }
+
+    if (connections > MAX_CONNECTIONS) {
+        connections = MAX_CONNECTIONS;
+    }
+    if (connections <= 1 || metadata.file_size < 2L * SEGMENT_STEP) {
+        download_file(sock, filename);  // Not worth extra connections
+        return 0;
+    }
+    if (!(session_get(sock)->features & SESSION_FEATURE_FRAMED)) {
+        // Servers that predate OP_HELLO ignore the length of a range and stream to the end of the file
+        log_message(LOG_INFO, "Server did not negotiate; downloading '%s' over one connection", filename);
+        download_file(sock, filename);
+        return 0;
+    }
+    if (metadata.file_size < (long)connections * SEGMENT_STEP) {
+        connections = metadata.file_size / SEGMENT_STEP;
+    }
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", DEST_DIR, filename);
+    int fd = result < 0 || result >= sizeof(file_path) ? -1 : open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_message(LOG_ERROR, "Error opening file for download: %s", filename);
+        return -1;
+    }
+
+    // Reserve the whole file up front so ranges land without extending it piecemeal
+    if (posix_fallocate(fd, 0, metadata.file_size) != 0 && ftruncate(fd, metadata.file_size) != 0) {
+        log_message(LOG_ERROR, "Error preallocating %ld bytes for '%s'", metadata.file_size, filename);
+        close(fd);
+        return -1;
+    }
+
+    SegmentedDownload download = {
+        .server_ip = server_ip, .port = port, .filename = filename, .fd = fd,
+        .piece_size = session_get(sock)->piece_size, .hash_algorithm = session_get(sock)->hash_algorithm,
+        .wire = session_get(sock)->wire,
+        .total_size = metadata.file_size, .count = connections,
+    };
+    download.segments = calloc(connections, sizeof(Segment));
+    SegmentWorker *workers = calloc(connections, sizeof(SegmentWorker));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    if (!download.segments || !workers || !threads) {
+        log_message(LOG_ERROR, "Out of memory starting segmented download");
+        free(download.segments);
+        free(workers);
+        free(threads);
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_init(&download.lock, NULL);
+
+    // Even, piece-aligned ranges to start with; stealing evens out the rest
+    long share = metadata.file_size / connections;
+    share -= share % download.piece_size;
+    for (int i = 0; i < connections; i++) {
+        Segment *segment = &download.segments[i];
+        segment->start = segment->inflight = i * share;
+        segment->end = i == connections - 1 ? metadata.file_size : (i + 1) * share;
+        segment->alive = 1;
+    }
+
+    int started = 0;
+    for (; started < connections; started++) {
+        workers[started].download = &download;
+        workers[started].index = started;
+        if (pthread_create(&threads[started], NULL, segment_worker, &workers[started]) != 0) {
+            // Threads that did start pick up the ranges of the missing ones
+            pthread_mutex_lock(&download.lock);
+            for (int i = started; i < connections; i++) {
+                download.segments[i].alive = 0;
+            }
+            pthread_mutex_unlock(&download.lock);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Ranges no connection was left to take over are fetched over the first one
+    for (int i = 0; i < connections; i++) {
+        Segment *segment = &download.segments[i];
+        while (segment->start < segment->end) {
+            long length = segment->end - segment->start < SEGMENT_STEP ? segment->end - segment->start : SEGMENT_STEP;
+            if (fetch_range(sock, filename, fd, segment->start, length) != 0) {
+                break;
+            }
+            segment->start += length;
+            download.received += length;
+            display_progress(download.total_size, download.received);
+        }
+    }
+
+    close(fd);
+    pthread_mutex_destroy(&download.lock);
+    free(download.segments);
+    free(workers);
+    free(threads);
+
+    if (download.received != metadata.file_size) {
+        log_message(LOG_ERROR, "Segmented download of '%s' incomplete: %ld of %ld bytes", filename, download.received, metadata.file_size);
+        return -1;
+    }
+    log_message(LOG_INFO, "Segmented download complete for '%s' over %d connections", filename, connections);
+    return 0;
+}
+
+// Function to download several files with pipelined requests
+int download_files(int sock, char *const filenames[], int count) {
+    Session *session = session_get(sock);
+    int failures = 0;
+
+    if (session->wire != WIRE_FRAMED) {
+        // Legacy messages carry no request ids; fall back to lockstep
+        for (int i = 0; i < count; i++) {
+            download_file(sock, filenames[i]);
+        }
+        return 0;
+    }
+
+    int sent = 0;
+    for (int done = 0; done < count; done++) {
+        // Top up the requests in flight and send them in one go
+        session_cork(sock);
+        while (sent < count && sent - done < PIPELINE_DEPTH) {
+            Payload payload = {0};
+            payload.operation = OP_DOWNLOAD;
+            strncpy(payload.filename, filenames[sent], sizeof(payload.filename) - 1);
+            session->request_id = sent + 1;
+            send_payload(sock, &payload);
+            sent++;
+        }
+        session->request_id = 0;
+        if (session_uncork(sock) != 0) {
+            log_message(LOG_ERROR, "Failed to send download requests");
+            return -1;
+        }
+
+        // Replies come back in request order
+        Payload header;
+        if (receive_payload(sock, &header) != 0 || header.operation != OP_DATA || session->request_id != (uint64_t)done + 1) {
+            log_message(LOG_ERROR, "Unexpected reply to download request for '%s'", filenames[done]);
+            session->request_id = 0;
+            return -1;
+        }
+        session->request_id = 0;
+
+        int result = receive_data(sock, filenames[done], &header, 1);
+        if (result == -2) {
+            return -1;  // The connection is out of step with the server
+        }
+        if (result != 0) {
+            failures++;
+        }
+    }
+
+    log_message(LOG_INFO, "Pipelined download of %d files finished with %d failures", count, failures);
+    return failures ? -1 : 0;
+}
+
+// Function to send a batch request and receive its metadata reply
+static int send_batch_request(int sock, int operation, char *const filenames[], int count, const char *pattern, BatchFile **files) {
+    ByteBuf request = {0};
+    batch_put_request(&request, operation, filenames, count, pattern);
+    int result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+    bytebuf_free(&request);
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send batch request");
+        return -1;
+    }
+
+    Frame frame;
+    long frame_len = receive_frame(sock, &frame);
+    if (frame_len < 0) {
+        log_message(LOG_ERROR, "Error receiving batch metadata");
+        return -1;
+    }
+    int received = batch_get_metadata(&frame, files);
+    session_consume(sock, frame_len);
+    if (received < 0) {
+        log_message(LOG_ERROR, "Malformed batch metadata received");
+    }
+    return received;
+}
+
+// Function to request the metadata of many files in one round trip
+int request_batch_metadata(int sock, char *const filenames[], int count, const char *pattern, BatchFile **files) {
+    if (session_get(sock)->wire == WIRE_FRAMED) {
+        return send_batch_request(sock, OP_BATCH_META, filenames, count, pattern, files);
+    }
+
+    // Legacy servers only know single-file metadata requests
+    if (pattern) {
+        log_message(LOG_ERROR, "File patterns need a framed connection");
+        return -1;
+    }
+    *files = calloc(count ? count : 1, sizeof(BatchFile));
+    if (!*files) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        Payload metadata;
+        BatchFile *file = &(*files)[i];
+        strncpy(file->filename, filenames[i], sizeof(file->filename) - 1);
+        if (request_file_metadata(sock, filenames[i], 0, &metadata) != 0) {
+            free(*files);
+            *files = NULL;
+            return -1;
+        }
+        file->status = metadata.status;
+        file->file_size = metadata.file_size;
+    }
+    return count;
+}
+
+// Function to download many files with a single batch request
+int download_batch(int sock, char *const filenames[], int count, const char *pattern) {
+    if (session_get(sock)->wire != WIRE_FRAMED) {
+        if (pattern) {
+            log_message(LOG_ERROR, "File patterns need a framed connection");
+            return -1;
+        }
+        return download_files(sock, filenames, count);
+    }
+
+    BatchFile *files;
+    int total = send_batch_request(sock, OP_BATCH_DOWNLOAD, filenames, count, pattern, &files);
+    if (total < 0) {
+        return -1;
+    }
+
+    // Found files follow in reply order, each with its own header
+    int failures = 0;
+    for (int i = 0; i < total; i++) {
+        if (files[i].status != STAT_FILE_FOUND) {
+            log_message(LOG_INFO, "File '%s' not found on server", files[i].filename);
+            failures++;
+            continue;
+        }
 
-    fclose(file);
+        Payload header;
+        if (receive_payload(sock, &header) != 0 || header.operation != OP_DATA || strcmp(header.filename, files[i].filename) != 0) {
+            log_message(LOG_ERROR, "Unexpected reply while downloading '%s'", files[i].filename);
+            free(files);
+            return -1;
+        }
+        int result = receive_data(sock, files[i].filename, &header, 0);
+        if (result == -2) {
+            free(files);
+            return -1;  // The connection is out of step with the server
+        }
+        if (result != 0) {
+            failures++;
+        }
+    }
+
+    log_message(LOG_INFO, "Batch download of %d files finished with %d failures", total, failures);
+    free(files);
+    return failures ? -1 : 0;
 }
 
 // Function to request file metadata from the server and compare the hash locally
@@ -184,7 +1058,8 @@ int request_file_metadata(int sock, const char *filename, long offset, Payload *
     memset(&payload, 0, sizeof(payload));
 
     payload.operation = OP_REQ_META_DATA;
-    strncpy(payload.filename, filename, sizeof(payload.filename));
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    payload.filename[sizeof(payload.filename) - 1] = '\0';
     payload.offset = offset;
 
     // Send the payload to the server
@@ -222,7 +1097,8 @@ int request_file_metadata(int sock, const char *filename, long offset, Payload *
             fclose(file);
             
             // Calculate the local file's hash
-            if (calculate_file_hash(file_path, offset, local_hash) == 0) {
+            Session *session = session_get(sock);
+            if (calculate_piece_hash(file_path, offset, session->piece_size, session->hash_algorithm, local_hash) == 0) {
                 log_message(LOG_INFO, "Local file hash: %s", local_hash);
 
                 // Compare the local hash with the server hash
@@ -247,7 +1123,6 @@ int request_file_metadata(int sock, const char *filename, long offset, Payload *
 
 // Function to upload a file to the server
 void upload_file(int sock, const char *filename) {
-    char buffer[CHUNK_SIZE];         // Buffer to hold file data chunks
     char file_path[MAX_FILENAME];    // Full file path for the file to upload
 
     // Construct the full file path from the destination directory and filename
@@ -258,23 +1133,31 @@ void upload_file(int sock, const char *filename) {
         return;
     }
 
-    // Open the file for reading in binary mode
-    FILE *file = fopen(file_path, "rb");
-    if (!file) {
+    // Open the file for reading
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
         log_message(LOG_ERROR, "Error opening file for upload: %s", filename);
         return;
     }
 
+    // A file the server already has can go up as the blocks that changed
+    struct stat delta_stat;
+    if (delta_transfers && session_delta(sock) && fstat(fd, &delta_stat) == 0 &&
+        upload_delta(sock, filename, fd, delta_stat.st_size) == 0) {
+        close(fd);
+        return;
+    }
+
     // Prepare the upload request payload
     Payload payload;
     memset(&payload, 0, sizeof(payload));
     payload.operation = OP_UPLOAD; // Set operation type to upload
-    memcpy(payload.filename, filename, sizeof(payload.filename)); // Copy filename to payload
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1); // Copy filename to payload
 
     // Send the upload request to the server
     if (send_payload(sock, &payload) != 0) {
         log_message(LOG_ERROR, "Failed to send upload request for '%s'", filename);
-        fclose(file);
+        close(fd);
         return;
     }
 
@@ -284,56 +1167,237 @@ void upload_file(int sock, const char *filename) {
 
     if (receive_payload(sock, &req_payload) != 0 && req_payload.operation != OP_REQ_META_DATA) {
         log_message(LOG_ERROR, "Failed to receive metadata request from server for '%s'", filename);
-        fclose(file);
+        close(fd);
         return;
     }
 
     // Prepare to send file metadata (size)
     Payload metadata_payload;
     struct stat file_stat;
+    long file_size;
 
     // Retrieve file metadata (size)
-    if (stat(file_path, &file_stat) == 0) {
-        long file_size = file_stat.st_size; // Get the size of the file
+    if (fstat(fd, &file_stat) == 0) {
+        file_size = file_stat.st_size; // Get the size of the file
         memset(&metadata_payload, 0, sizeof(metadata_payload));
 
         // Set up metadata payload with file information
         metadata_payload.operation = OP_META_DATA; // Set operation type to metadata
-        memcpy(metadata_payload.filename, filename, sizeof(metadata_payload.filename)); // Copy filename
+        strncpy(metadata_payload.filename, filename, sizeof(metadata_payload.filename) - 1); // Copy filename
         metadata_payload.file_size = file_size; // Set file size
 
         // Send the file metadata to the server
         if (send_payload(sock, &metadata_payload) != 0) {
             log_message(LOG_ERROR, "Failed to send metadata for file: %s", filename);
-            fclose(file);
+            close(fd);
             return;
         }
 
         log_message(LOG_INFO, "Sent metadata for file: %s, size: %ld bytes", filename, file_size);
     } else {
         log_message(LOG_ERROR, "Error retrieving file metadata for %s", filename);
-        fclose(file);
+        close(fd);
         return;
     }
 
-    // Upload file in chunks
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, CHUNK_SIZE, file)) > 0) {
-        // Send the read chunk to the server
-        if (send(sock, buffer, bytes_read, 0) < 0) {
-            log_message(LOG_ERROR, "Error sending file chunk for: %s", filename);
-            fclose(file);
-            return;
+    // Upload the file contents (kernel-to-kernel when possible, or compressed if agreed), hashed on the way out
+    TransferStats stats = {0};
+    Hasher hasher;
+    Hasher *digest = trailer_begin(sock, &hasher);
+    CompressStream stream;
+    int compressed = session_compress_begin(sock, &stream, 1);
+    trace_stream_begin();
+    off_t sent = compressed > 0 ? transfer_send_compressed(sock, fd, 0, file_size, &stream, &stats, digest)
+               : compressed == 0 ? transfer_send_file(sock, fd, 0, file_size, session_get(sock)->piece_size, &stats, digest)
+               : -1;
+    unsigned long long wire_bytes = compressed > 0 ? stream.wire_bytes : (unsigned long long)file_size;
+    trace_stream_end("send_file", filename);
+    compress_end(&stream);
+    close(fd);
+
+    if (sent != file_size) {
+        log_message(LOG_ERROR, "Error sending file contents for: %s", filename);
+        if (digest) {
+            hasher_free(digest);
         }
-        log_message(LOG_INFO, "Uploaded %d bytes of file '%s'", bytes_read, filename);
+        return;
     }
 
-    // Close the file after uploading
-    fclose(file);
+    // The digest follows the file so the server can check what it stored
+    if (session_trailers(sock)) {
+        Payload trailer;
+        trailer_build(digest, filename, 0, file_size, &trailer);
+        if (send_payload(sock, &trailer) != 0) {
+            log_message(LOG_ERROR, "Failed to send trailer for file: %s", filename);
+            return;
+        }
+    }
 
     // Log completion of the upload
     printf("File upload complete for '%s'\n", filename);
-    log_message(LOG_INFO, "File upload complete for '%s'", filename);
+    log_message(LOG_INFO, "File upload complete for '%s' (%llu bytes zero-copy, %llu bytes copied, %llu bytes on the wire)",
+                filename, stats.zero_copy_bytes, stats.copied_bytes, wire_bytes);
+}
+
+// Function to choose whether files the other side has move as deltas
+void set_delta_transfers(int enabled) {
+    delta_transfers = enabled;
+}
+
+// Function to choose the codec proposed for compressing file streams
+void set_compression(int codec) {
+    compression_codec = codec;
+}
+
+// Function to bring a local copy up to date from a delta against it
+int download_delta(int sock, const char *filename) {
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", DEST_DIR, filename);
+    if (result < 0 || result >= sizeof(file_path)) {
+        log_message(LOG_ERROR, "Error forming file path for filename: %s", filename);
+        return -1;
+    }
+
+    // The signature of the local copy tells the server which blocks we have
+    DeltaSignature signature;
+    struct stat file_stat;
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || delta_signature_build(fd, file_stat.st_size, &signature) != 0) {
+        log_message(LOG_ERROR, "Error hashing local copy of '%s'", filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+
+    ByteBuf request = {0};
+    delta_put_request(&request, filename, &signature);
+    result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+    bytebuf_free(&request);
+    delta_signature_free(&signature);
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send delta request for '%s'", filename);
+        return -1;
+    }
+
+    Frame frame;
+    int status;
+    DeltaScript script = {0};
+    long frame_len = receive_frame(sock, &frame);
+    result = frame_len < 0 ? -1 : delta_get_reply(&frame, &status, &script);
+    if (frame_len >= 0) {
+        session_consume(sock, frame_len);
+    }
+    if (result != 0) {
+        log_message(LOG_ERROR, "Invalid delta reply for '%s'", filename);
+        return -1;
+    }
+    if (status != STAT_FILE_FOUND) {
+        log_message(LOG_INFO, "File '%s' not available on server (status %d)", filename, status);
+        return -1;
+    }
+
+    // Unchanged blocks are copied locally; the literals arrive back to back
+    ByteRange *literals = NULL;
+    DeltaPatch patch;
+    int count = delta_script_literals(&script, &literals);
+    int opened = count >= 0 && delta_patch_open(&patch, file_path, &script) == 0;
+    int out_fd = opened ? patch.fd : open("/dev/null", O_WRONLY);  // Still read, to keep the stream in step
+    TransferStats stats = {0};
+    long literal_bytes = 0;
+    int complete = count >= 0 && out_fd >= 0;
+    for (int i = 0; i < count && complete; i++) {
+        complete = transfer_recv_file(sock, out_fd, literals[i].offset, literals[i].length, &stats, NULL) == literals[i].length;
+        literal_bytes += literals[i].length;
+    }
+    if (out_fd >= 0 && !opened) {
+        close(out_fd);
+    }
+    free(literals);
+
+    result = opened && delta_patch_finish(&patch, complete) == 0 ? 0 : -1;
+    if (result == 0) {
+        display_progress(script.file_size, script.file_size);
+        log_message(LOG_INFO, "Delta download complete for '%s' (%ld of %ld bytes transferred, %d steps)",
+                    filename, literal_bytes, script.file_size, script.count);
+    } else {
+        log_message(LOG_ERROR, "Delta download of '%s' failed; the local copy is unchanged", filename);
+    }
+    delta_script_free(&script);
+    return result;
+}
+
+// Function to upload a file as a delta against the server's copy
+int upload_delta(int sock, const char *filename, int fd, long file_size) {
+    ByteBuf request = {0};
+    delta_put_signature_request(&request, filename);
+    int result = request.failed ? -1 : send_bytes(sock, request.data, request.len);
+    bytebuf_free(&request);
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send signature request for '%s'", filename);
+        return -1;
+    }
+
+    Frame frame;
+    int status;
+    DeltaSignature signature = {0};
+    long frame_len = receive_frame(sock, &frame);
+    result = frame_len < 0 ? -1 : delta_get_signature_reply(&frame, &status, &signature);
+    if (frame_len >= 0) {
+        session_consume(sock, frame_len);
+    }
+    if (result != 0) {
+        log_message(LOG_ERROR, "Invalid signature reply for '%s'", filename);
+        return -1;
+    }
+    if (status != STAT_FILE_FOUND) {
+        log_message(LOG_INFO, "No copy of '%s' on the server to delta against; uploading it whole", filename);
+        return -1;
+    }
+
+    // Compare our copy with the server's blocks
+    DeltaScript script;
+    ByteRange *literals = NULL;
+    result = delta_script_build(fd, file_size, &signature, &script);
+    delta_signature_free(&signature);
+    int count = result == 0 ? delta_script_literals(&script, &literals) : -1;
+    if (count < 0) {
+        log_message(LOG_ERROR, "Error computing delta of '%s'", filename);
+        if (result == 0) {
+            delta_script_free(&script);
+        }
+        return -1;
+    }
+
+    // The script travels with the first literal; the literals follow each other without headers
+    delta_put_upload(&request, filename, &script);
+    result = request.failed ? -1 : count > 0 ? send_bytes_more(sock, request.data, request.len) : send_bytes(sock, request.data, request.len);
+    bytebuf_free(&request);
+    TransferStats stats = {0};
+    long literal_bytes = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        if (transfer_send_file(sock, fd, literals[i].offset, literals[i].length, session_get(sock)->piece_size, &stats, NULL) != literals[i].length) {
+            result = -1;
+        }
+        literal_bytes += literals[i].length;
+    }
+    free(literals);
+
+    Payload reply;
+    if (result != 0 || receive_payload(sock, &reply) != 0 || reply.operation != OP_DELTA_UPLOAD) {
+        log_message(LOG_ERROR, "Error sending delta of '%s'", filename);
+        result = -1;
+    } else if (reply.status != STAT_FILE_FOUND) {
+        log_message(LOG_ERROR, "Server could not rebuild '%s' from the delta", filename);
+        result = -1;
+    } else {
+        printf("File upload complete for '%s'\n", filename);
+        log_message(LOG_INFO, "Delta upload complete for '%s' (%ld of %ld bytes transferred, %d steps)",
+                    filename, literal_bytes, file_size, script.count);
+    }
+    delta_script_free(&script);
+    return result;
 }
 
 // Function to send an exit request to the server
@@ -354,7 +1418,7 @@ void send_exit_request(int sock) {
 // Function to display the download progress
 void display_progress(long total_size, long downloaded) {
     if (total_size <= 0) {
-        log_message(LOG_ERROR, "Invalid total size for progress display: %ld", total_size);
+        log_message_limited(LOG_ERROR, "Invalid total size for progress display: %ld", total_size);
         return; // Avoid division by zero or invalid progress display
     }
 
@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "compress.h"
+#include "logger.h"
+
+#define ZLIB_LEVEL Z_BEST_SPEED  // Link speed matters more than the last few percent
+#define ZLIB_WINDOW_BITS (-15)   // Raw deflate; the stream trailer already checks the data
+
+static const char *codec_names[COMPRESS_COUNT] = { "none", "zlib" };
+
+// Function to check whether this build can use a codec
+int compress_codec_supported(int codec) {
+    return codec >= 0 && codec < COMPRESS_COUNT;
+}
+
+// Function to get the name of a codec
+const char *compress_codec_name(int codec) {
+    return compress_codec_supported(codec) ? codec_names[codec] : "unknown";
+}
+
+// Function to look up a codec by name
+int compress_codec_parse(const char *name) {
+    for (int codec = 0; codec < COMPRESS_COUNT; codec++) {
+        if (strcasecmp(name, codec_names[codec]) == 0) {
+            return codec;
+        }
+    }
+    return -1;
+}
+
+// Function to open one direction of a compressed file stream
+int compress_begin(CompressStream *stream, int codec, int sending) {
+    memset(stream, 0, sizeof(*stream));
+    if (codec != COMPRESS_ZLIB) {
+        return -1;
+    }
+
+    int result = sending ? deflateInit2(&stream->zlib, ZLIB_LEVEL, Z_DEFLATED, ZLIB_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY)
+                         : inflateInit2(&stream->zlib, ZLIB_WINDOW_BITS);
+    if (result != Z_OK) {
+        return -1;
+    }
+    stream->raw = malloc(COMPRESS_PIECE_SIZE);
+    stream->chunk = malloc(COMPRESS_HEADER_SIZE + compressBound(COMPRESS_PIECE_SIZE));
+    if (!stream->raw || !stream->chunk) {
+        free(stream->raw);
+        free(stream->chunk);
+        sending ? deflateEnd(&stream->zlib) : inflateEnd(&stream->zlib);
+        return -1;
+    }
+    stream->codec = codec;
+    stream->sending = sending;
+    stream->chunk_need = COMPRESS_HEADER_SIZE;
+    return 0;
+}
+
+// Function to close a compressed file stream
+void compress_end(CompressStream *stream) {
+    if (stream->codec == COMPRESS_NONE) {
+        return;
+    }
+    stream->sending ? deflateEnd(&stream->zlib) : inflateEnd(&stream->zlib);
+    free(stream->raw);
+    free(stream->chunk);
+    stream->raw = stream->chunk = NULL;
+    stream->codec = COMPRESS_NONE;
+}
+
+// Helper function to write a chunk header
+static void put_header(unsigned char *header, uint32_t raw_len, uint32_t packed_len) {
+    uint32_t words[2] = { htonl(raw_len), htonl(packed_len) };
+    memcpy(header, words, sizeof(words));
+}
+
+// Helper function to fold a sampled piece into the decision whether to keep compressing
+static void sample_piece(CompressStream *stream, size_t raw_len, size_t wire_len) {
+    if (stream->sampled >= COMPRESS_SAMPLE_PIECES) {
+        return;
+    }
+    stream->sampled++;
+    stream->sample_raw += raw_len;
+    stream->sample_wire += wire_len;
+    if (stream->sampled == COMPRESS_SAMPLE_PIECES &&
+        stream->sample_wire * 100 > stream->sample_raw * (100 - COMPRESS_MIN_SAVING)) {
+        stream->skipping = 1;
+        log_message(LOG_INFO, "Data doesn't compress (%llu of %llu bytes); sending the rest as it is",
+                    stream->sample_wire, stream->sample_raw);
+    }
+}
+
+// Function to prepare the next chunk to send
+int compress_next(CompressStream *stream, int fd, off_t offset, size_t count, Hasher *hasher) {
+    stream->chunk_len = stream->chunk_sent = stream->chunk_raw = 0;
+    if (count == 0) {
+        return 0;
+    }
+
+    // Incompressible files go out behind stored headers, straight from the file
+    if (stream->skipping) {
+        size_t run = count < COMPRESS_MAX_RUN ? count : COMPRESS_MAX_RUN;
+        put_header(stream->chunk, run, COMPRESS_STORED);
+        stream->chunk_len = COMPRESS_HEADER_SIZE;
+        stream->stored = run;
+        stream->wire_bytes += COMPRESS_HEADER_SIZE;
+        return 0;
+    }
+
+    size_t want = count < COMPRESS_PIECE_SIZE ? count : COMPRESS_PIECE_SIZE;
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = pread(fd, stream->raw + got, want - got, offset + got);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;  // File ended early
+        }
+        got += n;
+    }
+    if (got == 0) {
+        return 0;
+    }
+    if (hasher) {
+        hasher_update(hasher, stream->raw, got);
+    }
+
+    // Every chunk is compressed on its own, so the receiver never holds more than one
+    deflateReset(&stream->zlib);
+    stream->zlib.next_in = stream->raw;
+    stream->zlib.avail_in = got;
+    stream->zlib.next_out = stream->chunk + COMPRESS_HEADER_SIZE;
+    stream->zlib.avail_out = compressBound(COMPRESS_PIECE_SIZE);
+    size_t packed = deflate(&stream->zlib, Z_FINISH) == Z_STREAM_END ? stream->zlib.total_out : got;
+
+    if (packed < got) {
+        put_header(stream->chunk, got, packed);
+    } else {
+        put_header(stream->chunk, got, COMPRESS_STORED);
+        memcpy(stream->chunk + COMPRESS_HEADER_SIZE, stream->raw, got);
+        packed = got;
+    }
+    sample_piece(stream, got, packed);
+    stream->chunk_len = COMPRESS_HEADER_SIZE + packed;
+    stream->chunk_raw = got;
+    stream->raw_bytes += got;
+    stream->wire_bytes += stream->chunk_len;
+    return 0;
+}
+
+// Function to decode a chunk header
+int compress_parse_header(const unsigned char *header, uint32_t *raw_len, uint32_t *packed_len) {
+    uint32_t words[2];
+    memcpy(words, header, sizeof(words));
+    *raw_len = ntohl(words[0]);
+    *packed_len = ntohl(words[1]);
+
+    if (*raw_len == 0) {
+        return -1;
+    }
+    if (*packed_len == COMPRESS_STORED) {
+        *packed_len = 0;
+        return *raw_len <= COMPRESS_MAX_RUN ? 1 : -1;
+    }
+    if (*raw_len > COMPRESS_PIECE_SIZE || *packed_len == 0 || *packed_len >= *raw_len) {
+        return -1;  // A chunk that didn't shrink would have been stored
+    }
+    return 0;
+}
+
+// Function to decompress the packed bytes of a received chunk
+int compress_decode(CompressStream *stream, const unsigned char *packed, size_t packed_len, size_t raw_len) {
+    inflateReset(&stream->zlib);
+    stream->zlib.next_in = (unsigned char *)packed;
+    stream->zlib.avail_in = packed_len;
+    stream->zlib.next_out = stream->raw;
+    stream->zlib.avail_out = raw_len;
+    if (inflate(&stream->zlib, Z_FINISH) != Z_STREAM_END || stream->zlib.total_out != raw_len || stream->zlib.avail_in != 0) {
+        return -1;
+    }
+    stream->raw_len = raw_len;
+    stream->raw_done = 0;
+    stream->raw_bytes += raw_len;
+    stream->wire_bytes += COMPRESS_HEADER_SIZE + packed_len;
+    return 0;
+}
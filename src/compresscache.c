@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "compresscache.h"
+#include "logger.h"
+
+#define COMPRESS_CACHE_MAGIC   0x4548434143525A59ULL  // "YZRCACHE"
+#define COMPRESS_CACHE_VERSION 1
+#define COMPRESS_CACHE_HOT_SLOTS 1024   // Files whose misses are counted at a time (power of two)
+#define COMPRESS_CACHE_NAME_BYTES 16    // Bytes of the SHA-256 of a file name that name its entry
+#define COMPRESS_CACHE_TEMP ".tmp"      // Suffix of an entry being built
+
+// Header at the start of every entry
+typedef struct {
+    uint64_t magic;              // COMPRESS_CACHE_MAGIC
+    uint32_t version;            // COMPRESS_CACHE_VERSION
+    uint32_t codec;              // COMPRESS_* codec of the stream
+    uint32_t incompressible;     // Non-zero if the file didn't compress (no stream follows)
+    uint64_t dev;                // Device of the file
+    uint64_t ino;                // Inode of the file
+    int64_t size;                // Size when compressed
+    int64_t mtime_sec;           // Modification time when compressed
+    int64_t mtime_nsec;
+    uint64_t stream_length;      // Bytes of compressed stream after the header
+    char hash[HASH_ALGO_COUNT][HASH_SIZE];  // Trailer digest of the file with every algorithm
+} CacheHeader;
+
+// A request for a compressed copy, written to the builder's pipe in one atomic write
+typedef struct {
+    char filename[MAX_FILENAME];
+} CacheRequest;
+
+// Misses counted for one file
+typedef struct {
+    char filename[MAX_FILENAME];
+    int misses;
+} HotFile;
+
+// An entry considered for eviction
+typedef struct {
+    char name[64];
+    off_t size;
+    struct timespec used;
+} CacheVictim;
+
+static char source_dir[MAX_FILENAME];     // The shared directory
+static char cache_dir[MAX_FILENAME + 8];  // Where the entries live (empty while the cache is closed)
+static long cache_limit;                  // Most bytes the entries may take
+static int request_pipe[2] = {-1, -1};    // Misses from every process, read by the builder
+static HotFile hot_files[COMPRESS_CACHE_HOT_SLOTS];  // Only touched by the builder
+
+// Function to form the path of a file's entry (or of the entry being built)
+static int cache_entry_path(const char *filename, const char *suffix, char *path, size_t size) {
+    unsigned char digest[HASH_DIGEST_SIZE];
+    char hex[COMPRESS_CACHE_NAME_BYTES * 2 + 1];
+    if (sha256_digest(filename, strlen(filename), digest) != 0) {
+        return -1;
+    }
+    hex_encode(digest, COMPRESS_CACHE_NAME_BYTES, hex);
+    int result = snprintf(path, size, "%s/%s.%s%s", cache_dir, hex, compress_codec_name(COMPRESS_ZLIB), suffix);
+    return result < 0 || (size_t)result >= size ? -1 : 0;
+}
+
+// Function to check that an entry header describes the current version of a file
+static int cache_header_matches(const CacheHeader *header, const struct stat *file_stat, int codec) {
+    return header->magic == COMPRESS_CACHE_MAGIC && header->version == COMPRESS_CACHE_VERSION &&
+           header->codec == (uint32_t)codec && header->dev == (uint64_t)file_stat->st_dev &&
+           header->ino == (uint64_t)file_stat->st_ino && header->size == file_stat->st_size &&
+           header->mtime_sec == file_stat->st_mtim.tv_sec && header->mtime_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+// Function to find a current compressed copy of a file
+int compress_cache_lookup(const char *filename, const struct stat *file_stat, int codec, int hash_algorithm, CachedCopy *copy) {
+    char path[sizeof(cache_dir) + 64];
+    if (cache_dir[0] == '\0' || codec != COMPRESS_ZLIB || file_stat->st_size < COMPRESS_CACHE_MIN_FILE ||
+        hash_digest_size(hash_algorithm) == 0 || strlen(filename) >= MAX_FILENAME ||
+        cache_entry_path(filename, "", path, sizeof(path)) != 0) {
+        return 0;
+    }
+
+    CacheHeader header;
+    struct stat entry_stat;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && fstat(fd, &entry_stat) == 0 &&
+        cache_header_matches(&header, file_stat, codec) &&
+        entry_stat.st_size == (off_t)(COMPRESS_CACHE_HEADER_SIZE + header.stream_length)) {
+        futimens(fd, NULL);  // The entry's mtime orders eviction
+        memset(copy, 0, sizeof(*copy));
+        memcpy(copy->hash, header.hash[hash_algorithm], HASH_SIZE);
+        copy->hash[HASH_SIZE - 1] = '\0';
+        copy->incompressible = header.incompressible != 0;
+        if (copy->incompressible) {
+            close(fd);
+            fd = -1;
+        }
+        copy->fd = fd;
+        copy->offset = COMPRESS_CACHE_HEADER_SIZE;
+        copy->length = header.stream_length;
+        return 1;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // Missing or stale; the builder decides whether the file is hot enough for a copy
+    CacheRequest request;
+    memset(&request, 0, sizeof(request));
+    strncpy(request.filename, filename, sizeof(request.filename) - 1);
+    if (write(request_pipe[1], &request, sizeof(request)) < 0 && errno != EAGAIN) {
+        log_message(LOG_ERROR, "Error queueing compressed copy of %s: %s", filename, strerror(errno));
+    }
+    return 0;
+}
+
+// Function to count a miss and tell whether the file has become hot
+static int cache_note_miss(const char *filename) {
+    uint32_t slot = 2166136261u;
+    for (const char *p = filename; *p; p++) {
+        slot = (slot ^ (unsigned char)*p) * 16777619u;  // FNV-1a
+    }
+    HotFile *hot = &hot_files[slot & (COMPRESS_CACHE_HOT_SLOTS - 1)];
+    if (strcmp(hot->filename, filename) != 0) {
+        snprintf(hot->filename, sizeof(hot->filename), "%s", filename);
+        hot->misses = 0;
+    }
+    if (++hot->misses < COMPRESS_CACHE_HOT_HITS) {
+        return 0;
+    }
+    hot->misses = 0;
+    return 1;
+}
+
+// Function to compress a file into a new entry
+static int cache_build(const char *filename) {
+    char file_path[MAX_FILENAME * 2];
+    char temp_path[sizeof(cache_dir) + 64], path[sizeof(cache_dir) + 64];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", source_dir, filename);
+    if (result < 0 || result >= sizeof(file_path) || cache_entry_path(filename, COMPRESS_CACHE_TEMP, temp_path, sizeof(temp_path)) != 0 ||
+        cache_entry_path(filename, "", path, sizeof(path)) != 0) {
+        return -1;
+    }
+
+    struct stat before, after;
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &before) != 0 || !S_ISREG(before.st_mode) || before.st_size < COMPRESS_CACHE_MIN_FILE) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int out_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CompressStream stream;
+    Hasher hashers[HASH_ALGO_COUNT];
+    int algorithms = 0;
+    if (out_fd < 0 || compress_begin(&stream, COMPRESS_ZLIB, 1) != 0) {
+        log_message(LOG_ERROR, "Error starting compressed copy of %s", file_path);
+        if (out_fd >= 0) {
+            close(out_fd);
+            unlink(temp_path);
+        }
+        close(fd);
+        return -1;
+    }
+    while (algorithms < HASH_ALGO_COUNT && hasher_begin(&hashers[algorithms], algorithms) == 0) {
+        algorithms++;
+    }
+
+    // The same chunks a live stream would carry, written after the header
+    off_t offset = 0, written = COMPRESS_CACHE_HEADER_SIZE;
+    result = algorithms == HASH_ALGO_COUNT ? 0 : -1;
+    while (result == 0 && offset < before.st_size && !stream.skipping) {
+        if (compress_next(&stream, fd, offset, before.st_size - offset, NULL) != 0 || stream.chunk_len == 0 ||
+            pwrite(out_fd, stream.chunk, stream.chunk_len, written) != (ssize_t)stream.chunk_len) {
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < algorithms; i++) {
+            hasher_update(&hashers[i], stream.raw, stream.chunk_raw);
+        }
+        offset += stream.chunk_raw;
+        written += stream.chunk_len;
+    }
+
+    // Incompressible files keep only their header, so senders skip the sampling
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.incompressible = stream.skipping;
+    if (header.incompressible) {
+        written = COMPRESS_CACHE_HEADER_SIZE;
+        result = ftruncate(out_fd, written);
+    }
+    for (int i = 0; i < algorithms; i++) {
+        unsigned char digest[HASH_DIGEST_SIZE];
+        if (hasher_end(&hashers[i], digest) == 0) {
+            hex_encode(digest, hash_digest_size(i), header.hash[i]);
+        }
+        hasher_free(&hashers[i]);
+    }
+    compress_end(&stream);
+
+    // A file that changed while it was read is left for the next miss
+    if (result == 0 && (fstat(fd, &after) != 0 || after.st_size != before.st_size ||
+                        after.st_mtim.tv_sec != before.st_mtim.tv_sec || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)) {
+        result = -1;
+    }
+    header.magic = COMPRESS_CACHE_MAGIC;
+    header.version = COMPRESS_CACHE_VERSION;
+    header.codec = COMPRESS_ZLIB;
+    header.dev = before.st_dev;
+    header.ino = before.st_ino;
+    header.size = before.st_size;
+    header.mtime_sec = before.st_mtim.tv_sec;
+    header.mtime_nsec = before.st_mtim.tv_nsec;
+    header.stream_length = written - COMPRESS_CACHE_HEADER_SIZE;
+    if (result == 0 && (written - COMPRESS_CACHE_HEADER_SIZE > cache_limit ||
+                        pwrite(out_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+                        rename(temp_path, path) != 0)) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temp_path);
+    } else {
+        log_message(LOG_INFO, "Cached compressed copy of %s: %ld of %ld bytes%s", file_path, (long)(written - COMPRESS_CACHE_HEADER_SIZE),
+                    (long)before.st_size, header.incompressible ? " (incompressible)" : "");
+    }
+    close(out_fd);
+    close(fd);
+    return result;
+}
+
+// Function to order eviction candidates, least recently served first
+static int compare_victims(const void *a, const void *b) {
+    const CacheVictim *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+// Function to remove the least recently served entries until the cache fits its limit
+static void cache_evict(int clear_temp) {
+    int dir_fd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return;
+    }
+
+    CacheVictim *victims = NULL;
+    size_t count = 0, cap = 0;
+    off_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat entry_stat;
+        size_t len = strlen(entry->d_name);
+        if (len > strlen(COMPRESS_CACHE_TEMP) && strcmp(entry->d_name + len - strlen(COMPRESS_CACHE_TEMP), COMPRESS_CACHE_TEMP) == 0) {
+            if (clear_temp) {
+                unlinkat(dir_fd, entry->d_name, 0);
+            }
+            continue;
+        }
+        if (entry->d_name[0] == '.' || len >= sizeof(victims->name) ||
+            fstatat(dir_fd, entry->d_name, &entry_stat, 0) != 0 || !S_ISREG(entry_stat.st_mode)) {
+            continue;
+        }
+        if (count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            CacheVictim *grown = realloc(victims, new_cap * sizeof(CacheVictim));
+            if (!grown) {
+                break;
+            }
+            victims = grown;
+            cap = new_cap;
+        }
+        memcpy(victims[count].name, entry->d_name, len + 1);
+        victims[count].size = entry_stat.st_size;
+        victims[count].used = entry_stat.st_mtim;
+        total += entry_stat.st_size;
+        count++;
+    }
+
+    if (total > cache_limit) {
+        qsort(victims, count, sizeof(CacheVictim), compare_victims);
+        for (size_t i = 0; i < count && total > cache_limit; i++) {
+            if (unlinkat(dir_fd, victims[i].name, 0) == 0) {
+                total -= victims[i].size;
+                log_message(LOG_INFO, "Evicted compressed copy %s/%s (%ld bytes)", cache_dir, victims[i].name, (long)victims[i].size);
+            }
+        }
+    }
+    free(victims);
+    closedir(dir);
+}
+
+// Function to build copies of hot files as their misses arrive
+static void *cache_build_main(void *arg) {
+    (void)arg;
+    CacheRequest request;
+    while (1) {
+        ssize_t n = read(request_pipe[0], &request, sizeof(request));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n != (ssize_t)sizeof(request)) {
+            break;
+        }
+        request.filename[sizeof(request.filename) - 1] = '\0';
+        if (cache_note_miss(request.filename) && cache_build(request.filename) == 0) {
+            cache_evict(0);
+        }
+    }
+    log_message(LOG_ERROR, "Compressed copy builder stopped");
+    return NULL;
+}
+
+// Function to open the cache of compressed copies next to a shared directory
+int compress_cache_open(const char *dir, long limit) {
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        len--;  // "dir/" and "dir" share a cache
+    }
+    int result = snprintf(cache_dir, sizeof(cache_dir), "%.*s%s", (int)len, dir, COMPRESS_CACHE_SUFFIX);
+    if (result < 0 || result >= sizeof(cache_dir) || len >= sizeof(source_dir)) {
+        log_message(LOG_ERROR, "Compressed cache path too long for directory: %s", dir);
+        cache_dir[0] = '\0';
+        return -1;
+    }
+    memcpy(source_dir, dir, len);
+    source_dir[len] = '\0';
+    cache_limit = limit;
+
+    if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) {
+        log_message(LOG_ERROR, "Error creating compressed cache %s: %s", cache_dir, strerror(errno));
+        cache_dir[0] = '\0';
+        return -1;
+    }
+
+    // Copies left half-built by an earlier run go before the builder starts; a lower limit may evict others
+    cache_evict(1);
+
+    // Senders never block on a full pipe; their misses are simply not counted
+    pthread_t thread;
+    if (pipe2(request_pipe, O_CLOEXEC) != 0 || fcntl(request_pipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+        pthread_create(&thread, NULL, cache_build_main, NULL) != 0) {
+        log_message(LOG_ERROR, "Error starting compressed copy builder");
+        cache_dir[0] = '\0';
+        return -1;
+    }
+    pthread_detach(thread);
+    log_message(LOG_INFO, "Compressed cache %s opened (limit %ld bytes)", cache_dir, limit);
+    return 0;
+}
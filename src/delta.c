@@ -0,0 +1,644 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+
+#define DELTA_READ_SIZE (1024 * 1024)  // Bytes read at a time when hashing a file
+#define DELTA_COPY_SIZE (64 * 1024)    // Bytes per pread/pwrite when the kernel can't copy
+#define DELTA_BLOCK_WIRE_SIZE (4 + DELTA_STRONG_SIZE) // Bytes of one block in a signature
+
+/// Hash table of the full blocks of a signature, keyed by rolling checksum
+typedef struct {
+    int *heads;  // First block of each bucket (-1 if empty)
+    int *next;   // Next block in the same bucket (-1 at the end)
+    int bits;    // log2 of the number of buckets
+} DeltaIndex;
+
+// Function to pick the signature block size for a file
+long delta_block_size(long file_size) {
+    long block_size = DELTA_MIN_BLOCK;
+    while (block_size < DELTA_MAX_BLOCK && block_size * block_size < file_size) {
+        block_size *= 2;
+    }
+    while ((file_size + block_size - 1) / block_size > DELTA_MAX_BLOCKS) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+// Function to compute the rolling checksum of a block (two 16-bit sums, as rsync does)
+uint32_t delta_weak(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += a;
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+// Function to compute the strong hash of a block
+static int delta_strong(const unsigned char *data, size_t len, unsigned char *strong) {
+    unsigned char digest[HASH_DIGEST_SIZE];
+    if (sha256_digest(data, len, digest) != 0) {
+        return -1;
+    }
+    memcpy(strong, digest, DELTA_STRONG_SIZE);
+    return 0;
+}
+
+// Helper function to read exactly len bytes at an offset
+static int read_at(int fd, unsigned char *buffer, long len, long offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buffer, len, offset);
+        if (n <= 0) {
+            return -1;  // Error, or the file is shorter than expected
+        }
+        buffer += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Helper function to write exactly len bytes at an offset
+static int write_at(int fd, const unsigned char *buffer, long len, long offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buffer, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to compute the block checksums of the old copy of a file
+int delta_signature_build(int fd, long file_size, DeltaSignature *signature) {
+    memset(signature, 0, sizeof(*signature));
+    if (file_size < 0) {
+        return -1;
+    }
+    signature->file_size = file_size;
+    signature->block_size = delta_block_size(file_size);
+    signature->count = (file_size + signature->block_size - 1) / signature->block_size;
+    signature->blocks = malloc(sizeof(DeltaBlock) * (signature->count ? signature->count : 1));
+
+    // Read whole blocks at a time, several of them when they are small
+    long block_size = signature->block_size;
+    long chunk_size = block_size >= DELTA_READ_SIZE ? block_size : DELTA_READ_SIZE / block_size * block_size;
+    unsigned char *chunk = malloc(chunk_size);
+    if (!signature->blocks || !chunk) {
+        free(chunk);
+        delta_signature_free(signature);
+        return -1;
+    }
+
+    long index = 0;
+    for (long offset = 0; offset < file_size; offset += chunk_size) {
+        long want = file_size - offset < chunk_size ? file_size - offset : chunk_size;
+        if (read_at(fd, chunk, want, offset) != 0) {
+            free(chunk);
+            delta_signature_free(signature);
+            return -1;
+        }
+        for (long pos = 0; pos < want; pos += block_size, index++) {
+            long len = want - pos < block_size ? want - pos : block_size;
+            signature->blocks[index].weak = delta_weak(chunk + pos, len);
+            if (delta_strong(chunk + pos, len, signature->blocks[index].strong) != 0) {
+                free(chunk);
+                delta_signature_free(signature);
+                return -1;
+            }
+        }
+    }
+    free(chunk);
+    return 0;
+}
+
+// Function to release a signature
+void delta_signature_free(DeltaSignature *signature) {
+    free(signature->blocks);
+    signature->blocks = NULL;
+    signature->count = 0;
+}
+
+// Function to find the bucket of a rolling checksum
+static inline uint32_t delta_bucket(const DeltaIndex *index, uint32_t weak) {
+    return (weak * 0x9E3779B1u) >> (32 - index->bits);
+}
+
+// Function to index the full blocks of a signature by rolling checksum
+static int delta_index_build(DeltaIndex *index, const DeltaSignature *signature, long full_blocks) {
+    index->bits = 1;
+    while ((1L << index->bits) < full_blocks * 2 && index->bits < 30) {
+        index->bits++;
+    }
+    index->heads = malloc(sizeof(int) << index->bits);
+    index->next = malloc(sizeof(int) * (full_blocks ? full_blocks : 1));
+    if (!index->heads || !index->next) {
+        free(index->heads);
+        free(index->next);
+        return -1;
+    }
+    memset(index->heads, 0xFF, sizeof(int) << index->bits);
+
+    // Insert backwards so every chain lists its blocks in file order
+    for (long i = full_blocks - 1; i >= 0; i--) {
+        uint32_t bucket = delta_bucket(index, signature->blocks[i].weak);
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = (int)i;
+    }
+    return 0;
+}
+
+// Function to find a block with the same checksums as a window, trying the expected one first
+static long delta_index_find(const DeltaIndex *index, const DeltaSignature *signature, long full_blocks,
+                             long expected, uint32_t weak, const unsigned char *window) {
+    unsigned char strong[DELTA_STRONG_SIZE];
+    int have_strong = 0;
+
+    // The strong hash is only worth computing once the rolling checksum agrees
+    if (expected >= 0 && expected < full_blocks && signature->blocks[expected].weak == weak) {
+        if (delta_strong(window, signature->block_size, strong) != 0) {
+            return -1;
+        }
+        have_strong = 1;
+        if (memcmp(strong, signature->blocks[expected].strong, DELTA_STRONG_SIZE) == 0) {
+            return expected;
+        }
+    }
+    for (int i = index->heads[delta_bucket(index, weak)]; i >= 0; i = index->next[i]) {
+        if (signature->blocks[i].weak != weak) {
+            continue;
+        }
+        if (!have_strong) {
+            if (delta_strong(window, signature->block_size, strong) != 0) {
+                return -1;
+            }
+            have_strong = 1;
+        }
+        if (memcmp(strong, signature->blocks[i].strong, DELTA_STRONG_SIZE) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to append a step to a script, extending the last one if they continue each other
+static int delta_add_op(DeltaScript *script, long source, long length) {
+    if (script->count > 0) {
+        DeltaOp *last = &script->ops[script->count - 1];
+        if ((source < 0 && last->source < 0) || (source >= 0 && last->source >= 0 && last->source + last->length == source)) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (script->count == DELTA_MAX_OPS) {
+        return -1;  // The script wouldn't fit in a frame; send the whole file instead
+    }
+    if (script->count == script->cap) {
+        int cap = script->cap ? script->cap * 2 : 64;
+        DeltaOp *grown = realloc(script->ops, sizeof(DeltaOp) * cap);
+        if (!grown) {
+            return -1;
+        }
+        script->ops = grown;
+        script->cap = cap;
+    }
+    script->ops[script->count].source = source;
+    script->ops[script->count].length = length;
+    script->count++;
+    return 0;
+}
+
+// Function to find the parts of a new file that the old copy already has
+int delta_script_build(int fd, long file_size, const DeltaSignature *signature, DeltaScript *script) {
+    memset(script, 0, sizeof(*script));
+    script->file_size = file_size;
+    long block_size = signature->block_size;
+    long full_blocks = signature->file_size / block_size;
+    if (full_blocks > signature->count) {
+        full_blocks = signature->count;
+    }
+
+    const unsigned char *data = NULL;
+    if (file_size > 0) {
+        data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return -1;
+        }
+        madvise((void *)data, file_size, MADV_SEQUENTIAL);
+    }
+
+    // The receiver checks what it rebuilt against the digest of the whole file
+    Sha256 sha;
+    int result = sha256_begin(&sha);
+    if (result == 0) {
+        if (file_size > 0) {
+            sha256_update(&sha, data, file_size);
+        }
+        result = sha256_end(&sha, script->digest);
+        sha256_free(&sha);
+    }
+
+    DeltaIndex index = {0};
+    if (result == 0 && full_blocks > 0) {
+        result = delta_index_build(&index, signature, full_blocks);
+    }
+
+    long pos = 0, literal_start = 0, expected = -1;
+    uint32_t a = 0, b = 0;
+    int rolling = 0;
+    while (result == 0 && full_blocks > 0 && pos + block_size <= file_size) {
+        if (!rolling) {
+            a = b = 0;
+            for (long i = 0; i < block_size; i++) {
+                a += data[pos + i];
+                b += a;
+            }
+            rolling = 1;
+        }
+
+        long match = delta_index_find(&index, signature, full_blocks, expected, (a & 0xFFFF) | (b << 16), data + pos);
+        if (match >= 0) {
+            if (pos > literal_start) {
+                result = delta_add_op(script, -1, pos - literal_start);
+            }
+            if (result == 0) {
+                result = delta_add_op(script, match * block_size, block_size);
+            }
+            pos += block_size;
+            literal_start = pos;
+            expected = match + 1;  // Unchanged runs continue with the next block
+            rolling = 0;
+            continue;
+        }
+
+        // Slide the window one byte
+        if (pos + block_size < file_size) {
+            uint32_t out = data[pos], in = data[pos + block_size];
+            a += in - out;
+            b += a - (uint32_t)block_size * out;
+        }
+        pos++;
+    }
+    if (result == 0 && file_size > literal_start) {
+        result = delta_add_op(script, -1, file_size - literal_start);
+    }
+
+    free(index.heads);
+    free(index.next);
+    if (data) {
+        munmap((void *)data, file_size);
+    }
+    if (result != 0) {
+        delta_script_free(script);
+    }
+    return result;
+}
+
+// Function to get the literal ranges of a script, in stream order
+int delta_script_literals(const DeltaScript *script, ByteRange **literals) {
+    int count = 0;
+    for (int i = 0; i < script->count; i++) {
+        count += script->ops[i].source < 0;
+    }
+    *literals = malloc(sizeof(ByteRange) * (count ? count : 1));
+    if (!*literals) {
+        return -1;
+    }
+
+    long offset = 0;
+    count = 0;
+    for (int i = 0; i < script->count; i++) {
+        if (script->ops[i].source < 0) {
+            (*literals)[count].offset = offset;
+            (*literals)[count].length = script->ops[i].length;
+            count++;
+        }
+        offset += script->ops[i].length;
+    }
+    return count;
+}
+
+// Function to release a script
+void delta_script_free(DeltaScript *script) {
+    free(script->ops);
+    script->ops = NULL;
+    script->count = script->cap = 0;
+}
+
+// Function to copy a range between files, in the kernel when it can
+static int copy_range(int in_fd, long in_offset, int out_fd, long out_offset, long length) {
+    while (length > 0) {
+        loff_t in_pos = in_offset, out_pos = out_offset;
+        ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, length, 0);
+        if (n <= 0) {
+            break;  // Unsupported here (or a short old copy); the buffered loop finds out which
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+
+    unsigned char buffer[DELTA_COPY_SIZE];
+    while (length > 0) {
+        long want = length < DELTA_COPY_SIZE ? length : DELTA_COPY_SIZE;
+        if (read_at(in_fd, buffer, want, in_offset) != 0 || write_at(out_fd, buffer, want, out_offset) != 0) {
+            return -1;
+        }
+        in_offset += want;
+        out_offset += want;
+        length -= want;
+    }
+    return 0;
+}
+
+// Function to start rebuilding a file by copying every matched block into a new copy
+int delta_patch_open(DeltaPatch *patch, const char *path, const DeltaScript *script) {
+    memset(patch, 0, sizeof(*patch));
+    patch->fd = -1;
+    int result = snprintf(patch->temp_path, sizeof(patch->temp_path), "%s%s", path, DELTA_TEMP_SUFFIX);
+    if (result < 0 || result >= sizeof(patch->temp_path) || strlen(path) >= sizeof(patch->path)) {
+        patch->temp_path[0] = '\0';
+        return -1;
+    }
+    strcpy(patch->path, path);
+    patch->file_size = script->file_size;
+    memcpy(patch->digest, script->digest, HASH_DIGEST_SIZE);
+
+    int old_fd = open(path, O_RDONLY);
+    if (old_fd >= 0) {
+        patch->fd = open(patch->temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    result = patch->fd >= 0 && ftruncate(patch->fd, script->file_size) == 0 ? 0 : -1;
+
+    long offset = 0;
+    for (int i = 0; i < script->count && result == 0; i++) {
+        if (script->ops[i].source >= 0) {
+            result = copy_range(old_fd, script->ops[i].source, patch->fd, offset, script->ops[i].length);
+        }
+        offset += script->ops[i].length;
+    }
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+
+    if (result != 0) {
+        if (patch->fd >= 0) {
+            close(patch->fd);
+            unlink(patch->temp_path);
+        }
+        patch->fd = -1;
+        patch->temp_path[0] = '\0';
+    }
+    return result;
+}
+
+// Function to check a file against its expected size and SHA-256 digest
+static int delta_verify(const char *path, long file_size, const unsigned char *digest) {
+    struct stat file_stat;
+    unsigned char actual[HASH_DIGEST_SIZE];
+    Sha256 sha;
+    int fd = open(path, O_RDONLY);
+    unsigned char *chunk = malloc(DELTA_READ_SIZE);
+    int result = fd >= 0 && chunk && fstat(fd, &file_stat) == 0 && file_stat.st_size == file_size ? sha256_begin(&sha) : -1;
+
+    if (result == 0) {
+        for (long offset = 0; offset < file_size && result == 0; offset += DELTA_READ_SIZE) {
+            long want = file_size - offset < DELTA_READ_SIZE ? file_size - offset : DELTA_READ_SIZE;
+            result = read_at(fd, chunk, want, offset);
+            if (result == 0) {
+                sha256_update(&sha, chunk, want);
+            }
+        }
+        if (result == 0) {
+            result = sha256_end(&sha, actual);
+        }
+        sha256_free(&sha);
+    }
+    free(chunk);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result == 0 && memcmp(actual, digest, HASH_DIGEST_SIZE) == 0 ? 0 : -1;
+}
+
+// Function to verify a rebuilt file and move it over the old one
+int delta_patch_finish(DeltaPatch *patch, int complete) {
+    if (patch->temp_path[0] == '\0') {
+        return -1;
+    }
+    if (patch->fd >= 0) {
+        close(patch->fd);
+        patch->fd = -1;
+    }
+
+    int result = complete ? delta_verify(patch->temp_path, patch->file_size, patch->digest) : -1;
+    if (result == 0 && rename(patch->temp_path, patch->path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(patch->temp_path);
+    }
+    patch->temp_path[0] = '\0';
+    return result;
+}
+
+// Function to append a signature to a frame body
+static void put_signature(ByteBuf *buf, const DeltaSignature *signature) {
+    unsigned char *packed = malloc(DELTA_BLOCK_WIRE_SIZE * (signature->count ? signature->count : 1));
+    if (!packed) {
+        buf->failed = 1;
+        return;
+    }
+    for (long i = 0; i < signature->count; i++) {
+        unsigned char *p = packed + i * DELTA_BLOCK_WIRE_SIZE;
+        uint32_t weak = signature->blocks[i].weak;
+        p[0] = weak & 0xFF;
+        p[1] = (weak >> 8) & 0xFF;
+        p[2] = (weak >> 16) & 0xFF;
+        p[3] = weak >> 24;
+        memcpy(p + 4, signature->blocks[i].strong, DELTA_STRONG_SIZE);
+    }
+
+    bytebuf_put_varint(buf, signature->file_size);
+    bytebuf_put_varint(buf, signature->block_size);
+    bytebuf_put_varint(buf, signature->count);
+    bytebuf_put_string(buf, packed, DELTA_BLOCK_WIRE_SIZE * signature->count);
+    free(packed);
+}
+
+// Function to decode a signature from a frame body
+static int get_signature(ByteReader *reader, DeltaSignature *signature) {
+    memset(signature, 0, sizeof(*signature));
+    uint64_t file_size = reader_varint(reader);
+    uint64_t block_size = reader_varint(reader);
+    uint64_t count = reader_varint(reader);
+    size_t len;
+    const unsigned char *packed = reader_string(reader, &len);
+    if (reader->failed || file_size > LONG_MAX || block_size == 0 || block_size > LONG_MAX / 2 ||
+        count > DELTA_MAX_BLOCKS || count != (file_size + block_size - 1) / block_size ||
+        len != count * DELTA_BLOCK_WIRE_SIZE) {
+        return -1;
+    }
+
+    signature->blocks = malloc(sizeof(DeltaBlock) * (count ? count : 1));
+    if (!signature->blocks) {
+        return -1;
+    }
+    signature->file_size = (long)file_size;
+    signature->block_size = (long)block_size;
+    signature->count = (long)count;
+    for (uint64_t i = 0; i < count; i++) {
+        const unsigned char *p = packed + i * DELTA_BLOCK_WIRE_SIZE;
+        signature->blocks[i].weak = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        memcpy(signature->blocks[i].strong, p + 4, DELTA_STRONG_SIZE);
+    }
+    return 0;
+}
+
+// Function to append a script to a frame body
+static void put_script(ByteBuf *buf, const DeltaScript *script) {
+    bytebuf_put_varint(buf, script->file_size);
+    bytebuf_put_string(buf, script->digest, HASH_DIGEST_SIZE);
+    bytebuf_put_varint(buf, script->count);
+    for (int i = 0; i < script->count; i++) {
+        bytebuf_put_svarint(buf, script->ops[i].source);
+        bytebuf_put_varint(buf, script->ops[i].length);
+    }
+}
+
+// Function to decode a script from a frame body
+static int get_script(ByteReader *reader, DeltaScript *script) {
+    memset(script, 0, sizeof(*script));
+    uint64_t file_size = reader_varint(reader);
+    size_t digest_len;
+    const unsigned char *digest = reader_string(reader, &digest_len);
+    uint64_t count = reader_varint(reader);
+
+    // Every step takes at least two bytes, so the count can't outgrow the body
+    if (reader->failed || file_size > LONG_MAX || digest_len != HASH_DIGEST_SIZE ||
+        count > DELTA_MAX_OPS || count > (uint64_t)(reader->end - reader->p) / 2) {
+        return -1;
+    }
+    script->ops = malloc(sizeof(DeltaOp) * (count ? count : 1));
+    if (!script->ops) {
+        return -1;
+    }
+    script->file_size = (long)file_size;
+    script->count = script->cap = (int)count;
+    memcpy(script->digest, digest, HASH_DIGEST_SIZE);
+
+    // The steps must add up to the new file exactly
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < count && !reader->failed; i++) {
+        int64_t source = reader_svarint(reader);
+        uint64_t length = reader_varint(reader);
+        if (source < -1 || length == 0 || length > file_size - total) {
+            reader->failed = 1;
+            break;
+        }
+        script->ops[i].source = (long)source;
+        script->ops[i].length = (long)length;
+        total += length;
+    }
+    if (reader->failed || total != file_size) {
+        delta_script_free(script);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to append a delta download request carrying the client's signature
+void delta_put_request(ByteBuf *buf, const char *filename, const DeltaSignature *signature) {
+    Payload payload = {0};
+    payload.operation = OP_DELTA;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    payload.file_size = signature->file_size;
+
+    size_t start = frame_begin(buf, OP_DELTA, 0);
+    frame_put_payload_fields(buf, &payload);
+    put_signature(buf, signature);
+    frame_end(buf, start);
+}
+
+// Function to decode the signature of a delta download request
+int delta_parse_request(int sock, DeltaSignature *signature) {
+    Session *session = session_get(sock);
+    ByteReader reader = { session->args, session->args + session->args_len, 0 };
+    return get_signature(&reader, signature);
+}
+
+// Function to append the reply to a delta download request
+void delta_put_reply(int sock, ByteBuf *buf, int status, const DeltaScript *script) {
+    size_t start = frame_begin(buf, OP_DELTA, session_get(sock)->request_id);
+    bytebuf_put_svarint(buf, status);
+    if (status == STAT_FILE_FOUND) {
+        put_script(buf, script);
+    }
+    frame_end(buf, start);
+}
+
+// Function to decode the reply to a delta download request
+int delta_get_reply(const Frame *frame, int *status, DeltaScript *script) {
+    ByteReader reader = { frame->body, frame->body + frame->body_len, 0 };
+    *status = (int)reader_svarint(&reader);
+    if (reader.failed || frame->opcode != OP_DELTA) {
+        return -1;
+    }
+    return *status == STAT_FILE_FOUND ? get_script(&reader, script) : 0;
+}
+
+// Function to append a request for the server's signature of a file
+void delta_put_signature_request(ByteBuf *buf, const char *filename) {
+    Payload payload = {0};
+    payload.operation = OP_DELTA_SIGNATURE;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    frame_put_payload(buf, &payload, 0);
+}
+
+// Function to append the reply to a signature request
+void delta_put_signature_reply(int sock, ByteBuf *buf, int status, const DeltaSignature *signature) {
+    size_t start = frame_begin(buf, OP_DELTA_SIGNATURE, session_get(sock)->request_id);
+    bytebuf_put_svarint(buf, status);
+    if (status == STAT_FILE_FOUND) {
+        put_signature(buf, signature);
+    }
+    frame_end(buf, start);
+}
+
+// Function to decode the reply to a signature request
+int delta_get_signature_reply(const Frame *frame, int *status, DeltaSignature *signature) {
+    ByteReader reader = { frame->body, frame->body + frame->body_len, 0 };
+    *status = (int)reader_svarint(&reader);
+    if (reader.failed || frame->opcode != OP_DELTA_SIGNATURE) {
+        return -1;
+    }
+    return *status == STAT_FILE_FOUND ? get_signature(&reader, signature) : 0;
+}
+
+// Function to append a delta upload carrying the script its literal bytes follow
+void delta_put_upload(ByteBuf *buf, const char *filename, const DeltaScript *script) {
+    Payload payload = {0};
+    payload.operation = OP_DELTA_UPLOAD;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+    payload.file_size = script->file_size;
+
+    size_t start = frame_begin(buf, OP_DELTA_UPLOAD, 0);
+    frame_put_payload_fields(buf, &payload);
+    put_script(buf, script);
+    frame_end(buf, start);
+}
+
+// Function to decode the script of a delta upload
+int delta_parse_upload(int sock, DeltaScript *script) {
+    Session *session = session_get(sock);
+    ByteReader reader = { session->args, session->args + session->args_len, 0 };
+    return get_script(&reader, script);
+}
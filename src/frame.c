@@ -0,0 +1,305 @@
+#include "frame.h"
+#include "hash.h"
+
+#define FRAME_FIXED_HEADER 4  // Magic, version, opcode and flags
+
+// Function to make room for len more bytes
+static int bytebuf_reserve(ByteBuf *buf, size_t len) {
+    if (buf->failed) {
+        return -1;
+    }
+    if (buf->len + len <= buf->cap) {
+        return 0;
+    }
+
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + len) {
+        cap *= 2;
+    }
+    unsigned char *data = realloc(buf->data, cap);
+    if (!data) {
+        buf->failed = 1;
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+// Function to append bytes to a buffer
+void bytebuf_put(ByteBuf *buf, const void *data, size_t len) {
+    if (len == 0 || bytebuf_reserve(buf, len) != 0) {
+        return;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// Function to encode a varint into at most 10 bytes
+static size_t varint_encode(unsigned char *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// Function to append an unsigned varint
+void bytebuf_put_varint(ByteBuf *buf, uint64_t value) {
+    unsigned char encoded[10];
+    bytebuf_put(buf, encoded, varint_encode(encoded, value));
+}
+
+// Function to append a signed (zigzag) varint
+void bytebuf_put_svarint(ByteBuf *buf, int64_t value) {
+    bytebuf_put_varint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// Function to append a length-prefixed byte string
+void bytebuf_put_string(ByteBuf *buf, const void *data, size_t len) {
+    bytebuf_put_varint(buf, len);
+    bytebuf_put(buf, data, len);
+}
+
+// Function to release a buffer
+void bytebuf_free(ByteBuf *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+// Function to start a frame with a one-byte placeholder length
+size_t frame_begin(ByteBuf *buf, int opcode, uint64_t request_id) {
+    int flags = request_id ? FRAME_FLAG_REQUEST_ID : 0;
+    unsigned char header[FRAME_FIXED_HEADER + 1] = { FRAME_MAGIC, FRAME_VERSION, (unsigned char)opcode, (unsigned char)flags, 0 };
+    size_t start = buf->len;
+    bytebuf_put(buf, header, sizeof(header));
+    if (request_id) {
+        bytebuf_put_varint(buf, request_id);
+    }
+    return start;
+}
+
+// Function to fix up the body length of a frame, widening the varint if needed
+void frame_end(ByteBuf *buf, size_t start) {
+    if (buf->failed) {
+        return;
+    }
+
+    size_t length_pos = start + FRAME_FIXED_HEADER;
+    size_t body_len = buf->len - length_pos - 1;
+    unsigned char encoded[10];
+    size_t n = varint_encode(encoded, body_len);
+
+    if (n > 1) {
+        if (bytebuf_reserve(buf, n - 1) != 0) {
+            return;
+        }
+        memmove(buf->data + length_pos + n, buf->data + length_pos + 1, body_len);
+        buf->len += n - 1;
+    }
+    memcpy(buf->data + length_pos, encoded, n);
+}
+
+// Function to decode a varint from raw bytes
+static int varint_decode(const unsigned char *p, const unsigned char *end, uint64_t *value, size_t *used) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < 10; i++) {
+        if (p + i >= end) {
+            return 0;  // Need more bytes
+        }
+        result |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *value = result;
+            *used = i + 1;
+            return 1;
+        }
+    }
+    return -1;  // Longer than any 64-bit value
+}
+
+// Function to parse one frame from received bytes
+long frame_parse(const unsigned char *data, size_t len, Frame *frame) {
+    if (len < FRAME_FIXED_HEADER + 1) {
+        return len > 0 && data[0] != FRAME_MAGIC ? -1 : 0;
+    }
+    if (data[0] != FRAME_MAGIC || data[1] == 0 || data[1] > FRAME_VERSION) {
+        return -1;
+    }
+
+    uint64_t body_len;
+    size_t used;
+    int result = varint_decode(data + FRAME_FIXED_HEADER, data + len, &body_len, &used);
+    if (result <= 0) {
+        return result;
+    }
+    if (body_len > FRAME_MAX_BODY) {
+        return -1;
+    }
+
+    size_t header_len = FRAME_FIXED_HEADER + used;
+    if (len < header_len + body_len) {
+        return 0;
+    }
+
+    frame->version = data[1];
+    frame->opcode = data[2];
+    frame->flags = data[3];
+    frame->request_id = 0;
+    frame->body = data + header_len;
+    frame->body_len = body_len;
+
+    if (frame->flags & FRAME_FLAG_REQUEST_ID) {
+        if (varint_decode(frame->body, frame->body + body_len, &frame->request_id, &used) != 1) {
+            return -1;
+        }
+        frame->body += used;
+        frame->body_len -= used;
+    }
+    return header_len + body_len;
+}
+
+// Function to read an unsigned varint from a frame body
+uint64_t reader_varint(ByteReader *reader) {
+    uint64_t value = 0;
+    size_t used;
+    if (reader->failed || varint_decode(reader->p, reader->end, &value, &used) != 1) {
+        reader->failed = 1;
+        return 0;
+    }
+    reader->p += used;
+    return value;
+}
+
+// Function to read a signed (zigzag) varint from a frame body
+int64_t reader_svarint(ByteReader *reader) {
+    uint64_t value = reader_varint(reader);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Function to read a length-prefixed byte string from a frame body
+const unsigned char *reader_string(ByteReader *reader, size_t *len) {
+    uint64_t length = reader_varint(reader);
+    if (reader->failed || length > (uint64_t)(reader->end - reader->p)) {
+        reader->failed = 1;
+        return NULL;
+    }
+    const unsigned char *data = reader->p;
+    reader->p += length;
+    *len = length;
+    return data;
+}
+
+// Function to append the fields of a Payload to a frame body
+void frame_put_payload_fields(ByteBuf *buf, const Payload *payload) {
+    bytebuf_put_svarint(buf, payload->status);
+    bytebuf_put_svarint(buf, payload->offset);
+    bytebuf_put_svarint(buf, payload->file_size);
+    bytebuf_put_string(buf, payload->filename, strnlen(payload->filename, sizeof(payload->filename) - 1));
+
+    // The hex hash travels as raw bytes (empty if there is no hash)
+    unsigned char hash[HASH_DIGEST_SIZE];
+    size_t hash_len = hex_decode(payload->hash, hash, sizeof(hash));
+    bytebuf_put_string(buf, hash, hash_len);
+}
+
+// Function to append a Payload as a compact frame
+void frame_put_payload(ByteBuf *buf, const Payload *payload, uint64_t request_id) {
+    size_t start = frame_begin(buf, payload->operation, request_id);
+    frame_put_payload_fields(buf, payload);
+    frame_end(buf, start);
+}
+
+// Function to decode a Payload from a frame
+int frame_get_payload(const Frame *frame, Payload *payload) {
+    ByteReader reader = { frame->body, frame->body + frame->body_len, 0 };
+
+    memset(payload, 0, sizeof(*payload));
+    payload->operation = frame->opcode;
+    payload->status = (int)reader_svarint(&reader);
+    payload->offset = (long)reader_svarint(&reader);
+    payload->file_size = (long)reader_svarint(&reader);
+
+    size_t name_len = 0;
+    const unsigned char *name = reader_string(&reader, &name_len);
+    if (!name || name_len >= sizeof(payload->filename)) {
+        return -1;
+    }
+    memcpy(payload->filename, name, name_len);
+    payload->filename_length = (int)name_len;
+
+    size_t hash_len = 0;
+    const unsigned char *hash = reader_string(&reader, &hash_len);
+    if (!hash || hash_len > HASH_DIGEST_SIZE) {
+        return -1;
+    }
+    hex_encode(hash, hash_len, payload->hash);
+
+    return reader.failed ? -1 : (int)(reader.p - frame->body);
+}
+
+// Function to append a payload in the wire format of a connection
+void payload_put(int sock, ByteBuf *buf, const Payload *payload) {
+    if (session_get(sock)->wire == WIRE_FRAMED) {
+        frame_put_payload(buf, payload, session_get(sock)->request_id);
+    } else {
+        // Legacy: the raw structure, for peers that predate framing
+        bytebuf_put(buf, payload, sizeof(Payload));
+    }
+}
+
+// Function to append an opaque message body in the wire format of a connection
+void message_put(int sock, ByteBuf *buf, int opcode, const void *body, size_t len) {
+    if (session_get(sock)->wire == WIRE_FRAMED) {
+        size_t start = frame_begin(buf, opcode, session_get(sock)->request_id);
+        bytebuf_put(buf, body, len);
+        frame_end(buf, start);
+    } else {
+        bytebuf_put(buf, body, len);
+    }
+}
+
+// Function to receive the next frame on a framed connection
+long receive_frame(int sock, Frame *frame) {
+    while (1) {
+        const unsigned char *buffered;
+        size_t available = session_buffered(sock, &buffered);
+        long frame_len = frame_parse(buffered, available, frame);
+        if (frame_len != 0) {
+            return frame_len;
+        }
+        if (session_fill(sock) <= 0) {
+            return -1;
+        }
+    }
+}
+
+// Function to receive an opaque message body sent with message_put
+ssize_t receive_message(int sock, int opcode, void *data, size_t size) {
+    if (session_get(sock)->wire == WIRE_FRAMED) {
+        Frame frame;
+        long frame_len = receive_frame(sock, &frame);
+        if (frame_len < 0 || frame.opcode != opcode) {
+            fprintf(stderr, "Unexpected message received\n");
+            return -1;
+        }
+        size_t len = frame.body_len < size ? frame.body_len : size;
+        memcpy(data, frame.body, len);
+        session_consume(sock, frame_len);
+        return len;
+    }
+
+    const unsigned char *buffered;
+    size_t available = session_buffered(sock, &buffered);
+    if (available == 0) {
+        if (session_fill(sock) <= 0) {
+            return -1;
+        }
+        available = session_buffered(sock, &buffered);
+    }
+    size_t len = available < size ? available : size;
+    memcpy(data, buffered, len);
+    session_consume(sock, len);
+    return len;
+}
@@ -0,0 +1,421 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define HASH_READ_SIZE (256 * 1024)  // Read size while hashing a piece
+
+// Two hex digits for every byte value, in order
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+static const char hex_pairs[] = HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5")
+                                HEX_ROW("6") HEX_ROW("7") HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b")
+                                HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+// Value of every hex digit plus one; zero marks anything else
+static const unsigned char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+static const EVP_MD *sha256_md = NULL;   // Fetched once instead of on every digest
+static pthread_key_t sha256_key;         // Per-thread context for sha256_digest
+
+// Function to free a thread's one-shot context when the thread exits
+static void sha256_key_free(void *ctx) {
+    EVP_MD_CTX_free(ctx);
+}
+
+// Function to look up the SHA-256 implementation once per process
+static void sha256_setup(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#endif
+    if (!sha256_md) {
+        sha256_md = EVP_sha256();
+    }
+    pthread_key_create(&sha256_key, sha256_key_free);
+}
+
+// Function to start a SHA-256 digest
+int sha256_begin(Sha256 *sha) {
+    pthread_once(&sha256_once, sha256_setup);
+    sha->ctx = EVP_MD_CTX_new();
+    if (!sha->ctx || EVP_DigestInit_ex(sha->ctx, sha256_md, NULL) != 1) {
+        sha256_free(sha);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to add bytes to a SHA-256 digest
+void sha256_update(Sha256 *sha, const void *data, size_t len) {
+    EVP_DigestUpdate(sha->ctx, data, len);
+}
+
+// Function to finish a SHA-256 digest and get ready for the next one
+int sha256_end(Sha256 *sha, unsigned char *digest) {
+    if (EVP_DigestFinal_ex(sha->ctx, digest, NULL) != 1) {
+        return -1;
+    }
+    return EVP_DigestInit_ex(sha->ctx, sha256_md, NULL) == 1 ? 0 : -1;
+}
+
+// Function to release a SHA-256 digest state
+void sha256_free(Sha256 *sha) {
+    EVP_MD_CTX_free(sha->ctx);
+    sha->ctx = NULL;
+}
+
+// Function to hash a small buffer with the calling thread's context
+int sha256_digest(const void *data, size_t len, unsigned char *digest) {
+    pthread_once(&sha256_once, sha256_setup);
+    EVP_MD_CTX *ctx = pthread_getspecific(sha256_key);
+    if (!ctx) {
+        ctx = EVP_MD_CTX_new();
+        if (!ctx) {
+            return -1;
+        }
+        pthread_setspecific(sha256_key, ctx);
+    }
+    if (EVP_DigestInit_ex(ctx, sha256_md, NULL) != 1 || EVP_DigestUpdate(ctx, data, len) != 1 ||
+        EVP_DigestFinal_ex(ctx, digest, NULL) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to start a SHA-256 digest behind the Hasher interface
+static int sha256_ops_begin(Hasher *hasher) {
+    return sha256_begin(&hasher->sha);
+}
+
+// Function to add bytes to a SHA-256 digest behind the Hasher interface
+static void sha256_ops_update(Hasher *hasher, const void *data, size_t len) {
+    sha256_update(&hasher->sha, data, len);
+}
+
+// Function to finish a SHA-256 digest behind the Hasher interface
+static int sha256_ops_end(Hasher *hasher, unsigned char *digest) {
+    return sha256_end(&hasher->sha, digest);
+}
+
+// Function to release a SHA-256 digest behind the Hasher interface
+static void sha256_ops_free(Hasher *hasher) {
+    sha256_free(&hasher->sha);
+}
+
+// Function to start a CRC32C checksum
+static int crc32c_ops_begin(Hasher *hasher) {
+    hasher->crc = 0;
+    return 0;
+}
+
+// Function to add bytes to a CRC32C checksum
+static void crc32c_ops_update(Hasher *hasher, const void *data, size_t len) {
+    hasher->crc = crc32c_update(hasher->crc, data, len);
+}
+
+// Function to finish a CRC32C checksum as four big-endian bytes
+static int crc32c_ops_end(Hasher *hasher, unsigned char *digest) {
+    for (int i = 0; i < 4; i++) {
+        digest[i] = (unsigned char)(hasher->crc >> (24 - 8 * i));
+    }
+    hasher->crc = 0;
+    return 0;
+}
+
+// Function to start an XXH64 hash
+static int xxh64_ops_begin(Hasher *hasher) {
+    xxh64_begin(&hasher->xxh, 0);
+    return 0;
+}
+
+// Function to add bytes to an XXH64 hash
+static void xxh64_ops_update(Hasher *hasher, const void *data, size_t len) {
+    xxh64_update(&hasher->xxh, data, len);
+}
+
+// Function to finish an XXH64 hash as eight big-endian bytes
+static int xxh64_ops_end(Hasher *hasher, unsigned char *digest) {
+    uint64_t hash = xxh64_end(&hasher->xxh);
+    for (int i = 0; i < 8; i++) {
+        digest[i] = (unsigned char)(hash >> (56 - 8 * i));
+    }
+    xxh64_begin(&hasher->xxh, 0);
+    return 0;
+}
+
+// Function to release a checksum that holds no resources
+static void plain_ops_free(Hasher *hasher) {
+    (void)hasher;
+}
+
+// Operations of one checksum algorithm
+typedef struct {
+    const char *name;      // Name used on the command line and in logs
+    size_t digest_size;    // Bytes in a digest
+    int (*begin)(Hasher *hasher);
+    void (*update)(Hasher *hasher, const void *data, size_t len);
+    int (*end)(Hasher *hasher, unsigned char *digest);
+    void (*free)(Hasher *hasher);
+} HashOps;
+
+// Algorithms indexed by HASH_ALGO_*
+static const HashOps hash_ops[HASH_ALGO_COUNT] = {
+    [HASH_ALGO_SHA256] = { "sha256", HASH_DIGEST_SIZE, sha256_ops_begin, sha256_ops_update, sha256_ops_end, sha256_ops_free },
+    [HASH_ALGO_CRC32C] = { "crc32c", 4, crc32c_ops_begin, crc32c_ops_update, crc32c_ops_end, plain_ops_free },
+    [HASH_ALGO_XXH64] = { "xxh64", 8, xxh64_ops_begin, xxh64_ops_update, xxh64_ops_end, plain_ops_free },
+};
+
+// Function to start a digest with the given algorithm
+int hasher_begin(Hasher *hasher, int algorithm) {
+    if (algorithm < 0 || algorithm >= HASH_ALGO_COUNT) {
+        return -1;
+    }
+    hasher->algorithm = algorithm;
+    return hash_ops[algorithm].begin(hasher);
+}
+
+// Function to add bytes to a digest
+void hasher_update(Hasher *hasher, const void *data, size_t len) {
+    hash_ops[hasher->algorithm].update(hasher, data, len);
+}
+
+// Function to finish a digest and get ready for the next one
+int hasher_end(Hasher *hasher, unsigned char *digest) {
+    return hash_ops[hasher->algorithm].end(hasher, digest);
+}
+
+// Function to release a digest state
+void hasher_free(Hasher *hasher) {
+    hash_ops[hasher->algorithm].free(hasher);
+}
+
+// Function to get the digest size of an algorithm
+size_t hash_digest_size(int algorithm) {
+    return algorithm >= 0 && algorithm < HASH_ALGO_COUNT ? hash_ops[algorithm].digest_size : 0;
+}
+
+// Function to get the name of an algorithm
+const char *hash_algorithm_name(int algorithm) {
+    return algorithm >= 0 && algorithm < HASH_ALGO_COUNT ? hash_ops[algorithm].name : "unknown";
+}
+
+// Function to look up an algorithm by name
+int hash_algorithm_parse(const char *name) {
+    for (int algorithm = 0; algorithm < HASH_ALGO_COUNT; algorithm++) {
+        if (strcmp(name, hash_ops[algorithm].name) == 0) {
+            return algorithm;
+        }
+    }
+    return -1;
+}
+
+// A run of pieces being hashed, shared by the threads working on it
+typedef struct HashJob {
+    int fd;                    // File being hashed
+    long file_size;            // Size of the file
+    long piece_size;           // Bytes per piece
+    long first;                // First piece of the run
+    long count;                // Pieces in the run
+    unsigned char *digests;    // Output, one digest per piece
+    long claimed;              // Pieces handed out so far
+    long done;                 // Pieces finished
+    int failed;                // Set if any piece failed
+    struct HashJob *next;      // Next job with pieces left to hand out
+} HashJob;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;  // Signalled when a job is queued
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;  // Signalled when a job completes
+static HashJob *pool_jobs = NULL;  // Jobs with pieces left to hand out
+static int pool_started = 0;       // Non-zero once the workers were started
+static int pool_workers = 0;       // Threads besides the callers
+
+// Function to hash pieces [start, end) of a job
+static int hash_job_pieces(const HashJob *job, long start, long end, Sha256 *sha, unsigned char *chunk) {
+    for (long index = start; index < end; index++) {
+        long offset = (job->first + index) * job->piece_size;
+        long remaining = job->file_size - offset < job->piece_size ? job->file_size - offset : job->piece_size;
+        while (remaining > 0) {
+            size_t want = remaining < HASH_READ_SIZE ? remaining : HASH_READ_SIZE;
+            ssize_t bytes_read = pread(job->fd, chunk, want, offset);
+            if (bytes_read <= 0) {
+                return -1;  // Read error, or the file shrank underneath us
+            }
+            sha256_update(sha, chunk, bytes_read);
+            offset += bytes_read;
+            remaining -= bytes_read;
+        }
+        if (sha256_end(sha, job->digests + index * HASH_DIGEST_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to hand out the next pieces of a job (the caller holds pool_lock)
+static long hash_job_claim(HashJob *job, long *start) {
+    long batch = HASH_CLAIM_BYTES / job->piece_size;
+    if (batch < 1) {
+        batch = 1;
+    }
+    *start = job->claimed;
+    long end = job->claimed + batch < job->count ? job->claimed + batch : job->count;
+    job->claimed = end;
+
+    // Fully handed out jobs leave the queue; their threads still finish them
+    if (job->claimed == job->count) {
+        HashJob **link = &pool_jobs;
+        while (*link && *link != job) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = job->next;
+        }
+    }
+    return end;
+}
+
+// Function to record finished pieces of a job (the caller holds pool_lock)
+static void hash_job_finish(HashJob *job, long pieces, int result) {
+    job->done += pieces;
+    if (result != 0) {
+        job->failed = 1;
+    }
+    if (job->done == job->count) {
+        pthread_cond_broadcast(&pool_done);
+    }
+}
+
+// Function run by every pool thread: hash pieces of whichever job is queued first
+static void *hash_worker_main(void *arg) {
+    Sha256 sha;
+    unsigned char *chunk = malloc(HASH_READ_SIZE);
+    if (!chunk || sha256_begin(&sha) != 0) {
+        free(chunk);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (!pool_jobs) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        HashJob *job = pool_jobs;
+        long start;
+        long end = hash_job_claim(job, &start);
+        pthread_mutex_unlock(&pool_lock);
+
+        int result = hash_job_pieces(job, start, end, &sha, chunk);
+
+        pthread_mutex_lock(&pool_lock);
+        hash_job_finish(job, end - start, result);
+    }
+    return NULL;
+}
+
+// Function to reset the pool in a forked child, which has none of the threads
+static void hash_pool_atfork_child(void) {
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_work, NULL);
+    pthread_cond_init(&pool_done, NULL);
+    pool_jobs = NULL;
+    pool_started = 0;
+    pool_workers = 0;
+}
+
+// Function to start the pool threads once (the caller holds pool_lock)
+static void hash_pool_start(void) {
+    if (pool_started) {
+        return;
+    }
+    pool_started = 1;
+    pthread_atfork(NULL, NULL, hash_pool_atfork_child);
+
+    // One thread per core besides the caller, which always hashes too
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > HASH_POOL_MAX_THREADS ? HASH_POOL_MAX_THREADS - 1 : (int)cores - 1;
+    for (int i = 0; i < wanted; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, hash_worker_main, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        pool_workers++;
+    }
+}
+
+// Function to hash a run of pieces, spread over the pool when it is large
+int hash_pieces(int fd, long file_size, long piece_size, long first, long count, unsigned char *digests) {
+    HashJob job = { fd, file_size, piece_size, first, count, digests, 0, 0, 0, NULL };
+    Sha256 sha;
+    unsigned char *chunk = malloc(HASH_READ_SIZE);
+    if (count <= 0 || !chunk || sha256_begin(&sha) != 0) {
+        free(chunk);
+        return count <= 0 ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    hash_pool_start();
+    if (pool_workers == 0 || count * piece_size < HASH_PARALLEL_MIN_BYTES) {
+        pthread_mutex_unlock(&pool_lock);
+        int result = hash_job_pieces(&job, 0, count, &sha, chunk);
+        sha256_free(&sha);
+        free(chunk);
+        return result;
+    }
+
+    // Queue the job for the pool and work on it alongside
+    HashJob **link = &pool_jobs;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = &job;
+    pthread_cond_broadcast(&pool_work);
+    while (job.claimed < job.count) {
+        long start;
+        long end = hash_job_claim(&job, &start);
+        pthread_mutex_unlock(&pool_lock);
+
+        int result = hash_job_pieces(&job, start, end, &sha, chunk);
+
+        pthread_mutex_lock(&pool_lock);
+        hash_job_finish(&job, end - start, result);
+    }
+    while (job.done < job.count) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    sha256_free(&sha);
+    free(chunk);
+    return job.failed ? -1 : 0;
+}
+
+// Function to encode bytes as lowercase hex, two digits per table lookup
+void hex_encode(const unsigned char *bytes, size_t len, char *hex) {
+    for (size_t i = 0; i < len; i++) {
+        memcpy(hex + i * 2, hex_pairs + bytes[i] * 2, 2);
+    }
+    hex[len * 2] = '\0';
+}
+
+// Function to decode hex digits up to the first character that isn't one
+size_t hex_decode(const char *hex, unsigned char *bytes, size_t max) {
+    size_t len = 0;
+    while (len < max) {
+        unsigned char high = hex_values[(unsigned char)hex[len * 2]];
+        unsigned char low = high ? hex_values[(unsigned char)hex[len * 2 + 1]] : 0;
+        if (!low) {
+            break;
+        }
+        bytes[len++] = (unsigned char)((high - 1) << 4 | (low - 1));
+    }
+    return len;
+}
@@ -0,0 +1,368 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "hashindex.h"
+#include "merkle.h"
+#include "logger.h"
+
+#define HASH_INDEX_MAGIC   0x5844494853415459ULL  // "YTASHIDX"
+#define HASH_INDEX_VERSION 1
+#define HASH_INDEX_INITIAL_ARENA (4 * 1024 * 1024)  // Digest bytes reserved when the index is created
+
+// Header at the start of the index file; mapped on its own so the mutex never moves
+typedef struct {
+    uint64_t magic;            // HASH_INDEX_MAGIC once initialized
+    uint32_t version;          // HASH_INDEX_VERSION
+    uint32_t header_size;      // sizeof(IndexHeader), which depends on the pthread ABI
+    pthread_mutex_t lock;      // Robust, process-shared; guards everything below and the entries
+    uint64_t file_size;        // Current size of the index file
+    uint64_t arena_used;       // File offset of the first free digest byte
+    uint32_t used_slots;       // Entries in use
+} IndexHeader;
+
+// Digests of one file at one piece size
+typedef struct {
+    uint64_t dev;              // Device of the file
+    uint64_t ino;              // Inode of the file
+    int64_t size;              // Size when hashed
+    int64_t mtime_sec;         // Modification time when hashed
+    int64_t mtime_nsec;
+    int64_t piece_size;        // Bytes per piece
+    uint64_t digests;          // File offset of the digests
+    uint64_t count;            // Number of digests
+    uint32_t used;             // Set last, once the entry is complete
+} IndexEntry;
+
+#define HASH_INDEX_ENTRIES_OFFSET 4096  // Entries start on the page after the header
+#define HASH_INDEX_ARENA_OFFSET (HASH_INDEX_ENTRIES_OFFSET + HASH_INDEX_SLOTS * sizeof(IndexEntry))
+
+static IndexHeader *index_header = NULL;  // Fixed mapping of the header
+static unsigned char *index_data = NULL;  // Mapping of the whole file, remapped as it grows
+static size_t index_mapped = 0;           // Length of index_data
+static int index_fd = -1;
+
+// Function to (re)initialize the robust process-shared mutex in the header
+static int index_init_lock(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int result = pthread_mutex_init(&index_header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return result == 0 ? 0 : -1;
+}
+
+// Function to map the whole index file at its current size
+static int index_remap(void) {
+    size_t size = index_header->file_size;
+    if (index_data && index_mapped == size) {
+        return 0;
+    }
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (data == MAP_FAILED) {
+        log_message(LOG_ERROR, "Error mapping hash index: %s", strerror(errno));
+        return -1;
+    }
+    if (index_data) {
+        munmap(index_data, index_mapped);
+    }
+    index_data = data;
+    index_mapped = size;
+    return 0;
+}
+
+// Function to take the index lock and catch up with growth by other processes
+static int index_lock(void) {
+    int result = pthread_mutex_lock(&index_header->lock);
+    if (result == EOWNERDEAD) {
+        // The holder died mid-update; entries are published last, so at worst some digest space leaks
+        pthread_mutex_consistent(&index_header->lock);
+        result = 0;
+    }
+    if (result != 0) {
+        return -1;
+    }
+    if (index_remap() != 0) {
+        pthread_mutex_unlock(&index_header->lock);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to empty the index, keeping the file
+static void index_clear(void) {
+    memset(index_data + HASH_INDEX_ENTRIES_OFFSET, 0, HASH_INDEX_SLOTS * sizeof(IndexEntry));
+    index_header->arena_used = HASH_INDEX_ARENA_OFFSET;
+    index_header->used_slots = 0;
+}
+
+// Function to find the slot of a file at a piece size (NULL if the table is full)
+static IndexEntry *index_slot(const struct stat *file_stat, long piece_size) {
+    IndexEntry *entries = (IndexEntry *)(index_data + HASH_INDEX_ENTRIES_OFFSET);
+    uint64_t hash = ((uint64_t)file_stat->st_ino * 0x9E3779B97F4A7C15ULL) ^
+                    ((uint64_t)file_stat->st_dev * 0xC2B2AE3D27D4EB4FULL) ^ (uint64_t)piece_size;
+    for (uint32_t probe = 0; probe < HASH_INDEX_SLOTS; probe++) {
+        IndexEntry *entry = &entries[(hash + probe) & (HASH_INDEX_SLOTS - 1)];
+        if (!entry->used || (entry->dev == (uint64_t)file_stat->st_dev && entry->ino == (uint64_t)file_stat->st_ino &&
+                             entry->piece_size == piece_size)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Function to check that an entry describes the file as it is now
+static int index_entry_matches(const IndexEntry *entry, const struct stat *file_stat) {
+    return entry->used && entry->size == file_stat->st_size &&
+           entry->mtime_sec == file_stat->st_mtim.tv_sec && entry->mtime_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+// Function to open (or create) the hash index next to a shared directory
+int hash_index_open(const char *dir) {
+    char path[MAX_FILENAME + sizeof(HASH_INDEX_SUFFIX)];
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        len--;  // "dir/" and "dir" share an index
+    }
+    int result = snprintf(path, sizeof(path), "%.*s%s", (int)len, dir, HASH_INDEX_SUFFIX);
+    if (result < 0 || result >= sizeof(path)) {
+        log_message(LOG_ERROR, "Hash index path too long for directory: %s", dir);
+        return -1;
+    }
+
+    index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat file_stat;
+    if (index_fd < 0 || fstat(index_fd, &file_stat) != 0) {
+        log_message(LOG_ERROR, "Error opening hash index %s: %s", path, strerror(errno));
+        if (index_fd >= 0) {
+            close(index_fd);
+            index_fd = -1;
+        }
+        return -1;
+    }
+
+    // Anything too short to hold the entry table is treated as a new index
+    int cold = file_stat.st_size < (off_t)(HASH_INDEX_ARENA_OFFSET + HASH_INDEX_INITIAL_ARENA);
+    if (cold && ftruncate(index_fd, HASH_INDEX_ARENA_OFFSET + HASH_INDEX_INITIAL_ARENA) != 0) {
+        log_message(LOG_ERROR, "Error sizing hash index %s: %s", path, strerror(errno));
+        close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+
+    index_header = mmap(NULL, sizeof(IndexHeader), PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (index_header == MAP_FAILED) {
+        log_message(LOG_ERROR, "Error mapping hash index %s: %s", path, strerror(errno));
+        index_header = NULL;
+        close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+    if (!cold && (index_header->magic != HASH_INDEX_MAGIC || index_header->version != HASH_INDEX_VERSION ||
+                  index_header->header_size != sizeof(IndexHeader) || index_header->file_size != (uint64_t)file_stat.st_size ||
+                  index_header->arena_used < HASH_INDEX_ARENA_OFFSET || index_header->arena_used > index_header->file_size)) {
+        cold = 1;  // Written by another version, or torn
+    }
+
+    // Nothing else uses the index yet, so a lock left held by a previous run is simply replaced
+    if (cold) {
+        memset(index_header, 0, sizeof(IndexHeader));
+        index_header->file_size = HASH_INDEX_ARENA_OFFSET + HASH_INDEX_INITIAL_ARENA;
+        if (ftruncate(index_fd, index_header->file_size) != 0) {
+            log_message(LOG_ERROR, "Error sizing hash index %s: %s", path, strerror(errno));
+        }
+    }
+    if (index_init_lock() != 0 || index_remap() != 0) {
+        munmap(index_header, sizeof(IndexHeader));
+        index_header = NULL;
+        close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+    if (cold) {
+        index_clear();
+        index_header->version = HASH_INDEX_VERSION;
+        index_header->header_size = sizeof(IndexHeader);
+        index_header->magic = HASH_INDEX_MAGIC;
+    }
+
+    log_message(LOG_INFO, "Hash index %s %s (%u files)", path, cold ? "created" : "loaded", index_header->used_slots);
+    return cold;
+}
+
+// Function to store the digests of a file (the caller holds the lock)
+static void index_store(const struct stat *file_stat, long piece_size, const unsigned char *digests, long count) {
+    size_t bytes = count * MERKLE_HASH_SIZE;
+    IndexEntry *entry = index_slot(file_stat, piece_size);
+
+    // A full table or an oversized file starts over; entries of deleted files go with it
+    if (!entry || (!entry->used && index_header->used_slots >= HASH_INDEX_SLOTS / 4 * 3) ||
+        index_header->arena_used + bytes > HASH_INDEX_MAX_SIZE) {
+        log_message(LOG_INFO, "Hash index full (%u files), starting over", index_header->used_slots);
+        index_clear();
+        entry = index_slot(file_stat, piece_size);
+        if (index_header->arena_used + bytes > HASH_INDEX_MAX_SIZE) {
+            return;
+        }
+    }
+
+    // Grow the file (and every process's mapping, lazily) when the digests don't fit
+    if (index_header->arena_used + bytes > index_header->file_size) {
+        uint64_t size = index_header->file_size;
+        while (size < index_header->arena_used + bytes) {
+            size *= 2;
+        }
+        if (ftruncate(index_fd, size) != 0) {
+            log_message(LOG_ERROR, "Error growing hash index: %s", strerror(errno));
+            return;
+        }
+        index_header->file_size = size;
+        if (index_remap() != 0) {
+            return;
+        }
+        entry = index_slot(file_stat, piece_size);
+    }
+
+    // Replaced digests are left behind until the index starts over
+    if (!entry->used) {
+        index_header->used_slots++;
+    }
+    entry->used = 0;
+    memcpy(index_data + index_header->arena_used, digests, bytes);
+    entry->dev = file_stat->st_dev;
+    entry->ino = file_stat->st_ino;
+    entry->size = file_stat->st_size;
+    entry->mtime_sec = file_stat->st_mtim.tv_sec;
+    entry->mtime_nsec = file_stat->st_mtim.tv_nsec;
+    entry->piece_size = piece_size;
+    entry->digests = index_header->arena_used;
+    entry->count = count;
+    index_header->arena_used += bytes;
+    __atomic_store_n(&entry->used, 1, __ATOMIC_RELEASE);
+}
+
+// Function to get the digest of one piece of a file from the index, without hashing on a miss
+int hash_index_lookup(const struct stat *file_stat, long piece_size, long piece, unsigned char *digest) {
+    if (!index_header || piece_size < MIN_PIECE_SIZE || piece < 0 || index_lock() != 0) {
+        return -1;
+    }
+    long count = file_stat->st_size > 0 ? (file_stat->st_size + piece_size - 1) / piece_size : 1;
+    IndexEntry *entry = index_slot(file_stat, piece_size);
+    int hit = entry && index_entry_matches(entry, file_stat) && entry->count == (uint64_t)count && piece < count;
+    if (hit) {
+        memcpy(digest, index_data + entry->digests + piece * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+    }
+    pthread_mutex_unlock(&index_header->lock);
+    return hit ? 0 : -1;
+}
+
+// Function to get the digest of every piece of a file, from the index when it is current
+int hash_index_digests(int fd, const struct stat *file_stat, long piece_size, unsigned char **digests, long *count) {
+    if (piece_size <= 0) {
+        return -1;
+    }
+    *count = file_stat->st_size > 0 ? (file_stat->st_size + piece_size - 1) / piece_size : 1;
+    *digests = malloc(*count * MERKLE_HASH_SIZE);
+    if (!*digests) {
+        return -1;
+    }
+
+    int indexed = index_header && piece_size >= MIN_PIECE_SIZE;
+    if (indexed && index_lock() == 0) {
+        IndexEntry *entry = index_slot(file_stat, piece_size);
+        int hit = entry && index_entry_matches(entry, file_stat) && entry->count == (uint64_t)*count;
+        if (hit) {
+            memcpy(*digests, index_data + entry->digests, *count * MERKLE_HASH_SIZE);
+        }
+        pthread_mutex_unlock(&index_header->lock);
+        if (hit) {
+            return 0;
+        }
+    }
+
+    // Hash without holding the lock; other requests keep being answered meanwhile
+    if (hash_pieces(fd, file_stat->st_size, piece_size, 0, *count, *digests) != 0) {
+        free(*digests);
+        *digests = NULL;
+        return -1;
+    }
+
+    // Only digests of a file that didn't change while it was read are worth keeping
+    struct stat after;
+    if (indexed && fstat(fd, &after) == 0 && after.st_size == file_stat->st_size &&
+        after.st_mtim.tv_sec == file_stat->st_mtim.tv_sec && after.st_mtim.tv_nsec == file_stat->st_mtim.tv_nsec &&
+        index_lock() == 0) {
+        index_store(file_stat, piece_size, *digests, *count);
+        pthread_mutex_unlock(&index_header->lock);
+    }
+    return 0;
+}
+
+// Arguments of the background index build
+typedef struct {
+    char dir[MAX_FILENAME];
+    long piece_size;
+} IndexBuild;
+
+// Function to hash every file of a directory into the index
+static void *index_build_main(void *arg) {
+    IndexBuild *build = arg;
+    int dir_fd = open(build->dir, O_RDONLY | O_DIRECTORY);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        log_message(LOG_ERROR, "Error opening directory to index: %s", build->dir);
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        free(build);
+        return NULL;
+    }
+
+    struct dirent *entry;
+    int files = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        int fd = openat(dir_fd, entry->d_name, O_RDONLY);
+        struct stat file_stat;
+        unsigned char *digests;
+        long count;
+        if (fd >= 0 && fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+            hash_index_digests(fd, &file_stat, build->piece_size, &digests, &count) == 0) {
+            free(digests);
+            files++;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+
+    log_message(LOG_INFO, "Hash index built for %d files in %s", files, build->dir);
+    free(build);
+    return NULL;
+}
+
+// Function to start hashing a directory into the index in the background
+int hash_index_build_async(const char *dir, long piece_size) {
+    IndexBuild *build = malloc(sizeof(IndexBuild));
+    if (!build) {
+        return -1;
+    }
+    strncpy(build->dir, dir, sizeof(build->dir) - 1);
+    build->dir[sizeof(build->dir) - 1] = '\0';
+    build->piece_size = piece_size;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, index_build_main, build) != 0) {
+        log_message(LOG_ERROR, "Error starting hash index build");
+        free(build);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
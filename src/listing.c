@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "listing.h"
+#include "hashindex.h"
+#include "logger.h"
+
+#define LIST_READ_SIZE (32 * 1024)  // Bytes of directory entries read at a time
+
+// Function to append an OP_LIST_PAGE request: payload fields, then the cursor, limit and flags
+void list_put_request(ByteBuf *buf, const char *pattern, uint64_t cursor, int limit, int flags) {
+    Payload payload = {0};
+    payload.operation = OP_LIST_PAGE;
+    strncpy(payload.filename, pattern, sizeof(payload.filename) - 1);
+
+    size_t start = frame_begin(buf, OP_LIST_PAGE, 0);
+    frame_put_payload_fields(buf, &payload);
+    bytebuf_put_varint(buf, cursor);
+    bytebuf_put_varint(buf, limit);
+    bytebuf_put_varint(buf, flags);
+    frame_end(buf, start);
+}
+
+// Function to decode the cursor, limit and flags of a listing request
+int list_parse_request(int sock, uint64_t *cursor, int *limit, int *flags) {
+    Session *session = session_get(sock);
+    ByteReader reader = { session->args, session->args + session->args_len, 0 };
+    uint64_t wanted_cursor = reader_varint(&reader);
+    uint64_t wanted_limit = reader_varint(&reader);
+    uint64_t wanted_flags = reader_varint(&reader);
+    if (reader.failed || wanted_cursor > INT64_MAX) {
+        return -1;
+    }
+    *cursor = wanted_cursor;
+    *limit = wanted_limit == 0 || wanted_limit > LIST_PAGE_ENTRIES ? LIST_PAGE_ENTRIES : (int)wanted_limit;
+    *flags = (int)(wanted_flags & LIST_DIGESTS);
+    return 0;
+}
+
+// Function to check a name against a listing filter: a prefix, or a glob if it has glob characters
+static int list_match(const char *pattern, const char *name) {
+    if (pattern[0] == '\0') {
+        return 1;
+    }
+    if (strpbrk(pattern, "*?[") == NULL) {
+        return strncmp(name, pattern, strlen(pattern)) == 0;
+    }
+    return fnmatch(pattern, name, FNM_PERIOD) == 0;
+}
+
+// Function to compute the Merkle root of a file, from the hash index when it is warm
+static int list_digest(int dir_fd, const char *name, long piece_size, unsigned char *root) {
+    struct stat file_stat;
+    unsigned char *digests = NULL;
+    long count;
+    MerkleTree tree = {0};
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    int result = fd >= 0 && fstat(fd, &file_stat) == 0 &&
+                 hash_index_digests(fd, &file_stat, piece_size, &digests, &count) == 0 &&
+                 merkle_build_from_digests(&tree, digests, file_stat.st_size, piece_size) == 0 ? 0 : -1;
+    if (result == 0) {
+        memcpy(root, merkle_root(&tree), MERKLE_HASH_SIZE);
+    }
+    merkle_free(&tree);
+    free(digests);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+// Function to append one page of a directory listing
+int list_put_page(int sock, ByteBuf *buf, const char *dir, const char *pattern, uint64_t cursor, int limit, int flags) {
+    ByteBuf entries = {0};
+    int count = 0, scanned = 0, more = 1;
+    uint64_t position = cursor;  // d_off of the last entry examined: the next page starts after it
+    char *dirents = malloc(LIST_READ_SIZE);
+
+    int dir_fd = dirents ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (dir_fd < 0 || lseek(dir_fd, (off_t)cursor, SEEK_SET) < 0) {
+        log_message(LOG_ERROR, "Error reading shared directory %s from cursor %llu: %s", dir, (unsigned long long)cursor, strerror(errno));
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        free(dirents);
+        size_t start = frame_begin(buf, OP_LIST_PAGE, session_get(sock)->request_id);
+        bytebuf_put_svarint(buf, STAT_SERVER_ERROR);
+        frame_end(buf, start);
+        return -1;
+    }
+
+    // Entries past the one a page stops at are read again by the next page
+    while (more && count < limit && scanned < LIST_SCAN_MAX && entries.len < LIST_PAGE_BYTES) {
+        ssize_t n = getdents64(dir_fd, dirents, LIST_READ_SIZE);
+        if (n <= 0) {
+            if (n < 0) {
+                log_message(LOG_ERROR, "Error reading shared directory %s: %s", dir, strerror(errno));
+            }
+            more = 0;
+            break;
+        }
+        for (ssize_t at = 0; at < n; ) {
+            struct dirent64 *entry = (struct dirent64 *)(dirents + at);
+            at += entry->d_reclen;
+            if (count >= limit || scanned >= LIST_SCAN_MAX || entries.len >= LIST_PAGE_BYTES) {
+                break;
+            }
+            scanned++;
+            position = (uint64_t)entry->d_off;
+
+            // Only regular files, as the plain listing shows them
+            struct stat file_stat;
+            if ((entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) || !list_match(pattern, entry->d_name) ||
+                fstatat(dir_fd, entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(file_stat.st_mode)) {
+                continue;
+            }
+            unsigned char root[MERKLE_HASH_SIZE];
+            int has_digest = (flags & LIST_DIGESTS) && list_digest(dir_fd, entry->d_name, session_get(sock)->piece_size, root) == 0;
+            bytebuf_put_string(&entries, entry->d_name, strlen(entry->d_name));
+            bytebuf_put_svarint(&entries, file_stat.st_size);
+            bytebuf_put_svarint(&entries, file_stat.st_mtim.tv_sec);
+            bytebuf_put_varint(&entries, file_stat.st_mtim.tv_nsec);
+            bytebuf_put_string(&entries, root, has_digest ? MERKLE_HASH_SIZE : 0);
+            count++;
+        }
+    }
+    close(dir_fd);
+    free(dirents);
+
+    // The cursor and end flag are known only now, so the entries are copied in behind them
+    int failed = entries.failed;
+    size_t start = frame_begin(buf, OP_LIST_PAGE, session_get(sock)->request_id);
+    bytebuf_put_svarint(buf, failed ? STAT_SERVER_ERROR : STAT_FILE_FOUND);
+    if (!failed) {
+        bytebuf_put_varint(buf, position);
+        bytebuf_put_varint(buf, more);
+        bytebuf_put(buf, entries.data, entries.len);
+    }
+    frame_end(buf, start);
+    bytebuf_free(&entries);
+    return failed ? -1 : count;
+}
+
+// Function to decode the header of a listing page
+int list_get_page(const Frame *frame, ListPage *page) {
+    memset(page, 0, sizeof(*page));
+    page->reader.p = frame->body;
+    page->reader.end = frame->body + frame->body_len;
+    page->status = (int)reader_svarint(&page->reader);
+    if (page->status == STAT_FILE_FOUND) {
+        page->cursor = reader_varint(&page->reader);
+        page->more = reader_varint(&page->reader) != 0;
+    }
+    return page->reader.failed || frame->opcode != OP_LIST_PAGE ? -1 : 0;
+}
+
+// Function to decode the next entry of a listing page
+int list_page_next(ListPage *page, ListEntry *entry) {
+    if (page->status != STAT_FILE_FOUND || page->reader.p == page->reader.end) {
+        return 0;
+    }
+
+    size_t name_len, digest_len;
+    memset(entry, 0, sizeof(*entry));
+    const unsigned char *name = reader_string(&page->reader, &name_len);
+    entry->file_size = (long)reader_svarint(&page->reader);
+    entry->mtime_sec = (long)reader_svarint(&page->reader);
+    entry->mtime_nsec = (long)reader_varint(&page->reader);
+    const unsigned char *digest = reader_string(&page->reader, &digest_len);
+    if (page->reader.failed || !name || !digest || name_len == 0 || name_len >= sizeof(entry->filename) ||
+        (digest_len != 0 && digest_len != MERKLE_HASH_SIZE)) {
+        page->reader.failed = 1;
+        return -1;
+    }
+    memcpy(entry->filename, name, name_len);
+    entry->has_digest = digest_len != 0;
+    memcpy(entry->digest, digest, digest_len);
+    return 1;
+}
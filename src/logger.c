@@ -1,15 +1,56 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
 #include "logger.h"
 
 #define LOG_FILE "log.txt"  // Define the log file path
+#define LOG_BATCH_BYTES (64 * 1024)  // Bytes of formatted records written at a time
+#define LOG_IDLE_WAIT_MS 100         // Longest the writer sleeps before looking at the ring again
+#define LOG_RING_MASK ((unsigned long)LOG_RING_RECORDS - 1)
+
+// One queued message
+typedef struct {
+    // Lap marker, relative to the slot index so a zeroed ring is empty: the slot is free for
+    // position p when it equals p's lap base, holds p's record at base + 1, and is consumed at base + LOG_RING_RECORDS
+    unsigned long sequence;
+    time_t time;
+    LogLevel level;
+    size_t length;
+    char text[LOG_RECORD_SIZE];
+} LogRecord;
 
 static int verbose_mode = 0;  // Flag for verbose mode
 
+static LogRecord ring[LOG_RING_RECORDS];   // Bounded MPMC queue (producers claim positions with a CAS)
+static unsigned long ring_head;            // Next position a producer claims
+static unsigned long ring_tail;            // Next position to write out (guarded by drain_lock)
+static LogStats log_stats;                 // Updated atomically
+static unsigned long long dropped_reported;  // Drops already noted in the log (guarded by drain_lock)
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;  // One consumer at a time: the writer or log_flush
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int writer_sleeping;      // Set while the writer waits for records
+static int writer_running;       // 1 once this process has a writer thread, -1 if it couldn't start one
+static int log_fd = -1;          // The log file, opened once with O_APPEND so processes can share it
+static int hooks_installed;      // atexit and atfork handlers are registered once per program
+
+static char batch[LOG_BATCH_BYTES];      // Formatted records not yet written (guarded by drain_lock)
+static size_t batch_len;
+static time_t batch_time = -1;           // Second the cached timestamp is for
+static char batch_stamp[20];
+
 // Function to get the current timestamp as a string
 const char* get_current_time() {
-    static char buffer[20];
+    static __thread char buffer[20];  // Per thread, so concurrent workers don't share it
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm_info);
     return buffer;
 }
 
@@ -18,31 +59,236 @@ void set_verbose(int verbose) {
     verbose_mode = verbose;
 }
 
-// Function to log messages with level and timestamp
-void log_message(LogLevel level, const char *format, ...) {
-    FILE *log_file = fopen(LOG_FILE, "a");
-    if (log_file == NULL) {
-        perror("Error opening log file");
-        return;
+// Helper function to name a log level
+static const char *level_name(LogLevel level) {
+    return level == LOG_DEBUG ? "DEBUG" : level == LOG_INFO ? "INFO" : "ERROR";
+}
+
+// Function to write the formatted batch to the log file (with drain_lock held)
+static void batch_write(void) {
+    size_t done = 0;
+    while (done < batch_len) {
+        ssize_t n = write(log_fd, batch + done, batch_len - done);
+        if (n <= 0) {
+            break;  // Nowhere to report it but the log itself
+        }
+        done += n;
     }
+    batch_len = 0;
+}
 
-    const char *level_str = (level == LOG_INFO) ? "INFO" : "ERROR";
-    fprintf(log_file, "[%s] [%s] ", get_current_time(), level_str);
+// Function to append one line to the batch (with drain_lock held)
+static void batch_put(time_t when, LogLevel level, const char *text, size_t length) {
+    if (batch_len + length + sizeof(batch_stamp) + 16 > sizeof(batch)) {
+        batch_write();
+    }
+    if (when != batch_time) {
+        struct tm tm_info;
+        localtime_r(&when, &tm_info);
+        strftime(batch_stamp, sizeof(batch_stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+        batch_time = when;
+    }
+    batch_len += snprintf(batch + batch_len, sizeof(batch) - batch_len, "[%s] [%s] ", batch_stamp, level_name(level));
+    memcpy(batch + batch_len, text, length);
+    batch_len += length;
+    batch[batch_len++] = '\n';
+}
 
+// Function to write out every published record (with drain_lock held)
+static int ring_drain(void) {
+    int count = 0;
+    if (log_fd < 0) {
+        return 0;
+    }
+    while (1) {
+        LogRecord *record = &ring[ring_tail & LOG_RING_MASK];
+        unsigned long base = ring_tail & ~LOG_RING_MASK;
+        if (__atomic_load_n(&record->sequence, __ATOMIC_SEQ_CST) != base + 1) {
+            break;  // Empty, or the producer of the next record is still filling it in
+        }
+        batch_put(record->time, record->level, record->text, record->length);
+        __atomic_store_n(&record->sequence, base + LOG_RING_RECORDS, __ATOMIC_RELEASE);
+        ring_tail++;
+        count++;
+    }
+    __atomic_add_fetch(&log_stats.written, count, __ATOMIC_RELAXED);
+
+    // Losses are noted in the log where they happened
+    unsigned long long dropped = __atomic_load_n(&log_stats.dropped, __ATOMIC_RELAXED);
+    if (dropped != dropped_reported) {
+        char note[96];
+        int length = snprintf(note, sizeof(note), "Log ring full: dropped %llu records", dropped - dropped_reported);
+        batch_put(time(NULL), LOG_ERROR, note, length);
+        dropped_reported = dropped;
+    }
+    batch_write();
+    return count;
+}
+
+// Function to write queued records in batches for the life of the process
+static void *log_writer_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&drain_lock);
+        int count = ring_drain();
+        pthread_mutex_unlock(&drain_lock);
+        if (count > 0) {
+            continue;
+        }
+
+        // Producers wake us only while this flag is set, so the common case costs them no syscall
+        pthread_mutex_lock(&wake_lock);
+        __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+        LogRecord *next = &ring[__atomic_load_n(&ring_tail, __ATOMIC_RELAXED) & LOG_RING_MASK];
+        if (__atomic_load_n(&next->sequence, __ATOMIC_SEQ_CST) != (__atomic_load_n(&ring_tail, __ATOMIC_RELAXED) & ~LOG_RING_MASK) + 1) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += LOG_IDLE_WAIT_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wake, &wake_lock, &until);
+        }
+        __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+// Function to forget the parent's queue and writer in a forked child (the parent writes its own records)
+static void log_after_fork_child(void) {
+    for (int i = 0; i < LOG_RING_RECORDS; i++) {
+        ring[i].sequence = 0;
+    }
+    ring_head = ring_tail = 0;
+    memset(&log_stats, 0, sizeof(log_stats));
+    dropped_reported = 0;
+    batch_len = 0;
+    writer_sleeping = 0;
+    writer_running = 0;
+    pthread_mutex_init(&start_lock, NULL);
+    pthread_mutex_init(&drain_lock, NULL);
+    pthread_mutex_init(&wake_lock, NULL);
+    pthread_cond_init(&wake, NULL);
+}
+
+// Function to open the log file and start this process's writer thread
+static void log_start(void) {
+    pthread_mutex_lock(&start_lock);
+    if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE) == 0) {
+        if (log_fd < 0) {
+            log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (log_fd < 0) {
+                perror("Error opening log file");
+            }
+        }
+        if (!hooks_installed) {
+            atexit(log_flush);
+            pthread_atfork(NULL, NULL, log_after_fork_child);
+            hooks_installed = 1;
+        }
+
+        // Without a writer thread every call writes its own record
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int running = pthread_create(&thread, &attr, log_writer_main, NULL) == 0 ? 1 : -1;
+        pthread_attr_destroy(&attr);
+        __atomic_store_n(&writer_running, running, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+// Function to claim the next ring slot and publish a record in it; -1 if the ring is full
+static int ring_push(LogLevel level, time_t when, const char *text, size_t length) {
+    unsigned long position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    while (1) {
+        LogRecord *record = &ring[position & LOG_RING_MASK];
+        unsigned long base = position & ~LOG_RING_MASK;
+        unsigned long sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == base) {
+            if (__atomic_compare_exchange_n(&ring_head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                record->time = when;
+                record->level = level;
+                record->length = length;
+                memcpy(record->text, text, length);
+                __atomic_store_n(&record->sequence, base + 1, __ATOMIC_SEQ_CST);
+                return 0;
+            }
+        } else if ((long)(sequence - base) < 0) {
+            return -1;  // The slot still holds the previous lap's record
+        } else {
+            position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);  // Another producer took it
+        }
+    }
+}
+
+// Function to queue a message with level and timestamp
+void log_write(LogLevel level, const char *format, ...) {
+    char text[LOG_RECORD_SIZE];
     va_list args;
     va_start(args, format);
-    vfprintf(log_file, format, args);
+    int length = vsnprintf(text, sizeof(text), format, args);
     va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if (length >= (int)sizeof(text)) {
+        length = sizeof(text) - 1;
+    }
 
-    fprintf(log_file, "\n");
-    fclose(log_file);
+    int running = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE);
+    if (running == 0) {
+        log_start();
+        running = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE);
+    }
+    if (ring_push(level, time(NULL), text, length) != 0) {
+        __atomic_add_fetch(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+    } else if (running < 0) {
+        log_flush();
+    } else if (__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&wake_lock);
+    }
 
     // Output to console if verbose mode is enabled
     if (verbose_mode) {
-        printf("[%s] [%s] ", get_current_time(), level_str);
-        va_start(args, format);
-        vprintf(format, args);
-        va_end(args);
-        printf("\n");
+        printf("[%s] [%s] %s\n", get_current_time(), level_name(level), text);
+    }
+}
+
+// Function to check whether a rate-limited call site may log now
+int log_rate_allow(LogRateLimit *limit, const char *file, int line) {
+    long now = time(NULL);
+    long window = __atomic_load_n(&limit->window, __ATOMIC_RELAXED);
+    if (window != now && __atomic_compare_exchange_n(&limit->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+        unsigned int suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0) {
+            log_write(LOG_INFO, "Suppressed %u similar messages from %s:%d", suppressed, file, line);
+        }
     }
+    if (__atomic_add_fetch(&limit->count, 1, __ATOMIC_RELAXED) <= LOG_RATE_BURST) {
+        return 1;
+    }
+    __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&log_stats.suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Function to write every queued record now
+void log_flush(void) {
+    pthread_mutex_lock(&drain_lock);
+    ring_drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+// Function to get the logger counters of this process
+void log_get_stats(LogStats *stats) {
+    stats->written = __atomic_load_n(&log_stats.written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&log_stats.dropped, __ATOMIC_RELAXED);
+    stats->suppressed = __atomic_load_n(&log_stats.suppressed, __ATOMIC_RELAXED);
 }
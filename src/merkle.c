@@ -0,0 +1,332 @@
+#include <limits.h>
+
+#include "merkle.h"
+
+// Function to hash two child nodes into their parent
+static void hash_node(const unsigned char *left, const unsigned char *right, unsigned char *out) {
+    unsigned char node[1 + 2 * MERKLE_HASH_SIZE];
+    node[0] = 0x01;
+    memcpy(node + 1, left, MERKLE_HASH_SIZE);
+    memcpy(node + 1 + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+    sha256_digest(node, sizeof(node), out);
+}
+
+// Function to get a node of a level
+static unsigned char *merkle_node(const MerkleTree *tree, int level, long index) {
+    return tree->nodes + (tree->level_start[level] + index) * MERKLE_HASH_SIZE;
+}
+
+// Function to allocate a tree for a file
+int merkle_init(MerkleTree *tree, long file_size, long piece_size) {
+    memset(tree, 0, sizeof(*tree));
+    if (file_size < 0 || piece_size <= 0) {
+        return -1;
+    }
+    tree->file_size = file_size;
+    tree->piece_size = piece_size;
+    tree->leaf_count = file_size > 0 ? (file_size + piece_size - 1) / piece_size : 1;
+
+    // Each level is half as wide as the one below, rounded up
+    long total = 0;
+    long width = tree->leaf_count;
+    while (1) {
+        tree->level_start[tree->levels] = total;
+        tree->level_width[tree->levels] = width;
+        tree->levels++;
+        total += width;
+        if (width == 1) {
+            break;
+        }
+        width = (width + 1) / 2;
+    }
+
+    tree->nodes = malloc(total * MERKLE_HASH_SIZE);
+    return tree->nodes ? 0 : -1;
+}
+
+// Function to get a leaf hash of a tree
+unsigned char *merkle_leaf(MerkleTree *tree, long index) {
+    return merkle_node(tree, 0, index);
+}
+
+// Function to set a leaf from the digest of its piece
+void merkle_set_piece(MerkleTree *tree, long index, const unsigned char *digest) {
+    unsigned char leaf[1 + MERKLE_HASH_SIZE];
+    leaf[0] = 0x00;
+    memcpy(leaf + 1, digest, MERKLE_HASH_SIZE);
+    sha256_digest(leaf, sizeof(leaf), merkle_leaf(tree, index));
+}
+
+// Function to hash a run of pieces of a file into the leaves of a tree
+int merkle_hash_pieces(MerkleTree *tree, int fd, long first, long count) {
+    unsigned char digest[MERKLE_HASH_SIZE];
+    for (long index = first; index < first + count; index++) {
+        if (hash_pieces(fd, tree->file_size, tree->piece_size, index, 1, digest) != 0) {
+            return -1;
+        }
+        merkle_set_piece(tree, index, digest);
+    }
+    return 0;
+}
+
+// Function to compute the levels above the leaves
+void merkle_finish(MerkleTree *tree) {
+    for (int level = 1; level < tree->levels; level++) {
+        long below = tree->level_width[level - 1];
+        for (long i = 0; i < tree->level_width[level]; i++) {
+            unsigned char *left = merkle_node(tree, level - 1, 2 * i);
+            if (2 * i + 1 < below) {
+                hash_node(left, left + MERKLE_HASH_SIZE, merkle_node(tree, level, i));
+            } else {
+                memcpy(merkle_node(tree, level, i), left, MERKLE_HASH_SIZE);  // Odd node out is promoted
+            }
+        }
+    }
+}
+
+// Function to hash a whole file into a tree
+int merkle_build(MerkleTree *tree, int fd, long file_size, long piece_size) {
+    if (merkle_init(tree, file_size, piece_size) != 0 ||
+        merkle_hash_pieces(tree, fd, 0, tree->leaf_count) != 0) {
+        merkle_free(tree);
+        return -1;
+    }
+    merkle_finish(tree);
+    return 0;
+}
+
+// Function to build a tree from the digests of every piece
+int merkle_build_from_digests(MerkleTree *tree, const unsigned char *digests, long file_size, long piece_size) {
+    if (merkle_init(tree, file_size, piece_size) != 0) {
+        merkle_free(tree);
+        return -1;
+    }
+    for (long index = 0; index < tree->leaf_count; index++) {
+        merkle_set_piece(tree, index, digests + index * MERKLE_HASH_SIZE);
+    }
+    merkle_finish(tree);
+    return 0;
+}
+
+// Function to get the root hash of a finished tree
+const unsigned char *merkle_root(const MerkleTree *tree) {
+    return merkle_node(tree, tree->levels - 1, 0);
+}
+
+// Function to collect the hashes proving a run of leaves belongs to the root
+int merkle_range_proof(const MerkleTree *tree, long first, long count, unsigned char *proof) {
+    int proof_count = 0;
+    if (count <= 0) {
+        return 0;
+    }
+
+    // Per level: the left neighbour of the run if it starts on a right child,
+    // the right neighbour if it ends on a left child that has one
+    long lo = first;
+    long hi = first + count;
+    for (int level = 0; level < tree->levels - 1; level++) {
+        if (lo & 1) {
+            memcpy(proof + proof_count++ * MERKLE_HASH_SIZE, merkle_node(tree, level, lo - 1), MERKLE_HASH_SIZE);
+            lo--;
+        }
+        if ((hi & 1) && hi < tree->level_width[level]) {
+            memcpy(proof + proof_count++ * MERKLE_HASH_SIZE, merkle_node(tree, level, hi), MERKLE_HASH_SIZE);
+            hi++;
+        }
+        lo /= 2;
+        hi = (hi + 1) / 2;
+    }
+    return proof_count;
+}
+
+// Function to check a run of leaves against a root with a range proof
+int merkle_verify_range(const unsigned char *root, long leaf_count, long first, long count,
+                        const unsigned char *leaves, const unsigned char *proof, int proof_count) {
+    if (count <= 0) {
+        return proof_count == 0 ? 0 : -1;
+    }
+    if (first < 0 || leaf_count <= 0 || count > leaf_count || first > leaf_count - count) {
+        return -1;
+    }
+
+    // Room for the run plus a neighbour on each side; nodes[j] is node lo + j
+    unsigned char *nodes = malloc((count + 2) * MERKLE_HASH_SIZE);
+    if (!nodes) {
+        return -1;
+    }
+    memcpy(nodes, leaves, count * MERKLE_HASH_SIZE);
+
+    // Replay merkle_range_proof, hashing the run upwards
+    long lo = first;
+    long hi = first + count;
+    long width = leaf_count;
+    int used = 0;
+    int result = 0;
+    while (width > 1 && result == 0) {
+        if (lo & 1) {
+            if (used >= proof_count) {
+                result = -1;
+                break;
+            }
+            memmove(nodes + MERKLE_HASH_SIZE, nodes, (hi - lo) * MERKLE_HASH_SIZE);
+            memcpy(nodes, proof + used++ * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+            lo--;
+        }
+        if ((hi & 1) && hi < width) {
+            if (used >= proof_count) {
+                result = -1;
+                break;
+            }
+            memcpy(nodes + (hi - lo) * MERKLE_HASH_SIZE, proof + used++ * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+            hi++;
+        }
+
+        long parents = 0;
+        for (long i = lo; i < hi; i += 2) {
+            unsigned char *left = nodes + (i - lo) * MERKLE_HASH_SIZE;
+            if (i + 1 < hi) {
+                hash_node(left, left + MERKLE_HASH_SIZE, nodes + parents * MERKLE_HASH_SIZE);
+            } else {
+                memmove(nodes + parents * MERKLE_HASH_SIZE, left, MERKLE_HASH_SIZE);
+            }
+            parents++;
+        }
+        lo /= 2;
+        hi = (hi + 1) / 2;
+        width = (width + 1) / 2;
+    }
+
+    if (result == 0 && (used != proof_count || memcmp(nodes, root, MERKLE_HASH_SIZE) != 0)) {
+        result = -1;
+    }
+    free(nodes);
+    return result;
+}
+
+// Function to release a tree
+void merkle_free(MerkleTree *tree) {
+    free(tree->nodes);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// Function to append a manifest request
+void manifest_put_request(ByteBuf *buf, const char *filename, long first, long count) {
+    Payload payload = {0};
+    payload.operation = OP_MANIFEST;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+
+    size_t start = frame_begin(buf, OP_MANIFEST, 0);
+    frame_put_payload_fields(buf, &payload);
+    bytebuf_put_varint(buf, first);
+    bytebuf_put_varint(buf, count);
+    frame_end(buf, start);
+}
+
+// Function to decode the leaf run of a manifest request
+int manifest_parse_request(int sock, long *first, long *count) {
+    Session *session = session_get(sock);
+    ByteReader reader = { session->args, session->args + session->args_len, 0 };
+    uint64_t wanted_first = reader_varint(&reader);
+    uint64_t wanted_count = reader_varint(&reader);
+    if (reader.failed || wanted_first > LONG_MAX || wanted_count > LONG_MAX) {
+        return -1;
+    }
+    *first = (long)wanted_first;
+    *count = (long)wanted_count;
+    return 0;
+}
+
+// Function to append the manifest reply for a run of leaves
+void manifest_put_reply(int sock, ByteBuf *buf, int status, const MerkleTree *tree, long first, long count) {
+    size_t start = frame_begin(buf, OP_MANIFEST, session_get(sock)->request_id);
+    bytebuf_put_svarint(buf, status);
+    if (status != STAT_FILE_FOUND) {
+        frame_end(buf, start);
+        return;
+    }
+
+    // Clip the run to the tree and to one reply
+    if (first > tree->leaf_count) {
+        first = tree->leaf_count;
+    }
+    if (count > tree->leaf_count - first) {
+        count = tree->leaf_count - first;
+    }
+    if (count > MERKLE_MAX_REPLY_LEAVES) {
+        count = MERKLE_MAX_REPLY_LEAVES;
+    }
+
+    unsigned char proof[MERKLE_MAX_PROOF * MERKLE_HASH_SIZE];
+    int proof_count = merkle_range_proof(tree, first, count, proof);
+
+    bytebuf_put_svarint(buf, tree->file_size);
+    bytebuf_put_varint(buf, tree->piece_size);
+    bytebuf_put_varint(buf, tree->leaf_count);
+    bytebuf_put_string(buf, merkle_root(tree), MERKLE_HASH_SIZE);
+    bytebuf_put_varint(buf, first);
+    bytebuf_put_string(buf, tree->nodes + first * MERKLE_HASH_SIZE, count * MERKLE_HASH_SIZE);
+    bytebuf_put_string(buf, proof, proof_count * MERKLE_HASH_SIZE);
+    frame_end(buf, start);
+}
+
+// Function to decode and verify a manifest reply
+int manifest_get_reply(const Frame *frame, Manifest *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+    ByteReader reader = { frame->body, frame->body + frame->body_len, 0 };
+    manifest->status = (int)reader_svarint(&reader);
+    if (reader.failed || frame->opcode != OP_MANIFEST) {
+        return -1;
+    }
+    if (manifest->status != STAT_FILE_FOUND) {
+        return 0;
+    }
+
+    manifest->file_size = (long)reader_svarint(&reader);
+    uint64_t piece_size = reader_varint(&reader);
+    uint64_t leaf_count = reader_varint(&reader);
+    size_t root_len, leaves_len, proof_len;
+    const unsigned char *root = reader_string(&reader, &root_len);
+    uint64_t first = reader_varint(&reader);
+    const unsigned char *leaves = reader_string(&reader, &leaves_len);
+    const unsigned char *proof = reader_string(&reader, &proof_len);
+    if (reader.failed || root_len != MERKLE_HASH_SIZE || piece_size == 0 || piece_size > MAX_PIECE_SIZE ||
+        leaf_count > LONG_MAX || first > leaf_count || leaves_len % MERKLE_HASH_SIZE != 0 ||
+        proof_len % MERKLE_HASH_SIZE != 0 || proof_len > MERKLE_MAX_PROOF * MERKLE_HASH_SIZE) {
+        return -1;
+    }
+    long expected_leaves = manifest->file_size > 0 ? (manifest->file_size + (long)piece_size - 1) / (long)piece_size : 1;
+    if (manifest->file_size < 0 || leaf_count != (uint64_t)expected_leaves) {
+        return -1;
+    }
+
+    manifest->piece_size = (long)piece_size;
+    manifest->leaf_count = (long)leaf_count;
+    memcpy(manifest->root, root, MERKLE_HASH_SIZE);
+    manifest->first = (long)first;
+    manifest->count = leaves_len / MERKLE_HASH_SIZE;
+    manifest->proof_count = proof_len / MERKLE_HASH_SIZE;
+
+    // The leaves must hash up to the root before anyone relies on them
+    if (merkle_verify_range(manifest->root, manifest->leaf_count, manifest->first, manifest->count,
+                            leaves, proof, manifest->proof_count) != 0) {
+        return -1;
+    }
+
+    manifest->leaves = malloc(leaves_len ? leaves_len : 1);
+    manifest->proof = malloc(proof_len ? proof_len : 1);
+    if (!manifest->leaves || !manifest->proof) {
+        manifest_free(manifest);
+        return -1;
+    }
+    memcpy(manifest->leaves, leaves, leaves_len);
+    memcpy(manifest->proof, proof, proof_len);
+    return 0;
+}
+
+// Function to release a manifest
+void manifest_free(Manifest *manifest) {
+    free(manifest->leaves);
+    free(manifest->proof);
+    manifest->leaves = NULL;
+    manifest->proof = NULL;
+}
@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+
+#include "metaindex.h"
+#include "logger.h"
+
+#define META_INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define META_EVENT_BUFFER (64 * 1024)   // Bytes of inotify events read at a time
+#define META_RESCAN_POLL_MS 1000        // How often the watcher checks for a requested rescan while idle
+
+// Header at the start of the shared mapping
+typedef struct {
+    pthread_mutex_t lock;   // Robust, process-shared; guards everything in the mapping
+    int ready;              // Set while the table describes the directory (lookups go to the filesystem otherwise)
+    int rescan;             // Set when the table must be rebuilt from the directory
+    int full;               // Set when a file didn't fit in the table or the name arena
+    uint32_t slots;         // Table size (power of two)
+    uint32_t used;          // Entries in use
+    uint64_t arena_size;    // Bytes of name arena
+    uint64_t arena_used;    // First free byte of the arena (names of removed files stay until a rescan)
+    uint64_t generation;    // Last generation handed out
+} MetaHeader;
+
+// Stat information of one regular file, found by name with linear probing
+typedef struct {
+    uint64_t generation;    // Changes whenever the file does (0 for an empty slot)
+    uint64_t name;          // Arena offset of the null-terminated name
+    uint32_t hash;          // FNV-1a of the name
+    uint32_t mode;          // st_mode
+    uint64_t dev;           // Device of the file
+    uint64_t ino;           // Inode of the file
+    int64_t size;           // Size in bytes
+    int64_t mtime_sec;      // Modification time
+    int64_t mtime_nsec;
+} MetaEntry;
+
+// A file this process keeps open for repeated requests
+typedef struct {
+    int used;                     // Non-zero while the slot holds a descriptor
+    int fd;                       // The open file
+    int refs;                     // Requests using the descriptor
+    char filename[MAX_FILENAME];  // Name in the shared directory (empty once the file changed)
+    uint64_t generation;          // Index generation of the file when it was opened
+    struct stat file_stat;        // Its stat information
+    uint64_t last_used;           // Clock value of the last request, for eviction
+} OpenFile;
+
+static MetaHeader *meta = NULL;         // Shared mapping (NULL while there is no index)
+static MetaEntry *meta_entries;         // The table, after the header
+static char *meta_names;                // The name arena, after the table
+static char meta_dir[MAX_FILENAME];     // The shared directory
+static int meta_dir_fd = -1;            // The shared directory, for fstatat
+static int meta_inotify = -1;           // Watch on the shared directory
+
+static OpenFile open_files[META_INDEX_FD_CACHE];  // Per process; children start with an empty cache
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t open_files_clock;
+
+// Function to hash a file name
+static uint32_t meta_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = name; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;  // FNV-1a
+    }
+    return hash;
+}
+
+// Function to take the index lock
+static int meta_lock(void) {
+    int result = pthread_mutex_lock(&meta->lock);
+    if (result == EOWNERDEAD) {
+        // The holder died mid-update; the table may be inconsistent, so rebuild it
+        pthread_mutex_consistent(&meta->lock);
+        meta->ready = 0;
+        meta->rescan = 1;
+        result = 0;
+    }
+    return result == 0 ? 0 : -1;
+}
+
+// Function to find a file's slot, or the empty slot it would take
+static MetaEntry *meta_find(const char *name, uint32_t hash) {
+    uint32_t mask = meta->slots - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        MetaEntry *entry = &meta_entries[i];
+        if (!entry->generation || (entry->hash == hash && strcmp(meta_names + entry->name, name) == 0)) {
+            return entry;
+        }
+    }
+}
+
+// Function to empty a slot, moving later entries of its probe run back so lookups still find them
+static void meta_delete(MetaEntry *entry) {
+    uint32_t mask = meta->slots - 1;
+    uint32_t hole = entry - meta_entries;
+    for (uint32_t i = (hole + 1) & mask; meta_entries[i].generation; i = (i + 1) & mask) {
+        uint32_t home = meta_entries[i].hash & mask;
+        // An entry moves into the hole unless its home lies cyclically between the hole and it
+        int stays = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!stays) {
+            meta_entries[hole] = meta_entries[i];
+            hole = i;
+        }
+    }
+    memset(&meta_entries[hole], 0, sizeof(MetaEntry));
+    meta->used--;
+}
+
+// Function to store a file's stat information (with the lock held)
+static void meta_put(const char *name, const struct stat *file_stat) {
+    uint32_t hash = meta_hash(name);
+    MetaEntry *entry = meta_find(name, hash);
+    if (entry->generation && entry->dev == (uint64_t)file_stat->st_dev && entry->ino == (uint64_t)file_stat->st_ino &&
+        entry->size == file_stat->st_size && entry->mtime_sec == file_stat->st_mtim.tv_sec &&
+        entry->mtime_nsec == file_stat->st_mtim.tv_nsec && entry->mode == file_stat->st_mode) {
+        return;  // Unchanged; open descriptors stay valid
+    }
+
+    if (!entry->generation) {
+        // Keep the table at most three quarters full so probe runs stay short
+        size_t len = strlen(name) + 1;
+        if ((meta->used + 1) * 4 > meta->slots * 3 || meta->arena_used + len > meta->arena_size) {
+            if (!meta->full && meta->ready) {
+                meta->rescan = 1;  // Removed names may have left enough room once the arena is compacted
+            }
+            meta->full = 1;
+            meta->ready = 0;
+            return;
+        }
+        memcpy(meta_names + meta->arena_used, name, len);
+        entry->name = meta->arena_used;
+        entry->hash = hash;
+        meta->arena_used += len;
+        meta->used++;
+    }
+    entry->mode = file_stat->st_mode;
+    entry->dev = file_stat->st_dev;
+    entry->ino = file_stat->st_ino;
+    entry->size = file_stat->st_size;
+    entry->mtime_sec = file_stat->st_mtim.tv_sec;
+    entry->mtime_nsec = file_stat->st_mtim.tv_nsec;
+    entry->generation = ++meta->generation;
+}
+
+// Function to bring one file's entry up to date with the directory
+static void meta_update(const char *name) {
+    struct stat file_stat;
+    int found = fstatat(meta_dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(file_stat.st_mode);
+    if (meta_lock() != 0) {
+        return;
+    }
+    if (found) {
+        meta_put(name, &file_stat);
+    } else {
+        MetaEntry *entry = meta_find(name, meta_hash(name));
+        if (entry->generation) {
+            meta_delete(entry);
+        }
+    }
+    pthread_mutex_unlock(&meta->lock);
+}
+
+// Function to rebuild the table from the directory
+static void meta_scan(void) {
+    if (meta_lock() != 0) {
+        return;
+    }
+    memset(meta_entries, 0, (size_t)meta->slots * sizeof(MetaEntry));
+    meta->used = 0;
+    meta->arena_used = 0;
+    meta->ready = meta->rescan = meta->full = 0;
+    pthread_mutex_unlock(&meta->lock);
+
+    // Events that arrive meanwhile are queued by inotify and applied after the scan
+    DIR *dir = opendir(meta_dir);
+    if (!dir) {
+        log_message(LOG_ERROR, "Error scanning shared directory %s: %s", meta_dir, strerror(errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN) {
+            meta_update(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    if (meta_lock() != 0) {
+        return;
+    }
+    if (meta->full) {
+        meta->rescan = 0;  // Retrying wouldn't help; serve from the filesystem
+        log_message(LOG_ERROR, "Shared directory %s outgrew its metadata index; looking files up on disk", meta_dir);
+    } else {
+        meta->ready = 1;
+        log_message(LOG_INFO, "Indexed metadata of %u files in %s", meta->used, meta_dir);
+    }
+    pthread_mutex_unlock(&meta->lock);
+}
+
+// Function to apply inotify events to the index for as long as the directory exists
+static void *meta_watch_main(void *arg) {
+    (void)arg;
+    char *events = malloc(META_EVENT_BUFFER);
+    if (!events) {
+        log_message(LOG_ERROR, "Out of memory starting metadata watcher");
+        return NULL;
+    }
+    meta_scan();
+
+    while (1) {
+        struct pollfd watch = { meta_inotify, POLLIN, 0 };
+        int result = poll(&watch, 1, META_RESCAN_POLL_MS);
+        if (meta->rescan) {
+            meta_scan();
+        }
+        if (result <= 0) {
+            continue;
+        }
+        ssize_t n = read(meta_inotify, events, META_EVENT_BUFFER);
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            break;
+        }
+
+        int rescan = 0, gone = 0;
+        for (ssize_t at = 0; at < n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)(events + at);
+            at += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = 1;  // Events were lost
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+                gone = 1;
+            } else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                meta_update(event->name);
+            }
+        }
+        if (gone) {
+            break;
+        }
+        if (rescan) {
+            meta_scan();
+        }
+    }
+
+    // Without a watch the table can't be trusted any more
+    if (meta_lock() == 0) {
+        meta->ready = 0;
+        pthread_mutex_unlock(&meta->lock);
+    }
+    log_message(LOG_ERROR, "Stopped watching shared directory %s; looking files up on disk", meta_dir);
+    free(events);
+    return NULL;
+}
+
+// Function to index the shared directory and start watching it
+int meta_index_open(const char *dir) {
+    if (strlen(dir) >= sizeof(meta_dir)) {
+        log_message(LOG_ERROR, "Shared directory path too long for metadata index: %s", dir);
+        return -1;
+    }
+    strcpy(meta_dir, dir);
+
+    // Size the table for twice the files there are now, so the directory can grow
+    DIR *listing = opendir(dir);
+    if (!listing) {
+        log_message(LOG_ERROR, "Error opening shared directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    uint64_t files = 0;
+    while (readdir(listing) != NULL) {
+        files++;
+    }
+    closedir(listing);
+    uint64_t slots = META_INDEX_MIN_SLOTS;
+    while (slots < files * 2 && slots < (1u << 31)) {
+        slots *= 2;
+    }
+
+    size_t entries_offset = (sizeof(MetaHeader) + 63) & ~(size_t)63;
+    size_t names_offset = entries_offset + slots * sizeof(MetaEntry);
+    size_t size = names_offset + slots * META_INDEX_NAME_BYTES;
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        log_message(LOG_ERROR, "Error mapping metadata index: %s", strerror(errno));
+        return -1;
+    }
+    MetaHeader *header = mapping;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int result = pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    header->slots = slots;
+    header->arena_size = slots * META_INDEX_NAME_BYTES;
+
+    // The watch comes first so nothing that changes during the first scan is missed
+    pthread_t thread;
+    meta_dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    meta_inotify = inotify_init1(IN_CLOEXEC);
+    if (result != 0 || meta_dir_fd < 0 || meta_inotify < 0 || inotify_add_watch(meta_inotify, dir, META_INDEX_EVENTS) < 0) {
+        log_message(LOG_ERROR, "Error watching shared directory %s: %s", dir, strerror(errno));
+    } else {
+        meta = header;
+        meta_entries = (MetaEntry *)((char *)mapping + entries_offset);
+        meta_names = (char *)mapping + names_offset;
+        if (pthread_create(&thread, NULL, meta_watch_main, NULL) == 0) {
+            pthread_detach(thread);
+            return 0;
+        }
+        log_message(LOG_ERROR, "Error starting metadata watcher");
+        meta = NULL;
+    }
+    if (meta_dir_fd >= 0) {
+        close(meta_dir_fd);
+        meta_dir_fd = -1;
+    }
+    if (meta_inotify >= 0) {
+        close(meta_inotify);
+        meta_inotify = -1;
+    }
+    munmap(mapping, size);
+    return -1;
+}
+
+// Function to find the name in the index of a path into the shared directory (NULL if it has none)
+static const char *meta_name(const char *file_path) {
+    if (!meta) {
+        return NULL;
+    }
+    size_t dir_len = strlen(meta_dir);
+    const char *name = file_path + dir_len + 1;
+    if (strncmp(file_path, meta_dir, dir_len) != 0 || file_path[dir_len] != '/' || name[0] == '\0' || strchr(name, '/')) {
+        return NULL;
+    }
+    return name;
+}
+
+// Function to look a file up in the index, returning its generation (0 if the index can't answer)
+static uint64_t meta_lookup(const char *name, struct stat *file_stat) {
+    if (!name || meta_lock() != 0) {
+        return 0;
+    }
+    uint64_t generation = 0;
+    if (meta->ready) {
+        const MetaEntry *entry = meta_find(name, meta_hash(name));
+        if (entry->generation) {
+            memset(file_stat, 0, sizeof(*file_stat));
+            file_stat->st_dev = entry->dev;
+            file_stat->st_ino = entry->ino;
+            file_stat->st_mode = entry->mode;
+            file_stat->st_nlink = 1;
+            file_stat->st_size = entry->size;
+            file_stat->st_mtim.tv_sec = entry->mtime_sec;
+            file_stat->st_mtim.tv_nsec = entry->mtime_nsec;
+            generation = entry->generation;
+        }
+    }
+    pthread_mutex_unlock(&meta->lock);
+    return generation;
+}
+
+// Function to get the stat information of a file in the shared directory
+int meta_index_stat(const char *file_path, struct stat *file_stat) {
+    if (meta_lookup(meta_name(file_path), file_stat) != 0) {
+        return 0;
+    }
+
+    // Paths the index doesn't hold (missing files, symlinks, subdirectories) are left to the filesystem
+    return stat(file_path, file_stat);
+}
+
+// Function to build the newline-separated list of files from the index
+ssize_t meta_index_list(ByteBuf *file_list, size_t limit) {
+    if (!meta || meta_lock() != 0) {
+        return -1;
+    }
+    if (!meta->ready) {
+        pthread_mutex_unlock(&meta->lock);
+        return -1;
+    }
+
+    size_t length = 0;
+    for (uint32_t i = 0; i < meta->slots; i++) {
+        if (!meta_entries[i].generation) {
+            continue;
+        }
+        const char *name = meta_names + meta_entries[i].name;
+        size_t name_length = strlen(name);
+        if (length + name_length + 1 > limit) {
+            log_message(LOG_INFO, "File list too long, truncating");
+            break;
+        }
+        bytebuf_put(file_list, name, name_length);
+        bytebuf_put(file_list, "\n", 1);
+        length += name_length + 1;
+    }
+    pthread_mutex_unlock(&meta->lock);
+    return file_list->failed ? -1 : (ssize_t)length;
+}
+
+// Function to record a change this process made to a file
+void meta_index_refresh(const char *file_path) {
+    const char *name = meta_name(file_path);
+    if (name) {
+        meta_update(name);
+    }
+}
+
+// Function to free a cached descriptor nobody uses (with the cache lock held)
+static void open_file_drop(OpenFile *file) {
+    close(file->fd);
+    memset(file, 0, sizeof(*file));
+}
+
+// Function to hand out the cached descriptor of an unchanged file (-1 if none)
+static int open_file_cached(const char *name, uint64_t generation, struct stat *file_stat) {
+    if (generation == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < META_INDEX_FD_CACHE; i++) {
+        OpenFile *file = &open_files[i];
+        if (!file->used || strcmp(file->filename, name) != 0) {
+            continue;
+        }
+        if (file->generation == generation) {
+            file->refs++;
+            file->last_used = ++open_files_clock;
+            *file_stat = file->file_stat;
+            pthread_mutex_unlock(&open_files_lock);
+            return file->fd;
+        }
+        // The file changed; the descriptor goes once its last request is done
+        file->filename[0] = '\0';
+        if (file->refs == 0) {
+            open_file_drop(file);
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return -1;
+}
+
+// Function to open a file of the shared directory only if the fd cache holds it
+int meta_index_open_cached(const char *file_path, struct stat *file_stat) {
+    struct stat indexed;
+    const char *name = meta_name(file_path);
+    return name ? open_file_cached(name, meta_lookup(name, &indexed), file_stat) : -1;
+}
+
+// Function to open a file of the shared directory through the fd cache
+int meta_index_open_file(const char *file_path, struct stat *file_stat) {
+    struct stat indexed;
+    const char *name = meta_name(file_path);
+    uint64_t generation = meta_lookup(name, &indexed);
+    int cached = open_file_cached(name, generation, file_stat);
+    if (cached >= 0) {
+        return cached;
+    }
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, file_stat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // Only a file the index agrees with is kept; otherwise the index hasn't caught up yet
+    if (generation == 0 || indexed.st_dev != file_stat->st_dev || indexed.st_ino != file_stat->st_ino ||
+        indexed.st_size != file_stat->st_size || indexed.st_mtim.tv_sec != file_stat->st_mtim.tv_sec ||
+        indexed.st_mtim.tv_nsec != file_stat->st_mtim.tv_nsec) {
+        return fd;
+    }
+    pthread_mutex_lock(&open_files_lock);
+    OpenFile *slot = NULL;
+    for (int i = 0; i < META_INDEX_FD_CACHE; i++) {
+        OpenFile *file = &open_files[i];
+        if (!file->used) {
+            slot = file;
+            break;
+        }
+        if (file->refs == 0 && (!slot || file->last_used < slot->last_used)) {
+            slot = file;  // Least recently used among the idle ones
+        }
+    }
+    if (slot) {
+        if (slot->used) {
+            open_file_drop(slot);
+        }
+        slot->used = 1;
+        slot->fd = fd;
+        slot->refs = 1;
+        strcpy(slot->filename, name);
+        slot->generation = generation;
+        slot->file_stat = *file_stat;
+        slot->last_used = ++open_files_clock;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return fd;
+}
+
+// Function to release a descriptor from meta_index_open_file
+void meta_index_close_file(int fd) {
+    if (fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < META_INDEX_FD_CACHE; i++) {
+        OpenFile *file = &open_files[i];
+        if (file->used && file->fd == fd) {
+            if (--file->refs == 0 && file->filename[0] == '\0') {
+                open_file_drop(file);
+            }
+            pthread_mutex_unlock(&open_files_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    close(fd);
+}
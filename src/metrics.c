@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "logger.h"
+
+#define METRICS_REQUEST_BYTES 2048  // Most of a scrape request that is read
+
+// Counters and histograms of one opcode
+typedef struct {
+    uint64_t requests;                     // Requests handled
+    uint64_t errors;                       // Requests that failed
+    uint64_t bytes_sent;                   // File data sent
+    uint64_t bytes_received;               // File data received
+    uint64_t transfers;                    // File streams
+    uint64_t first_bytes;                  // Streams that started
+    uint64_t latency_sum;                  // Microseconds
+    uint64_t first_byte_sum;               // Microseconds
+    uint64_t throughput_sum;               // Bytes per second
+    uint64_t latency[METRICS_BUCKETS];     // Request latency in microseconds
+    uint64_t first_byte[METRICS_BUCKETS];  // Time to the first byte of a stream in microseconds
+    uint64_t throughput[METRICS_BUCKETS];  // Throughput of a stream in bytes per second
+} OpMetrics;
+
+// One copy of every metric; recording picks a shard by thread id
+typedef struct {
+    OpMetrics ops[METRICS_OPS];
+    int64_t connections_active;
+    uint64_t connections_total;
+    uint64_t cpu_us;  // CPU time of forked children that have finished
+} __attribute__((aligned(64))) MetricsShard;
+
+static MetricsShard *metrics = NULL;   // Shared mapping (NULL while metrics are off)
+static __thread int shard_index = -1;  // This thread's shard (reset in forked children)
+static int metrics_listener = -1;      // Scrape endpoint, served by a thread of the main process
+
+// Function to give a forked child its own shard and drop its copy of the endpoint
+static void metrics_after_fork_child(void) {
+    shard_index = -1;
+    if (metrics_listener >= 0) {
+        close(metrics_listener);
+        metrics_listener = -1;
+    }
+}
+
+// Function to map the shared counters and histograms
+int metrics_open(void) {
+    void *mapping = mmap(NULL, sizeof(MetricsShard) * METRICS_SHARDS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        log_message(LOG_ERROR, "Error mapping metrics: %s", strerror(errno));
+        return -1;
+    }
+    metrics = mapping;
+    pthread_atfork(NULL, NULL, metrics_after_fork_child);
+    return 0;
+}
+
+// Function to get the calling thread's operation counters
+static OpMetrics *op_metrics(int opcode) {
+    if (shard_index < 0) {
+        shard_index = (int)(syscall(SYS_gettid) % METRICS_SHARDS);
+    }
+    return &metrics[shard_index].ops[opcode > 0 && opcode < METRICS_OPS ? opcode : 0];
+}
+
+// Function to find the histogram bucket of a value: exact below METRICS_SUB_BUCKETS, then log-linear
+static int bucket_of(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);  // At least 3
+    int bucket = (magnitude - 2) * METRICS_SUB_BUCKETS + (int)((value >> (magnitude - 3)) & (METRICS_SUB_BUCKETS - 1));
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+// Function to find the first value past a histogram bucket
+static uint64_t bucket_end(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+    int magnitude = bucket / METRICS_SUB_BUCKETS + 2;
+    return (uint64_t)(METRICS_SUB_BUCKETS + 1 + bucket % METRICS_SUB_BUCKETS) << (magnitude - 3);
+}
+
+// Function to add a value to a histogram and its sum
+static void histogram_add(uint64_t *buckets, uint64_t *sum, uint64_t value) {
+    __atomic_add_fetch(&buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(sum, value, __ATOMIC_RELAXED);
+}
+
+// Function to read the monotonic clock for a later recording call
+uint64_t metrics_now(void) {
+    struct timespec now;
+    if (!metrics) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Function to count a handled request and its latency
+void metrics_request(int opcode, uint64_t start_ns) {
+    if (!metrics || start_ns == 0) {
+        return;
+    }
+    OpMetrics *op = op_metrics(opcode);
+    __atomic_add_fetch(&op->requests, 1, __ATOMIC_RELAXED);
+    histogram_add(op->latency, &op->latency_sum, (metrics_now() - start_ns) / 1000);
+}
+
+// Function to count a failed request
+void metrics_error(int opcode) {
+    if (metrics) {
+        __atomic_add_fetch(&op_metrics(opcode)->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to record a file stream
+void metrics_transfer(int opcode, uint64_t start_ns, uint64_t first_byte_ns, uint64_t bytes, int sending) {
+    if (!metrics || start_ns == 0) {
+        return;
+    }
+    uint64_t now = metrics_now();
+    OpMetrics *op = op_metrics(opcode);
+    __atomic_add_fetch(sending ? &op->bytes_sent : &op->bytes_received, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&op->transfers, 1, __ATOMIC_RELAXED);
+    if (first_byte_ns != 0) {
+        __atomic_add_fetch(&op->first_bytes, 1, __ATOMIC_RELAXED);
+        histogram_add(op->first_byte, &op->first_byte_sum, (first_byte_ns - start_ns) / 1000);
+    }
+    uint64_t elapsed = now - (first_byte_ns != 0 ? first_byte_ns : start_ns);
+    if (bytes > 0 && elapsed > 0) {
+        histogram_add(op->throughput, &op->throughput_sum, (uint64_t)((double)bytes * 1e9 / elapsed));
+    }
+}
+
+// Function to count a connection opening or closing
+void metrics_connection(int delta) {
+    if (!metrics) {
+        return;
+    }
+    if (shard_index < 0) {
+        op_metrics(0);
+    }
+    __atomic_add_fetch(&metrics[shard_index].connections_active, delta, __ATOMIC_RELAXED);
+    if (delta > 0) {
+        __atomic_add_fetch(&metrics[shard_index].connections_total, delta, __ATOMIC_RELAXED);
+    }
+}
+
+// Helper function to read the CPU time the calling process has used so far
+static uint64_t process_cpu_us(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Function to count the CPU time of a forked child that is about to exit
+void metrics_process_exit(void) {
+    if (!metrics) {
+        return;
+    }
+    if (shard_index < 0) {
+        op_metrics(0);
+    }
+    __atomic_add_fetch(&metrics[shard_index].cpu_us, process_cpu_us(), __ATOMIC_RELAXED);
+}
+
+// Helper function to append a formatted line
+static void put_line(ByteBuf *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0) {
+        bytebuf_put(out, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+    }
+}
+
+// Helper function to append the HELP and TYPE lines of a metric family
+static void put_family(ByteBuf *out, const char *name, const char *type, const char *help) {
+    put_line(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Helper function to append one histogram series, scaling its unit into the exported one
+static void put_histogram(ByteBuf *out, const char *name, const char *op, const uint64_t *buckets, uint64_t sum, double scale) {
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        count += buckets[i];
+        if ((i + 1) % METRICS_SUB_BUCKETS == 0) {
+            put_line(out, "%s_bucket{op=\"%s\",le=\"%.9g\"} %llu\n", name, op, bucket_end(i) * scale, (unsigned long long)count);
+        }
+    }
+    put_line(out, "%s_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", name, op, (unsigned long long)count);
+    put_line(out, "%s_sum{op=\"%s\"} %.9g\n", name, op, sum * scale);
+    put_line(out, "%s_count{op=\"%s\"} %llu\n", name, op, (unsigned long long)count);
+}
+
+// Function to append every metric in the Prometheus text format
+void metrics_render(ByteBuf *out) {
+    if (!metrics) {
+        return;
+    }
+
+    // Shards are summed into one snapshot; concurrent updates land in this scrape or the next
+    OpMetrics *totals = calloc(METRICS_OPS, sizeof(OpMetrics));
+    if (!totals) {
+        out->failed = 1;
+        return;
+    }
+    int64_t active = 0;
+    uint64_t connections = 0;
+    uint64_t cpu_us = process_cpu_us();  // The rendering process is the server itself: the accept loop or every reactor thread
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        const uint64_t *from = (const uint64_t *)metrics[s].ops;
+        uint64_t *to = (uint64_t *)totals;
+        for (size_t i = 0; i < METRICS_OPS * sizeof(OpMetrics) / sizeof(uint64_t); i++) {
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+        active += __atomic_load_n(&metrics[s].connections_active, __ATOMIC_RELAXED);
+        connections += __atomic_load_n(&metrics[s].connections_total, __ATOMIC_RELAXED);
+        cpu_us += __atomic_load_n(&metrics[s].cpu_us, __ATOMIC_RELAXED);
+    }
+
+    put_family(out, "yats_connections_active", "gauge", "Client connections open now.");
+    put_line(out, "yats_connections_active %lld\n", (long long)active);
+    put_family(out, "yats_connections_total", "counter", "Client connections accepted.");
+    put_line(out, "yats_connections_total %llu\n", (unsigned long long)connections);
+    put_family(out, "yats_cpu_seconds_total", "counter", "CPU time of the server and of its forked children that have finished.");
+    put_line(out, "yats_cpu_seconds_total %.6f\n", cpu_us / 1e6);
+
+    // Only opcodes that have been used get series
+    static const struct { const char *name, *help; size_t field; } counters[] = {
+        { "yats_requests_total", "Requests handled, by opcode.", offsetof(OpMetrics, requests) },
+        { "yats_request_errors_total", "Requests that failed or were refused, by opcode.", offsetof(OpMetrics, errors) },
+        { "yats_sent_bytes_total", "File data sent, by opcode.", offsetof(OpMetrics, bytes_sent) },
+        { "yats_received_bytes_total", "File data received, by opcode.", offsetof(OpMetrics, bytes_received) },
+        { "yats_transfers_total", "File streams, by opcode.", offsetof(OpMetrics, transfers) },
+    };
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        put_family(out, counters[c].name, "counter", counters[c].help);
+        for (int i = 0; i < METRICS_OPS; i++) {
+            uint64_t value = *(const uint64_t *)((const char *)&totals[i] + counters[c].field);
+            if (totals[i].requests || totals[i].errors || totals[i].transfers) {
+                put_line(out, "%s{op=\"%s\"} %llu\n", counters[c].name, opcode_name(i), (unsigned long long)value);
+            }
+        }
+    }
+
+    put_family(out, "yats_request_duration_seconds", "histogram", "Time from a request arriving to its reply or stream finishing.");
+    for (int i = 0; i < METRICS_OPS; i++) {
+        if (totals[i].requests) {
+            put_histogram(out, "yats_request_duration_seconds", opcode_name(i), totals[i].latency, totals[i].latency_sum, 1e-6);
+        }
+    }
+    put_family(out, "yats_first_byte_seconds", "histogram", "Time from a request arriving to the first byte of its file stream.");
+    for (int i = 0; i < METRICS_OPS; i++) {
+        if (totals[i].first_bytes) {
+            put_histogram(out, "yats_first_byte_seconds", opcode_name(i), totals[i].first_byte, totals[i].first_byte_sum, 1e-6);
+        }
+    }
+    put_family(out, "yats_transfer_bytes_per_second", "histogram", "Throughput of file streams from their first byte to their last.");
+    for (int i = 0; i < METRICS_OPS; i++) {
+        if (totals[i].transfers) {
+            put_histogram(out, "yats_transfer_bytes_per_second", opcode_name(i), totals[i].throughput, totals[i].throughput_sum, 1);
+        }
+    }
+    free(totals);
+}
+
+// Helper function to send a whole buffer to a scraper
+static int send_all(int sock, const void *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        data = (const char *)data + n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Function to answer one scrape: any GET of / or /metrics gets the metrics
+static void metrics_answer(int client) {
+    struct timeval timeout = { 1, 0 };  // A stuck scraper mustn't hold up the next one for long
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[METRICS_REQUEST_BYTES];
+    size_t length = 0;
+    while (length < sizeof(request) - 1) {
+        ssize_t n = recv(client, request + length, sizeof(request) - 1 - length, 0);
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    ByteBuf body = {0};
+    int found = strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0;
+    if (found) {
+        metrics_render(&body);
+    }
+    char header[192];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                 found && !body.failed ? "200 OK" : found ? "500 Internal Server Error" : "404 Not Found",
+                                 body.failed ? 0 : body.len);
+    if (send_all(client, header, header_length) == 0 && found && !body.failed) {
+        send_all(client, body.data, body.len);
+    }
+    bytebuf_free(&body);
+}
+
+// Function to answer scrapes one at a time for the life of the server
+static void *metrics_serve_main(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    while (1) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_message(LOG_ERROR, "Error accepting metrics scrape: %s", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+        metrics_answer(client);
+        close(client);
+    }
+    return NULL;
+}
+
+// Function to serve the metrics on a local TCP port or Unix socket
+int metrics_serve(const char *address) {
+    int listener;
+    int is_port = address[0] != '\0' && strspn(address, "0123456789") == strlen(address);
+    if (is_port) {
+        struct sockaddr_in addr = {0};
+        int opt = 1;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // Local scrapers only
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener >= 0 && (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0 ||
+                              bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+            close(listener);
+            listener = -1;
+        }
+    } else {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            log_message(LOG_ERROR, "Metrics socket path too long: %s", address);
+            return -1;
+        }
+        strcpy(addr.sun_path, address);
+        unlink(address);  // Left behind by an earlier run
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+
+    pthread_t thread;
+    if (listener < 0 || listen(listener, 16) != 0 ||
+        pthread_create(&thread, NULL, metrics_serve_main, (void *)(intptr_t)listener) != 0) {
+        log_message(LOG_ERROR, "Error serving metrics on %s: %s", address, strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+    pthread_detach(thread);
+    metrics_listener = listener;
+    log_message(LOG_INFO, "Serving metrics on %s%s", is_port ? "http://127.0.0.1:" : "", address);
+    return 0;
+}
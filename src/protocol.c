@@ -1,38 +1,411 @@
+#include <errno.h>
+#include <pthread.h>
+
 #include "protocol.h"
+#include "frame.h"
+#include "hash.h"
+#include "trace.h"
 
-// Function to send the payload structure
-int send_payload(int sock, const Payload *payload) {
-    // Send the entire payload structure in one go
-    ssize_t sent_bytes = send(sock, payload, sizeof(Payload), 0);
-    if (sent_bytes < 0) {
-        perror("Error sending payload");
+#define SESSION_PAGE_SIZE 1024  // Sessions allocated together
+#define SESSION_PAGES     1024  // Pages per directory
+#define SESSION_DIRS      1024  // Directories in the table (covers every descriptor the kernel hands out, below 2^30)
+#define HASH_READ_SIZE    (64 * 1024)  // Read size while hashing a piece
+
+static Session **session_dirs[SESSION_DIRS];  // Directories and pages are allocated on first use and never freed
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to find the session of a descriptor, allocating its page if needed (NULL if that fails)
+static Session *session_find(int sock) {
+    if (sock < 0 || sock / SESSION_PAGE_SIZE / SESSION_PAGES >= SESSION_DIRS) {
+        return NULL;
+    }
+
+    int dir = sock / SESSION_PAGE_SIZE / SESSION_PAGES;
+    int page = sock / SESSION_PAGE_SIZE % SESSION_PAGES;
+    Session **pages = __atomic_load_n(&session_dirs[dir], __ATOMIC_ACQUIRE);
+    Session *sessions = pages ? __atomic_load_n(&pages[page], __ATOMIC_ACQUIRE) : NULL;
+    if (!sessions) {
+        pthread_mutex_lock(&session_lock);
+        pages = session_dirs[dir];
+        if (!pages && (pages = calloc(SESSION_PAGES, sizeof(Session *))) != NULL) {
+            __atomic_store_n(&session_dirs[dir], pages, __ATOMIC_RELEASE);
+        }
+        sessions = pages ? pages[page] : NULL;
+        if (pages && !sessions && (sessions = calloc(SESSION_PAGE_SIZE, sizeof(Session))) != NULL) {
+            for (int i = 0; i < SESSION_PAGE_SIZE; i++) {
+                sessions[i].piece_size = CHUNK_SIZE;
+            }
+            __atomic_store_n(&pages[page], sessions, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&session_lock);
+        if (!sessions) {
+            return NULL;
+        }
+    }
+    return &sessions[sock % SESSION_PAGE_SIZE];
+}
+
+// Function to get the session state of a connection
+Session *session_get(int sock) {
+    Session *session = session_find(sock);
+    if (!session) {
+        // session_reset allocated it when the descriptor was opened, so only a misuse gets here
+        fprintf(stderr, "No session for socket %d\n", sock);
+        abort();
+    }
+    return session;
+}
+
+// Function to reset the session of a connection to legacy defaults
+int session_reset(int sock) {
+    Session *session = session_find(sock);
+    if (!session) {
+        return -1;
+    }
+    free(session->rbuf);
+    free(session->wbuf);
+    free(session->args);
+    memset(session, 0, sizeof(*session));
+    session->piece_size = CHUNK_SIZE;
+    return 0;
+}
+
+// Function to clamp a proposed piece size to the negotiable range
+long piece_size_agree(long piece_size) {
+    if (piece_size < MIN_PIECE_SIZE) {
+        return MIN_PIECE_SIZE;
+    }
+    if (piece_size > MAX_PIECE_SIZE) {
+        return MAX_PIECE_SIZE;
+    }
+    return piece_size - piece_size % CHUNK_SIZE;  // Keep legacy chunk alignment
+}
+
+// Function to make room for len more bytes in a session buffer
+static int buffer_reserve(unsigned char **data, size_t *cap, size_t used, size_t len) {
+    if (used + len <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : SESSION_READ_SIZE;
+    while (new_cap < used + len) {
+        new_cap *= 2;
+    }
+    unsigned char *grown = realloc(*data, new_cap);
+    if (!grown) {
+        return -1;
+    }
+    *data = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+// Function to send all bytes, looping over partial writes
+static int send_all(int sock, const void *data, size_t len, int flags) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, (const char *)data + sent, len - sent, MSG_NOSIGNAL | flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error sending payload");
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// Function to send bytes, or queue them while the session is corked
+int send_bytes(int sock, const void *data, size_t len) {
+    Session *session = session_get(sock);
+    if (!session->corked) {
+        return send_all(sock, data, len, 0);
+    }
+
+    if (buffer_reserve(&session->wbuf, &session->wbuf_cap, session->wbuf_len, len) != 0) {
+        return -1;
+    }
+    memcpy(session->wbuf + session->wbuf_len, data, len);
+    session->wbuf_len += len;
+    return 0;
+}
+
+// Function to start batching sends
+void session_cork(int sock) {
+    session_get(sock)->corked = 1;
+}
+
+// Function to send everything queued in one go
+int session_uncork(int sock) {
+    Session *session = session_get(sock);
+    session->corked = 0;
+    int result = send_all(sock, session->wbuf, session->wbuf_len, 0);
+    session->wbuf_len = 0;
+    return result;
+}
+
+// Function to read more bytes from the socket into the read-ahead buffer
+ssize_t session_fill(int sock) {
+    Session *session = session_get(sock);
+
+    // Compact consumed bytes away before growing
+    if (session->rbuf_start > 0) {
+        memmove(session->rbuf, session->rbuf + session->rbuf_start, session->rbuf_len - session->rbuf_start);
+        session->rbuf_len -= session->rbuf_start;
+        session->rbuf_start = 0;
+    }
+    if (buffer_reserve(&session->rbuf, &session->rbuf_cap, session->rbuf_len, SESSION_READ_SIZE) != 0) {
+        errno = ENOMEM;
         return -1;
-    } else if (sent_bytes < sizeof(Payload)) {
-        fprintf(stderr, "Partial payload sent: %zd of %zu bytes\n", sent_bytes, sizeof(Payload));
-        return -1;  // Indicate a partial send failure
     }
-    return 0;  // Successful send
+
+    ssize_t n;
+    do {
+        n = recv(sock, session->rbuf + session->rbuf_len, session->rbuf_cap - session->rbuf_len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        session->rbuf_len += n;
+    }
+    return n;
+}
+
+// Function to get the bytes read ahead but not consumed yet
+size_t session_buffered(int sock, const unsigned char **data) {
+    Session *session = session_get(sock);
+    *data = session->rbuf + session->rbuf_start;
+    return session->rbuf_len - session->rbuf_start;
+}
+
+// Function to mark buffered bytes as consumed
+void session_consume(int sock, size_t len) {
+    Session *session = session_get(sock);
+    session->rbuf_start += len;
+    if (session->rbuf_start >= session->rbuf_len) {
+        session->rbuf_start = session->rbuf_len = 0;
+    }
+}
+
+// Function to write bytes read ahead from the socket into a file
+long session_drain_to_file(int sock, int fd, off_t offset, long max) {
+    const unsigned char *data;
+    size_t available = session_buffered(sock, &data);
+    size_t len = available < (size_t)max ? available : (size_t)max;
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd, data + written, len - written, offset + written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    session_consume(sock, len);
+    return len;
+}
+
+// Function to send a payload in the session's wire format
+int send_payload(int sock, const Payload *payload) {
+    ByteBuf buf = {0};
+    payload_put(sock, &buf, payload);
+    int result = buf.failed ? -1 : send_bytes(sock, buf.data, buf.len);
+    bytebuf_free(&buf);
+    return result;
+}
+
+// Function to send bytes that file data follows immediately
+int send_bytes_more(int sock, const void *data, size_t len) {
+    if (session_get(sock)->corked) {
+        return send_bytes(sock, data, len);
+    }
+    return send_all(sock, data, len, MSG_MORE);
+}
+
+// Function to send a payload that file data follows immediately
+int send_payload_more(int sock, const Payload *payload) {
+    ByteBuf buf = {0};
+    payload_put(sock, &buf, payload);
+    int result = buf.failed ? -1 : send_bytes_more(sock, buf.data, buf.len);
+    bytebuf_free(&buf);
+    return result;
+}
+
+// Function to decode a payload from the bytes already read ahead
+int payload_parse(int sock, Payload *payload) {
+    Session *session = session_get(sock);
+    const unsigned char *data;
+    size_t available = session_buffered(sock, &data);
+    if (available == 0) {
+        return 0;
+    }
+
+    // Framed messages start with a magic byte no legacy opcode can produce
+    if (data[0] == FRAME_MAGIC) {
+        Frame frame;
+        long frame_len = frame_parse(data, available, &frame);
+        if (frame_len <= 0) {
+            return (int)frame_len;
+        }
+        int used = frame_get_payload(&frame, payload);
+        if (used < 0) {
+            return -1;
+        }
+
+        // Keep any arguments that follow the payload fields
+        session->args_len = frame.body_len - used;
+        if (session->args_len > 0) {
+            if (buffer_reserve(&session->args, &session->args_cap, 0, session->args_len) != 0) {
+                return -1;
+            }
+            memcpy(session->args, frame.body + used, session->args_len);
+        }
+
+        session_consume(sock, frame_len);
+        session->wire = WIRE_FRAMED;
+        session->request_id = frame.request_id;
+        return 1;
+    }
+
+    if (available < sizeof(Payload)) {
+        return 0;
+    }
+    memcpy(payload, data, sizeof(Payload));
+    payload->filename[sizeof(payload->filename) - 1] = '\0';
+    payload->hash[sizeof(payload->hash) - 1] = '\0';
+    session_consume(sock, sizeof(Payload));
+    session->wire = WIRE_LEGACY;
+    session->request_id = 0;
+    session->args_len = 0;
+    return 1;
 }
 
-// Function to receive the payload structure
+// Function to receive a payload in either wire format
 int receive_payload(int sock, Payload *payload) {
-    // Receive the entire payload structure
-    ssize_t received_bytes = recv(sock, payload, sizeof(Payload), 0);
-    if (received_bytes <= 0) {
-        perror("Error receiving payload");
+    while (1) {
+        int result = payload_parse(sock, payload);
+        if (result > 0) {
+            return 0;
+        }
+        if (result < 0) {
+            fprintf(stderr, "Malformed payload received\n");
+            return -1;
+        }
+
+        // Partial message so far; read more
+        ssize_t n = session_fill(sock);
+        if (n <= 0) {
+            if (n < 0) {
+                perror("Error receiving payload");
+            } else {
+                fprintf(stderr, "Connection closed while receiving payload\n");
+            }
+            return -1;
+        }
+    }
+}
+
+// Function to check whether file streams on a connection are followed by an OP_TRAILER
+int session_trailers(int sock) {
+    Session *session = session_get(sock);
+    return session->wire == WIRE_FRAMED && (session->features & SESSION_FEATURE_TRAILER);
+}
+
+// Function to check whether a connection can send files as deltas
+int session_delta(int sock) {
+    Session *session = session_get(sock);
+    return session->wire == WIRE_FRAMED && (session->features & SESSION_FEATURE_DELTA);
+}
+
+// Function to check whether a connection can list files page by page
+int session_listing(int sock) {
+    Session *session = session_get(sock);
+    return session->wire == WIRE_FRAMED && (session->features & SESSION_FEATURE_LISTING);
+}
+
+// Function to check whether the server records a trace of a connection
+int session_traced(int sock) {
+    Session *session = session_get(sock);
+    return session->wire == WIRE_FRAMED && (session->features & SESSION_FEATURE_TRACE);
+}
+
+// Function to get the short name of an opcode
+const char *opcode_name(int opcode) {
+    static const char *names[] = {
+        "unknown", "download", "upload", "list_files", "req_meta_data", "meta_data", "exit", "hello", "file_list", "data",
+        "batch_meta", "batch_download", "read_ranges", "manifest", "trailer", "delta", "delta_signature", "delta_upload",
+        "list_page"
+    };
+    return opcode > 0 && opcode < (int)(sizeof(names) / sizeof(names[0])) ? names[opcode] : "unknown";
+}
+
+// Function to open the compressed stream of a single-file transfer if the connection agreed to a codec
+int session_compress_begin(int sock, CompressStream *stream, int sending) {
+    int codec = session_get(sock)->compression;
+    stream->codec = COMPRESS_NONE;
+    if (codec == COMPRESS_NONE) {
+        return 0;
+    }
+    return compress_begin(stream, codec, sending) == 0 ? 1 : -1;
+}
+
+// Function to start the running digest of a stream if the connection uses trailers
+Hasher *trailer_begin(int sock, Hasher *hasher) {
+    if (!session_trailers(sock) || hasher_begin(hasher, session_get(sock)->hash_algorithm) != 0) {
+        return NULL;
+    }
+    return hasher;
+}
+
+// Function to finish the running digest of a stream as an OP_TRAILER payload
+void trailer_build(Hasher *hasher, const char *filename, long offset, long length, Payload *trailer) {
+    unsigned char digest[HASH_DIGEST_SIZE];
+
+    memset(trailer, 0, sizeof(*trailer));
+    trailer->operation = OP_TRAILER;
+    trailer->status = STAT_FILE_FOUND;
+    trailer->offset = offset;
+    trailer->file_size = length;
+    strncpy(trailer->filename, filename, sizeof(trailer->filename) - 1);
+    if (!hasher) {
+        return;
+    }
+    if (hasher_end(hasher, digest) == 0) {
+        hex_encode(digest, hash_digest_size(hasher->algorithm), trailer->hash);
+    }
+    hasher_free(hasher);
+}
+
+// Function to compare a received trailer with the one built over the received bytes
+int trailer_verify(const Payload *expected, const Payload *received) {
+    if (received->operation != OP_TRAILER || received->offset != expected->offset ||
+        received->file_size != expected->file_size || expected->hash[0] == '\0' ||
+        strcmp(received->hash, expected->hash) != 0) {
         return -1;
-    } else if (received_bytes < sizeof(Payload)) {
-        fprintf(stderr, "Partial payload received: %zd of %zu bytes\n", received_bytes, sizeof(Payload));
-        return -1;  // Indicate a partial receive failure
     }
-    return 0;  // Successful receive
+    return 0;
 }
 
-// Function to calculate the hash of a specific chunk of a file
+// Function to receive the trailer that follows a stream and compare it with the local one
+int receive_trailer(int sock, const Payload *expected) {
+    Payload received;
+    if (receive_payload(sock, &received) != 0 || received.operation != OP_TRAILER) {
+        return -1;
+    }
+    return expected ? trailer_verify(expected, &received) : 0;
+}
+
+// Function to calculate the hash of the legacy chunk that ends at an offset
 int calculate_file_hash(const char *file_path, long offset, char *hash_output) {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
+    return calculate_piece_hash(file_path, offset, CHUNK_SIZE, HASH_ALGO_SHA256, hash_output);
+}
+
+// Helper function to hash the piece that ends at an offset
+static int hash_piece(const char *file_path, long offset, long piece_size, int algorithm, char *hash_output) {
+    unsigned char hash[HASH_DIGEST_SIZE];
+    Hasher hasher;
 
     // Open the file for reading
     FILE *file = fopen(file_path, "rb");
@@ -42,40 +415,59 @@ int calculate_file_hash(const char *file_path, long offset, char *hash_output) {
     }
 
     // Ensure the offset is valid
-    if (offset < CHUNK_SIZE) {
+    if (piece_size <= 0 || offset < piece_size) {
         fprintf(stderr, "Invalid offset: %ld for file: %s\n", offset, file_path);
         fclose(file);
         return -1;  // Invalid offset
     }
 
-    // Read the chunk corresponding to the last completed offset
-    if (fseek(file, offset - CHUNK_SIZE, SEEK_SET) != 0) {
+    // Read the piece corresponding to the last completed offset
+    if (fseek(file, offset - piece_size, SEEK_SET) != 0) {
         perror("Error seeking to offset in file");
         fclose(file);
         return -1;  // Return error if seeking fails
     }
 
-    char chunk[CHUNK_SIZE];
-    size_t bytes_read = fread(chunk, 1, CHUNK_SIZE, file);
-    if (bytes_read < CHUNK_SIZE) {
-        if (feof(file)) {
-            fprintf(stderr, "End of file reached while reading chunk: %s\n", file_path);
-        } else {
-            perror("Error reading file chunk");
-        }
+    if (hasher_begin(&hasher, algorithm) != 0) {
+        fprintf(stderr, "Error starting %s hash for file: %s\n", hash_algorithm_name(algorithm), file_path);
         fclose(file);
-        return -1;  // Return error if reading fails
+        return -1;
     }
 
-    // Update SHA256 context with the chunk
-    SHA256_Update(&sha256, chunk, CHUNK_SIZE);
-    SHA256_Final(hash, &sha256);
+    char chunk[HASH_READ_SIZE];
+    long remaining = piece_size;
+    while (remaining > 0) {
+        size_t want = remaining < (long)sizeof(chunk) ? remaining : sizeof(chunk);
+        size_t bytes_read = fread(chunk, 1, want, file);
+        if (bytes_read < want) {
+            if (feof(file)) {
+                fprintf(stderr, "End of file reached while reading chunk: %s\n", file_path);
+            } else {
+                perror("Error reading file chunk");
+            }
+            hasher_free(&hasher);
+            fclose(file);
+            return -1;  // Return error if reading fails
+        }
+
+        // Update the checksum with the chunk
+        hasher_update(&hasher, chunk, bytes_read);
+        remaining -= bytes_read;
+    }
+    int result = hasher_end(&hasher, hash);
+    hasher_free(&hasher);
     fclose(file);
 
     // Convert hash to string format
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(&hash_output[i * 2], "%02x", hash[i]);
-    }
+    hex_encode(hash, hash_digest_size(algorithm), hash_output);
 
-    return 0;  // Successful hash calculation
-}
\ No newline at end of file
+    return result;  // Successful hash calculation
+}
+
+// Function to calculate the checksum of the piece that ends at an offset
+int calculate_piece_hash(const char *file_path, long offset, long piece_size, int algorithm, char *hash_output) {
+    uint64_t started = trace_now();
+    int result = hash_piece(file_path, offset, piece_size, algorithm, hash_output);
+    trace_span("calculate_piece_hash", started, file_path, piece_size);
+    return result;
+}
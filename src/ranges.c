@@ -0,0 +1,108 @@
+#include <limits.h>
+
+#include "ranges.h"
+
+// Function to append a request for several ranges of one file
+void ranges_put_request(ByteBuf *buf, const char *filename, const ByteRange *ranges, int count) {
+    Payload payload = {0};
+    payload.operation = OP_READ_RANGES;
+    strncpy(payload.filename, filename, sizeof(payload.filename) - 1);
+
+    size_t start = frame_begin(buf, OP_READ_RANGES, 0);
+    frame_put_payload_fields(buf, &payload);
+    bytebuf_put_varint(buf, count);
+    for (int i = 0; i < count; i++) {
+        bytebuf_put_varint(buf, ranges[i].offset);
+        bytebuf_put_varint(buf, ranges[i].length);
+    }
+    frame_end(buf, start);
+}
+
+// Function to decode the ranges of a request received on a connection
+int ranges_parse(int sock, ByteRange **ranges) {
+    Session *session = session_get(sock);
+    ByteReader reader = { session->args, session->args + session->args_len, 0 };
+    uint64_t count = reader_varint(&reader);
+    if (reader.failed || count > MAX_RANGES) {
+        return -1;
+    }
+
+    *ranges = malloc(sizeof(ByteRange) * (count ? count : 1));
+    if (!*ranges) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset = reader_varint(&reader);
+        uint64_t length = reader_varint(&reader);
+        if (offset > LONG_MAX || length > LONG_MAX - offset) {
+            reader.failed = 1;
+        }
+        (*ranges)[i].offset = (long)offset;
+        (*ranges)[i].length = (long)length;
+    }
+
+    if (reader.failed) {
+        free(*ranges);
+        *ranges = NULL;
+        return -1;
+    }
+    return (int)count;
+}
+
+// Function to order ranges by offset
+static int compare_ranges(const void *a, const void *b) {
+    long x = ((const ByteRange *)a)->offset;
+    long y = ((const ByteRange *)b)->offset;
+    return (x > y) - (x < y);
+}
+
+// Function to sort, clip and merge ranges
+int ranges_coalesce(ByteRange *ranges, int count, long file_size) {
+    qsort(ranges, count, sizeof(ByteRange), compare_ranges);
+
+    int merged = 0;
+    for (int i = 0; i < count; i++) {
+        long start = ranges[i].offset;
+        long end = start + ranges[i].length;
+        if (end > file_size) {
+            end = file_size;
+        }
+        if (start >= end) {
+            continue;  // Empty or past the end of the file
+        }
+
+        // One read (and one header) for ranges that touch or overlap
+        if (merged > 0 && start <= ranges[merged - 1].offset + ranges[merged - 1].length) {
+            ByteRange *last = &ranges[merged - 1];
+            if (end > last->offset + last->length) {
+                last->length = end - last->offset;
+            }
+            continue;
+        }
+        ranges[merged].offset = start;
+        ranges[merged].length = end - start;
+        merged++;
+    }
+    return merged;
+}
+
+// Function to append the reply that precedes the range streams
+void ranges_put_reply(int sock, ByteBuf *buf, int status, long file_size, int count) {
+    size_t start = frame_begin(buf, OP_READ_RANGES, session_get(sock)->request_id);
+    bytebuf_put_svarint(buf, status);
+    bytebuf_put_svarint(buf, file_size);
+    bytebuf_put_varint(buf, count);
+    frame_end(buf, start);
+}
+
+// Function to decode the reply that precedes the range streams
+int ranges_get_reply(const Frame *frame, int *status, long *file_size) {
+    ByteReader reader = { frame->body, frame->body + frame->body_len, 0 };
+    *status = (int)reader_svarint(&reader);
+    *file_size = (long)reader_svarint(&reader);
+    uint64_t count = reader_varint(&reader);
+    if (reader.failed || frame->opcode != OP_READ_RANGES || count > MAX_RANGES) {
+        return -1;
+    }
+    return (int)count;
+}
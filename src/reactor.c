@@ -0,0 +1,1170 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "server.h"
+#include "logger.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "compresscache.h"
+#include "metaindex.h"
+#include "metrics.h"
+#include "trace.h"
+
+struct OffloadJob;
+
+typedef struct {
+    int id;                              // Worker index (also the preferred core)
+    int port;                            // Port to listen on
+    int listen_sock;                     // Worker-owned SO_REUSEPORT listener
+    int epoll_fd;                        // Worker epoll instance
+    int wake_fd;                         // Eventfd that interrupts the worker's epoll_wait
+    int stopping;                        // Set to make the worker leave its loop
+    pthread_mutex_t done_lock;           // Protects done
+    struct OffloadJob *done;             // Offloaded steps finished since the last wakeup
+} Worker;
+
+// Blocking step of a request, run off the event loop
+typedef struct OffloadJob {
+    Worker *worker;                              // Event loop the connection goes back to
+    Conn *conn;                                  // Connection waiting for the step
+    void (*run)(Conn *conn);                     // Blocking part, run on an offload thread
+    void (*resume)(Worker *worker, Conn *conn);  // Rest of the request, run back on the event loop
+    struct OffloadJob *next;                     // Next job in the queue or done list
+} OffloadJob;
+
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_work = PTHREAD_COND_INITIALIZER;  // Signalled when a job is queued
+static OffloadJob *offload_head = NULL;  // Oldest queued job
+static OffloadJob *offload_tail = NULL;  // Newest queued job
+static int offload_threads = 0;          // Offload threads running
+
+// Function to create a non-blocking listening socket for a worker
+static int create_listener(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        log_message(LOG_ERROR, "Error creating listening socket: %s", strerror(errno));
+        return -1;
+    }
+
+    set_socket_options(sock);
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        log_message(LOG_ERROR, "Error binding listening socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, REACTOR_BACKLOG) < 0) {
+        log_message(LOG_ERROR, "Error listening on socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Function to change the events a connection is waiting for
+static void conn_watch(Worker *worker, Conn *conn, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev) < 0) {
+        log_message(LOG_ERROR, "Error updating epoll interest for socket %d: %s", conn->sock, strerror(errno));
+        conn->state = CONN_CLOSING;
+    }
+}
+
+// Function to release a connection and everything it owns
+static void conn_close(Worker *worker, Conn *conn) {
+    if (conn->request_start && conn->op != OP_EXIT) {
+        metrics_error(conn->op);  // Dropped before it was answered
+    }
+    metrics_connection(-1);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+    session_reset(conn->sock);
+    close(conn->sock);
+    meta_index_close_file(conn->file_fd);
+    batch_free(&conn->batch);
+    free(conn->ranges);
+    bytebuf_free(&conn->out);
+    delta_patch_finish(&conn->patch, 0);  // An interrupted delta upload leaves the old copy alone
+    compress_end(&conn->compress);
+    if (conn->digest) {
+        hasher_free(conn->digest);
+    }
+    free(conn);
+    log_message_limited(LOG_INFO, "Client connection closed.");
+}
+
+// Function to go back to waiting for the next request
+static void conn_expect_request(Worker *worker, Conn *conn) {
+    if (conn->request_start) {
+        metrics_request(conn->op, conn->request_start);
+        conn->request_start = 0;
+    }
+    trace_span(opcode_name(conn->op), conn->trace_start, conn->request.filename, -1);
+    conn->trace_start = 0;
+    conn->state = CONN_READ_REQUEST;
+    conn_watch(worker, conn, EPOLLIN);
+}
+
+// Function to start flushing the queued response; reading resumes afterwards
+static void conn_flush_response(Worker *worker, Conn *conn) {
+    if (conn->out.failed) {
+        log_message(LOG_ERROR, "Out of memory queueing response for socket %d", conn->sock);
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    conn->out_sent = 0;
+    conn->state = CONN_SEND_BUFFER;
+    conn_watch(worker, conn, EPOLLOUT);
+}
+
+// Function to queue a payload response in the connection's wire format
+static void conn_queue_payload(Worker *worker, Conn *conn, const Payload *payload) {
+    payload_put(conn->sock, &conn->out, payload);
+    conn_flush_response(worker, conn);
+}
+
+// Function run by every offload thread: the blocking steps of whichever connections queued them first
+static void *offload_main(void *arg) {
+    pthread_mutex_lock(&offload_lock);
+    while (1) {
+        while (!offload_head) {
+            pthread_cond_wait(&offload_work, &offload_lock);
+        }
+        OffloadJob *job = offload_head;
+        offload_head = job->next;
+        if (!offload_head) {
+            offload_tail = NULL;
+        }
+        pthread_mutex_unlock(&offload_lock);
+
+        trace_attach(session_traced(job->conn->sock) ? &job->conn->trace : NULL);
+        job->run(job->conn);
+        trace_attach(NULL);
+
+        // Hand the connection back to its event loop
+        Worker *worker = job->worker;
+        uint64_t one = 1;
+        pthread_mutex_lock(&worker->done_lock);
+        job->next = worker->done;
+        worker->done = job;
+        pthread_mutex_unlock(&worker->done_lock);
+        if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+            log_message(LOG_ERROR, "Error waking worker %d: %s", worker->id, strerror(errno));
+        }
+
+        pthread_mutex_lock(&offload_lock);
+    }
+    return NULL;
+}
+
+// Function to run the blocking step of a request on an offload thread; the connection resumes when it is done
+static void conn_offload(Worker *worker, Conn *conn, void (*run)(Conn *), void (*resume)(Worker *, Conn *)) {
+    // Nothing but the step may touch the connection meanwhile, so it leaves the epoll set
+    OffloadJob *job = offload_threads > 0 ? malloc(sizeof(OffloadJob)) : NULL;
+    if (!job || epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL) < 0) {
+        free(job);
+        run(conn);  // Without offload threads the event loop waits for the step itself
+        if (conn->state != CONN_CLOSING) {
+            resume(worker, conn);
+        }
+        return;
+    }
+
+    job->worker = worker;
+    job->conn = conn;
+    job->run = run;
+    job->resume = resume;
+    job->next = NULL;
+    conn->state = CONN_OFFLOADED;
+
+    pthread_mutex_lock(&offload_lock);
+    if (offload_tail) {
+        offload_tail->next = job;
+    } else {
+        offload_head = job;
+    }
+    offload_tail = job;
+    pthread_cond_signal(&offload_work);
+    pthread_mutex_unlock(&offload_lock);
+}
+
+// Function to start the offload threads
+static void offload_start(void) {
+    for (int i = 0; i < REACTOR_OFFLOAD_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, offload_main, NULL) != 0) {
+            log_message(LOG_ERROR, "Failed to create offload thread %d; the event loops run blocking steps themselves", i);
+            break;
+        }
+        pthread_detach(thread);
+        offload_threads++;
+    }
+}
+
+// Function to answer an OP_DOWNLOAD request that cannot be served
+static void conn_reject_send_file(Worker *worker, Conn *conn, int status) {
+    Payload header;
+    metrics_error(OP_DOWNLOAD);
+    if (session_get(conn->sock)->request_id == 0) {
+        conn_expect_request(worker, conn);  // Lockstep clients learn about errors from the metadata reply
+        return;
+    }
+    build_data_header(conn->request.filename, conn->request.offset, 0, status, &header);
+    conn_queue_payload(worker, conn, &header);
+}
+
+// Function to start the running digest and codec of a single-file stream if the client agreed to them
+static int conn_start_stream(Conn *conn, int sending) {
+    conn->trailed = session_trailers(conn->sock);
+    conn->digest = trailer_begin(conn->sock, &conn->hasher);
+    conn->stream_offset = conn->file_offset;
+    conn->stream_length = conn->file_remaining;
+    conn->cached = 0;
+    if (session_compress_begin(conn->sock, &conn->compress, sending) < 0) {
+        log_message(LOG_ERROR, "Out of memory opening compressed stream for socket %d", conn->sock);
+        conn->state = CONN_CLOSING;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to finish the running digest of a completed stream: queue our trailer, or wait for the client's
+static int conn_finish_stream(Worker *worker, Conn *conn, int sending) {
+    Payload trailer;
+    if (!conn->trailed) {
+        return 0;
+    }
+    conn->trailed = 0;
+    trailer_build(conn->digest, conn->filename, conn->stream_offset, conn->stream_length, &trailer);
+    conn->digest = NULL;
+    if (conn->cached) {
+        strcpy(trailer.hash, conn->cached_hash);
+    }
+
+    if (!sending) {
+        conn->expected_trailer = trailer;
+        conn->trailer_pending = 1;
+        return 0;
+    }
+    payload_put(conn->sock, &conn->out, &trailer);
+    conn_flush_response(worker, conn);
+    return 1;
+}
+
+// Function to check the trailer that follows an upload
+static void conn_check_trailer(Conn *conn, const Payload *trailer) {
+    if (!conn->trailer_pending) {
+        log_message(LOG_ERROR, "Unexpected trailer from client on socket %d", conn->sock);
+        return;
+    }
+    conn->trailer_pending = 0;
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, conn->expected_trailer.filename);
+    if (result < 0 || result >= sizeof(file_path)) {
+        return;  // The upload itself was refused for this name
+    }
+    if (trailer_verify(&conn->expected_trailer, trailer) == 0) {
+        log_message(LOG_INFO, "Verified %s hash of uploaded file: %s", hash_algorithm_name(conn->hasher.algorithm), file_path);
+        return;
+    }
+    log_message(LOG_ERROR, "Integrity check failed for uploaded file: %s; removing it", file_path);
+    metrics_error(OP_META_DATA);
+    unlink(file_path);
+    meta_index_refresh(file_path);
+}
+
+// Function to open the file for an OP_DOWNLOAD request with open_file; -1 if that found no file
+static int conn_open_send_file_with(Conn *conn, int (*open_file)(const char *, struct stat *)) {
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, conn->request.filename);
+    if (result < 0 || result >= sizeof(file_path)) {
+        log_message(LOG_ERROR, "Error forming file path for filename: %s", conn->request.filename);
+        conn->offload_result = STAT_SERVER_ERROR;
+        return 0;
+    }
+
+    // Hot files stay open between requests
+    struct stat file_stat;
+    int fd = open_file(file_path, &file_stat);
+    if (fd < 0) {
+        return -1;
+    }
+    conn->offload_result = STAT_FILE_FOUND;
+
+    conn->file_fd = fd;
+    conn->file_offset = conn->request.offset;
+    conn->file_remaining = file_stat.st_size > conn->request.offset ? file_stat.st_size - conn->request.offset : 0;
+    if (conn->request.file_size > 0 && conn->file_remaining > conn->request.file_size) {
+        conn->file_remaining = conn->request.file_size;  // A nonzero size limits the range
+    }
+    memcpy(conn->filename, conn->request.filename, sizeof(conn->filename));
+    conn->filename[sizeof(conn->filename) - 1] = '\0';
+    if (conn_start_stream(conn, 1) != 0) {
+        return 0;
+    }
+
+    // Whole-file compressed downloads of hot files go out precompressed, straight from the cache
+    CachedCopy copy;
+    if (conn->compress.codec != COMPRESS_NONE && conn->file_offset == 0 && conn->file_remaining == file_stat.st_size &&
+        compress_cache_lookup(conn->filename, &file_stat, conn->compress.codec, session_get(conn->sock)->hash_algorithm, &copy)) {
+        if (copy.fd >= 0) {
+            meta_index_close_file(conn->file_fd);
+            conn->file_fd = copy.fd;
+            conn->file_offset = copy.offset;
+            conn->file_remaining = copy.length;
+            compress_end(&conn->compress);
+            if (conn->digest) {
+                hasher_free(conn->digest);
+                conn->digest = NULL;
+            }
+            conn->cached = 1;
+            memcpy(conn->cached_hash, copy.hash, sizeof(conn->cached_hash));
+            log_message(LOG_INFO, "Sending %s from the compressed cache (%ld bytes on the wire)", file_path, (long)copy.length);
+        } else {
+            conn->compress.skipping = copy.incompressible;  // Known not to compress: no need to sample it again
+        }
+    }
+    return 0;
+}
+
+// Function to open the file for an OP_DOWNLOAD request (offload thread)
+static void conn_open_send_file(Conn *conn) {
+    if (conn_open_send_file_with(conn, meta_index_open_file) != 0) {
+        log_message(LOG_ERROR, "Error opening file: %s/%s", SRC_DIR, conn->request.filename);
+        conn->offload_result = STAT_FILE_NOT_FOUND;
+    }
+}
+
+// Function to start streaming the file opened for an OP_DOWNLOAD request
+static void conn_start_send_file(Worker *worker, Conn *conn) {
+    if (conn->offload_result != STAT_FILE_FOUND) {
+        conn_reject_send_file(worker, conn, conn->offload_result);
+        return;
+    }
+
+    // Pipelined requests get the stream length up front; the file follows the header
+    if (session_get(conn->sock)->request_id != 0) {
+        Payload header;
+        build_data_header(conn->filename, conn->stream_offset, conn->stream_length, STAT_FILE_FOUND, &header);
+        conn_queue_payload(worker, conn, &header);
+        return;
+    }
+
+    conn->state = CONN_SEND_FILE;
+    conn_watch(worker, conn, EPOLLOUT);
+}
+
+// Function to open the next file of a batch download and queue its header (offload thread)
+static void conn_open_next_batch_file(Conn *conn) {
+    const BatchFile *file;
+    off_t length;
+    int fd;
+
+    // Files that vanished since the metadata reply get an empty header
+    while ((fd = batch_open_next(&conn->batch, &file, &length)) >= 0 || file) {
+        Payload header;
+        build_data_header(file->filename, 0, fd >= 0 ? length : 0, fd >= 0 ? STAT_FILE_FOUND : STAT_FILE_NOT_FOUND, &header);
+        payload_put(conn->sock, &conn->out, &header);
+        if (fd >= 0) {
+            conn->file_fd = fd;
+            conn->file_offset = 0;
+            conn->file_remaining = length;
+            memcpy(conn->filename, file->filename, sizeof(conn->filename));
+            break;
+        }
+    }
+    if (fd < 0) {
+        batch_free(&conn->batch);
+    }
+}
+
+// Function to send the headers queued for a batch download, or go back to reading requests once it is done
+static void conn_send_batch(Worker *worker, Conn *conn) {
+    if (conn->out.len > 0) {
+        conn_flush_response(worker, conn);
+    } else {
+        conn_expect_request(worker, conn);
+    }
+}
+
+// Function to queue the next file of a batch download, or finish the batch
+static void conn_continue_batch(Worker *worker, Conn *conn) {
+    conn_offload(worker, conn, conn_open_next_batch_file, conn_send_batch);
+}
+
+// Function to resolve a batch request and queue its metadata reply (offload thread)
+static void conn_resolve_batch(Conn *conn) {
+    // An unresolvable batch is answered with an empty list so the client isn't left waiting
+    if (batch_resolve(conn->sock, &conn->request, SRC_DIR, &conn->batch) != 0) {
+        log_message(LOG_ERROR, "Error resolving batch request (pattern '%s')", conn->request.filename);
+    }
+    batch_put_metadata(conn->sock, &conn->out, &conn->batch);
+    log_message(LOG_INFO, "Sent batch metadata for %d files", conn->batch.count);
+
+    if (conn->request.operation == OP_BATCH_DOWNLOAD) {
+        conn_open_next_batch_file(conn);
+        return;
+    }
+    batch_free(&conn->batch);
+}
+
+// Function to queue the header of the next range; the range follows it
+static void conn_next_range(Worker *worker, Conn *conn) {
+    ByteRange *range = &conn->ranges[conn->range_next++];
+    conn->file_offset = range->offset;
+    conn->file_remaining = range->length;
+
+    // Delta literals follow each other without headers
+    if (conn->delta == DELTA_RECEIVING) {
+        conn->state = CONN_RECV_FILE;
+        conn_watch(worker, conn, EPOLLIN);
+        return;
+    }
+    if (conn->delta == DELTA_NONE) {
+        Payload header;
+        build_data_header(conn->filename, range->offset, range->length, STAT_FILE_FOUND, &header);
+        payload_put(conn->sock, &conn->out, &header);
+    }
+    conn_flush_response(worker, conn);
+}
+
+// Function to open the file of a range read request and build its reply (offload thread)
+static void conn_open_ranges(Conn *conn) {
+    int count = ranges_parse(conn->sock, &conn->ranges);
+    int status = count < 0 ? STAT_SERVER_ERROR : STAT_FILE_FOUND;
+    struct stat file_stat = {0};
+    int fd = -1;
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, conn->request.filename);
+    if (result < 0 || result >= sizeof(file_path)) {
+        log_message(LOG_ERROR, "Error forming file path for filename: %s", conn->request.filename);
+        status = status == STAT_FILE_FOUND ? STAT_FILE_NOT_FOUND : status;
+    } else if (status == STAT_FILE_FOUND && (fd = meta_index_open_file(file_path, &file_stat)) < 0) {
+        log_message(LOG_ERROR, "Error opening file: %s", file_path);
+        status = STAT_FILE_NOT_FOUND;
+    }
+    count = status == STAT_FILE_FOUND ? ranges_coalesce(conn->ranges, count, file_stat.st_size) : 0;
+    ranges_put_reply(conn->sock, &conn->out, status, file_stat.st_size, count);
+
+    if (count == 0) {
+        meta_index_close_file(fd);
+        free(conn->ranges);
+        conn->ranges = NULL;
+        conn->range_count = 0;
+        return;
+    }
+
+    // The file stays open across its ranges
+    conn->file_fd = fd;
+    conn->range_count = count;
+}
+
+// Function to answer a range read request: the reply, then a header and the bytes of each range
+static void conn_start_ranges(Worker *worker, Conn *conn) {
+    if (conn->range_count == 0) {
+        conn_flush_response(worker, conn);
+        return;
+    }
+    conn->range_next = 0;
+    memcpy(conn->filename, conn->request.filename, sizeof(conn->filename));
+    conn_next_range(worker, conn);
+}
+
+// Function to build the script and literal ranges of a delta download (offload thread)
+static void conn_build_delta(Conn *conn) {
+    conn->range_count = build_delta(conn->sock, &conn->request, &conn->out, &conn->file_fd, &conn->ranges);
+}
+
+// Function to answer a delta download: the script, then its literal ranges
+static void conn_start_delta(Worker *worker, Conn *conn) {
+    if (conn->range_count == 0) {
+        conn_flush_response(worker, conn);
+        return;
+    }
+    conn->range_next = 0;
+    conn->delta = DELTA_SENDING;
+    memcpy(conn->filename, conn->request.filename, sizeof(conn->filename));
+    conn_next_range(worker, conn);
+}
+
+// Function to build the metadata reply to an OP_REQ_META_DATA request (offload thread)
+static void conn_build_metadata(Conn *conn) {
+    Session *session = session_get(conn->sock);
+    conn->offload_result = build_file_metadata(conn->request.filename, conn->request.offset, session->piece_size,
+                                               session->hash_algorithm, &conn->reply);
+}
+
+// Function to answer an OP_REQ_META_DATA request with the metadata built for it
+static void conn_send_metadata(Worker *worker, Conn *conn) {
+    if (conn->offload_result == 0) {
+        conn_queue_payload(worker, conn, &conn->reply);
+    } else {
+        conn_expect_request(worker, conn);
+    }
+}
+
+// Function to build the reply to an OP_MANIFEST request (offload thread)
+static void conn_build_manifest(Conn *conn) {
+    build_manifest(conn->sock, &conn->request, &conn->out);
+}
+
+// Function to build the reply to an OP_LIST_FILES request (offload thread)
+static void conn_build_file_list(Conn *conn) {
+    build_file_list_reply(conn->sock, &conn->out);
+}
+
+// Function to build the reply to an OP_LIST_PAGE request (offload thread)
+static void conn_build_list_page(Conn *conn) {
+    build_list_page(conn->sock, &conn->request, &conn->out);
+}
+
+// Function to build the reply to an OP_DELTA_SIGNATURE request (offload thread)
+static void conn_build_delta_signature(Conn *conn) {
+    build_delta_signature(conn->sock, &conn->request, &conn->out);
+}
+
+// Function to verify a rebuilt delta upload and answer it
+static void conn_finish_delta_upload(Worker *worker, Conn *conn, int complete) {
+    Payload reply;
+    conn->delta = DELTA_NONE;
+    finish_delta_upload(&conn->patch, conn->request.filename, complete, &reply);
+    if (reply.status != STAT_FILE_FOUND) {
+        metrics_error(OP_DELTA_UPLOAD);
+    }
+    conn_queue_payload(worker, conn, &reply);
+}
+
+// Function to start a delta upload: copy the unchanged blocks, then receive the literal ranges
+static void conn_start_delta_upload(Worker *worker, Conn *conn) {
+    ByteRange *literals;
+    int count = begin_delta_upload(conn->sock, &conn->request, &conn->patch, &literals);
+    if (count < 0) {
+        conn->state = CONN_CLOSING;  // Without a script there is no telling where the literals end
+        return;
+    }
+    if (count == 0) {
+        free(literals);
+        conn_finish_delta_upload(worker, conn, 1);
+        return;
+    }
+
+    // Literals for a file that can't be rebuilt are still read, to keep the stream in step
+    conn->file_fd = conn->patch.fd >= 0 ? conn->patch.fd : open("/dev/null", O_WRONLY);
+    conn->patch.fd = -1;  // conn_finish_file closes it
+    if (conn->file_fd < 0) {
+        free(literals);
+        delta_patch_finish(&conn->patch, 0);
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    conn->ranges = literals;
+    conn->range_count = count;
+    conn->range_next = 0;
+    conn->delta = DELTA_RECEIVING;
+    memcpy(conn->filename, conn->request.filename, sizeof(conn->filename));
+    conn_next_range(worker, conn);
+}
+
+// Function to finish a file transfer and return to reading requests
+static void conn_finish_file(Worker *worker, Conn *conn, const char *direction) {
+    if (conn->ranges && conn->range_next < conn->range_count && conn->file_remaining == 0) {
+        conn_next_range(worker, conn);
+        return;
+    }
+    int multi_part = conn->batch.dir_fd >= 0 || conn->ranges != NULL;
+    free(conn->ranges);
+    conn->ranges = NULL;
+    conn->range_count = conn->range_next = 0;
+
+    meta_index_close_file(conn->file_fd);
+    conn->file_fd = -1;
+    compress_end(&conn->compress);
+    metrics_transfer(conn->op, conn->request_start, conn->first_byte, conn->transferred, strcmp(direction, "sent") == 0);
+    trace_stream_end(strcmp(direction, "sent") == 0 ? "send_file" : "receive_file", conn->filename);
+    conn->first_byte = conn->transferred = 0;
+    if (strcmp(direction, "received") == 0 && conn->delta == DELTA_NONE) {
+        char file_path[MAX_FILENAME];
+        int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, conn->filename);
+        if (result >= 0 && result < sizeof(file_path)) {
+            meta_index_refresh(file_path);  // Later requests see the upload without waiting for inotify
+        }
+    }
+    if (conn->file_remaining == 0) {
+        log_message(LOG_INFO, "Successfully %s file: %s", direction, conn->filename);
+        if (conn_finish_stream(worker, conn, strcmp(direction, "sent") == 0)) {
+            return;  // The trailer goes out first
+        }
+    } else {
+        if (conn->digest) {
+            hasher_free(conn->digest);
+            conn->digest = NULL;
+        }
+        conn->trailed = 0;
+        log_message(LOG_ERROR, "Incomplete transfer of file: %s, %ld bytes missing", conn->filename, (long)conn->file_remaining);
+        metrics_error(conn->op);
+        if (multi_part) {
+            conn->state = CONN_CLOSING;  // The client can't find the next header any more
+            return;
+        }
+    }
+
+    if (conn->delta == DELTA_RECEIVING) {
+        conn_finish_delta_upload(worker, conn, 1);
+        return;
+    }
+    conn->delta = DELTA_NONE;
+
+    if (conn->batch.dir_fd >= 0) {
+        conn_continue_batch(worker, conn);
+        return;
+    }
+    conn_expect_request(worker, conn);
+}
+
+// Function to create the file for an OP_META_DATA (upload) request (offload thread)
+static void conn_open_recv_file(Conn *conn) {
+    char file_path[MAX_FILENAME];
+    conn->offload_result = -1;
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, conn->request.filename);
+    if (result < 0 || result >= sizeof(file_path)) {
+        log_message(LOG_ERROR, "Error forming file path for filename: %s", conn->request.filename);
+        return;
+    }
+
+    // Overwrite the file if it exists (readable too, for the running digest)
+    conn->file_fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (conn->file_fd < 0) {
+        log_message(LOG_ERROR, "Error creating file: %s", file_path);
+        return;
+    }
+    conn->offload_result = 0;
+}
+
+// Function to start receiving the file created for an OP_META_DATA (upload) request
+static void conn_start_recv_file(Worker *worker, Conn *conn) {
+    if (conn->offload_result != 0) {
+        metrics_error(OP_META_DATA);
+        conn_expect_request(worker, conn);
+        return;
+    }
+
+    conn->file_offset = 0;
+    conn->file_remaining = conn->request.file_size > 0 ? conn->request.file_size : 0;
+    memcpy(conn->filename, conn->request.filename, sizeof(conn->filename));
+    conn->filename[sizeof(conn->filename) - 1] = '\0';
+    if (conn_start_stream(conn, 0) != 0) {
+        return;
+    }
+    conn->state = CONN_RECV_FILE;
+    conn_watch(worker, conn, EPOLLIN);  // Offloaded connections come back without events
+
+    // Zero-length uploads complete without any socket readiness
+    if (conn->file_remaining == 0) {
+        conn_finish_file(worker, conn, "received");
+    }
+}
+
+// Function to dispatch a fully received request
+static void conn_dispatch(Worker *worker, Conn *conn) {
+    Payload *payload = &conn->request;
+    conn->op = payload->operation;
+    conn->request_start = metrics_now();  // Counted when the connection goes back to reading requests
+    conn->trace_start = trace_now();
+
+    switch (payload->operation) {
+        case OP_DOWNLOAD:
+            // Files still open from earlier requests start right away; opening others and compressed-cache lookups may block
+            if (session_get(conn->sock)->compression == COMPRESS_NONE && conn_open_send_file_with(conn, meta_index_open_cached) == 0) {
+                if (conn->state != CONN_CLOSING) {
+                    conn_start_send_file(worker, conn);
+                }
+                break;
+            }
+            conn_offload(worker, conn, conn_open_send_file, conn_start_send_file);
+            break;
+
+        case OP_UPLOAD: {
+            // Server requests metadata from the client
+            Payload req_payload;
+            memset(&req_payload, 0, sizeof(req_payload));
+            req_payload.operation = OP_REQ_META_DATA;
+            memcpy(req_payload.filename, payload->filename, sizeof(req_payload.filename));
+            log_message(LOG_DEBUG, "Requested metadata for file: %s", payload->filename);
+            conn_queue_payload(worker, conn, &req_payload);
+            break;
+        }
+
+        case OP_REQ_META_DATA:
+            log_message(LOG_DEBUG, "Client requested metadata for %s at offset %ld", payload->filename, payload->offset);
+            conn_offload(worker, conn, conn_build_metadata, conn_send_metadata);
+            break;
+
+        case OP_META_DATA:
+            log_message(LOG_INFO, "Received file metadata from client: %s, size: %ld", payload->filename, payload->file_size);
+            conn_offload(worker, conn, conn_open_recv_file, conn_start_recv_file);
+            break;
+
+        case OP_LIST_FILES:
+            conn_offload(worker, conn, conn_build_file_list, conn_flush_response);
+            break;
+
+        case OP_LIST_PAGE:
+            conn_offload(worker, conn, conn_build_list_page, conn_flush_response);
+            break;
+
+        case OP_BATCH_META:
+        case OP_BATCH_DOWNLOAD:
+            conn_offload(worker, conn, conn_resolve_batch, conn_send_batch);
+            break;
+
+        case OP_READ_RANGES:
+            conn_offload(worker, conn, conn_open_ranges, conn_start_ranges);
+            break;
+
+        case OP_MANIFEST:
+            conn_offload(worker, conn, conn_build_manifest, conn_flush_response);
+            break;
+
+        case OP_DELTA:
+            conn_offload(worker, conn, conn_build_delta, conn_start_delta);
+            break;
+
+        case OP_DELTA_SIGNATURE:
+            conn_offload(worker, conn, conn_build_delta_signature, conn_flush_response);
+            break;
+
+        case OP_DELTA_UPLOAD:
+            conn_start_delta_upload(worker, conn);
+            break;
+
+        case OP_TRAILER:
+            conn_check_trailer(conn, payload);
+            conn_expect_request(worker, conn);
+            break;
+
+        case OP_HELLO: {
+            Payload reply;
+            build_session_reply(conn->sock, payload, &reply);
+            conn_queue_payload(worker, conn, &reply);
+            break;
+        }
+
+        case OP_EXIT:
+            log_message(LOG_INFO, "Client requested to close the connection.");
+            conn->state = CONN_CLOSING;
+            break;
+
+        default:
+            log_message(LOG_ERROR, "Invalid operation received from client: %d", payload->operation);
+            metrics_error(payload->operation);
+            conn_expect_request(worker, conn);
+            break;
+    }
+}
+
+// Function to read (part of) a request message
+static void conn_on_read_request(Worker *worker, Conn *conn) {
+    while (conn->state == CONN_READ_REQUEST) {
+        // Requests may already be buffered behind the previous one
+        int parsed = payload_parse(conn->sock, &conn->request);
+        if (parsed > 0) {
+            conn_dispatch(worker, conn);
+            continue;
+        }
+        if (parsed < 0) {
+            log_message(LOG_ERROR, "Malformed request from client on socket %d", conn->sock);
+            conn->state = CONN_CLOSING;
+            return;
+        }
+
+        ssize_t n = session_fill(conn->sock);
+        if (n == 0) {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LOG_ERROR, "Error receiving payload from client: %s", strerror(errno));
+                conn->state = CONN_CLOSING;
+            }
+            return;
+        }
+    }
+}
+
+// Function to flush a buffered response
+static void conn_on_send_buffer(Worker *worker, Conn *conn) {
+    // A header followed by file data shouldn't go out in a segment of its own
+    int flags = MSG_NOSIGNAL | (conn->file_fd >= 0 && conn->file_remaining > 0 ? MSG_MORE : 0);
+
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = send(conn->sock, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent, flags);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LOG_ERROR, "Error sending response to client: %s", strerror(errno));
+                conn->state = CONN_CLOSING;
+            }
+            return;
+        }
+        conn->out_sent += n;
+    }
+
+    conn->out.len = conn->out_sent = 0;  // Keep the allocation for the next response
+
+    // A data header is followed by its file stream
+    if (conn->file_fd >= 0) {
+        conn->state = CONN_SEND_FILE;
+        return;
+    }
+    conn_expect_request(worker, conn);
+}
+
+// Function to stream the next chunks of a file to the client
+static void conn_on_send_file(Worker *worker, Conn *conn) {
+    int done = conn->file_remaining == 0;
+    if (!conn->first_byte) {
+        conn->first_byte = metrics_now();
+        trace_stream_begin();
+    }
+
+    for (int budget = 0; !done && budget < REACTOR_IO_BUDGET; budget++) {
+        int compressed = conn->compress.codec != COMPRESS_NONE;
+        size_t want = conn->file_remaining < TRANSFER_BUFFER_SIZE || compressed ? conn->file_remaining : TRANSFER_BUFFER_SIZE;
+        ssize_t bytes_sent = compressed ? transfer_send_compressed_some(conn->sock, conn->file_fd, &conn->file_offset, want, &conn->compress, NULL, conn->digest)
+                                        : transfer_send_some(conn->sock, conn->file_fd, &conn->file_offset, want, NULL, conn->digest);
+        if (bytes_sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LOG_ERROR, "Error sending file: %s", conn->filename);
+                conn->state = CONN_CLOSING;
+            }
+            return;
+        }
+        if (bytes_sent == 0) {
+            done = 1;  // File shrank; stop the transfer
+            break;
+        }
+        conn->file_remaining -= bytes_sent;
+        conn->transferred += bytes_sent;
+        done = conn->file_remaining == 0;
+        if (bytes_sent < want && !compressed) {
+            return;  // Socket buffer is full (compressed streams find out from EAGAIN)
+        }
+    }
+
+    // Otherwise the budget ran out; level-triggered epoll resumes us after the others
+    if (done) {
+        conn_finish_file(worker, conn, "sent");
+    }
+}
+
+// Function to receive the next chunks of an uploaded file
+static void conn_on_recv_file(Worker *worker, Conn *conn) {
+    const unsigned char *buffered;
+    int compressed = conn->compress.codec != COMPRESS_NONE;
+    if (!conn->first_byte) {
+        conn->first_byte = metrics_now();
+        trace_stream_begin();
+    }
+
+    // Chunks read ahead with the request raise no readiness events, so they don't count against the budget
+    for (int budget = 0; (budget < REACTOR_IO_BUDGET || (compressed && session_buffered(conn->sock, &buffered) > 0)) &&
+                         conn->file_remaining > 0; budget++) {
+        ssize_t bytes_received = compressed ? transfer_recv_compressed_some(conn->sock, conn->file_fd, &conn->file_offset, conn->file_remaining, &conn->compress, NULL, conn->digest)
+                                            : transfer_recv_some(conn->sock, conn->file_fd, &conn->file_offset, conn->file_remaining, NULL, conn->digest);
+        if (bytes_received == 0) {
+            log_message(LOG_INFO, "Connection closed by client before full file was received");
+            conn->state = CONN_CLOSING;
+            return;
+        }
+        if (bytes_received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LOG_ERROR, "Error receiving file: %s", conn->filename);
+                conn->state = CONN_CLOSING;
+            }
+            return;
+        }
+        conn->file_remaining -= bytes_received;
+        conn->transferred += bytes_received;
+    }
+
+    if (conn->file_remaining == 0) {
+        conn_finish_file(worker, conn, "received");
+    }
+}
+
+// Function to advance a connection's state machine as far as the socket allows
+static void conn_resume(Worker *worker, Conn *conn) {
+    ConnState previous;
+    const unsigned char *buffered;
+
+    // Events recorded while serving a traced connection go to its track
+    trace_attach(session_traced(conn->sock) ? &conn->trace : NULL);
+
+    // Bytes read ahead raise no further readiness events, so keep going while they last
+    do {
+        previous = conn->state;
+        switch (conn->state) {
+            case CONN_READ_REQUEST:
+                conn_on_read_request(worker, conn);
+                break;
+            case CONN_SEND_BUFFER:
+                conn_on_send_buffer(worker, conn);
+                break;
+            case CONN_SEND_FILE:
+                conn_on_send_file(worker, conn);
+                break;
+            case CONN_RECV_FILE:
+                conn_on_recv_file(worker, conn);
+                break;
+            case CONN_OFFLOADED:
+            case CONN_CLOSING:
+                break;
+        }
+    } while (conn->state != previous && conn->state != CONN_CLOSING && session_buffered(conn->sock, &buffered) > 0);
+
+    if (conn->state == CONN_CLOSING) {
+        if (session_traced(conn->sock)) {
+            trace_flush();
+        }
+        conn_close(worker, conn);
+    }
+    trace_attach(NULL);
+}
+
+// Function to accept every pending connection on the worker's listener
+static void worker_accept(Worker *worker) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept4(worker->listen_sock, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LOG_ERROR, "Error accepting client connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        Conn *conn = calloc(1, sizeof(Conn));
+        if (!conn || session_reset(client_sock) != 0) {
+            log_message(LOG_ERROR, "Out of memory accepting client connection");
+            free(conn);
+            close(client_sock);
+            continue;
+        }
+        conn->sock = client_sock;
+        conn->trace.track = client_sock;
+        conn->addr = client_addr;
+        conn->file_fd = -1;
+        conn->batch.dir_fd = -1;
+        conn->patch.fd = -1;
+        conn->state = CONN_READ_REQUEST;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            log_message(LOG_ERROR, "Error registering client socket: %s", strerror(errno));
+            close(client_sock);
+            free(conn);
+            continue;
+        }
+        metrics_connection(1);  // Only registered connections reach conn_close, which takes it back
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        log_message_limited(LOG_INFO, "Client connected: IP = %s, Port = %d, Worker = %d", client_ip, ntohs(client_addr.sin_port), worker->id);
+    }
+}
+
+// Function to resume the connections whose offloaded steps are done
+static void worker_resume_offloaded(Worker *worker) {
+    uint64_t count;
+    if (read(worker->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_message(LOG_ERROR, "Error reading wakeup of worker %d: %s", worker->id, strerror(errno));
+    }
+
+    pthread_mutex_lock(&worker->done_lock);
+    OffloadJob *jobs = worker->done;
+    worker->done = NULL;
+    pthread_mutex_unlock(&worker->done_lock);
+
+    while (jobs) {
+        OffloadJob *job = jobs;
+        Conn *conn = job->conn;
+        jobs = job->next;
+
+        // Back in the epoll set without events; the rest of the request picks the ones it waits for
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->sock, &ev) < 0) {
+            log_message(LOG_ERROR, "Error registering client socket: %s", strerror(errno));
+            conn->state = CONN_CLOSING;
+        }
+        if (conn->state != CONN_CLOSING) {
+            trace_attach(session_traced(conn->sock) ? &conn->trace : NULL);
+            conn->state = CONN_READ_REQUEST;  // Where the request was dispatched from
+            job->resume(worker, conn);
+        }
+        free(job);
+        conn_resume(worker, conn);
+    }
+}
+
+// Function run by each worker thread: one event loop per core
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    // Pin the worker to its core; failure only costs locality
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->id % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    while (!__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE)) {
+        int ready = epoll_wait(worker->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERROR, "epoll_wait failed on worker %d: %s", worker->id, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            Conn *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                worker_accept(worker);
+            } else if (events[i].data.ptr == worker) {
+                worker_resume_offloaded(worker);
+            } else {
+                // Errors and hang-ups surface through the next recv/send
+                conn_resume(worker, conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Function to set up a worker's listener, epoll instance and wakeup eventfd
+static int worker_setup(Worker *worker) {
+    worker->listen_sock = create_listener(worker->port);
+    worker->epoll_fd = epoll_create1(0);
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (worker->listen_sock < 0 || worker->epoll_fd < 0 || worker->wake_fd < 0) {
+        log_message(LOG_ERROR, "Failed to start worker %d", worker->id);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // NULL marks the listener
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_sock, &ev) < 0) {
+        log_message(LOG_ERROR, "Error registering listener of worker %d: %s", worker->id, strerror(errno));
+        return -1;
+    }
+    ev.data.ptr = worker;  // The worker itself marks its wakeups
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) < 0) {
+        log_message(LOG_ERROR, "Error registering wakeups of worker %d: %s", worker->id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Function to stop and join the started workers, then close the descriptors of every worker
+static void reactor_stop(Worker *pool, pthread_t *threads, int started, int count) {
+    for (int i = 1; i < started; i++) {
+        uint64_t one = 1;
+        __atomic_store_n(&pool[i].stopping, 1, __ATOMIC_RELEASE);
+        if (write(pool[i].wake_fd, &one, sizeof(one)) < 0) {
+            log_message(LOG_ERROR, "Error waking worker %d: %s", i, strerror(errno));
+        }
+    }
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pool[i].listen_sock >= 0) {
+            close(pool[i].listen_sock);
+        }
+        if (pool[i].epoll_fd >= 0) {
+            close(pool[i].epoll_fd);
+        }
+        if (pool[i].wake_fd >= 0) {
+            close(pool[i].wake_fd);
+        }
+        pthread_mutex_destroy(&pool[i].done_lock);
+    }
+    free(pool);
+    free(threads);
+}
+
+// Function to start the per-core workers and serve forever
+int reactor_run(int port, int workers) {
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+
+    // A client vanishing mid-send must not kill every connection of the process
+    signal(SIGPIPE, SIG_IGN);
+
+    Worker *pool = calloc(workers, sizeof(Worker));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (!pool || !threads) {
+        log_message(LOG_ERROR, "Out of memory starting %d workers", workers);
+        free(pool);
+        free(threads);
+        return -1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pool[i].id = i;
+        pool[i].port = port;
+        pool[i].listen_sock = pool[i].epoll_fd = pool[i].wake_fd = -1;
+        pthread_mutex_init(&pool[i].done_lock, NULL);
+    }
+    for (int i = 0; i < workers; i++) {
+        if (worker_setup(&pool[i]) != 0) {
+            reactor_stop(pool, threads, 0, workers);
+            return -1;
+        }
+    }
+
+    offload_start();
+
+    printf("Server started on port %d with %d epoll workers\n", port, workers);
+    log_message(LOG_INFO, "Server started on port %d with %d epoll workers", port, workers);
+
+    // Worker 0 runs on this thread; if any worker can't start, or it stops, the others are stopped too
+    int started = 1;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, worker_main, &pool[started]) != 0) {
+            log_message(LOG_ERROR, "Failed to create worker thread %d", started);
+            reactor_stop(pool, threads, started, workers);
+            return -1;
+        }
+    }
+    worker_main(&pool[0]);
+
+    reactor_stop(pool, threads, started, workers);
+    return -1;
+}
@@ -1,6 +1,17 @@
 #include "server.h"
 #include "logger.h"
 #include "protocol.h"
+#include "frame.h"
+#include "batch.h"
+#include "ranges.h"
+#include "merkle.h"
+#include "hashindex.h"
+#include "compresscache.h"
+#include "listing.h"
+#include "metaindex.h"
+#include "metrics.h"
+#include "trace.h"
+#include "transfer.h"
 
 char SRC_DIR[MAX_FILENAME] = "server_dir";
 
@@ -24,12 +35,22 @@ void set_socket_options(int sock) {
     }
 #endif
 
-    log_message(LOG_INFO, "Socket options set successfully on socket %d", sock);
+    log_message(LOG_DEBUG, "Socket options set successfully on socket %d", sock);
 }
 
 // Function to handle client connections
 void handle_client(int client_sock, struct sockaddr_in client_addr) {
     Payload payload;
+    Payload reply;
+    TraceContext trace = { .track = client_sock };
+
+    // Every connection starts with legacy parameters until the client negotiates
+    if (session_reset(client_sock) != 0) {
+        log_message(LOG_ERROR, "Out of memory for the session of socket %d; refusing the connection", client_sock);
+        close(client_sock);
+        return;
+    }
+    metrics_connection(1);
 
     // Infinite loop to continuously handle requests
     while (1) {
@@ -38,12 +59,15 @@ void handle_client(int client_sock, struct sockaddr_in client_addr) {
             log_message(LOG_ERROR, "Error receiving payload from client");
             break;  // Exit loop on error
         }
+        uint64_t started = metrics_now();
+        trace_attach(session_traced(client_sock) ? &trace : NULL);
+        uint64_t traced = trace_now();
 
         // Handle operations based on the payload type
         switch (payload.operation) {
             case OP_DOWNLOAD:
-                // Proceed with download if the metadata is accepted
-                send_file(client_sock, payload.filename, payload.offset);
+                // Proceed with download if the metadata is accepted; a nonzero size limits the range
+                send_file(client_sock, payload.filename, payload.offset, payload.file_size);
                 break;
 
             case OP_UPLOAD:
@@ -53,7 +77,7 @@ void handle_client(int client_sock, struct sockaddr_in client_addr) {
 
             case OP_REQ_META_DATA:
                 // Client requested metadata about a file, including offset
-                log_message(LOG_INFO, "Client requested metadata for %s at offset %ld", payload.filename, payload.offset);
+                log_message(LOG_DEBUG, "Client requested metadata for %s at offset %ld", payload.filename, payload.offset);
                 send_file_metadata(client_sock, payload.filename, payload.offset);
                 break;
 
@@ -68,6 +92,50 @@ void handle_client(int client_sock, struct sockaddr_in client_addr) {
                 send_file_list(client_sock);
                 break;
 
+            case OP_LIST_PAGE:
+                // One page of the listing, with sizes, times and optionally digests
+                send_list_page(client_sock, &payload);
+                break;
+
+            case OP_BATCH_META:
+            case OP_BATCH_DOWNLOAD:
+                // Metadata for many files in one reply, then the files themselves if asked
+                send_batch(client_sock, &payload);
+                break;
+
+            case OP_READ_RANGES:
+                // Exact byte ranges, merged where they touch
+                send_ranges(client_sock, &payload);
+                break;
+
+            case OP_MANIFEST:
+                // Merkle root and piece hashes for verification
+                send_manifest(client_sock, &payload);
+                break;
+
+            case OP_DELTA:
+                // Instructions rebuilding the client's copy, then the bytes it lacks
+                send_delta(client_sock, &payload);
+                break;
+
+            case OP_DELTA_SIGNATURE:
+                // Block checksums of our copy, so the client can send a delta
+                send_delta_signature(client_sock, &payload);
+                break;
+
+            case OP_DELTA_UPLOAD:
+                // Rebuild our copy from unchanged blocks and the literals that follow
+                receive_delta(client_sock, &payload);
+                break;
+
+            case OP_HELLO:
+                // Client proposes session parameters (piece size)
+                build_session_reply(client_sock, &payload, &reply);
+                if (send_payload(client_sock, &reply) != 0) {
+                    log_message(LOG_ERROR, "Failed to send session reply");
+                }
+                break;
+
             case OP_EXIT:
                 printf("Client requested to close the connection.\n");
                 log_message(LOG_INFO, "Client requested to close the connection.");
@@ -76,19 +144,43 @@ void handle_client(int client_sock, struct sockaddr_in client_addr) {
             default:
                 log_message(LOG_ERROR, "Invalid operation received from client: %d", payload.operation);
                 printf("Invalid operation received from client\n");
+                metrics_error(payload.operation);
                 break;
         }
+        metrics_request(payload.operation, started);
+        trace_span(opcode_name(payload.operation), traced, payload.filename, -1);
     }
 
 cleanup:
     // Clean up and close the client socket
+    trace_flush();
+    trace_attach(NULL);
+    session_reset(client_sock);
+    metrics_connection(-1);
     close(client_sock);
-    log_message(LOG_INFO, "Client connection closed.");
+    TransferStats stats;
+    transfer_get_stats(&stats);
+    log_message(LOG_INFO, "Client connection closed. Transfer totals: %llu bytes zero-copy, %llu bytes copied (%llu via io_uring), %llu fallbacks",
+                stats.zero_copy_bytes, stats.copied_bytes, stats.uring_bytes, stats.fallbacks);
 }
 
-// Function to send metadata about a file to the client
-void send_file_metadata(int client_sock, const char *filename, long offset) {
-    Payload metadata_payload;
+// Function to get the checksum of the piece that ends at an offset, from the hash index when it can
+static int piece_hash_at(const char *file_path, long offset, long piece_size, int algorithm, char *hash_output) {
+    struct stat file_stat;
+    unsigned char digest[MERKLE_HASH_SIZE];
+
+    // A miss hashes just the piece asked for; whole files are indexed by the background build and OP_MANIFEST
+    if (algorithm == HASH_ALGO_SHA256 && piece_size >= MIN_PIECE_SIZE && offset % piece_size == 0 &&
+        meta_index_stat(file_path, &file_stat) == 0 && offset <= file_stat.st_size &&
+        hash_index_lookup(&file_stat, piece_size, offset / piece_size - 1, digest) == 0) {
+        hex_encode(digest, MERKLE_HASH_SIZE, hash_output);
+        return 0;
+    }
+    return calculate_piece_hash(file_path, offset, piece_size, algorithm, hash_output);
+}
+
+// Function to build the metadata payload for a file
+int build_file_metadata(const char *filename, long offset, long piece_size, int hash_algorithm, Payload *metadata_payload) {
     struct stat file_stat;
 
     char file_path[MAX_FILENAME];
@@ -97,58 +189,110 @@ void send_file_metadata(int client_sock, const char *filename, long offset) {
     if (result < 0 || result >= sizeof(file_path)) {
         perror("Error forming file path");
         log_message(LOG_ERROR, "Error forming file path for filename: %s", filename);
-        return;
+        return -1;
     }
 
+    // Initialize the metadata payload
+    memset(metadata_payload, 0, sizeof(*metadata_payload));
+    metadata_payload->operation = OP_META_DATA;
+    strncpy(metadata_payload->filename, filename, sizeof(metadata_payload->filename) - 1);
+
     // Retrieve file statistics
-    if (stat(file_path, &file_stat) != 0) {
-        // File not found; send STAT_FILE_NOT_FOUND
+    if (meta_index_stat(file_path, &file_stat) != 0) {
+        // File not found; report STAT_FILE_NOT_FOUND
         log_message(LOG_ERROR, "File not found: %s", filename);
-        
-        // Initialize the payload for file not found status
-        memset(&metadata_payload, 0, sizeof(metadata_payload));
-        metadata_payload.operation = OP_META_DATA; // Set appropriate operation
-        memcpy(metadata_payload.filename, filename, sizeof(metadata_payload.filename));
-        metadata_payload.status = STAT_FILE_NOT_FOUND; // Set status to file not found
-
-        // Send the metadata payload to the client
-        if (send_payload(client_sock, &metadata_payload) != 0) {
-            log_message(LOG_ERROR, "Failed to send file not found status for: %s", filename);
-        } else {
-            log_message(LOG_INFO, "Sent file not found status for file: %s", filename);
-        }
-        return; // Exit the function after sending the error status
+        metrics_error(OP_REQ_META_DATA);
+        metadata_payload->status = STAT_FILE_NOT_FOUND;
+        return 0;
     }
 
-    long file_size = file_stat.st_size;
-    char hash[HASH_SIZE];
-
-    // Initialize the metadata payload
-    memset(&metadata_payload, 0, sizeof(metadata_payload));
-    metadata_payload.operation = OP_META_DATA;
-    memcpy(metadata_payload.filename, filename, sizeof(metadata_payload.filename));
-    metadata_payload.file_size = file_size;
+    metadata_payload->file_size = file_stat.st_size;
 
     // Handle the hash calculation based on the offset
     if (offset > 0) {
-        if (calculate_file_hash(file_path, offset, hash) == 0) {
-            memcpy(metadata_payload.hash, hash, sizeof(metadata_payload.hash));
-            metadata_payload.status = STAT_FILE_VERIFY;
-        } else {
+        char hash[HASH_SIZE];
+        if (piece_hash_at(file_path, offset, piece_size, hash_algorithm, hash) != 0) {
             log_message(LOG_ERROR, "Error calculating hash for file '%s'", file_path);
-            return;
+            return -1;
         }
+        memcpy(metadata_payload->hash, hash, sizeof(metadata_payload->hash));
+        metadata_payload->status = STAT_FILE_VERIFY;
     } else {
-        // No offset means this is a new upload; send an empty hash
-        metadata_payload.status = STAT_FILE_FOUND;
+        // No offset means this is a new download; send an empty hash
+        metadata_payload->status = STAT_FILE_FOUND;
+    }
+
+    return 0;
+}
+
+// Function to send metadata about a file to the client
+void send_file_metadata(int client_sock, const char *filename, long offset) {
+    Payload metadata_payload;
+
+    Session *session = session_get(client_sock);
+    if (build_file_metadata(filename, offset, session->piece_size, session->hash_algorithm, &metadata_payload) != 0) {
+        return;
     }
 
     // Send the metadata payload to the client
     if (send_payload(client_sock, &metadata_payload) != 0) {
         log_message(LOG_ERROR, "Failed to send metadata for file: %s", filename);
+    } else if (metadata_payload.status == STAT_FILE_NOT_FOUND) {
+        log_message(LOG_DEBUG, "Sent file not found status for file: %s", filename);
     } else {
-        log_message(LOG_INFO, "Sent metadata for file: %s with hash", filename);
+        log_message(LOG_DEBUG, "Sent metadata for file: %s with hash", filename);
+    }
+}
+
+// Function to build the header announcing a file stream to a pipelined request
+void build_data_header(const char *filename, long offset, long length, int status, Payload *header) {
+    memset(header, 0, sizeof(*header));
+    header->operation = OP_DATA;
+    header->status = status;
+    header->offset = offset;
+    header->file_size = length;
+    // The memset left the terminator; names that don't fit are cut short
+    header->filename_length = strnlen(filename, sizeof(header->filename) - 1);
+    memcpy(header->filename, filename, header->filename_length);
+}
+
+// Function to tell a pipelined client that no file stream follows
+static void send_data_error(int client_sock, const char *filename, long offset, int status) {
+    Payload header;
+    metrics_error(OP_DOWNLOAD);
+    if (session_get(client_sock)->request_id == 0) {
+        return;  // Lockstep clients learn about errors from the metadata reply
+    }
+    build_data_header(filename, offset, 0, status, &header);
+    if (send_payload(client_sock, &header) != 0) {
+        log_message(LOG_ERROR, "Failed to send data header for file: %s", filename);
+    }
+}
+
+// Function to agree on the session parameters proposed by the client
+void build_session_reply(int client_sock, const Payload *hello, Payload *reply) {
+    Session *session = session_get(client_sock);
+    session->piece_size = piece_size_agree(hello->file_size);
+
+    // The checksum algorithm and feature bits ride in the offset field; unknown algorithms fall back to SHA-256
+    int algorithm = (int)(hello->offset & HELLO_ALGORITHM_MASK);
+    session->hash_algorithm = hash_digest_size(algorithm) > 0 ? algorithm : HASH_ALGO_SHA256;
+    session->features = (int)(hello->offset & SESSION_FEATURES);
+    if (!trace_enabled()) {
+        session->features &= ~SESSION_FEATURE_TRACE;  // Started with --no-trace
     }
+
+    // So does the stream codec; one we don't know leaves streams raw
+    int codec = (int)((hello->offset & HELLO_COMPRESS_MASK) >> HELLO_COMPRESS_SHIFT);
+    session->compression = compress_codec_supported(codec) ? codec : COMPRESS_NONE;
+
+    memset(reply, 0, sizeof(*reply));
+    reply->operation = OP_HELLO;
+    reply->status = STAT_ACCEPTED;
+    reply->file_size = session->piece_size;
+    reply->offset = session->hash_algorithm | session->features | ((long)session->compression << HELLO_COMPRESS_SHIFT);
+    log_message(LOG_INFO, "Agreed piece size %ld, %s checksums, features 0x%x and %s compression (client proposed %ld and 0x%lx)", session->piece_size,
+                hash_algorithm_name(session->hash_algorithm), session->features, compress_codec_name(session->compression), hello->file_size, hello->offset);
 }
 
 // Function to send request for metadata
@@ -167,169 +311,625 @@ void send_request_metadata(int client_sock, const char *filename) {
         return;  // Exit if sending fails
     }
 
-    log_message(LOG_INFO, "Requested metadata for file: %s", filename);
+    log_message(LOG_DEBUG, "Requested metadata for file: %s", filename);
 }
 
-// Function to send the list of available files in the shared directory
-void send_file_list(int client_sock) {
+// Function to build the newline-separated list of files in the shared directory
+ssize_t build_file_list(ByteBuf *file_list, size_t limit) {
     DIR *dir;
     struct dirent *entry;
-    char file_list[1024] = "";  // Buffer to hold the file list
+    size_t length = 0;
+
+    // The metadata index answers without reading the directory once it is current
+    size_t start = file_list->len;
+    ssize_t indexed = meta_index_list(file_list, limit);
+    if (indexed >= 0) {
+        return indexed;
+    }
+    file_list->len = start;
 
     dir = opendir(SRC_DIR);
     if (dir == NULL) {
         log_message(LOG_ERROR, "Error opening shared directory: %s", strerror(errno));
-        const char *error_message = "Error opening shared directory.\n";
-        send(client_sock, error_message, strlen(error_message), 0);
-        return;  // Exit the function on error
+        return -1;
     }
 
     while ((entry = readdir(dir)) != NULL) {
         // Only consider regular files
-        if (entry->d_type == DT_REG) {  
-            // Check if adding this file name would exceed the buffer size
-            size_t new_length = strlen(file_list) + strlen(entry->d_name) + 2; // +2 for newline and null-terminator
-            if (new_length < sizeof(file_list)) {
-                strcat(file_list, entry->d_name);
-                strcat(file_list, "\n");
+        if (entry->d_type == DT_REG) {
+            // Check if adding this file name would exceed the limit
+            size_t name_length = strlen(entry->d_name);
+            if (length + name_length + 1 <= limit) { // +1 for the newline
+                bytebuf_put(file_list, entry->d_name, name_length);
+                bytebuf_put(file_list, "\n", 1);
+                length += name_length + 1;
             } else {
                 log_message(LOG_INFO, "File list too long, truncating");
-                break;  // Stop adding more files to avoid overflow
+                break;  // Stop adding more files
             }
         }
     }
 
     closedir(dir);
+    return file_list->failed ? -1 : (ssize_t)length;
+}
+
+// Function to build the file list reply in the wire format of a connection
+ssize_t build_file_list_reply(int client_sock, ByteBuf *reply) {
+    ByteBuf file_list = {0};
 
-    // Check if the file list is empty and send an appropriate message
-    if (strlen(file_list) == 0) {
+    // Frames carry their own length; legacy clients read the list with one FILE_LIST_SIZE read
+    size_t limit = session_get(client_sock)->wire == WIRE_FRAMED ? SIZE_MAX : FILE_LIST_SIZE - 1;
+    ssize_t length = build_file_list(&file_list, limit);
+    if (length < 0) {
+        const char *error_message = "Error opening shared directory.\n";
+        message_put(client_sock, reply, OP_FILE_LIST, error_message, strlen(error_message));
+    } else if (length == 0) {
+        // Check if the file list is empty and send an appropriate message
         const char *no_files_message = "No files available in the shared directory.\n";
-        send(client_sock, no_files_message, strlen(no_files_message), 0);
+        message_put(client_sock, reply, OP_FILE_LIST, no_files_message, strlen(no_files_message));
     } else {
-        // Send the file list directly
-        if (send(client_sock, file_list, strlen(file_list), 0) < 0) {
-            log_message(LOG_ERROR, "Error sending file list to client: %s", strerror(errno));
-        } else {
-            log_message(LOG_INFO, "Sent file list to client.");
-        }
+        message_put(client_sock, reply, OP_FILE_LIST, file_list.data, file_list.len);
+    }
+    bytebuf_free(&file_list);
+    return length;
+}
+
+// Function to send the list of available files in the shared directory
+void send_file_list(int client_sock) {
+    ByteBuf reply = {0};
+
+    ssize_t length = build_file_list_reply(client_sock, &reply);
+    if (reply.failed || send_bytes(client_sock, reply.data, reply.len) != 0) {
+        log_message(LOG_ERROR, "Error sending file list to client: %s", strerror(errno));
+    } else if (length > 0) {
+        log_message(LOG_INFO, "Sent file list to client.");
     }
+    bytebuf_free(&reply);
 }
 
-// Function to send a file in chunks from a specific offset
-void send_file(int client_sock, const char *filename, long offset) {
+// Function to build one page of the file listing
+void build_list_page(int client_sock, const Payload *request, ByteBuf *reply) {
+    uint64_t cursor;
+    int limit, flags;
+    if (list_parse_request(client_sock, &cursor, &limit, &flags) != 0) {
+        log_message(LOG_ERROR, "Malformed listing request");
+        size_t start = frame_begin(reply, OP_LIST_PAGE, session_get(client_sock)->request_id);
+        bytebuf_put_svarint(reply, STAT_SERVER_ERROR);
+        frame_end(reply, start);
+        return;
+    }
+
+    int count = list_put_page(client_sock, reply, SRC_DIR, request->filename, cursor, limit, flags);
+    if (count >= 0) {
+        log_message(LOG_INFO, "Sent listing page of %d files from cursor %llu (filter '%s')", count, (unsigned long long)cursor, request->filename);
+    }
+}
+
+// Function to answer a paged listing request
+void send_list_page(int client_sock, const Payload *request) {
+    ByteBuf reply = {0};
+    build_list_page(client_sock, request, &reply);
+    if (reply.failed || send_bytes(client_sock, reply.data, reply.len) != 0) {
+        log_message(LOG_ERROR, "Error sending listing page to client: %s", strerror(errno));
+    }
+    bytebuf_free(&reply);
+}
+
+// Function to send a file from a specific offset
+void send_file(int client_sock, const char *filename, long offset, long max_length) {
     char file_path[MAX_FILENAME];
+    uint64_t started = metrics_now();
     // Form the full file path
     int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, filename);
 
     // Check for snprintf errors
     if (result < 0 || result >= sizeof(file_path)) {
         log_message(LOG_ERROR, "Error forming file path for filename: %s", filename);
+        send_data_error(client_sock, filename, offset, STAT_SERVER_ERROR);
         return;
     }
 
-    // Open the file for reading
-    FILE *file = fopen(file_path, "rb");
-    if (!file) {
+    // Open the file for reading (hot files stay open between requests)
+    struct stat file_stat;
+    int fd = meta_index_open_file(file_path, &file_stat);
+    if (fd < 0) {
         log_message(LOG_ERROR, "Error opening file: %s", file_path);
+        send_data_error(client_sock, filename, offset, STAT_FILE_NOT_FOUND);
         return;
     }
 
-    // Move the file pointer to the desired offset
-    if (fseek(file, offset, SEEK_SET) != 0) {
-        log_message(LOG_ERROR, "Error seeking to offset %ld in file: %s", offset, file_path);
-        fclose(file);
-        return;
+    // Stream from the offset to the end of the file (kernel-to-kernel when possible)
+    off_t length = file_stat.st_size > offset ? file_stat.st_size - offset : 0;
+    if (max_length > 0 && length > max_length) {
+        length = max_length;
+    }
+    TransferStats stats = {0};
+
+    // Pipelined requests get the stream length up front
+    if (session_get(client_sock)->request_id != 0) {
+        Payload header;
+        build_data_header(filename, offset, length, STAT_FILE_FOUND, &header);
+        if ((length > 0 ? send_payload_more(client_sock, &header) : send_payload(client_sock, &header)) != 0) {
+            log_message(LOG_ERROR, "Failed to send data header for file: %s", file_path);
+            meta_index_close_file(fd);
+            return;
+        }
     }
 
-    char buffer[CHUNK_SIZE];
-    ssize_t bytes_read;
+    // The stream is hashed as it goes out and its digest follows it
+    Hasher hasher;
+    Hasher *digest = trailer_begin(client_sock, &hasher);
+    CompressStream stream;
+    int compressed = session_compress_begin(client_sock, &stream, 1);
+    uint64_t first_byte = metrics_now();
+    trace_stream_begin();
+
+    // Whole-file compressed downloads of hot files go out precompressed, straight from the cache
+    CachedCopy copy = { .fd = -1 };
+    int cached = compressed > 0 && offset == 0 && length == file_stat.st_size &&
+                 compress_cache_lookup(filename, &file_stat, stream.codec, session_get(client_sock)->hash_algorithm, &copy);
+    off_t sent;
+    if (cached && copy.fd >= 0) {
+        sent = transfer_send_file(client_sock, copy.fd, copy.offset, copy.length, session_get(client_sock)->piece_size, &stats, NULL) == copy.length
+             ? length : -1;
+        stream.wire_bytes = copy.length;
+        close(copy.fd);
+    } else {
+        stream.skipping = cached && copy.incompressible;  // Known not to compress: no need to sample it again
+        sent = compressed > 0 ? transfer_send_compressed(client_sock, fd, offset, length, &stream, &stats, digest)
+             : compressed == 0 ? transfer_send_file(client_sock, fd, offset, length, session_get(client_sock)->piece_size, &stats, digest)
+             : -1;
+        cached = 0;
+    }
 
-    // Read and send the file in chunks
-    while ((bytes_read = fread(buffer, 1, CHUNK_SIZE, file)) > 0) {
-        ssize_t bytes_sent = 0;
+    metrics_transfer(OP_DOWNLOAD, started, first_byte, sent > 0 ? sent : 0, 1);
+    trace_stream_end("send_file", filename);
+    if (sent < 0) {
+        log_message(LOG_ERROR, "Error sending file: %s", file_path);
+        metrics_error(OP_DOWNLOAD);
+    } else {
+        log_message(LOG_INFO, "Successfully sent file: %s from offset: %ld (%llu bytes zero-copy, %llu bytes copied, %llu bytes on the wire%s)",
+                    file_path, offset, stats.zero_copy_bytes, stats.copied_bytes, compressed > 0 ? stream.wire_bytes : (unsigned long long)sent,
+                    cached ? ", from the compressed cache" : "");
+    }
+    compress_end(&stream);
+    if (session_trailers(client_sock) && sent == length) {
+        Payload trailer;
+        if (cached) {
+            if (digest) {
+                hasher_free(digest);  // The cache already knows the digest of the file
+            }
+            trailer_build(NULL, filename, offset, length, &trailer);
+            strcpy(trailer.hash, copy.hash);
+        } else {
+            trailer_build(digest, filename, offset, length, &trailer);
+        }
+        if (send_payload(client_sock, &trailer) != 0) {
+            log_message(LOG_ERROR, "Failed to send trailer for file: %s", file_path);
+        }
+    } else if (digest) {
+        hasher_free(digest);
+    }
 
-        // Ensure the entire buffer is sent
-        while (bytes_sent < bytes_read) {
-            ssize_t send_result = send(client_sock, buffer + bytes_sent, bytes_read - bytes_sent, 0);
-            if (send_result < 0) {
-                log_message(LOG_ERROR, "Error sending file: %s", file_path);
-                fclose(file);
-                return;
+    meta_index_close_file(fd);
+}
+
+// Function to answer a batch metadata or download request
+void send_batch(int client_sock, const Payload *request) {
+    Batch batch;
+    ByteBuf reply = {0};
+
+    // An unresolvable batch is answered with an empty list so the client isn't left waiting
+    if (batch_resolve(client_sock, request, SRC_DIR, &batch) != 0) {
+        log_message(LOG_ERROR, "Error resolving batch request (pattern '%s')", request->filename);
+    }
+    batch_put_metadata(client_sock, &reply, &batch);
+    int result = reply.failed ? -1 : send_bytes(client_sock, reply.data, reply.len);
+    bytebuf_free(&reply);
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send batch metadata");
+        batch_free(&batch);
+        return;
+    }
+    log_message(LOG_INFO, "Sent batch metadata for %d files", batch.count);
+
+    // Stream the files back to back, each announced by its own header
+    const BatchFile *file;
+    off_t length;
+    int fd;
+    uint64_t started = metrics_now();
+    while (request->operation == OP_BATCH_DOWNLOAD && ((fd = batch_open_next(&batch, &file, &length)) >= 0 || file)) {
+        Payload header;
+        build_data_header(file->filename, 0, fd >= 0 ? length : 0, fd >= 0 ? STAT_FILE_FOUND : STAT_FILE_NOT_FOUND, &header);
+        if (fd < 0 || length == 0) {
+            result = send_payload(client_sock, &header);
+        } else {
+            result = send_payload_more(client_sock, &header);
+            uint64_t first_byte = metrics_now();
+            if (result == 0 && transfer_send_file(client_sock, fd, 0, length, session_get(client_sock)->piece_size, NULL, NULL) != length) {
+                result = -1;
             }
-            bytes_sent += send_result;
+            metrics_transfer(request->operation, started, first_byte, result == 0 ? length : 0, 1);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (result != 0) {
+            log_message(LOG_ERROR, "Error sending batch file: %s", file->filename);
+            metrics_error(request->operation);
+            break;
         }
     }
 
-    // Check for reading errors
-    if (ferror(file)) {
-        log_message(LOG_ERROR, "Error reading file: %s", file_path);
-    } else {
-        log_message(LOG_INFO, "Successfully sent file: %s from offset: %ld", file_path, offset);
+    batch_free(&batch);
+}
+
+// Function to answer a range read request
+void send_ranges(int client_sock, const Payload *request) {
+    uint64_t started = metrics_now();
+    ByteRange *ranges = NULL;
+    int count = ranges_parse(client_sock, &ranges);
+    int status = count < 0 ? STAT_SERVER_ERROR : STAT_FILE_FOUND;
+    struct stat file_stat = {0};
+    int fd = -1;
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, request->filename);
+    if (result < 0 || result >= sizeof(file_path)) {
+        log_message(LOG_ERROR, "Error forming file path for filename: %s", request->filename);
+        status = status == STAT_FILE_FOUND ? STAT_FILE_NOT_FOUND : status;
+    } else if (status == STAT_FILE_FOUND && (fd = meta_index_open_file(file_path, &file_stat)) < 0) {
+        log_message(LOG_ERROR, "Error opening file: %s", file_path);
+        status = STAT_FILE_NOT_FOUND;
+    }
+    count = status == STAT_FILE_FOUND ? ranges_coalesce(ranges, count, file_stat.st_size) : 0;
+
+    // The reply travels with the first range header; each header travels with its range
+    ByteBuf out = {0};
+    ranges_put_reply(client_sock, &out, status, file_stat.st_size, count);
+    uint64_t first_byte = metrics_now();
+    uint64_t sent = 0;
+    result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        Payload header;
+        build_data_header(request->filename, ranges[i].offset, ranges[i].length, STAT_FILE_FOUND, &header);
+        payload_put(client_sock, &out, &header);
+        result = out.failed ? -1 : send_bytes_more(client_sock, out.data, out.len);
+        out.len = 0;
+        if (result == 0 && transfer_send_file(client_sock, fd, ranges[i].offset, ranges[i].length, session_get(client_sock)->piece_size, NULL, NULL) != ranges[i].length) {
+            result = -1;
+        }
+        sent += result == 0 ? ranges[i].length : 0;
+    }
+    if (result == 0 && out.len > 0) {
+        result = out.failed ? -1 : send_bytes(client_sock, out.data, out.len);
     }
 
-    fclose(file);
+    if (count > 0) {
+        metrics_transfer(OP_READ_RANGES, started, first_byte, sent, 1);
+    }
+    if (result != 0 || status != STAT_FILE_FOUND) {
+        metrics_error(OP_READ_RANGES);
+    }
+    if (result != 0) {
+        log_message(LOG_ERROR, "Error sending ranges of file: %s", file_path);
+    } else if (count > 0) {
+        log_message(LOG_INFO, "Sent %d ranges of file: %s", count, file_path);
+    }
+    bytebuf_free(&out);
+    free(ranges);
+    meta_index_close_file(fd);
+}
+
+// Function to build the reply to a manifest request
+void build_manifest(int client_sock, const Payload *request, ByteBuf *reply) {
+    long first = 0, count = 0;
+    int status = STAT_FILE_FOUND;
+    MerkleTree tree = {0};
+    struct stat file_stat;
+    unsigned char *digests = NULL;
+    long pieces;
+    int fd = -1;
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, request->filename);
+    if (manifest_parse_request(client_sock, &first, &count) != 0) {
+        log_message(LOG_ERROR, "Malformed manifest request for file: %s", request->filename);
+        status = STAT_SERVER_ERROR;
+    } else if (result < 0 || result >= sizeof(file_path) ||
+               (fd = meta_index_open_file(file_path, &file_stat)) < 0 || !S_ISREG(file_stat.st_mode)) {
+        log_message(LOG_ERROR, "Error opening file: %s", file_path);
+        status = STAT_FILE_NOT_FOUND;
+    } else if (hash_index_digests(fd, &file_stat, session_get(client_sock)->piece_size, &digests, &pieces) != 0 ||
+               merkle_build_from_digests(&tree, digests, file_stat.st_size, session_get(client_sock)->piece_size) != 0) {
+        log_message(LOG_ERROR, "Error hashing file: %s", file_path);
+        status = STAT_SERVER_ERROR;
+    }
+    meta_index_close_file(fd);
+    free(digests);
+
+    manifest_put_reply(client_sock, reply, status, &tree, first, count);
+    if (status == STAT_FILE_FOUND) {
+        char root[HASH_SIZE];
+        hex_encode(merkle_root(&tree), MERKLE_HASH_SIZE, root);
+        log_message(LOG_INFO, "Built manifest for file: %s (%ld pieces, root %s)", file_path, tree.leaf_count, root);
+    }
+    merkle_free(&tree);
+}
+
+// Function to answer a manifest request
+void send_manifest(int client_sock, const Payload *request) {
+    ByteBuf reply = {0};
+    build_manifest(client_sock, request, &reply);
+    if (reply.failed || send_bytes(client_sock, reply.data, reply.len) != 0) {
+        log_message(LOG_ERROR, "Failed to send manifest for file: %s", request->filename);
+    }
+    bytebuf_free(&reply);
+}
+
+// Function to build the reply to a delta download request
+int build_delta(int client_sock, const Payload *request, ByteBuf *reply, int *fd, ByteRange **literals) {
+    DeltaSignature signature;
+    DeltaScript script = {0};
+    struct stat file_stat;
+    int status = STAT_FILE_FOUND;
+    int count = 0;
+    *fd = -1;
+    *literals = NULL;
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, request->filename);
+    if (delta_parse_request(client_sock, &signature) != 0) {
+        log_message(LOG_ERROR, "Malformed delta request for file: %s", request->filename);
+        status = STAT_SERVER_ERROR;
+    } else if (result < 0 || result >= sizeof(file_path) ||
+               (*fd = meta_index_open_file(file_path, &file_stat)) < 0 || !S_ISREG(file_stat.st_mode)) {
+        log_message(LOG_ERROR, "Error opening file: %s", file_path);
+        status = STAT_FILE_NOT_FOUND;
+    } else if (delta_script_build(*fd, file_stat.st_size, &signature, &script) != 0 ||
+               (count = delta_script_literals(&script, literals)) < 0) {
+        log_message(LOG_ERROR, "Error computing delta of file: %s", file_path);
+        status = STAT_SERVER_ERROR;
+        count = 0;
+    }
+    delta_signature_free(&signature);
+
+    delta_put_reply(client_sock, reply, status, &script);
+    if (status == STAT_FILE_FOUND) {
+        long literal_bytes = 0;
+        for (int i = 0; i < count; i++) {
+            literal_bytes += (*literals)[i].length;
+        }
+        log_message(LOG_INFO, "Built delta for file: %s (%d steps, %ld of %ld bytes literal)",
+                    file_path, script.count, literal_bytes, script.file_size);
+    }
+    delta_script_free(&script);
+
+    if (count == 0) {
+        free(*literals);
+        *literals = NULL;
+        meta_index_close_file(*fd);
+        *fd = -1;
+    }
+    return count;
+}
+
+// Function to answer a delta download request
+void send_delta(int client_sock, const Payload *request) {
+    uint64_t started = metrics_now();
+    ByteBuf reply = {0};
+    ByteRange *literals;
+    int fd;
+    int count = build_delta(client_sock, request, &reply, &fd, &literals);
+
+    // The reply travels with the first literal; the literals follow each other without headers
+    int result = reply.failed ? -1 : count > 0 ? send_bytes_more(client_sock, reply.data, reply.len) : send_bytes(client_sock, reply.data, reply.len);
+    TransferStats stats = {0};
+    uint64_t first_byte = metrics_now();
+    for (int i = 0; i < count && result == 0; i++) {
+        if (transfer_send_file(client_sock, fd, literals[i].offset, literals[i].length, session_get(client_sock)->piece_size, &stats, NULL) != literals[i].length) {
+            result = -1;
+        }
+    }
+    if (count > 0) {
+        metrics_transfer(OP_DELTA, started, first_byte, stats.zero_copy_bytes + stats.copied_bytes, 1);
+    }
+
+    if (result != 0) {
+        log_message(LOG_ERROR, "Failed to send delta of file: %s", request->filename);
+        metrics_error(OP_DELTA);
+    } else if (count > 0) {
+        log_message(LOG_INFO, "Sent %d literal ranges of file: %s (%llu bytes zero-copy, %llu bytes copied)",
+                    count, request->filename, stats.zero_copy_bytes, stats.copied_bytes);
+    }
+    bytebuf_free(&reply);
+    free(literals);
+    meta_index_close_file(fd);
+}
+
+// Function to build the reply to a signature request
+void build_delta_signature(int client_sock, const Payload *request, ByteBuf *reply) {
+    DeltaSignature signature = {0};
+    int status = STAT_FILE_FOUND;
+    struct stat file_stat;
+    int fd = -1;
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, request->filename);
+    if (result < 0 || result >= sizeof(file_path) ||
+        (fd = meta_index_open_file(file_path, &file_stat)) < 0 || !S_ISREG(file_stat.st_mode)) {
+        log_message(LOG_INFO, "No copy of file to delta against: %s", file_path);
+        status = STAT_FILE_NOT_FOUND;
+    } else if (delta_signature_build(fd, file_stat.st_size, &signature) != 0) {
+        log_message(LOG_ERROR, "Error hashing file: %s", file_path);
+        status = STAT_SERVER_ERROR;
+    }
+    meta_index_close_file(fd);
+
+    delta_put_signature_reply(client_sock, reply, status, &signature);
+    if (status == STAT_FILE_FOUND) {
+        log_message(LOG_INFO, "Built delta signature for file: %s (%ld blocks of %ld bytes)", file_path, signature.count, signature.block_size);
+    }
+    delta_signature_free(&signature);
+}
+
+// Function to answer a signature request
+void send_delta_signature(int client_sock, const Payload *request) {
+    ByteBuf reply = {0};
+    build_delta_signature(client_sock, request, &reply);
+    if (reply.failed || send_bytes(client_sock, reply.data, reply.len) != 0) {
+        log_message(LOG_ERROR, "Failed to send delta signature for file: %s", request->filename);
+    }
+    bytebuf_free(&reply);
+}
+
+// Function to start applying a delta upload by copying the unchanged blocks
+int begin_delta_upload(int client_sock, const Payload *request, DeltaPatch *patch, ByteRange **literals) {
+    DeltaScript script;
+    memset(patch, 0, sizeof(*patch));
+    patch->fd = -1;
+    *literals = NULL;
+
+    if (delta_parse_upload(client_sock, &script) != 0) {
+        log_message(LOG_ERROR, "Malformed delta upload for file: %s", request->filename);
+        return -1;
+    }
+    int count = delta_script_literals(&script, literals);
+
+    char file_path[MAX_FILENAME];
+    int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, request->filename);
+    if (count >= 0 && (result < 0 || result >= sizeof(file_path) || delta_patch_open(patch, file_path, &script) != 0)) {
+        log_message(LOG_ERROR, "Error rebuilding file: %s; discarding the delta", file_path);
+    }
+    delta_script_free(&script);
+    return count;
+}
+
+// Function to finish applying a delta upload and build the reply to it
+void finish_delta_upload(DeltaPatch *patch, const char *filename, int complete, Payload *reply) {
+    memset(reply, 0, sizeof(*reply));
+    reply->operation = OP_DELTA_UPLOAD;
+    reply->status = STAT_SERVER_ERROR;
+    strncpy(reply->filename, filename, sizeof(reply->filename) - 1);
+    reply->file_size = patch->file_size;
+    if (patch->temp_path[0] == '\0') {
+        return;  // Nothing was rebuilt
+    }
+
+    if (delta_patch_finish(patch, complete) != 0) {
+        log_message(LOG_ERROR, "Delta upload did not rebuild file: %s; keeping the old copy", patch->path);
+        return;
+    }
+    meta_index_refresh(patch->path);
+    reply->status = STAT_FILE_FOUND;
+    log_message(LOG_INFO, "Rebuilt file from a delta upload: %s, total size: %ld bytes", patch->path, patch->file_size);
+}
+
+// Function to receive a delta upload and rebuild the file from the server's copy
+void receive_delta(int client_sock, const Payload *request) {
+    uint64_t started = metrics_now();
+    DeltaPatch patch;
+    ByteRange *literals;
+    Payload reply;
+    int count = begin_delta_upload(client_sock, request, &patch, &literals);
+
+    // Literals for a file that can't be rebuilt are still read, to keep the stream in step
+    int fd = patch.fd >= 0 ? patch.fd : open("/dev/null", O_WRONLY);
+    TransferStats stats = {0};
+    int complete = count >= 0 && fd >= 0;
+    uint64_t first_byte = metrics_now();
+    for (int i = 0; i < count && complete; i++) {
+        complete = transfer_recv_file(client_sock, fd, literals[i].offset, literals[i].length, &stats, NULL) == literals[i].length;
+    }
+    if (count > 0) {
+        metrics_transfer(OP_DELTA_UPLOAD, started, first_byte, stats.zero_copy_bytes + stats.copied_bytes, 0);
+    }
+    if (fd >= 0 && fd != patch.fd) {
+        close(fd);
+    }
+    free(literals);
+
+    finish_delta_upload(&patch, request->filename, complete, &reply);
+    if (reply.status != STAT_FILE_FOUND) {
+        metrics_error(OP_DELTA_UPLOAD);
+    }
+    if (send_payload(client_sock, &reply) != 0) {
+        log_message(LOG_ERROR, "Failed to send delta upload reply for file: %s", request->filename);
+    }
 }
 
 // Function to receive a file from the client and save it (with overwrite and reliability)
 void receive_file(int client_sock, const char *filename, long expected_file_size) {
     char file_path[MAX_FILENAME];
+    uint64_t started = metrics_now();
     
     // Form the file path for saving the received file
     int result = snprintf(file_path, sizeof(file_path), "%s/%s", SRC_DIR, filename);
     if (result < 0 || result >= sizeof(file_path)) {
         log_message(LOG_ERROR, "Error forming file path for filename: %s", filename);
+        metrics_error(OP_META_DATA);
         return;
     }
 
-    // Open the file in "wb" mode to overwrite if it exists
-    FILE *file = fopen(file_path, "wb");
-    if (!file) {
+    // Open the file with O_TRUNC to overwrite if it exists (readable too, for the running digest)
+    int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         log_message(LOG_ERROR, "Error creating file: %s", file_path);
+        metrics_error(OP_META_DATA);
         return;
     }
 
-    char buffer[CHUNK_SIZE];
-    long total_bytes_received = 0;
-
-    // Loop to receive chunks until the full file is received
-    while (total_bytes_received < expected_file_size) {
-        // Calculate the size of the chunk to receive
-        long bytes_remaining = expected_file_size - total_bytes_received;
-        int chunk_size = (bytes_remaining < CHUNK_SIZE) ? bytes_remaining : CHUNK_SIZE;
-
-        // Receive the next chunk
-        ssize_t bytes_received = recv(client_sock, buffer, chunk_size, 0);
-        if (bytes_received <= 0) {
-            // Log closure or error details
-            if (bytes_received == 0) {
-                log_message(LOG_INFO, "Connection closed by client before full file was received");
-            } else {
-                log_message(LOG_ERROR, "Error receiving file: %s", file_path);
-            }
-            fclose(file);
-            return;
+    // Receive exactly the announced size (socket->pipe->file when possible)
+    TransferStats stats = {0};
+    Hasher hasher;
+    Hasher *digest = trailer_begin(client_sock, &hasher);
+    CompressStream stream;
+    int compressed = session_compress_begin(client_sock, &stream, 0);
+    uint64_t first_byte = metrics_now();
+    trace_stream_begin();
+    off_t total_bytes_received = compressed > 0 ? transfer_recv_compressed(client_sock, fd, 0, expected_file_size, &stream, &stats, digest)
+                               : compressed == 0 ? transfer_recv_file(client_sock, fd, 0, expected_file_size, &stats, digest)
+                               : -1;
+    unsigned long long wire_bytes = compressed > 0 ? stream.wire_bytes : (unsigned long long)total_bytes_received;
+    compress_end(&stream);
+    close(fd);
+    meta_index_refresh(file_path);
+    metrics_transfer(OP_META_DATA, started, first_byte, total_bytes_received > 0 ? total_bytes_received : 0, 0);
+    trace_stream_end("receive_file", filename);
+
+    if (total_bytes_received < 0) {
+        log_message(LOG_ERROR, "Error receiving file: %s", file_path);
+        metrics_error(OP_META_DATA);
+        if (digest) {
+            hasher_free(digest);
         }
+        return;
+    }
 
-        // Write the received chunk to the file
-        size_t bytes_written = fwrite(buffer, 1, bytes_received, file);
-        if (bytes_written != bytes_received) {
-            log_message(LOG_ERROR, "Error writing to file: %s", file_path);
-            fclose(file);
+    // The client's digest of what it sent follows the file
+    if (session_trailers(client_sock) && total_bytes_received == expected_file_size) {
+        Payload trailer;
+        trailer_build(digest, filename, 0, expected_file_size, &trailer);
+        if (receive_trailer(client_sock, &trailer) != 0) {
+            log_message(LOG_ERROR, "Integrity check failed for uploaded file: %s; removing it", file_path);
+            unlink(file_path);
+            meta_index_refresh(file_path);
+            metrics_error(OP_META_DATA);
             return;
         }
-
-        total_bytes_received += bytes_received;
-
-        // Log the progress
-        log_message(LOG_INFO, "Received %ld of %ld bytes for file: %s", total_bytes_received, expected_file_size, file_path);
+        log_message(LOG_INFO, "Verified %s hash of uploaded file: %s", hash_algorithm_name(hasher.algorithm), file_path);
+    } else if (digest) {
+        hasher_free(digest);
     }
 
     // Final verification of received file size
     if (total_bytes_received == expected_file_size) {
-        log_message(LOG_INFO, "Successfully received complete file: %s, total size: %ld bytes", file_path, total_bytes_received);
+        log_message(LOG_INFO, "Successfully received complete file: %s, total size: %ld bytes (%llu bytes zero-copy, %llu bytes copied, %llu bytes on the wire)",
+                    file_path, (long)total_bytes_received, stats.zero_copy_bytes, stats.copied_bytes, wire_bytes);
     } else {
-        log_message(LOG_ERROR, "Incomplete file received: %s. Expected %ld bytes, but got %ld bytes", file_path, expected_file_size, total_bytes_received);
+        log_message(LOG_INFO, "Connection closed by client before full file was received");
+        log_message(LOG_ERROR, "Incomplete file received: %s. Expected %ld bytes, but got %ld bytes", file_path, expected_file_size, (long)total_bytes_received);
+        metrics_error(OP_META_DATA);
     }
-
-    fclose(file);
 }
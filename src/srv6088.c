@@ -1,14 +1,17 @@
 #include "server.h"
 #include "logger.h"
 #include "protocol.h"
-
-#include "server.h"
-#include "logger.h"
-#include "protocol.h"
+#include "transfer.h"
+#include "reactor.h"
+#include "hashindex.h"
+#include "compresscache.h"
+#include "metaindex.h"
+#include "metrics.h"
+#include "trace.h"
 
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        fprintf(stderr, "Usage: %s -p <port> --source-directory <dir>\n", argv[0]);
+        fprintf(stderr, "Usage: %s -p <port> --source-directory <dir> [--mode fork|epoll] [--workers <n>] [--no-hash-index] [--no-compress-cache] [--compress-cache-size <MB>] [--no-metadata-index] [--metrics <port|path>] [--no-trace]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -18,6 +21,13 @@ int main(int argc, char *argv[]) {
     socklen_t client_len = sizeof(client_addr);
     char *source_directory = NULL;
     int verbose_mode = 0;
+    int epoll_mode = 0;
+    int workers = 0;
+    int hash_index = 1;
+    int metadata_index = 1;
+    long compress_cache_limit = COMPRESS_CACHE_DEFAULT_LIMIT;
+    const char *metrics_address = NULL;
+    int tracing = 1;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
@@ -28,6 +38,26 @@ int main(int argc, char *argv[]) {
             port = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--source-directory") == 0) {
             source_directory = argv[++i];
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            epoll_mode = strcmp(argv[++i], "epoll") == 0;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-zero-copy") == 0) {
+            transfer_set_zero_copy(0);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            transfer_set_uring(1);
+        } else if (strcmp(argv[i], "--no-hash-index") == 0) {
+            hash_index = 0;
+        } else if (strcmp(argv[i], "--no-compress-cache") == 0) {
+            compress_cache_limit = 0;
+        } else if (strcmp(argv[i], "--compress-cache-size") == 0 && i + 1 < argc) {
+            compress_cache_limit = atol(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--no-metadata-index") == 0) {
+            metadata_index = 0;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_address = argv[++i];
+        } else if (strcmp(argv[i], "--no-trace") == 0) {
+            tracing = 0;
         }
     }
 
@@ -40,6 +70,41 @@ int main(int argc, char *argv[]) {
     strncpy(SRC_DIR, source_directory, sizeof(SRC_DIR) - 1);
     SRC_DIR[sizeof(SRC_DIR) - 1] = '\0';  // Ensure null termination
 
+    // Every child and worker records into the same counters; the endpoint is served by this process
+    metrics_open();
+    if (metrics_address && metrics_serve(metrics_address) != 0) {
+        fprintf(stderr, "Could not serve metrics on %s\n", metrics_address);
+        exit(EXIT_FAILURE);
+    }
+
+    // Clients that ask for a trace get their connection recorded, one file per process, without a restart
+    if (tracing) {
+        char trace_dir[MAX_FILENAME + 16];
+        snprintf(trace_dir, sizeof(trace_dir), "%s.traces/", SRC_DIR);
+        trace_open(trace_dir, "server");
+    }
+
+    // Keep the directory's metadata in memory so requests skip stat and open; every child and worker shares it
+    if (metadata_index) {
+        meta_index_open(SRC_DIR);
+    }
+
+    // Load the piece digests of earlier runs; a new index fills in the background while clients are served
+    if (hash_index && hash_index_open(SRC_DIR) == 1) {
+        hash_index_build_async(SRC_DIR, DEFAULT_PIECE_SIZE);
+    }
+
+    // Hot files get precompressed copies that compressed downloads are served from as they are
+    if (compress_cache_limit > 0) {
+        compress_cache_open(SRC_DIR, compress_cache_limit);
+    }
+
+    // Serve every client from per-core event loops instead of forking
+    if (epoll_mode) {
+        reactor_run(port, workers);
+        exit(EXIT_FAILURE);
+    }
+
     // Create server socket
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) {
@@ -86,9 +151,10 @@ int main(int argc, char *argv[]) {
         char client_ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
         int client_port = ntohs(client_addr.sin_port);
-        log_message(LOG_INFO, "Client connected: IP = %s, Port = %d", client_ip, client_port);
+        log_message_limited(LOG_INFO, "Client connected: IP = %s, Port = %d", client_ip, client_port);
 
-        // Fork to handle each client in a separate process
+        // Fork to handle each client in a separate process; nothing buffered may be inherited and written twice
+        fflush(stdout);
         pid = fork();
         if (pid < 0) {
             perror("Error forking process");
@@ -100,7 +166,10 @@ int main(int argc, char *argv[]) {
             close(server_sock);  // Child does not need the listening socket
             handle_client(client_sock, client_addr);
             close(client_sock);
-            exit(EXIT_SUCCESS);  // Exit child process after handling
+            metrics_process_exit();
+            log_flush();
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);  // Not exit(): the parent's atexit handlers aren't the child's to run
         } else {
             // Parent process: continue to accept new clients
             close(client_sock);  // Parent closes the connected socket
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "frame.h"
+#include "logger.h"
+
+#define TRACE_EVENT_CHARS 512  // Longest formatted event
+
+// One buffered event
+typedef struct {
+    const char *name;              // Span or instant name (a string literal)
+    char phase;                    // 'X' for a span, 'i' for an instant
+    int track;                     // Thread id shown in the viewer
+    uint64_t ts;                   // Start in microseconds
+    uint64_t dur;                  // Length of a span in microseconds
+    long long bytes;               // Bytes moved or hashed (-1 if none)
+    char file[TRACE_FILE_CHARS];   // File worked on (empty if none)
+} TraceEvent;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the file
+static char trace_path[PATH_MAX];      // Trace file, or a directory ending in '/' (empty while tracing is off)
+static char trace_name[32];            // Process name shown in the viewer
+static int trace_fd = -1;              // This process's trace file, opened at the first flush
+
+static __thread TraceContext *attached;  // Connection the calling thread records for (NULL if none)
+static __thread TraceEvent *events;      // The calling thread's buffer, allocated at its first event
+static __thread int buffered;            // Events in the buffer
+
+// Function to forget the parent's file and buffer in a forked child
+static void trace_after_fork_child(void) {
+    pthread_mutex_init(&trace_lock, NULL);
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    buffered = 0;
+}
+
+// Function to write what is left and close the JSON array at exit
+static void trace_close(void) {
+    trace_flush();
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        if (write(trace_fd, "\n]\n", 3) != 3) {
+            log_message(LOG_ERROR, "Error finishing trace file: %s", strerror(errno));
+        }
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    trace_path[0] = '\0';  // Threads still running record nothing more
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Function to name the file traced events are written to
+int trace_open(const char *path, const char *name) {
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(trace_path) - 32) {
+        log_message(LOG_ERROR, "Invalid trace path: %s", path);
+        return -1;
+    }
+    pthread_mutex_lock(&trace_lock);
+    int first = trace_path[0] == '\0' && trace_fd < 0;
+    strcpy(trace_path, path);
+    snprintf(trace_name, sizeof(trace_name), "%s", name);
+    pthread_mutex_unlock(&trace_lock);
+    if (first) {
+        pthread_atfork(NULL, NULL, trace_after_fork_child);
+        atexit(trace_close);
+    }
+    return 0;
+}
+
+// Function to check whether traced connections can be recorded
+int trace_enabled(void) {
+    return trace_path[0] != '\0';
+}
+
+// Function to record the calling thread's events for a connection
+void trace_attach(TraceContext *context) {
+    attached = trace_enabled() ? context : NULL;
+}
+
+// Function to read the clock events are stamped with
+uint64_t trace_now(void) {
+    struct timespec now;
+    if (!attached) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function to add an event to the calling thread's buffer, writing the buffer out when it is full
+static void trace_record(const char *name, char phase, uint64_t ts, uint64_t dur, const char *file, long long bytes) {
+    if (!events) {
+        events = malloc(TRACE_BUFFER_EVENTS * sizeof(TraceEvent));
+        if (!events) {
+            return;
+        }
+    }
+    if (buffered == TRACE_BUFFER_EVENTS) {
+        trace_flush();
+    }
+
+    TraceEvent *event = &events[buffered++];
+    event->name = name;
+    event->phase = phase;
+    event->track = attached->track;
+    event->ts = ts;
+    event->dur = dur;
+    event->bytes = bytes;
+    snprintf(event->file, sizeof(event->file), "%s", file ? file : "");
+}
+
+// Function to record a span that ends now
+void trace_span(const char *name, uint64_t start_us, const char *file, long long bytes) {
+    uint64_t now = trace_now();
+    if (now == 0 || start_us == 0) {
+        return;
+    }
+    trace_record(name, 'X', start_us, now - start_us, file, bytes);
+}
+
+// Function to start timing a file stream of the attached connection
+void trace_stream_begin(void) {
+    if (attached) {
+        attached->stream_start = trace_now();
+        attached->stream_bytes = 0;
+    }
+}
+
+// Function to count stream bytes, marking the first byte and every TRACE_PROGRESS_BYTES
+void trace_stream_bytes(long long bytes) {
+    if (!attached || attached->stream_start == 0 || bytes <= 0) {
+        return;
+    }
+    long long before = attached->stream_bytes;
+    attached->stream_bytes += bytes;
+    if (before == 0) {
+        trace_record("first_byte", 'i', trace_now(), 0, NULL, bytes);
+    }
+    if (before / TRACE_PROGRESS_BYTES != attached->stream_bytes / TRACE_PROGRESS_BYTES) {
+        trace_record("progress", 'i', trace_now(), 0, NULL, attached->stream_bytes);
+    }
+}
+
+// Function to record the current stream as a span
+void trace_stream_end(const char *name, const char *file) {
+    if (attached && attached->stream_start) {
+        trace_span(name, attached->stream_start, file, attached->stream_bytes);
+        attached->stream_start = 0;
+    }
+}
+
+// Helper function to append a string as JSON string contents
+static void put_json_string(ByteBuf *out, const char *text) {
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        char escaped[8];
+        if (*c == '"' || *c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = *c;
+            bytebuf_put(out, escaped, 2);
+        } else if (*c < 0x20) {
+            bytebuf_put(out, escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", *c));
+        } else {
+            bytebuf_put(out, c, 1);
+        }
+    }
+}
+
+// Helper function to append one event as a JSON object
+static void put_event(ByteBuf *out, const TraceEvent *event, int pid) {
+    char line[TRACE_EVENT_CHARS];
+    int length = event->phase == 'X'
+        ? snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"yats\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{",
+                   event->name, (unsigned long long)event->ts, (unsigned long long)event->dur, pid, event->track)
+        : snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"yats\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{",
+                   event->name, (unsigned long long)event->ts, pid, event->track);
+    bytebuf_put(out, line, length);
+    if (event->file[0]) {
+        bytebuf_put(out, "\"file\":\"", 8);
+        put_json_string(out, event->file);
+        bytebuf_put(out, "\"", 1);
+    }
+    if (event->bytes >= 0) {
+        length = snprintf(line, sizeof(line), "%s\"bytes\":%lld", event->file[0] ? "," : "", event->bytes);
+        bytebuf_put(out, line, length);
+    }
+    bytebuf_put(out, "}}", 2);
+}
+
+// Function to open this process's trace file and start its JSON array
+static int trace_file_open(int pid) {
+    char path[PATH_MAX + 64];
+    size_t length = strlen(trace_path);
+    if (trace_path[length - 1] == '/') {
+        if (mkdir(trace_path, 0755) != 0 && errno != EEXIST) {
+            log_message(LOG_ERROR, "Error creating trace directory %s: %s", trace_path, strerror(errno));
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s%s-%d.json", trace_path, trace_name, pid);
+    } else {
+        snprintf(path, sizeof(path), "%s", trace_path);
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        log_message(LOG_ERROR, "Error opening trace file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char header[128];
+    int header_length = snprintf(header, sizeof(header), "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+                                 pid, trace_name);
+    if (write(trace_fd, header, header_length) != header_length) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    log_message(LOG_INFO, "Writing trace events to %s", path);
+    return 0;
+}
+
+// Function to write the calling thread's buffered events to the trace file
+void trace_flush(void) {
+    if (buffered == 0) {
+        return;
+    }
+    int pid = (int)getpid();
+    ByteBuf out = {0};
+    for (int i = 0; i < buffered; i++) {
+        bytebuf_put(&out, ",\n", 2);
+        put_event(&out, &events[i], pid);
+    }
+
+    // One write per flush keeps the events of concurrent threads whole; the file's header is the array's first element
+    pthread_mutex_lock(&trace_lock);
+    if (out.failed || !trace_enabled() || (trace_fd < 0 && trace_file_open(pid) != 0) ||
+        write(trace_fd, out.data, out.len) != (ssize_t)out.len) {
+        log_message_limited(LOG_ERROR, "Lost %d trace events", buffered);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    buffered = 0;
+    bytebuf_free(&out);
+}
@@ -0,0 +1,585 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "compress.h"
+#include "uring.h"
+#include "trace.h"
+
+static int zero_copy_enabled = 1;        // Flag for the sendfile path
+static int uring_enabled = 0;            // Flag for the io_uring backend
+static TransferStats global_stats;       // Process-wide counters (updated atomically)
+static __thread char *copy_buffer;       // Per-thread buffer of the copy fallback
+static __thread size_t copy_buffer_size; // Capacity of that buffer
+static __thread int splice_pipe[2] = {-1, -1};  // Per-thread pipe of the splice path
+static __thread size_t splice_pipe_size;        // Capacity of that pipe
+
+// Function to add bytes to the global and optional per-transfer counters (and a traced connection's stream)
+static void count_bytes(TransferStats *stats, int zero_copy, size_t bytes) {
+    trace_stream_bytes(bytes);
+    if (zero_copy) {
+        __atomic_add_fetch(&global_stats.zero_copy_bytes, bytes, __ATOMIC_RELAXED);
+        if (stats) stats->zero_copy_bytes += bytes;
+    } else {
+        __atomic_add_fetch(&global_stats.copied_bytes, bytes, __ATOMIC_RELAXED);
+        if (stats) stats->copied_bytes += bytes;
+    }
+}
+
+// Function to get this thread's copy buffer, grown to at least size bytes
+static char *get_copy_buffer(size_t size) {
+    if (size < TRANSFER_BUFFER_SIZE) {
+        size = TRANSFER_BUFFER_SIZE;
+    }
+    if (size > TRANSFER_MAX_CHUNK) {
+        size = TRANSFER_MAX_CHUNK;
+    }
+    if (copy_buffer_size < size) {
+        char *buffer = realloc(copy_buffer, size);
+        if (!buffer) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        copy_buffer = buffer;
+        copy_buffer_size = size;
+    }
+    return copy_buffer;
+}
+
+// Function to enable or disable the zero-copy path
+void transfer_set_zero_copy(int enabled) {
+    zero_copy_enabled = enabled;
+}
+
+// Function to check whether the zero-copy path is enabled
+int transfer_zero_copy_enabled(void) {
+    return zero_copy_enabled;
+}
+
+// Function to select the io_uring backend
+void transfer_set_uring(int enabled) {
+    uring_enabled = enabled;
+}
+
+// Function to count bytes moved by the io_uring backend
+static void count_uring_bytes(TransferStats *stats, off_t bytes) {
+    count_bytes(stats, 0, bytes);
+    __atomic_add_fetch(&global_stats.uring_bytes, bytes, __ATOMIC_RELAXED);
+    if (stats) stats->uring_bytes += bytes;
+}
+
+// Function to fold a range of a file that was just sent or written into a digest (a page cache read)
+static int hash_file_range(Hasher *hasher, int fd, off_t offset, size_t length) {
+    if (!get_copy_buffer(TRANSFER_BUFFER_SIZE)) {
+        return -1;
+    }
+    while (length > 0) {
+        size_t want = length < copy_buffer_size ? length : copy_buffer_size;
+        ssize_t n = pread(fd, copy_buffer, want, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            errno = n == 0 ? EIO : errno;
+            return -1;
+        }
+        hasher_update(hasher, copy_buffer, n);
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Function to send a chunk through a user-space buffer
+static ssize_t copy_send_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats, Hasher *hasher) {
+    if (!get_copy_buffer(count)) {
+        return -1;
+    }
+
+    size_t want = count < copy_buffer_size ? count : copy_buffer_size;
+    ssize_t bytes_read = pread(fd, copy_buffer, want, *offset);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+
+    // Ensure the buffer is sent; stop early only if a non-blocking socket is full
+    ssize_t bytes_sent = 0;
+    while (bytes_sent < bytes_read) {
+        ssize_t n = send(sock, copy_buffer + bytes_sent, bytes_read - bytes_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && bytes_sent > 0) {
+                break;
+            }
+            return -1;
+        }
+        bytes_sent += n;
+    }
+
+    if (hasher) {
+        hasher_update(hasher, copy_buffer, bytes_sent);
+    }
+    *offset += bytes_sent;
+    count_bytes(stats, 0, bytes_sent);
+    return bytes_sent;
+}
+
+// Function to send up to count bytes of a file in one step
+ssize_t transfer_send_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats, Hasher *hasher) {
+    if (zero_copy_enabled) {
+        size_t want = count < TRANSFER_SENDFILE_MAX ? count : TRANSFER_SENDFILE_MAX;
+        off_t start = *offset;
+        ssize_t bytes_sent = sendfile(sock, fd, offset, want);
+        if (bytes_sent >= 0) {
+            count_bytes(stats, 1, bytes_sent);
+            if (hasher && bytes_sent > 0 && hash_file_range(hasher, fd, start, bytes_sent) != 0) {
+                return -1;
+            }
+            return bytes_sent;
+        }
+
+        // Anything but "this file can't be spliced" is a real error
+        if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        __atomic_add_fetch(&global_stats.fallbacks, 1, __ATOMIC_RELAXED);
+        if (stats) stats->fallbacks++;
+    }
+
+    return copy_send_some(sock, fd, offset, count, stats, hasher);
+}
+
+// Function to get a monotonic timestamp in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to adapt the sender I/O size to the throughput of the last full step
+static size_t adapt_chunk(size_t chunk, double rate, double *last_rate) {
+    if (*last_rate > 0) {
+        if (rate >= *last_rate * 1.05 && chunk < TRANSFER_MAX_CHUNK) {
+            chunk *= 2;  // Bigger steps still pay off
+        } else if (rate < *last_rate * 0.75 && chunk > TRANSFER_MIN_CHUNK) {
+            chunk /= 2;  // The link slowed down; keep steps short
+        }
+    }
+    *last_rate = rate;
+    return chunk;
+}
+
+// Function to send a range of a file to a blocking socket
+off_t transfer_send_file(int sock, int fd, off_t offset, off_t length, size_t chunk_size, TransferStats *stats, Hasher *hasher) {
+    off_t total_sent = 0;
+
+    if (uring_enabled && uring_available()) {
+        total_sent = uring_send_file(sock, fd, offset, length, hasher);
+        if (total_sent > 0) {
+            count_uring_bytes(stats, total_sent);
+        }
+        return total_sent;
+    }
+
+    size_t chunk = chunk_size < TRANSFER_MIN_CHUNK ? TRANSFER_MIN_CHUNK : chunk_size;
+    chunk = chunk > TRANSFER_MAX_CHUNK ? TRANSFER_MAX_CHUNK : chunk;
+    double last_rate = 0;
+
+    while (total_sent < length) {
+        size_t want = length - total_sent < chunk ? length - total_sent : chunk;
+        double start = now_seconds();
+        ssize_t bytes_sent = transfer_send_some(sock, fd, &offset, want, stats, hasher);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            break;  // File ended early
+        }
+        total_sent += bytes_sent;
+
+        double elapsed = now_seconds() - start;
+        if (bytes_sent == chunk && elapsed > 0) {
+            chunk = adapt_chunk(chunk, bytes_sent / elapsed, &last_rate);
+        }
+    }
+
+    return total_sent;
+}
+
+// Function to drop this thread's pipe (e.g. when it holds bytes that can't be written)
+static void close_splice_pipe(void) {
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+    splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+// Function to create this thread's pipe on first use
+static int open_splice_pipe(void) {
+    if (splice_pipe[0] >= 0) {
+        return 0;
+    }
+    if (pipe2(splice_pipe, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    // A bigger pipe means fewer splice round trips; the default still works
+    int size = fcntl(splice_pipe[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+    if (size < 0) {
+        size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+    }
+    splice_pipe_size = size > 0 ? size : 65536;
+    return 0;
+}
+
+// Function to receive a chunk through a user-space buffer
+static ssize_t copy_recv_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats, Hasher *hasher) {
+    if (!get_copy_buffer(TRANSFER_BUFFER_SIZE)) {
+        return -1;
+    }
+
+    size_t want = count < TRANSFER_BUFFER_SIZE ? count : TRANSFER_BUFFER_SIZE;
+    ssize_t bytes_received = recv(sock, copy_buffer, want, 0);
+    if (bytes_received <= 0) {
+        return bytes_received;
+    }
+
+    ssize_t bytes_written = 0;
+    while (bytes_written < bytes_received) {
+        ssize_t n = pwrite(fd, copy_buffer + bytes_written, bytes_received - bytes_written, *offset + bytes_written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes_written += n;
+    }
+
+    if (hasher) {
+        hasher_update(hasher, copy_buffer, bytes_received);
+    }
+    *offset += bytes_received;
+    count_bytes(stats, 0, bytes_received);
+    return bytes_received;
+}
+
+// Function to write out the rest of the pipe through the copy buffer
+static ssize_t drain_pipe_by_copy(int fd, off_t *offset, ssize_t bytes_in, ssize_t bytes_out, TransferStats *stats) {
+    __atomic_add_fetch(&global_stats.fallbacks, 1, __ATOMIC_RELAXED);
+    if (stats) stats->fallbacks++;
+    count_bytes(stats, 1, bytes_out);
+
+    while (bytes_out < bytes_in) {
+        size_t want = bytes_in - bytes_out < TRANSFER_BUFFER_SIZE ? bytes_in - bytes_out : TRANSFER_BUFFER_SIZE;
+        ssize_t n = get_copy_buffer(TRANSFER_BUFFER_SIZE) ? read(splice_pipe[0], copy_buffer, want) : -1;
+        if (n <= 0 || pwrite(fd, copy_buffer, n, *offset) != n) {
+            close_splice_pipe();
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        *offset += n;
+        bytes_out += n;
+        count_bytes(stats, 0, n);
+    }
+
+    return bytes_in;
+}
+
+// Function to move a chunk socket->pipe->file without entering user space
+static ssize_t splice_recv_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats) {
+    if (open_splice_pipe() < 0) {
+        return -1;
+    }
+
+    // The pipe is empty, so this only waits if the socket itself is blocking
+    size_t want = count < splice_pipe_size ? count : splice_pipe_size;
+    ssize_t bytes_in = splice(sock, NULL, splice_pipe[1], NULL, want, SPLICE_F_MOVE);
+    if (bytes_in <= 0) {
+        return bytes_in;
+    }
+
+    // Drain the pipe completely so it is empty for the next connection of this thread
+    ssize_t bytes_out = 0;
+    while (bytes_out < bytes_in) {
+        ssize_t n = splice(splice_pipe[0], NULL, fd, offset, bytes_in - bytes_out, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            // The file can't be spliced into; the bytes are only in the pipe now
+            return drain_pipe_by_copy(fd, offset, bytes_in, bytes_out, stats);
+        }
+        if (n <= 0) {
+            int saved_errno = n < 0 ? errno : EIO;
+            close_splice_pipe();
+            errno = saved_errno;
+            return -1;
+        }
+        bytes_out += n;
+    }
+
+    count_bytes(stats, 1, bytes_in);
+    return bytes_in;
+}
+
+// Function to receive up to count bytes into a file in one step
+ssize_t transfer_recv_some(int sock, int fd, off_t *offset, size_t count, TransferStats *stats, Hasher *hasher) {
+    off_t start = *offset;
+
+    // Bytes read ahead along with the last message come first
+    long buffered = session_drain_to_file(sock, fd, *offset, count);
+    if (buffered != 0) {
+        if (buffered > 0) {
+            *offset += buffered;
+            count_bytes(stats, 0, buffered);
+            if (hasher && hash_file_range(hasher, fd, start, buffered) != 0) {
+                return -1;
+            }
+        }
+        return buffered;
+    }
+
+    if (zero_copy_enabled) {
+        ssize_t bytes_received = splice_recv_some(sock, fd, offset, count, stats);
+        if (bytes_received > 0 && hasher && hash_file_range(hasher, fd, start, bytes_received) != 0) {
+            return -1;
+        }
+        if (bytes_received >= 0 || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) {
+            return bytes_received;
+        }
+
+        // The socket can't be spliced from; nothing was consumed yet
+        __atomic_add_fetch(&global_stats.fallbacks, 1, __ATOMIC_RELAXED);
+        if (stats) stats->fallbacks++;
+    }
+
+    return copy_recv_some(sock, fd, offset, count, stats, hasher);
+}
+
+// Function to receive exactly length bytes from a blocking socket into a file
+off_t transfer_recv_file(int sock, int fd, off_t offset, off_t length, TransferStats *stats, Hasher *hasher) {
+    off_t total_received = 0;
+
+    if (uring_enabled && uring_available()) {
+        long buffered = session_drain_to_file(sock, fd, offset, length);
+        if (buffered < 0 || (hasher && buffered > 0 && hash_file_range(hasher, fd, offset, buffered) != 0)) {
+            return -1;
+        }
+        count_bytes(stats, 0, buffered);
+
+        off_t received = uring_recv_file(sock, fd, offset + buffered, length - buffered, hasher);
+        if (received < 0) {
+            return -1;
+        }
+        count_uring_bytes(stats, received);
+        return buffered + received;
+    }
+
+    while (total_received < length) {
+        ssize_t bytes_received = transfer_recv_some(sock, fd, &offset, length - total_received, stats, hasher);
+        if (bytes_received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_received == 0) {
+            break;  // Peer closed the connection early
+        }
+        total_received += bytes_received;
+    }
+
+    return total_received;
+}
+
+// Function to send the next part of a compressed file stream
+ssize_t transfer_send_compressed_some(int sock, int fd, off_t *offset, size_t count, CompressStream *stream, TransferStats *stats, Hasher *hasher) {
+    while (1) {
+        // Finish the chunk in flight; a stored header is followed by its file bytes at once
+        int flags = MSG_NOSIGNAL | (stream->stored > 0 ? MSG_MORE : 0);
+        while (stream->chunk_sent < stream->chunk_len) {
+            ssize_t n = send(sock, stream->chunk + stream->chunk_sent, stream->chunk_len - stream->chunk_sent, flags);
+            if (n < 0) {
+                return -1;
+            }
+            stream->chunk_sent += n;
+        }
+        if (stream->chunk_raw > 0) {
+            size_t done = stream->chunk_raw;
+            stream->chunk_raw = 0;
+            count_bytes(stats, 0, done);
+            return done;
+        }
+
+        // The file bytes behind a stored header go out as they are
+        if (stream->stored > 0) {
+            size_t want = count < (size_t)stream->stored ? count : (size_t)stream->stored;
+            ssize_t bytes_sent = transfer_send_some(sock, fd, offset, want, stats, hasher);
+            if (bytes_sent > 0) {
+                stream->stored -= bytes_sent;
+                stream->raw_bytes += bytes_sent;
+                stream->wire_bytes += bytes_sent;
+            }
+            return bytes_sent;
+        }
+
+        if (compress_next(stream, fd, *offset, count, hasher) != 0) {
+            return -1;
+        }
+        if (stream->chunk_len == 0) {
+            return 0;  // End of file
+        }
+        *offset += stream->chunk_raw;
+    }
+}
+
+// Function to send a range of a file to a blocking socket as a compressed stream
+off_t transfer_send_compressed(int sock, int fd, off_t offset, off_t length, CompressStream *stream, TransferStats *stats, Hasher *hasher) {
+    off_t total_sent = 0;
+    while (total_sent < length) {
+        ssize_t bytes_sent = transfer_send_compressed_some(sock, fd, &offset, length - total_sent, stream, stats, hasher);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            break;  // File ended early
+        }
+        total_sent += bytes_sent;
+    }
+    return total_sent;
+}
+
+// Helper function to gather the next chunk of a compressed stream: read-ahead bytes first, then exactly what is missing
+static ssize_t gather_chunk(int sock, CompressStream *stream) {
+    const unsigned char *data;
+    size_t missing = stream->chunk_need - stream->chunk_len;
+    size_t available = session_buffered(sock, &data);
+    if (available > 0) {
+        size_t len = available < missing ? available : missing;
+        memcpy(stream->chunk + stream->chunk_len, data, len);
+        session_consume(sock, len);
+        stream->chunk_len += len;
+        return len;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(sock, stream->chunk + stream->chunk_len, missing, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        stream->chunk_len += n;
+    }
+    return n;
+}
+
+// Function to receive the next part of a compressed file stream into a file
+ssize_t transfer_recv_compressed_some(int sock, int fd, off_t *offset, size_t count, CompressStream *stream, TransferStats *stats, Hasher *hasher) {
+    while (1) {
+        // Decoded bytes of the last chunk come first
+        if (stream->raw_done < stream->raw_len) {
+            size_t left = stream->raw_len - stream->raw_done;
+            size_t len = count < left ? count : left;
+            ssize_t n = pwrite(fd, stream->raw + stream->raw_done, len, *offset);
+            if (n <= 0) {
+                errno = n == 0 ? EIO : errno;
+                return -1;
+            }
+            if (hasher) {
+                hasher_update(hasher, stream->raw + stream->raw_done, n);
+            }
+            stream->raw_done += n;
+            *offset += n;
+            count_bytes(stats, 0, n);
+            return n;
+        }
+
+        // The file bytes behind a stored header arrive as they are (spliced when possible)
+        if (stream->stored > 0) {
+            size_t want = count < (size_t)stream->stored ? count : (size_t)stream->stored;
+            ssize_t bytes_received = transfer_recv_some(sock, fd, offset, want, stats, hasher);
+            if (bytes_received > 0) {
+                stream->stored -= bytes_received;
+                stream->raw_bytes += bytes_received;
+                stream->wire_bytes += bytes_received;
+            }
+            return bytes_received;
+        }
+
+        while (stream->chunk_len < stream->chunk_need) {
+            ssize_t n = gather_chunk(sock, stream);
+            if (n <= 0) {
+                return n;
+            }
+        }
+
+        // A complete header says what follows it
+        uint32_t raw_len, packed_len;
+        if (stream->chunk_need == COMPRESS_HEADER_SIZE) {
+            int stored = compress_parse_header(stream->chunk, &raw_len, &packed_len);
+            if (stored < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (stored) {
+                stream->stored = raw_len;
+                stream->chunk_len = 0;
+                stream->wire_bytes += COMPRESS_HEADER_SIZE;
+            } else {
+                stream->chunk_need += packed_len;
+            }
+            continue;
+        }
+
+        // A complete chunk decodes into the next piece
+        compress_parse_header(stream->chunk, &raw_len, &packed_len);
+        if (compress_decode(stream, stream->chunk + COMPRESS_HEADER_SIZE, packed_len, raw_len) != 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        stream->chunk_len = 0;
+        stream->chunk_need = COMPRESS_HEADER_SIZE;
+    }
+}
+
+// Function to receive exactly length bytes of a compressed stream from a blocking socket into a file
+off_t transfer_recv_compressed(int sock, int fd, off_t offset, off_t length, CompressStream *stream, TransferStats *stats, Hasher *hasher) {
+    off_t total_received = 0;
+    while (total_received < length) {
+        ssize_t bytes_received = transfer_recv_compressed_some(sock, fd, &offset, length - total_received, stream, stats, hasher);
+        if (bytes_received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_received == 0) {
+            break;  // Peer closed the connection early
+        }
+        total_received += bytes_received;
+    }
+    return total_received;
+}
+
+// Function to get a snapshot of the process-wide counters
+void transfer_get_stats(TransferStats *stats) {
+    stats->zero_copy_bytes = __atomic_load_n(&global_stats.zero_copy_bytes, __ATOMIC_RELAXED);
+    stats->copied_bytes = __atomic_load_n(&global_stats.copied_bytes, __ATOMIC_RELAXED);
+    stats->fallbacks = __atomic_load_n(&global_stats.fallbacks, __ATOMIC_RELAXED);
+    stats->uring_bytes = __atomic_load_n(&global_stats.uring_bytes, __ATOMIC_RELAXED);
+}
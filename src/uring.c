@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "logger.h"
+
+#define URING_SLOT_SOCK 0  // Registered file slot of the socket
+#define URING_SLOT_FILE 1  // Registered file slot of the file
+
+typedef struct {
+    int state;                  // 0 = not set up, 1 = ready, -1 = unavailable
+    int fd;                     // io_uring instance
+    unsigned sq_local_tail;     // Submission tail not yet published
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers;              // URING_DEPTH registered buffers
+} Ring;
+
+static __thread Ring ring;  // One ring per thread, reused by every transfer
+
+// Function to set up the calling thread's ring
+static int ring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH * 2, &params);
+    if (ring.fd < 0) {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    char *cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    ring.buffers = NULL;
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring.sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    // Register the buffers once so file reads/writes skip per-I/O page pinning
+    if (posix_memalign((void **)&ring.buffers, 4096, URING_DEPTH * URING_BUFFER_SIZE) != 0) {
+        ring.buffers = NULL;
+        goto fail;
+    }
+    struct iovec iovecs[URING_DEPTH];
+    for (int i = 0; i < URING_DEPTH; i++) {
+        iovecs[i].iov_base = ring.buffers + (size_t)i * URING_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_DEPTH) < 0) {
+        goto fail;
+    }
+
+    // Register an empty file table; each transfer fills in its socket and file
+    int fds[2] = {-1, -1};
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds, 2) < 0) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    // Undo what was set up, keeping errno for the fallback message; closing the ring drops its registrations
+    {
+        int saved_errno = errno;
+        if (sq_ptr != MAP_FAILED) {
+            munmap(sq_ptr, sq_size);
+        }
+        if (cq_ptr != MAP_FAILED) {
+            munmap(cq_ptr, cq_size);
+        }
+        if (ring.sqes != MAP_FAILED) {
+            munmap(ring.sqes, sqes_size);
+        }
+        ring.sqes = NULL;
+        free(ring.buffers);
+        ring.buffers = NULL;
+        close(ring.fd);
+        ring.fd = -1;
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+// Function to check whether io_uring can be used by the calling thread
+int uring_available(void) {
+    if (ring.state == 0) {
+        if (ring_setup() == 0) {
+            ring.state = 1;
+        } else {
+            log_message(LOG_ERROR, "io_uring unavailable (%s), using the blocking transfer path", strerror(errno));
+            ring.state = -1;
+        }
+    }
+    return ring.state == 1;
+}
+
+// Function to point the registered file slots at this transfer's socket and file
+static int ring_register_files(int sock, int fd) {
+    int fds[2];
+    fds[URING_SLOT_SOCK] = sock;
+    fds[URING_SLOT_FILE] = fd;
+
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (unsigned long)fds;
+    return syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 2) < 0 ? -1 : 0;
+}
+
+// Function to claim the next submission queue entry
+static struct io_uring_sqe *ring_get_sqe(void) {
+    unsigned index = ring.sq_local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.sq_local_tail++;
+    return sqe;
+}
+
+// Function to submit the queued entries and collect all their results in one call
+static int ring_submit_and_wait(int count, int *results) {
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+    int to_submit = count;
+    int completed = 0;
+    while (completed < count) {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Requests may still be in flight; this ring can't be trusted any more
+            log_message(LOG_ERROR, "io_uring_enter failed (%s), disabling io_uring for this thread", strerror(errno));
+            ring.state = -1;
+            return -1;
+        }
+        to_submit -= ret < to_submit ? ret : to_submit;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+// Function to send the rest of a buffer after a short or cancelled io_uring send
+static int send_remainder(int sock, const char *data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = send(sock, data + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// Function to send a range of a file with batched io_uring submissions
+static off_t ring_send_file(int sock, int fd, off_t offset, off_t length, Hasher *hasher) {
+    int results[URING_DEPTH];
+    int lengths[URING_DEPTH];
+    off_t total_sent = 0;
+
+    while (total_sent < length) {
+        // Batch of fixed-buffer file reads, all in one submission
+        int batch = 0;
+        for (off_t queued = 0; batch < URING_DEPTH && total_sent + queued < length; batch++) {
+            off_t left = length - total_sent - queued;
+            lengths[batch] = left < URING_BUFFER_SIZE ? left : URING_BUFFER_SIZE;
+
+            struct io_uring_sqe *sqe = ring_get_sqe();
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = URING_SLOT_FILE;
+            sqe->addr = (unsigned long)(ring.buffers + (size_t)batch * URING_BUFFER_SIZE);
+            sqe->len = lengths[batch];
+            sqe->off = offset + total_sent + queued;
+            sqe->buf_index = batch;
+            sqe->user_data = batch;
+            queued += lengths[batch];
+        }
+        if (ring_submit_and_wait(batch, results) != 0) {
+            return -1;
+        }
+
+        // Keep the contiguous prefix that was read; a short read means end of file
+        int ready = 0;
+        int eof = 0;
+        for (int i = 0; i < batch; i++) {
+            if (results[i] < 0) {
+                errno = -results[i];
+                return -1;
+            }
+            if (results[i] < lengths[i]) {
+                lengths[i] = results[i];
+                ready = i + (results[i] > 0);
+                eof = 1;
+                break;
+            }
+            ready = i + 1;
+        }
+
+        // The buffers hold the stream in order, so the digest folds them in place
+        for (int i = 0; hasher && i < ready; i++) {
+            hasher_update(hasher, ring.buffers + (size_t)i * URING_BUFFER_SIZE, lengths[i]);
+        }
+
+        // Linked socket sends keep the stream in order, again in one submission
+        for (int i = 0; i < ready; i++) {
+            struct io_uring_sqe *sqe = ring_get_sqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->flags = IOSQE_FIXED_FILE | (i + 1 < ready ? IOSQE_IO_LINK : 0);
+            sqe->fd = URING_SLOT_SOCK;
+            sqe->addr = (unsigned long)(ring.buffers + (size_t)i * URING_BUFFER_SIZE);
+            sqe->len = lengths[i];
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            sqe->user_data = i;
+        }
+        if (ready > 0 && ring_submit_and_wait(ready, results) != 0) {
+            return -1;
+        }
+
+        // A short send breaks the link; finish those buffers with plain sends
+        for (int i = 0; i < ready; i++) {
+            int sent = results[i] > 0 ? results[i] : 0;
+            if (results[i] < 0 && results[i] != -ECANCELED) {
+                errno = -results[i];
+                return -1;
+            }
+            if (sent < lengths[i] &&
+                send_remainder(sock, ring.buffers + (size_t)i * URING_BUFFER_SIZE + sent, lengths[i] - sent) != 0) {
+                return -1;
+            }
+            total_sent += lengths[i];
+        }
+
+        if (eof) {
+            break;
+        }
+    }
+
+    return total_sent;
+}
+
+// Function to receive a range of a file with batched io_uring submissions
+static off_t ring_recv_file(int sock, int fd, off_t offset, off_t length, Hasher *hasher) {
+    int results[URING_DEPTH];
+    int lengths[URING_DEPTH];
+    off_t total_received = 0;
+
+    while (total_received < length) {
+        // Linked receives fill consecutive buffers in stream order, never past length
+        int batch = 0;
+        for (off_t queued = 0; batch < URING_DEPTH && total_received + queued < length; batch++) {
+            off_t left = length - total_received - queued;
+            lengths[batch] = left < URING_BUFFER_SIZE ? left : URING_BUFFER_SIZE;
+            queued += lengths[batch];
+        }
+        for (int i = 0; i < batch; i++) {
+            struct io_uring_sqe *sqe = ring_get_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_FIXED_FILE | (i + 1 < batch ? IOSQE_IO_LINK : 0);
+            sqe->fd = URING_SLOT_SOCK;
+            sqe->addr = (unsigned long)(ring.buffers + (size_t)i * URING_BUFFER_SIZE);
+            sqe->len = lengths[i];
+            sqe->msg_flags = MSG_WAITALL;
+            sqe->user_data = i;
+        }
+        if (ring_submit_and_wait(batch, results) != 0) {
+            return -1;
+        }
+
+        // Only the contiguous prefix of filled buffers is valid stream data. MSG_WAITALL can come back
+        // short on a healthy connection (a signal, a receive timeout); the rest is queued again next round
+        int ready = 0;
+        int closed = 0;
+        for (int i = 0; i < batch; i++) {
+            if (results[i] == 0) {
+                closed = 1;  // Only an empty receive means the peer closed
+                break;
+            }
+            if (results[i] == -ECANCELED || results[i] == -EINTR) {
+                break;
+            }
+            if (results[i] < 0) {
+                errno = -results[i];
+                return -1;
+            }
+            ready = i + 1;
+            if (results[i] < lengths[i]) {
+                lengths[i] = results[i];
+                break;
+            }
+        }
+
+        // Fold the received buffers into the digest while they are still in hand
+        for (int i = 0; hasher && i < ready; i++) {
+            hasher_update(hasher, ring.buffers + (size_t)i * URING_BUFFER_SIZE, lengths[i]);
+        }
+
+        // Fixed-buffer file writes at their offsets, all in one submission
+        off_t write_offset = offset + total_received;
+        for (int i = 0; i < ready; i++) {
+            struct io_uring_sqe *sqe = ring_get_sqe();
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = URING_SLOT_FILE;
+            sqe->addr = (unsigned long)(ring.buffers + (size_t)i * URING_BUFFER_SIZE);
+            sqe->len = lengths[i];
+            sqe->off = write_offset;
+            sqe->buf_index = i;
+            sqe->user_data = i;
+            write_offset += lengths[i];
+        }
+        if (ready > 0 && ring_submit_and_wait(ready, results) != 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (results[i] != lengths[i]) {
+                errno = results[i] < 0 ? -results[i] : EIO;
+                return -1;
+            }
+            total_received += lengths[i];
+        }
+
+        if (closed) {
+            break;
+        }
+    }
+
+    return total_received;
+}
+
+// Function to run a transfer with this transfer's socket and file registered
+static off_t with_registered_files(off_t (*transfer)(int, int, off_t, off_t, Hasher *), int sock, int fd, off_t offset, off_t length,
+                                   Hasher *hasher) {
+    if (!uring_available() || ring_register_files(sock, fd) != 0) {
+        return -1;
+    }
+
+    off_t result = transfer(sock, fd, offset, length, hasher);
+
+    // Registered slots hold references; drop them so closing the socket really closes it
+    if (ring.state == 1) {
+        int saved_errno = errno;
+        ring_register_files(-1, -1);
+        errno = saved_errno;
+    }
+    return result;
+}
+
+// Function to send a range of a file to a blocking socket through io_uring
+off_t uring_send_file(int sock, int fd, off_t offset, off_t length, Hasher *hasher) {
+    return with_registered_files(ring_send_file, sock, fd, offset, length, hasher);
+}
+
+// Function to receive a range of a file from a blocking socket through io_uring
+off_t uring_recv_file(int sock, int fd, off_t offset, off_t length, Hasher *hasher) {
+    return with_registered_files(ring_recv_file, sock, fd, offset, length, hasher);
+}
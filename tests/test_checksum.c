@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "hash.h"
+
+// Test CRC32C and XXH64 against known vectors, fed whole and in uneven pieces, and the Hasher interface
+void test_checksums() {
+    unsigned char data[1000];
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 7);
+    }
+    assert(crc32c_update(0, "123456789", 9) == 0xE3069283);
+    assert(crc32c_update(0, data, sizeof(data)) == 0x79A16AE6);
+
+    Xxh64State xxh;
+    xxh64_begin(&xxh, 0);
+    assert(xxh64_end(&xxh) == 0xEF46DB3751D8E999ULL);
+    xxh64_update(&xxh, "abc", 3);
+    assert(xxh64_end(&xxh) == 0x44BC2CF5AD770999ULL);
+
+    // Split points that straddle the 8-byte words and 32-byte stripes
+    uint32_t crc = 0;
+    xxh64_begin(&xxh, 0);
+    for (size_t offset = 0, step = 1; offset < sizeof(data); offset += step, step = step * 2 + 1) {
+        size_t len = offset + step > sizeof(data) ? sizeof(data) - offset : step;
+        crc = crc32c_update(crc, data + offset, len);
+        xxh64_update(&xxh, data + offset, len);
+    }
+    assert(crc == 0x79A16AE6);
+    assert(xxh64_end(&xxh) == 0x25275608A9CFC168ULL);
+
+    // Digests come out big-endian, so their hex reads like the number
+    unsigned char digest[HASH_DIGEST_SIZE];
+    char hex[HASH_DIGEST_SIZE * 2 + 1];
+    Hasher hasher;
+    assert(hasher_begin(&hasher, HASH_ALGO_CRC32C) == 0);
+    hasher_update(&hasher, "123456789", 9);
+    assert(hasher_end(&hasher, digest) == 0);
+    hex_encode(digest, hash_digest_size(HASH_ALGO_CRC32C), hex);
+    assert(strcmp(hex, "e3069283") == 0);
+    hasher_free(&hasher);
+    assert(hasher_begin(&hasher, HASH_ALGO_XXH64) == 0);
+    hasher_update(&hasher, "abc", 3);
+    assert(hasher_end(&hasher, digest) == 0);
+    hex_encode(digest, hash_digest_size(HASH_ALGO_XXH64), hex);
+    assert(strcmp(hex, "44bc2cf5ad770999") == 0);
+    hasher_free(&hasher);
+
+    for (int algorithm = 0; algorithm < HASH_ALGO_COUNT; algorithm++) {
+        assert(hash_algorithm_parse(hash_algorithm_name(algorithm)) == algorithm);
+    }
+    assert(hash_algorithm_parse("md5") == -1);
+    assert(hasher_begin(&hasher, HASH_ALGO_COUNT) == -1);
+    assert(hash_digest_size(HASH_ALGO_COUNT) == 0);
+    printf("Checksums passed\n");
+}
+
+int main() {
+    test_checksums();
+    printf("All checksum tests passed\n");
+    return 0;
+}
@@ -120,6 +120,7 @@ void generate_test_files() {
 // Function to simulate a client downloading a file
 void simulate_client_download(const char* filename) {
     int sock = connect_to_server(TEST_SERVER_IP, TEST_SERVER_PORT);
+    assert(sock >= 0);
     
     download_file(sock, filename);  // Simulate downloading the file
 
@@ -145,6 +146,7 @@ void simulate_client_download(const char* filename) {
 // Function to simulate a client uploading a file
 void simulate_client_upload(const char* filename) {
     int sock = connect_to_server(TEST_SERVER_IP, TEST_SERVER_PORT);
+    assert(sock >= 0);
     
     upload_file(sock, filename);  // Simulate uploading the file
 
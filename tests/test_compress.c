@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "compress.h"
+#include "transfer.h"
+#include "protocol.h"
+
+// Test that compressed streams arrive intact, shrink text and give up on data that doesn't compress
+void test_compress() {
+    char path[] = "/tmp/test_compress_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    static unsigned char data[3 * 1024 * 1024 + 1000], received[sizeof(data)];
+    const char *alphabet = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+    for (int kind = 0; kind < 2; kind++) {
+        // Alphanumeric text like createfile writes, then bytes that don't compress
+        unsigned int seed = 12345;
+        for (size_t i = 0; i < sizeof(data); i++) {
+            seed = seed * 1103515245 + 12345;
+            data[i] = kind == 0 ? (unsigned char)alphabet[(seed >> 16) % 62] : (unsigned char)(seed >> 16);
+        }
+        assert(pwrite(fd, data, sizeof(data), 0) == (ssize_t)sizeof(data));
+
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            CompressStream stream;
+            assert(compress_begin(&stream, COMPRESS_ZLIB, 1) == 0);
+            off_t sent = transfer_send_compressed(fds[0], fd, 0, sizeof(data), &stream, NULL, NULL);
+            _exit(sent == (off_t)sizeof(data) && stream.skipping == kind ? 0 : 1);
+        }
+
+        // The receiver's running digest covers the file bytes, not the wire bytes
+        char out_path[] = "/tmp/test_compress_out_XXXXXX";
+        int out_fd = mkstemp(out_path);
+        assert(out_fd >= 0);
+        CompressStream stream;
+        Hasher hasher, expected;
+        unsigned char digest[HASH_DIGEST_SIZE], expected_digest[HASH_DIGEST_SIZE];
+        assert(compress_begin(&stream, COMPRESS_ZLIB, 0) == 0);
+        assert(hasher_begin(&hasher, HASH_ALGO_CRC32C) == 0 && hasher_begin(&expected, HASH_ALGO_CRC32C) == 0);
+        assert(transfer_recv_compressed(fds[1], out_fd, 0, sizeof(data), &stream, NULL, &hasher) == (off_t)sizeof(data));
+        int status;
+        assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        assert(pread(out_fd, received, sizeof(received), 0) == (ssize_t)sizeof(received));
+        assert(memcmp(received, data, sizeof(data)) == 0);
+        hasher_update(&expected, data, sizeof(data));
+        assert(hasher_end(&hasher, digest) == 0 && hasher_end(&expected, expected_digest) == 0);
+        assert(memcmp(digest, expected_digest, hash_digest_size(HASH_ALGO_CRC32C)) == 0);
+        if (kind == 0) {
+            assert(stream.wire_bytes * 5 < stream.raw_bytes * 4);  // 62 random symbols need under 6 of the 8 bits
+        } else {
+            assert(stream.wire_bytes <= stream.raw_bytes + (COMPRESS_SAMPLE_PIECES + 1) * COMPRESS_HEADER_SIZE);
+        }
+        hasher_free(&hasher);
+        hasher_free(&expected);
+        compress_end(&stream);
+        close(out_fd);
+        unlink(out_path);
+        session_reset(fds[0]);
+        session_reset(fds[1]);
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    // Headers that could never have been sent are rejected
+    unsigned char header[COMPRESS_HEADER_SIZE];
+    uint32_t raw_len, packed_len;
+    uint32_t words[][2] = { { 0, 10 }, { 1000, 1000 }, { COMPRESS_PIECE_SIZE + 1, 100 }, { 1000, 0 } };
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        uint32_t wire[2] = { htonl(words[i][0]), htonl(words[i][1]) };
+        memcpy(header, wire, sizeof(header));
+        assert(compress_parse_header(header, &raw_len, &packed_len) == -1);
+    }
+    uint32_t stored[2] = { htonl(5000), htonl(COMPRESS_STORED) };
+    memcpy(header, stored, sizeof(header));
+    assert(compress_parse_header(header, &raw_len, &packed_len) == 1 && raw_len == 5000 && packed_len == 0);
+
+    close(fd);
+    unlink(path);
+    printf("Compression passed\n");
+}
+
+int main() {
+    test_compress();
+    printf("All compression tests passed\n");
+    return 0;
+}
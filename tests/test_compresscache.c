@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "compresscache.h"
+#include "compress.h"
+#include "protocol.h"
+
+// Test that hot files get a compressed copy that decodes to the file and goes stale when it changes
+void test_compress_cache() {
+    char dir[] = "/tmp/test_zcache_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[64], cache_path[64];
+    snprintf(path, sizeof(path), "%s/file.txt", dir);
+    snprintf(cache_path, sizeof(cache_path), "%s" COMPRESS_CACHE_SUFFIX, dir);
+
+    static unsigned char data[2 * COMPRESS_CACHE_MIN_FILE + 1000];
+    unsigned int seed = 777;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = "abcdefghijklmnop"[(seed >> 16) % 16];
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    assert(fd >= 0);
+    assert(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+    struct stat file_stat;
+    assert(fstat(fd, &file_stat) == 0);
+
+    // Misses until the file is hot, then the builder catches up
+    CachedCopy copy;
+    assert(compress_cache_open(dir, 64L * 1024 * 1024) == 0);
+    for (int i = 0; i < COMPRESS_CACHE_HOT_HITS; i++) {
+        assert(compress_cache_lookup("file.txt", &file_stat, COMPRESS_ZLIB, HASH_ALGO_SHA256, &copy) == 0);
+    }
+    int hit = 0;
+    for (int i = 0; i < 500 && !hit; i++) {
+        usleep(10000);
+        hit = compress_cache_lookup("file.txt", &file_stat, COMPRESS_ZLIB, HASH_ALGO_SHA256, &copy);
+    }
+    assert(hit && copy.fd >= 0 && !copy.incompressible && copy.length < (off_t)sizeof(data));
+
+    // The entry holds the chunks a live stream would carry, and the digest of the whole file
+    CompressStream stream;
+    assert(compress_begin(&stream, COMPRESS_ZLIB, 0) == 0);
+    off_t at = copy.offset, done = 0;
+    unsigned char header[COMPRESS_HEADER_SIZE];
+    uint32_t raw_len, packed_len;
+    while (at < copy.offset + copy.length) {
+        assert(pread(copy.fd, header, sizeof(header), at) == (ssize_t)sizeof(header));
+        assert(compress_parse_header(header, &raw_len, &packed_len) == 0);
+        assert(pread(copy.fd, stream.chunk, packed_len, at + COMPRESS_HEADER_SIZE) == (ssize_t)packed_len);
+        assert(compress_decode(&stream, stream.chunk, packed_len, raw_len) == 0);
+        assert(memcmp(stream.raw, data + done, raw_len) == 0);
+        at += COMPRESS_HEADER_SIZE + packed_len;
+        done += raw_len;
+    }
+    assert(done == (off_t)sizeof(data));
+    compress_end(&stream);
+    close(copy.fd);
+    unsigned char digest[HASH_DIGEST_SIZE];
+    char hex[HASH_SIZE];
+    assert(sha256_digest(data, sizeof(data), digest) == 0);
+    hex_encode(digest, HASH_DIGEST_SIZE, hex);
+    assert(strcmp(copy.hash, hex) == 0);
+
+    // A new mtime makes the copy stale; other codecs never use it
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 12345, 0 } };
+    assert(futimens(fd, times) == 0 && fstat(fd, &file_stat) == 0);
+    assert(compress_cache_lookup("file.txt", &file_stat, COMPRESS_ZLIB, HASH_ALGO_SHA256, &copy) == 0);
+    assert(compress_cache_lookup("file.txt", &file_stat, COMPRESS_NONE, HASH_ALGO_SHA256, &copy) == 0);
+
+    DIR *cache = opendir(cache_path);
+    assert(cache != NULL);
+    struct dirent *entry;
+    while ((entry = readdir(cache)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            unlinkat(dirfd(cache), entry->d_name, 0);
+        }
+    }
+    closedir(cache);
+    close(fd);
+    unlink(path);
+    rmdir(cache_path);
+    rmdir(dir);
+    printf("Compressed cache passed\n");
+}
+
+int main() {
+    test_compress_cache();
+    printf("All compressed cache tests passed\n");
+    return 0;
+}
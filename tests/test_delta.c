@@ -0,0 +1,115 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "delta.h"
+#include "protocol.h"
+
+// Test that a delta rebuilds an edited file from the old copy and only the changed bytes
+void test_delta() {
+    char dir[] = "/tmp/test_delta_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char old_path[64], new_path[64];
+    snprintf(old_path, sizeof(old_path), "%s/old.bin", dir);
+    snprintf(new_path, sizeof(new_path), "%s/new.bin", dir);
+
+    // The new copy has bytes inserted, overwritten and appended
+    static unsigned char old_data[300000], new_data[sizeof(old_data) + 700];
+    for (size_t i = 0; i < sizeof(old_data); i++) {
+        old_data[i] = (unsigned char)((i * 2654435761u) >> 13);
+    }
+    memcpy(new_data, old_data, 50000);
+    memset(new_data + 50000, 'x', 500);
+    memcpy(new_data + 50500, old_data + 50000, sizeof(old_data) - 50000);
+    memset(new_data + 200000, 'y', 100);
+    memset(new_data + sizeof(old_data) + 500, 'z', 200);
+
+    int old_fd = open(old_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int new_fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(old_fd >= 0 && new_fd >= 0);
+    assert(write(old_fd, old_data, sizeof(old_data)) == (ssize_t)sizeof(old_data));
+    assert(write(new_fd, new_data, sizeof(new_data)) == (ssize_t)sizeof(new_data));
+
+    // The signature survives the trip through a request
+    DeltaSignature local, remote;
+    assert(delta_signature_build(old_fd, sizeof(old_data), &local) == 0);
+    assert(local.block_size == DELTA_MIN_BLOCK && local.count == (long)(sizeof(old_data) + DELTA_MIN_BLOCK - 1) / DELTA_MIN_BLOCK);
+    assert(local.blocks[1].weak == delta_weak(old_data + DELTA_MIN_BLOCK, DELTA_MIN_BLOCK));
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    session_get(fds[0])->wire = WIRE_FRAMED;
+    ByteBuf buf = {0};
+    delta_put_request(&buf, "old.bin", &local);
+    assert(!buf.failed && send_bytes(fds[0], buf.data, buf.len) == 0);
+    Payload request;
+    assert(receive_payload(fds[1], &request) == 0 && request.operation == OP_DELTA);
+    assert(delta_parse_request(fds[1], &remote) == 0);
+    assert(remote.count == local.count && memcmp(remote.blocks, local.blocks, sizeof(DeltaBlock) * local.count) == 0);
+
+    // Only the edits, each rounded out to at most a block on either side, are literal
+    DeltaScript script, received;
+    assert(delta_script_build(new_fd, sizeof(new_data), &remote, &script) == 0);
+    ByteRange *literals;
+    int count = delta_script_literals(&script, &literals);
+    long literal_bytes = 0;
+    for (int i = 0; i < count; i++) {
+        literal_bytes += literals[i].length;
+    }
+    assert(count == 3 && literal_bytes < 8 * DELTA_MIN_BLOCK);
+
+    // The script survives the trip through a reply
+    int status;
+    Frame frame;
+    buf.len = 0;
+    delta_put_reply(fds[1], &buf, STAT_FILE_FOUND, &script);
+    assert(frame_parse(buf.data, buf.len, &frame) == (long)buf.len);
+    assert(delta_get_reply(&frame, &status, &received) == 0 && status == STAT_FILE_FOUND);
+    assert(received.count == script.count && memcmp(received.digest, script.digest, HASH_DIGEST_SIZE) == 0);
+
+    // Rebuild the old copy into the new one; a wrong literal is caught by the digest
+    DeltaPatch patch;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        assert(delta_patch_open(&patch, old_path, &received) == 0);
+        for (int i = 0; i < count; i++) {
+            assert(pwrite(patch.fd, new_data + literals[i].offset, literals[i].length, literals[i].offset) == literals[i].length);
+        }
+        if (attempt == 0) {
+            assert(pwrite(patch.fd, "!", 1, literals[0].offset) == 1);
+            assert(delta_patch_finish(&patch, 1) == -1);
+            continue;
+        }
+        assert(delta_patch_finish(&patch, 1) == 0);
+    }
+    static unsigned char rebuilt[sizeof(new_data) + 1];
+    int fd = open(old_path, O_RDONLY);
+    assert(fd >= 0 && read(fd, rebuilt, sizeof(rebuilt)) == (ssize_t)sizeof(new_data));
+    assert(memcmp(rebuilt, new_data, sizeof(new_data)) == 0);
+    close(fd);
+
+    free(literals);
+    delta_script_free(&script);
+    delta_script_free(&received);
+    delta_signature_free(&local);
+    delta_signature_free(&remote);
+    bytebuf_free(&buf);
+    session_reset(fds[0]);
+    session_reset(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    close(old_fd);
+    close(new_fd);
+    unlink(old_path);
+    unlink(new_path);
+    rmdir(dir);
+    printf("Delta passed\n");
+}
+
+int main() {
+    test_delta();
+    printf("All delta tests passed\n");
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "protocol.h"
+#include "logger.h"
+#include "compress.h"
+#include "client.h"
+
+#define TEST_FILE_SIZE (10 * 1024 * 1024)  // Above 2 * SEGMENT_STEP so several connections take part
+#define UPLOAD_FILE_SIZE (256 * 1024)      // Size of the file uploaded by every combination
+#define TEST_TIMEOUT 60                    // Seconds before a stalled transfer fails the run
+
+// Server executable under test, built by the same Makefile
+const char* SERVER_EXEC = "bin/srv6088";
+const char* TEST_SERVER_IP = "127.0.0.1";
+
+// Files served in every combination: one that compresses well and one that doesn't
+const char* TEST_FILES[] = { "text.bin", "random.bin" };
+
+static char work_dir[] = "/tmp/test_e2e.XXXXXX";
+static char server_dir[MAX_FILENAME];
+static pid_t server_pid = -1;
+
+// Helper function to stop the server and its forked children
+static void stop_server() {
+    if (server_pid > 0) {
+        kill(-server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+}
+
+// Helper function to take the server down with a failed assertion or a stalled transfer
+static void on_failure(int sig) {
+    if (server_pid > 0) {
+        kill(-server_pid, SIGKILL);
+    }
+    if (sig == SIGALRM) {
+        static const char message[] = "End-to-end test timed out\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+// Helper function to find a free loopback port
+static int free_port() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sock >= 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    assert(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(sock, (struct sockaddr *)&addr, &len) == 0);
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+// Helper function to start the server in the given mode and wait until it accepts connections
+static int start_server(const char* mode) {
+    int port = free_port();
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+
+    fflush(stdout);  // The child must not repeat buffered output
+    server_pid = fork();
+    assert(server_pid >= 0);
+    if (server_pid == 0) {
+        setpgid(0, 0);
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+        execl(SERVER_EXEC, SERVER_EXEC, "-p", port_arg, "--source-directory", server_dir, "--mode", mode, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(server_pid, server_pid);
+
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(sock);
+            return port;
+        }
+        close(sock);
+        usleep(50 * 1000);
+    }
+    fprintf(stderr, "Server in %s mode did not start\n", mode);
+    stop_server();
+    exit(EXIT_FAILURE);
+}
+
+// Helper function to write a test file; compressible files repeat a few words, the others are random bytes
+static void create_test_file(const char* dir, const char* filename, size_t size, int compressible) {
+    char path[MAX_FILENAME * 2];
+    snprintf(path, sizeof(path), "%s/%s", dir, filename);
+    FILE* file = fopen(path, "wb");
+    assert(file != NULL);
+
+    static const char* words[] = { "alpha ", "bravo ", "charlie ", "delta ", "echo ", "foxtrot\n" };
+    for (size_t written = 0; written < size; ) {
+        char block[4096];
+        size_t n = 0;
+        while (n < sizeof(block)) {
+            if (compressible) {
+                const char* word = words[rand() % 6];
+                size_t len = strlen(word);
+                if (n + len > sizeof(block)) {
+                    break;
+                }
+                memcpy(block + n, word, len);
+                n += len;
+            } else {
+                block[n++] = (char)rand();
+            }
+        }
+        if (n > size - written) {
+            n = size - written;
+        }
+        assert(fwrite(block, 1, n, file) == n);
+        written += n;
+    }
+    fclose(file);
+}
+
+// Helper function to check that two files have the same contents
+static int files_equal(const char* path1, const char* path2) {
+    FILE* f1 = fopen(path1, "rb");
+    FILE* f2 = fopen(path2, "rb");
+    int equal = f1 != NULL && f2 != NULL;
+    while (equal) {
+        char buf1[65536], buf2[65536];
+        size_t n1 = fread(buf1, 1, sizeof(buf1), f1);
+        size_t n2 = fread(buf2, 1, sizeof(buf2), f2);
+        if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
+            equal = 0;
+        } else if (n1 == 0) {
+            break;
+        }
+    }
+    if (f1) fclose(f1);
+    if (f2) fclose(f2);
+    return equal;
+}
+
+// Helper function to download and upload over one wire, codec and connection count
+static void run_combination(int port, const char* mode, int wire, int codec, int connections) {
+    set_compression(codec);
+    int sock = connect_to_server(TEST_SERVER_IP, port);
+    assert(sock >= 0);
+
+    // Same rule as cli2219: the plain legacy wire never negotiates
+    session_get(sock)->wire = wire;
+    if (wire == WIRE_FRAMED || codec != COMPRESS_NONE || connections > 1) {
+        assert(negotiate_session(sock, DEFAULT_PIECE_SIZE, HASH_ALGO_SHA256) == 0);
+    }
+
+    char local[MAX_FILENAME * 2], remote[MAX_FILENAME * 2];
+    for (size_t i = 0; i < sizeof(TEST_FILES) / sizeof(TEST_FILES[0]); i++) {
+        snprintf(local, sizeof(local), "%s/%s", DEST_DIR, TEST_FILES[i]);
+        snprintf(remote, sizeof(remote), "%s/%s", server_dir, TEST_FILES[i]);
+        unlink(local);  // A leftover copy would turn the download into a resume
+        if (connections > 1) {
+            assert(download_file_segmented(sock, TEST_SERVER_IP, port, TEST_FILES[i], connections) == 0);
+        } else {
+            download_file(sock, TEST_FILES[i]);
+        }
+        if (!files_equal(local, remote)) {
+            fprintf(stderr, "%s mode, %s wire, codec %d, %d connection(s): %s differs\n",
+                    mode, wire == WIRE_FRAMED ? "framed" : "legacy", codec, connections, TEST_FILES[i]);
+            stop_server();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char upload[MAX_FILENAME];
+    snprintf(upload, sizeof(upload), "up-%s-%d-%d-%d.txt", mode, wire, codec, connections);
+    create_test_file(DEST_DIR, upload, UPLOAD_FILE_SIZE, 1);
+    upload_file(sock, upload);
+    send_exit_request(sock);
+    close(sock);
+
+    // Uploads are not acknowledged, so give the server a moment to write the last bytes
+    snprintf(local, sizeof(local), "%s/%s", DEST_DIR, upload);
+    snprintf(remote, sizeof(remote), "%s/%s", server_dir, upload);
+    int attempt = 0;
+    while (!files_equal(local, remote) && ++attempt < 100) {
+        usleep(50 * 1000);
+    }
+    assert(attempt < 100);
+}
+
+// Test that every wire, codec and connection count round-trips files against a server in the given mode
+void test_transfer_matrix(const char* mode) {
+    int port = start_server(mode);
+    int wires[] = { WIRE_LEGACY, WIRE_FRAMED };
+    int codecs[] = { COMPRESS_NONE, COMPRESS_ZLIB };
+    int connection_counts[] = { 1, 4 };
+
+    for (int w = 0; w < 2; w++) {
+        for (int c = 0; c < 2; c++) {
+            for (int n = 0; n < 2; n++) {
+                run_combination(port, mode, wires[w], codecs[c], connection_counts[n]);
+            }
+        }
+    }
+    stop_server();
+    printf("test_transfer_matrix (%s) passed\n", mode);
+}
+
+int main() {
+    srand(6088);
+    signal(SIGALRM, on_failure);
+    signal(SIGABRT, on_failure);
+    alarm(TEST_TIMEOUT);
+
+    assert(mkdtemp(work_dir) != NULL);
+    snprintf(server_dir, sizeof(server_dir), "%s/server", work_dir);
+    snprintf(DEST_DIR, sizeof(DEST_DIR), "%s/client", work_dir);
+    assert(mkdir(server_dir, 0755) == 0 && mkdir(DEST_DIR, 0755) == 0);
+
+    create_test_file(server_dir, TEST_FILES[0], TEST_FILE_SIZE, 1);
+    create_test_file(server_dir, TEST_FILES[1], TEST_FILE_SIZE, 0);
+
+    test_transfer_matrix("fork");
+    test_transfer_matrix("epoll");
+
+    char command[MAX_FILENAME + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", work_dir);
+    system(command);
+
+    printf("All tests passed!\n");
+    return 0;
+}
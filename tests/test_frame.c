@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "protocol.h"
+#include "frame.h"
+
+// Helper function to build a payload with every field set
+static void make_payload(Payload *payload, int operation, long offset, long file_size) {
+    memset(payload, 0, sizeof(*payload));
+    payload->operation = operation;
+    payload->status = STAT_FILE_FOUND;
+    payload->offset = offset;
+    payload->file_size = file_size;
+    strcpy(payload->filename, "file1.txt");
+    payload->filename_length = strlen(payload->filename);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH * 2; i++) {
+        payload->hash[i] = "0123456789abcdef"[i % 16];
+    }
+}
+
+// Test that payloads survive encoding and that truncated input asks for more bytes
+void test_payload_round_trip() {
+    Payload in, out;
+    make_payload(&in, OP_META_DATA, 3145728, 50000000000L);
+
+    ByteBuf buf = {0};
+    frame_put_payload(&buf, &in, 0);
+    assert(!buf.failed);
+    assert(buf.len < sizeof(Payload) / 4);  // Far smaller than the raw struct
+
+    Frame frame;
+    for (size_t len = 0; len < buf.len; len++) {
+        assert(frame_parse(buf.data, len, &frame) == 0);
+    }
+    assert(frame_parse(buf.data, buf.len, &frame) == (long)buf.len);
+    assert(frame.version == FRAME_VERSION);
+    assert(frame_get_payload(&frame, &out) == (int)frame.body_len);
+
+    assert(out.operation == in.operation);
+    assert(out.status == in.status);
+    assert(out.offset == in.offset);
+    assert(out.file_size == in.file_size);
+    assert(strcmp(out.filename, in.filename) == 0);
+    assert(strcmp(out.hash, in.hash) == 0);
+    printf("Payload round trip passed (%zu-byte frame for a %zu-byte struct)\n", buf.len, sizeof(Payload));
+    bytebuf_free(&buf);
+}
+
+// Test that bodies needing a multi-byte length varint are fixed up correctly, behind a request id
+void test_long_body() {
+    static char body[100000];
+    memset(body, 'x', sizeof(body));
+
+    ByteBuf buf = {0};
+    size_t start = frame_begin(&buf, OP_FILE_LIST, 300);
+    bytebuf_put(&buf, body, sizeof(body));
+    frame_end(&buf, start);
+
+    Frame frame;
+    assert(frame_parse(buf.data, buf.len, &frame) == (long)buf.len);
+    assert(frame.opcode == OP_FILE_LIST);
+    assert(frame.request_id == 300);
+    assert(frame.body_len == sizeof(body));
+    assert(memcmp(frame.body, body, sizeof(body)) == 0);
+    bytebuf_free(&buf);
+    printf("Long body passed\n");
+}
+
+// Test that input that is not a frame is rejected
+void test_malformed() {
+    unsigned char legacy[8] = { OP_DOWNLOAD, 0, 0, 0 };
+    unsigned char future[6] = { FRAME_MAGIC, FRAME_VERSION + 1, OP_DOWNLOAD, 0, 0 };
+    Frame frame;
+    assert(frame_parse(legacy, sizeof(legacy), &frame) == -1);
+    assert(frame_parse(future, sizeof(future), &frame) == -1);
+    printf("Malformed input passed\n");
+}
+
+// Test that a receiver handles both wire formats arriving in small pieces
+void test_receive_split() {
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    session_reset(fds[0]);
+    session_reset(fds[1]);
+
+    for (int wire = WIRE_LEGACY; wire <= WIRE_FRAMED; wire++) {
+        Payload in, out;
+        make_payload(&in, OP_DOWNLOAD, wire, 0);
+
+        ByteBuf buf = {0};
+        session_get(fds[0])->wire = wire;
+        payload_put(fds[0], &buf, &in);
+        for (size_t i = 0; i < buf.len; i += 7) {
+            size_t piece = buf.len - i < 7 ? buf.len - i : 7;
+            assert(write(fds[0], buf.data + i, piece) == (ssize_t)piece);
+        }
+        bytebuf_free(&buf);
+
+        assert(receive_payload(fds[1], &out) == 0);
+        assert(session_get(fds[1])->wire == wire);  // Replies follow the request format
+        assert(out.operation == OP_DOWNLOAD && out.offset == wire);
+        assert(strcmp(out.hash, in.hash) == 0);
+    }
+
+    // Descriptors past the first million get sessions of their own too
+    int high = 3 << 20;
+    assert(session_reset(high) == 0 && session_reset(high + 1) == 0);
+    session_get(high)->piece_size = MIN_PIECE_SIZE;
+    assert(session_get(high + 1)->piece_size == CHUNK_SIZE && session_get(high) != session_get(high + 1));
+    assert(session_reset(-1) == -1);
+
+    session_reset(fds[0]);
+    session_reset(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    printf("Split receive passed\n");
+}
+
+// Test that stream trailers built over differently split bytes agree and mismatches are caught
+void test_trailer() {
+    unsigned char data[5000];
+    Hasher sender, receiver;
+    Payload sent, built, empty;
+
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 13);
+    }
+
+    for (int algorithm = 0; algorithm < HASH_ALGO_COUNT; algorithm++) {
+        assert(hasher_begin(&sender, algorithm) == 0);
+        hasher_update(&sender, data, sizeof(data));
+        trailer_build(&sender, "file1.txt", 100, sizeof(data), &sent);
+        assert(sent.operation == OP_TRAILER && strlen(sent.hash) == hash_digest_size(algorithm) * 2);
+
+        assert(hasher_begin(&receiver, algorithm) == 0);
+        hasher_update(&receiver, data, 1);
+        hasher_update(&receiver, data + 1, 4095);
+        hasher_update(&receiver, data + 4096, sizeof(data) - 4096);
+        trailer_build(&receiver, "file1.txt", 100, sizeof(data), &built);
+        assert(trailer_verify(&built, &sent) == 0);
+
+        // A different range or different bytes don't verify
+        sent.offset = 0;
+        assert(trailer_verify(&built, &sent) == -1);
+        sent.offset = 100;
+        sent.hash[0] = sent.hash[0] == '0' ? '1' : '0';
+        assert(trailer_verify(&built, &sent) == -1);
+    }
+
+    // A trailer without a digest never verifies
+    trailer_build(NULL, "file1.txt", 100, sizeof(data), &empty);
+    assert(empty.hash[0] == '\0' && trailer_verify(&empty, &empty) == -1);
+    printf("Trailer passed\n");
+}
+
+int main() {
+    test_payload_round_trip();
+    test_long_body();
+    test_malformed();
+    test_receive_split();
+    test_trailer();
+    printf("All frame tests passed\n");
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hash.h"
+#include "protocol.h"
+
+// Test SHA-256 against a known vector, the hex codec, and pool hashing against one-shot digests
+void test_hash() {
+    unsigned char digest[HASH_DIGEST_SIZE], decoded[HASH_DIGEST_SIZE];
+    char hex[HASH_DIGEST_SIZE * 2 + 1];
+    assert(sha256_digest("abc", 3, digest) == 0);
+    hex_encode(digest, sizeof(digest), hex);
+    assert(strcmp(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") == 0);
+    assert(hex_decode(hex, decoded, sizeof(decoded)) == sizeof(decoded));
+    assert(memcmp(decoded, digest, sizeof(digest)) == 0);
+    assert(hex_decode("ABx1", decoded, sizeof(decoded)) == 1 && decoded[0] == 0xAB);
+
+    // Enough pieces to be spread over the pool when there is more than one core
+    long piece_size = MIN_PIECE_SIZE;
+    long size = HASH_PARALLEL_MIN_BYTES * 2 + 1234;
+    char path[] = "/tmp/test_hash_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    unsigned char *data = malloc(size);
+    for (long i = 0; i < size; i++) {
+        data[i] = (unsigned char)(i * 13 + (i >> 12));
+    }
+    assert(write(fd, data, size) == size);
+
+    long count = (size + piece_size - 1) / piece_size;
+    unsigned char *digests = malloc(count * HASH_DIGEST_SIZE);
+    assert(hash_pieces(fd, size, piece_size, 0, count, digests) == 0);
+    for (long i = 0; i < count; i++) {
+        long length = size - i * piece_size < piece_size ? size - i * piece_size : piece_size;
+        assert(sha256_digest(data + i * piece_size, length, digest) == 0);
+        assert(memcmp(digests + i * HASH_DIGEST_SIZE, digest, HASH_DIGEST_SIZE) == 0);
+    }
+    assert(hash_pieces(fd, size + piece_size, piece_size, count - 1, 2, digests) == -1);  // The file is shorter than claimed
+
+    free(digests);
+    free(data);
+    close(fd);
+    printf("Hashing passed\n");
+}
+
+int main() {
+    test_hash();
+    printf("All hash tests passed\n");
+    return 0;
+}
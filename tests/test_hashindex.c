@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "hashindex.h"
+#include "merkle.h"
+#include "hash.h"
+#include "protocol.h"
+
+// Helper function to fetch a file's digests through the index and check them against a direct hash
+static void check_index_digests(int fd, long piece_size) {
+    struct stat file_stat;
+    unsigned char *digests;
+    long count;
+    assert(fstat(fd, &file_stat) == 0);
+    assert(hash_index_digests(fd, &file_stat, piece_size, &digests, &count) == 0);
+    assert(count == (file_stat.st_size + piece_size - 1) / piece_size);
+
+    unsigned char *expected = malloc(count * MERKLE_HASH_SIZE);
+    assert(hash_pieces(fd, file_stat.st_size, piece_size, 0, count, expected) == 0);
+    assert(memcmp(digests, expected, count * MERKLE_HASH_SIZE) == 0);
+    free(expected);
+    free(digests);
+}
+
+// Test that the hash index survives a reopen and notices a file that changed
+void test_hash_index() {
+    char dir[] = "/tmp/test_index_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[64], index_path[64];
+    snprintf(path, sizeof(path), "%s/file.bin", dir);
+    snprintf(index_path, sizeof(index_path), "%s" HASH_INDEX_SUFFIX, dir);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    assert(fd >= 0);
+    static unsigned char data[3 * MIN_PIECE_SIZE + 100];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 31);
+    }
+    assert(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+
+    assert(hash_index_open(dir) == 1);  // Cold: nothing indexed yet
+    struct stat file_stat;
+    unsigned char digest[MERKLE_HASH_SIZE], expected[MERKLE_HASH_SIZE];
+    assert(fstat(fd, &file_stat) == 0);
+    assert(hash_index_lookup(&file_stat, MIN_PIECE_SIZE, 1, digest) == -1);  // A lookup never hashes
+    check_index_digests(fd, MIN_PIECE_SIZE);
+    check_index_digests(fd, MIN_PIECE_SIZE);  // Now answered from the index
+    assert(hash_index_lookup(&file_stat, MIN_PIECE_SIZE, 1, digest) == 0);
+    assert(hash_pieces(fd, file_stat.st_size, MIN_PIECE_SIZE, 1, 1, expected) == 0);
+    assert(memcmp(digest, expected, MERKLE_HASH_SIZE) == 0);
+    assert(hash_index_lookup(&file_stat, MIN_PIECE_SIZE, 4, digest) == -1);  // Past the last piece
+
+    // Same size, new contents and mtime: the stale entry must not be used
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 12345, 0 } };
+    data[MIN_PIECE_SIZE + 1] ^= 0xFF;
+    assert(pwrite(fd, data, sizeof(data), 0) == (ssize_t)sizeof(data));
+    assert(futimens(fd, times) == 0);
+    assert(fstat(fd, &file_stat) == 0);
+    assert(hash_index_lookup(&file_stat, MIN_PIECE_SIZE, 1, digest) == -1);
+    check_index_digests(fd, MIN_PIECE_SIZE);
+
+    // The index is a file; another open finds it warm
+    assert(hash_index_open(dir) == 0);
+    check_index_digests(fd, MIN_PIECE_SIZE);
+    check_index_digests(fd, MIN_PIECE_SIZE * 2);
+
+    close(fd);
+    unlink(path);
+    unlink(index_path);
+    rmdir(dir);
+    printf("Hash index passed\n");
+}
+
+int main() {
+    test_hash_index();
+    printf("All hash index tests passed\n");
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "listing.h"
+#include "hashindex.h"
+#include "protocol.h"
+#include "frame.h"
+
+// Test that a listing read in small pages returns every file once and honours the filter
+void test_listing() {
+    char dir[] = "/tmp/test_listing_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[64];
+    int seen[50] = {0};
+    for (int i = 0; i < 50; i++) {
+        snprintf(path, sizeof(path), "%s/%s%02d", dir, i % 2 ? "odd" : "even", i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        assert(fd >= 0 && write(fd, path, i) == i);
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s/subdir", dir);
+    assert(mkdir(path, 0755) == 0);
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    const char *patterns[] = { "", "odd", "even1*" };
+    const char *prefixes[] = { "", "odd", "even1" };
+    int expected[] = { 50, 25, 5 };
+    for (int p = 0; p < 3; p++) {
+        uint64_t cursor = 0;
+        int more = 1, total = 0, pages = 0;
+        while (more) {
+            ByteBuf buf = {0};
+            Frame frame;
+            ListPage page;
+            ListEntry entry;
+            int count = list_put_page(fds[0], &buf, dir, patterns[p], cursor, 7, 0);
+            assert(count >= 0 && count <= 7);
+            assert(frame_parse(buf.data, buf.len, &frame) == (long)buf.len);
+            assert(list_get_page(&frame, &page) == 0 && page.status == STAT_FILE_FOUND);
+            int result;
+            while ((result = list_page_next(&page, &entry)) > 0) {
+                int index = atoi(entry.filename + (entry.filename[0] == 'o' ? 3 : 4));
+                assert(entry.file_size == index && !entry.has_digest);
+                assert(strncmp(entry.filename, prefixes[p], strlen(prefixes[p])) == 0);
+                seen[index]++;
+                count--;
+                total++;
+            }
+            assert(result == 0 && count == 0);
+            cursor = page.cursor;
+            more = page.more;
+            pages++;
+            bytebuf_free(&buf);
+        }
+        assert(total == expected[p]);
+        assert(p != 0 || pages >= 50 / 7);
+    }
+    for (int i = 0; i < 50; i++) {
+        assert(seen[i] == 1 + (i % 2) + (i >= 10 && i < 20 && i % 2 == 0));  // Once per filter that matches the file
+    }
+
+    // Digests are the Merkle root a manifest would report
+    ByteBuf buf = {0};
+    Frame frame;
+    ListPage page;
+    ListEntry entry;
+    unsigned char *digests;
+    long count;
+    MerkleTree tree = {0};
+    struct stat file_stat;
+    snprintf(path, sizeof(path), "%s/odd49", dir);
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0 && fstat(fd, &file_stat) == 0);
+    assert(hash_index_digests(fd, &file_stat, session_get(fds[0])->piece_size, &digests, &count) == 0);
+    assert(merkle_build_from_digests(&tree, digests, file_stat.st_size, session_get(fds[0])->piece_size) == 0);
+    assert(list_put_page(fds[0], &buf, dir, "odd49", 0, LIST_PAGE_ENTRIES, LIST_DIGESTS) == 1);
+    assert(frame_parse(buf.data, buf.len, &frame) == (long)buf.len && list_get_page(&frame, &page) == 0);
+    assert(list_page_next(&page, &entry) == 1 && entry.has_digest);
+    assert(memcmp(entry.digest, merkle_root(&tree), MERKLE_HASH_SIZE) == 0);
+    assert(list_page_next(&page, &entry) == 0);
+    merkle_free(&tree);
+    free(digests);
+    close(fd);
+    bytebuf_free(&buf);
+
+    // A directory that can't be read gets an error page
+    assert(list_put_page(fds[0], &buf, "/nonexistent_listing_dir", "", 0, 10, 0) == -1);
+    assert(frame_parse(buf.data, buf.len, &frame) == (long)buf.len && list_get_page(&frame, &page) == 0);
+    assert(page.status == STAT_SERVER_ERROR && list_page_next(&page, &entry) == 0);
+    bytebuf_free(&buf);
+
+    session_reset(fds[0]);
+    session_reset(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    for (int i = 0; i < 50; i++) {
+        snprintf(path, sizeof(path), "%s/%s%02d", dir, i % 2 ? "odd" : "even", i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/subdir", dir);
+    rmdir(path);
+    rmdir(dir);
+    printf("Listing passed\n");
+}
+
+int main() {
+    test_listing();
+    printf("All listing tests passed\n");
+    return 0;
+}
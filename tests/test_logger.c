@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include "logger.h"
+
+// Helper thread function to log a burst of messages
+static void *log_burst(void *arg) {
+    for (int i = 0; i < 100; i++) {
+        log_message(LOG_INFO, "Logger test message %d from thread %ld", i, (long)arg);
+    }
+    return NULL;
+}
+
+// Test that logged records are written or counted, repeats are rate limited and forked children log too
+void test_logger() {
+    LogStats before, after;
+    log_flush();
+    log_get_stats(&before);
+    pthread_t threads[4];
+    for (long i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, log_burst, (void *)i) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    log_flush();
+    log_get_stats(&after);
+    assert(after.written - before.written + after.dropped - before.dropped >= 400);
+
+    // Debug calls don't even evaluate their arguments unless they are compiled in
+    int evaluated = 0;
+    log_message(LOG_DEBUG, "Logger test debug message %d", ++evaluated);
+    assert(evaluated == (LOG_MIN_LEVEL <= LOG_DEBUG));
+
+    before = after;
+    for (int i = 0; i < 100; i++) {
+        log_message_limited(LOG_INFO, "Logger test repeated message %d", i);
+    }
+    log_get_stats(&after);
+    assert(after.suppressed - before.suppressed >= 100 - 2 * LOG_RATE_BURST);
+
+    // A child's records reach the shared log file even though it inherited the parent's queue
+    char marker[64];
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        log_message(LOG_INFO, "Logger test child %d", (int)getpid());
+        log_flush();
+        _exit(0);  // exit() would write the parent's buffered stdout a second time
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status));
+    snprintf(marker, sizeof(marker), "Logger test child %d\n", (int)pid);
+    FILE *log_file = fopen("log.txt", "r");
+    assert(log_file != NULL);
+    char line[LOG_RECORD_SIZE + 64];
+    int found = 0;
+    while (fgets(line, sizeof(line), log_file)) {
+        found |= strstr(line, marker) != NULL;
+    }
+    fclose(log_file);
+    assert(found);
+    printf("Logger passed\n");
+}
+
+int main() {
+    test_logger();
+    printf("All logger tests passed\n");
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "merkle.h"
+
+// Test that every run of leaves proves against the root, and that a changed leaf doesn't
+void test_merkle_proofs() {
+    char path[] = "/tmp/test_merkle_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    for (long size = 0; size <= 9 * 100; size += 50) {
+        assert(ftruncate(fd, 0) == 0);
+        for (long i = 0; i < size; i++) {
+            unsigned char byte = (unsigned char)(i * 7 + size);
+            assert(pwrite(fd, &byte, 1, i) == 1);
+        }
+
+        MerkleTree tree;
+        assert(merkle_build(&tree, fd, size, 100) == 0);
+        assert(tree.leaf_count == (size > 0 ? (size + 99) / 100 : 1));
+        for (long first = 0; first < tree.leaf_count; first++) {
+            for (long count = 1; first + count <= tree.leaf_count; count++) {
+                unsigned char proof[MERKLE_MAX_PROOF * MERKLE_HASH_SIZE];
+                int proof_count = merkle_range_proof(&tree, first, count, proof);
+                const unsigned char *leaves = merkle_leaf(&tree, first);
+                assert(merkle_verify_range(merkle_root(&tree), tree.leaf_count, first, count, leaves, proof, proof_count) == 0);
+
+                // A run that doesn't match its position or a proof that's been cut short is rejected
+                if (tree.leaf_count > 1) {
+                    long other = first + count < tree.leaf_count ? first + 1 : first - 1;
+                    if (other >= 0 && other + count <= tree.leaf_count) {
+                        assert(merkle_verify_range(merkle_root(&tree), tree.leaf_count, other, count, leaves, proof, proof_count) != 0);
+                    }
+                    if (proof_count > 0) {
+                        assert(merkle_verify_range(merkle_root(&tree), tree.leaf_count, first, count, leaves, proof, proof_count - 1) != 0);
+                    }
+                }
+            }
+        }
+
+        // A single changed byte changes the root
+        if (size > 0) {
+            unsigned char root[MERKLE_HASH_SIZE];
+            memcpy(root, merkle_root(&tree), sizeof(root));
+            unsigned char byte;
+            assert(pread(fd, &byte, 1, size / 2) == 1);
+            byte ^= 0xFF;
+            assert(pwrite(fd, &byte, 1, size / 2) == 1);
+            MerkleTree changed;
+            assert(merkle_build(&changed, fd, size, 100) == 0);
+            assert(memcmp(root, merkle_root(&changed), sizeof(root)) != 0);
+            merkle_free(&changed);
+        }
+        merkle_free(&tree);
+    }
+    close(fd);
+    printf("Merkle proofs passed\n");
+}
+
+int main() {
+    test_merkle_proofs();
+    printf("All Merkle tests passed\n");
+    return 0;
+}
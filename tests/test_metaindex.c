@@ -0,0 +1,94 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "metaindex.h"
+#include "protocol.h"
+
+// Helper function to wait for the metadata index to list a file or not (it follows the directory in the background)
+static int wait_for_index(const char *name, int present) {
+    char line[64];
+    snprintf(line, sizeof(line), "\n%s\n", name);
+    for (int i = 0; i < 500; i++) {
+        ByteBuf list = {0};
+        bytebuf_put(&list, "\n", 1);
+        int listed = meta_index_list(&list, SIZE_MAX) >= 0;
+        bytebuf_put(&list, "", 1);
+        int found = listed && (strstr((const char *)list.data, line) != NULL) == present;
+        bytebuf_free(&list);
+        if (found) {
+            return 1;
+        }
+        usleep(10000);
+    }
+    return 0;
+}
+
+// Test that the metadata index follows the directory and hands out cached descriptors until a file changes
+void test_metadata_index() {
+    char dir[] = "/tmp/test_metaindex_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[64], other_path[64];
+    snprintf(path, sizeof(path), "%s/a.txt", dir);
+    snprintf(other_path, sizeof(other_path), "%s/b.txt", dir);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0 && write(fd, "0123456789", 10) == 10);
+    close(fd);
+
+    assert(meta_index_open(dir) == 0);
+    assert(wait_for_index("a.txt", 1));
+    struct stat file_stat, indexed;
+    assert(stat(path, &file_stat) == 0 && meta_index_stat(path, &indexed) == 0);
+    assert(indexed.st_size == 10 && indexed.st_ino == file_stat.st_ino && S_ISREG(indexed.st_mode));
+    assert(indexed.st_mtim.tv_sec == file_stat.st_mtim.tv_sec && indexed.st_mtim.tv_nsec == file_stat.st_mtim.tv_nsec);
+
+    // An unchanged file is opened once
+    int first = meta_index_open_file(path, &file_stat);
+    int second = meta_index_open_file(path, &file_stat);
+    assert(first >= 0 && first == second && file_stat.st_size == 10);
+    meta_index_close_file(first);
+    meta_index_close_file(second);
+    assert(fcntl(first, F_GETFD) >= 0);  // Still cached
+
+    // Writes, new files and removals reach the index without the caller telling it
+    fd = open(path, O_WRONLY | O_APPEND);
+    assert(fd >= 0 && write(fd, "abc", 3) == 3);
+    close(fd);
+    fd = open(other_path, O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0);
+    close(fd);
+    assert(wait_for_index("b.txt", 1));
+    ByteBuf list = {0};
+    assert(meta_index_list(&list, 6) == 6 && list.len == 6);  // Truncated to whole names
+    list.len = 0;
+    assert(meta_index_list(&list, SIZE_MAX) == 12 && list.len == 12);
+    bytebuf_free(&list);
+    int changed = 0;
+    for (int i = 0; i < 500 && !changed; i++) {
+        changed = meta_index_stat(path, &indexed) == 0 && indexed.st_size == 13;
+        usleep(changed ? 0 : 10000);
+    }
+    assert(changed);
+    fd = meta_index_open_file(path, &file_stat);
+    assert(fd >= 0 && file_stat.st_size == 13);
+    meta_index_close_file(fd);
+    unlink(other_path);
+    assert(wait_for_index("b.txt", 0));
+    assert(meta_index_stat(other_path, &indexed) != 0);
+
+    // Paths outside the directory are looked up on disk
+    assert(meta_index_stat(dir, &indexed) == 0 && S_ISDIR(indexed.st_mode));
+
+    unlink(path);
+    rmdir(dir);
+    printf("Metadata index passed\n");
+}
+
+int main() {
+    test_metadata_index();
+    printf("All metadata index tests passed\n");
+    return 0;
+}
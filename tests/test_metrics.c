@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "metrics.h"
+#include "frame.h"
+#include "protocol.h"
+
+// Helper function to read a counter series out of rendered metrics
+static unsigned long long metric_value(const ByteBuf *text, const char *series) {
+    char *copy = strndup((const char *)text->data, text->len);
+    assert(copy != NULL);
+    char needle[256];
+    snprintf(needle, sizeof(needle), "\n%s", series);  // Not the HELP and TYPE lines, which name the family too
+    char *line = strstr(copy, needle);
+    unsigned long long value = line ? strtoull(line + strlen(needle), NULL, 10) : 0;
+    free(copy);
+    return value;
+}
+
+// Test that requests, transfers and errors recorded anywhere show up in a scrape
+void test_metrics() {
+    assert(metrics_open() == 0);
+    uint64_t start = metrics_now();
+    assert(start > 0);
+    metrics_connection(1);
+    metrics_request(OP_DOWNLOAD, start);
+    metrics_transfer(OP_DOWNLOAD, start, metrics_now(), 1 << 20, 1);
+    metrics_error(OP_REQ_META_DATA);
+    metrics_request(OP_REQ_META_DATA, start);
+
+    // Forked children record into the same counters
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        metrics_request(OP_DOWNLOAD, metrics_now());
+        metrics_transfer(OP_META_DATA, metrics_now(), metrics_now(), 4096, 0);
+        struct timespec busy;
+        do {
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &busy);
+        } while (busy.tv_sec == 0 && busy.tv_nsec < 20000000);  // Exited children's CPU time is counted too
+        metrics_process_exit();
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    ByteBuf text = {0};
+    metrics_render(&text);
+    assert(!text.failed);
+    assert(metric_value(&text, "yats_connections_active ") == 1);
+    assert(metric_value(&text, "yats_requests_total{op=\"download\"} ") == 2);
+    assert(metric_value(&text, "yats_request_errors_total{op=\"req_meta_data\"} ") == 1);
+    assert(metric_value(&text, "yats_sent_bytes_total{op=\"download\"} ") == 1 << 20);
+    assert(metric_value(&text, "yats_received_bytes_total{op=\"meta_data\"} ") == 4096);
+    assert(metric_value(&text, "yats_request_duration_seconds_count{op=\"download\"} ") == 2);
+    assert(metric_value(&text, "yats_request_duration_seconds_bucket{op=\"download\",le=\"+Inf\"} ") == 2);
+    char *copy = strndup((const char *)text.data, text.len);
+    char *cpu = copy ? strstr(copy, "\nyats_cpu_seconds_total ") : NULL;
+    assert(cpu && strtod(cpu + strlen("\nyats_cpu_seconds_total "), NULL) >= 0.02);
+    free(copy);
+    bytebuf_free(&text);
+
+    // The endpoint answers a scrape over a Unix socket
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_metrics_%d.sock", (int)getpid());
+    assert(metrics_serve(path) == 0);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    assert(sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    assert(send(sock, request, strlen(request), 0) == (ssize_t)strlen(request));
+    char reply[65536];
+    size_t length = 0;
+    ssize_t n;
+    while (length < sizeof(reply) - 1 && (n = recv(sock, reply + length, sizeof(reply) - 1 - length, 0)) > 0) {
+        length += n;
+    }
+    reply[length] = '\0';
+    close(sock);
+    unlink(path);
+    assert(strncmp(reply, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    assert(strstr(reply, "yats_requests_total{op=\"download\"} 2\n") != NULL);
+    printf("Metrics passed\n");
+}
+
+int main() {
+    test_metrics();
+    printf("All metrics tests passed\n");
+    return 0;
+}
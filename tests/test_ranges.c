@@ -0,0 +1,31 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ranges.h"
+
+// Test that range requests are sorted, clipped and merged where they touch
+void test_ranges_coalesce() {
+    ByteRange ranges[] = {
+        { 500, 100 },   // Overlaps the next one once sorted
+        { 0, 100 },
+        { 100, 50 },    // Adjacent to [0, 100)
+        { 550, 100 },
+        { 900, 500 },   // Clipped to the file
+        { 2000, 10 },   // Past the end
+        { 300, 0 },     // Empty
+    };
+    int count = ranges_coalesce(ranges, sizeof(ranges) / sizeof(ranges[0]), 1000);
+    assert(count == 3);
+    assert(ranges[0].offset == 0 && ranges[0].length == 150);
+    assert(ranges[1].offset == 500 && ranges[1].length == 150);
+    assert(ranges[2].offset == 900 && ranges[2].length == 100);
+    printf("Range coalescing passed\n");
+}
+
+int main() {
+    test_ranges_coalesce();
+    printf("All range tests passed\n");
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "trace.h"
+#include "protocol.h"
+
+// Test that a traced thread's spans and stream marks reach the trace file, and untraced threads record nothing
+void test_trace() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_trace_%d.json", (int)getpid());
+    assert(trace_now() == 0);
+    assert(trace_open(path, "test") == 0);
+    assert(trace_enabled());
+
+    // Nothing is recorded before a context is attached
+    trace_span("test_untraced", 1, NULL, -1);
+    TraceContext context = { .track = 7 };
+    trace_attach(&context);
+    uint64_t start = trace_now();
+    assert(start > 0);
+
+    // More spans than a buffer holds, then a stream crossing two progress marks
+    for (int i = 0; i < TRACE_BUFFER_EVENTS + 10; i++) {
+        trace_span("test_span", start, "dir/\"quoted\".txt", i);
+    }
+    trace_stream_begin();
+    for (int i = 0; i < 10; i++) {
+        trace_stream_bytes(TRACE_PROGRESS_BYTES / 4);
+    }
+    trace_stream_end("test_stream", NULL);
+    trace_flush();
+    trace_attach(NULL);
+    assert(trace_now() == 0);
+
+    FILE *file = fopen(path, "r");
+    assert(file != NULL);
+    char line[1024];
+    int spans = 0, first_bytes = 0, progress = 0, streams = 0, untraced = 0;
+    char stream_bytes[32];
+    snprintf(stream_bytes, sizeof(stream_bytes), "\"bytes\":%d}", 10 * (TRACE_PROGRESS_BYTES / 4));
+    assert(fgets(line, sizeof(line), file) && strcmp(line, "[\n") == 0);
+    while (fgets(line, sizeof(line), file)) {
+        spans += strstr(line, "\"test_span\"") != NULL && strstr(line, "\"tid\":7,") != NULL &&
+                 strstr(line, "\"file\":\"dir/\\\"quoted\\\".txt\"") != NULL;
+        first_bytes += strstr(line, "\"first_byte\"") != NULL;
+        progress += strstr(line, "\"progress\"") != NULL;
+        streams += strstr(line, "\"test_stream\"") != NULL && strstr(line, stream_bytes) != NULL;
+        untraced += strstr(line, "test_untraced") != NULL;
+    }
+    fclose(file);
+    unlink(path);
+    assert(spans == TRACE_BUFFER_EVENTS + 10);
+    assert(first_bytes == 1 && progress == 2 && streams == 1 && untraced == 0);
+    printf("Trace passed\n");
+}
+
+int main() {
+    test_trace();
+    printf("All trace tests passed\n");
+    return 0;
+}